@@ -71,24 +71,23 @@ static int POS(char c)
     return -2;
 }
 
-//  base64 decoding
+//  base64 decoding into a buffer
 //
 //  s:       base64 string, must be null-terminated
-//  data:    output buffer for decoded data
+//  buf:     output buffer of at least BASE64_DECODED_MAX(strlen(s)) bytes
 //  data_len size of decoded data
-//  return:  allocated data buffer
+//  return:  0, or -1 if s isn't valid base64
 //
-void* base64_decode(const char* s, size_t *data_len)
+int base64_decode_buf(const char* s, void *buf, size_t *data_len)
 {
     const char *p;
-    unsigned char *q, *data;
-    int n[4];
+    unsigned char *q, *data = (unsigned char *) buf;
+    int n[4] = { 0, 0, 0, 0 };
 
 	size_t len = strlen(s);
 	if (len % 4)
-		return NULL;
-	data = (unsigned char*) malloc(len/4*3);
-	q = (unsigned char*) data;
+		return -1;
+	q = data;
 
 	for (p = s; *p; ) {
 	    n[0] = POS(*p++);
@@ -97,13 +96,13 @@ void* base64_decode(const char* s, size_t *data_len)
 	    n[3] = POS(*p++);
 
             if (n[0] == -2 || n[1] == -2 || n[2] == -2 || n[3] == -2)
-                return NULL;
+                return -1;
 
 	    if (n[0] == -1 || n[1] == -1)
-		return NULL;
+		return -1;
 
 	    if (n[2] == -1 && n[3] != -1)
-		return NULL;
+		return -1;
 
             q[0] = (n[0] << 2) + (n[1] >> 4);
 	    if (n[2] != -1)
@@ -115,5 +114,24 @@ void* base64_decode(const char* s, size_t *data_len)
 
 	*data_len = q-data - (n[2]==-1) - (n[3]==-1);
 
+	return 0;
+}
+
+//  base64 decoding
+//
+//  s:       base64 string, must be null-terminated
+//  data_len size of decoded data
+//  return:  allocated data buffer
+//
+void* base64_decode(const char* s, size_t *data_len)
+{
+	void *data;
+
+	if ((data = malloc(BASE64_DECODED_MAX(strlen(s)) + 1)) == NULL)
+		return NULL;
+	if (base64_decode_buf(s, data, data_len) != 0) {
+		free(data);
+		return NULL;
+	}
 	return data;
 }
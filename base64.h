@@ -3,7 +3,11 @@
 
 #include <stddef.h>
 
+/* bytes needed to decode a base64 string of length n */
+#define BASE64_DECODED_MAX(n)	((n) / 4 * 3)
+
 char* base64_encode(const void* buf, size_t size);
 void* base64_decode(const char* s, size_t *data_len);
+int base64_decode_buf(const char* s, void *buf, size_t *data_len);
 
 #endif
@@ -0,0 +1,814 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * ot-bench: feed synthetic or recorded publishes through handle_message()
+ * exactly as the MQTT (or HTTP) front end would, against a scratch
+ * store, and report throughput, per-message latency and bytes written.
+ * No broker, no phones, no reverse-geo lookups.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "udata.h"
+#include "fences.h"
+#include "gcache.h"
+#include "recorder.h"
+#include "storage.h"
+#include "summary.h"
+#include "spidx.h"
+#include "journal.h"
+#include "dedup.h"
+#include "misc.h"
+#include "util.h"
+#include "json.h"
+#include "utstring.h"
+#ifdef WITH_LUA
+# include "hooks.h"
+#endif
+#ifdef WITH_ENCRYPT
+# include <sodium.h>
+# include "base64.h"
+# define BENCH_KEY	"ot-bench-secret"
+#endif
+
+#ifndef LINESIZE
+# define LINESIZE (32 * 1024)
+#endif
+
+enum { M_LOCATION = 0, M_TRANSITION, M_WAYPOINTS, M_ENCRYPTED, M_MAX };
+static char *mixnames[M_MAX] = { "location", "transition", "waypoints", "encrypted" };
+
+struct msg {
+	char *topic;
+	char *payload;
+};
+
+struct device {
+	double lat, lon;
+	time_t tst;
+};
+
+static void usage(char *prog)
+{
+	printf("Usage: %s [options] [file.rec ...]\n", prog);
+	printf("  --storage <dir>       -S  store to write to (dflt: temporary, removed after)\n");
+	printf("  --devices <n>         -D  number of simulated devices (dflt: 10)\n");
+	printf("  --count <n>           -n  number of messages (dflt: 100000)\n");
+	printf("  --rate <n>            -r  messages per second (dflt: 0 = unthrottled)\n");
+	printf("  --mix <type=pct,...>  -m  payload mix of location, transition, waypoints,\n");
+	printf("                            encrypted (dflt: location=100)\n");
+	printf("  --http                -H  submit as HTTP mode publishes\n");
+#ifdef WITH_LUA
+	printf("  --lua-script <file>       load Lua hooks\n");
+#endif
+	printf("  --seed <n>                random seed (dflt: 1)\n");
+	printf("  --keep                    keep temporary store\n");
+	printf("  --journal                 journal publishes before handling them\n");
+	printf("  --batch <n>               publishes per journal sync (dflt: 64; 1 with --http)\n");
+	printf("  --kill-after <ms>         die with SIGALRM after <ms> as if crashed\n");
+	printf("  --export <n>              export all locations in <n> threads meanwhile\n");
+	printf("\n");
+	printf("With .rec files, their publishes are replayed round-robin over the\n");
+	printf("devices instead of generating synthetic ones. With --journal,\n");
+	printf("publishes left in the store's journal are replayed first; --count 0\n");
+	printf("only replays. With --export, threads read the devices' locations\n");
+	printf("over and over as a large /api/0/locations export does, isolocal\n");
+	printf("and all, while the publishes are handled; use --storage with a\n");
+	printf("store that holds a lot of them.\n");
+	exit(1);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+#define MAXPARTS	40	/* as many as splitter() returns */
+
+/*
+ * A mix type is named in full or by a prefix which is unambiguous.
+ */
+
+static int mixtype(char *name)
+{
+	int m, found = -1;
+
+	if (*name == 0)
+		return (-1);
+	for (m = 0; m < M_MAX; m++) {
+		if (strcmp(name, mixnames[m]) == 0)
+			return (m);
+		if (strncmp(name, mixnames[m], strlen(name)) == 0) {
+			if (found != -1)
+				return (-1);
+			found = m;
+		}
+	}
+	return (found);
+}
+
+static int parse_mix(char *s, int *mix)
+{
+	char *parts[MAXPARTS], *eq;
+	int n, np, m, total = 0;
+
+	memset(mix, 0, sizeof(int) * M_MAX);
+	if ((np = splitter(s, ",", parts)) < 1)
+		return (FALSE);
+
+	for (n = 0; n < np && n < M_MAX; n++) {
+		if ((eq = strchr(parts[n], '=')) == NULL)
+			break;
+		*eq = 0;
+		if ((m = mixtype(parts[n])) == -1)
+			break;
+		mix[m] = atoi(eq + 1);
+		total += mix[m];
+	}
+	splitterfree(parts);
+	return (n == np && total > 0);
+}
+
+static char *mktopic(int dev)
+{
+	UT_string *t = NULL;
+	char *s;
+
+	utstring_renew(t);
+	utstring_printf(t, "owntracks/bench/d%d", dev);
+	s = strdup(UB(t));
+	utstring_free(t);
+	return (s);
+}
+
+/*
+ * Each device does a random walk around Hannover, one fix per minute.
+ */
+
+static char *location(struct device *dv, int dev)
+{
+	JsonNode *o = json_mkobject();
+	char *js, tid[8];
+
+	dv->lat += (drand48() - 0.5) * 0.002;
+	dv->lon += (drand48() - 0.5) * 0.003;
+	dv->tst += 60;
+
+	snprintf(tid, sizeof(tid), "%02d", dev % 100);
+	json_append_member(o, "_type",	json_mkstring("location"));
+	json_append_member(o, "tid",	json_mkstring(tid));
+	json_append_member(o, "tst",	json_mknumber(dv->tst));
+	json_append_member(o, "lat",	json_mknumber(dv->lat));
+	json_append_member(o, "lon",	json_mknumber(dv->lon));
+	json_append_member(o, "acc",	json_mknumber(10 + (int)(drand48() * 40)));
+	json_append_member(o, "alt",	json_mknumber(55));
+	json_append_member(o, "vel",	json_mknumber((int)(drand48() * 60)));
+	json_append_member(o, "batt",	json_mknumber(80));
+	json_append_member(o, "conn",	json_mkstring("m"));
+	json_append_member(o, "t",	json_mkstring("u"));
+	js = json_stringify(o, NULL);
+	json_delete(o);
+	return (js);
+}
+
+static char *transition(struct device *dv, int dev)
+{
+	JsonNode *o = json_mkobject();
+	char *js;
+
+	dv->tst += 60;
+	json_append_member(o, "_type",	json_mkstring("transition"));
+	json_append_member(o, "tid",	json_mkstring("bb"));
+	json_append_member(o, "tst",	json_mknumber(dv->tst));
+	json_append_member(o, "wtst",	json_mknumber(1440000000 + dev));
+	json_append_member(o, "lat",	json_mknumber(dv->lat));
+	json_append_member(o, "lon",	json_mknumber(dv->lon));
+	json_append_member(o, "acc",	json_mknumber(20));
+	json_append_member(o, "event",	json_mkstring(drand48() < 0.5 ? "enter" : "leave"));
+	json_append_member(o, "desc",	json_mkstring("Home"));
+	json_append_member(o, "t",	json_mkstring("c"));
+	js = json_stringify(o, NULL);
+	json_delete(o);
+	return (js);
+}
+
+static char *waypoints(struct device *dv, int dev)
+{
+	JsonNode *o = json_mkobject(), *arr = json_mkarray(), *wp;
+	char *js, desc[32];
+	int n;
+
+	for (n = 0; n < 5; n++) {
+		wp = json_mkobject();
+		snprintf(desc, sizeof(desc), "Place %d", n);
+		json_append_member(wp, "_type",	json_mkstring("waypoint"));
+		json_append_member(wp, "desc",	json_mkstring(desc));
+		json_append_member(wp, "lat",	json_mknumber(dv->lat + n * 0.01));
+		json_append_member(wp, "lon",	json_mknumber(dv->lon + n * 0.01));
+		json_append_member(wp, "rad",	json_mknumber(100 + n * 50));
+		json_append_member(wp, "tst",	json_mknumber(1440000000 + dev * 10 + n));
+		json_append_element(arr, wp);
+	}
+	json_append_member(o, "_type",	json_mkstring("waypoints"));
+	json_append_member(o, "waypoints", arr);
+	js = json_stringify(o, NULL);
+	json_delete(o);
+	return (js);
+}
+
+#ifdef WITH_ENCRYPT
+static char *encrypt(char *cleartext)
+{
+	unsigned char key[crypto_secretbox_KEYBYTES];
+	unsigned char *buf;
+	size_t mlen = strlen(cleartext);
+	JsonNode *o;
+	char *b64, *js;
+
+	memset(key, 0, sizeof(key));
+	memcpy(key, BENCH_KEY, strlen(BENCH_KEY));
+
+	if ((buf = malloc(crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + mlen)) == NULL)
+		return (NULL);
+	randombytes_buf(buf, crypto_secretbox_NONCEBYTES);
+	crypto_secretbox_easy(buf + crypto_secretbox_NONCEBYTES, (unsigned char *)cleartext, mlen, buf, key);
+	b64 = base64_encode(buf, crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + mlen);
+	free(buf);
+
+	o = json_mkobject();
+	json_append_member(o, "_type", json_mkstring("encrypted"));
+	json_append_member(o, "data", json_mkstring(b64));
+	js = json_stringify(o, NULL);
+	json_delete(o);
+	free(b64);
+	return (js);
+}
+#endif
+
+/*
+ * Prepare `count' messages from the mix. Encrypted messages carry a
+ * location.
+ */
+
+static struct msg *synthesize(long count, int ndevices, int *mix)
+{
+	struct device *devs;
+	struct msg *msgs;
+	long i;
+	int n, dev, r, total = 0;
+	char *js;
+
+	for (n = 0; n < M_MAX; n++)
+		total += mix[n];
+
+	devs = calloc(ndevices, sizeof(struct device));
+	msgs = calloc(count, sizeof(struct msg));
+	if (devs == NULL || msgs == NULL)
+		return (NULL);
+
+	for (dev = 0; dev < ndevices; dev++) {
+		devs[dev].lat = 52.3759 + (drand48() - 0.5) * 0.2;
+		devs[dev].lon = 9.7320 + (drand48() - 0.5) * 0.3;
+		devs[dev].tst = 1700000000;
+	}
+
+	for (i = 0; i < count; i++) {
+		dev = i % ndevices;
+		r = drand48() * total;
+		for (n = 0; n < M_MAX - 1 && r >= mix[n]; n++)
+			r -= mix[n];
+
+		switch (n) {
+			case M_TRANSITION:
+				js = transition(&devs[dev], dev);
+				break;
+			case M_WAYPOINTS:
+				js = waypoints(&devs[dev], dev);
+				break;
+			case M_ENCRYPTED:
+#ifdef WITH_ENCRYPT
+				{
+					char *clear = location(&devs[dev], dev);
+
+					js = encrypt(clear);
+					free(clear);
+				}
+#else
+				js = location(&devs[dev], dev);
+#endif
+				break;
+			default:
+				js = location(&devs[dev], dev);
+				break;
+		}
+
+		msgs[i].topic = mktopic(dev);
+		msgs[i].payload = js;
+	}
+	free(devs);
+	return (msgs);
+}
+
+/*
+ * Load publishes from .rec files; lines are assigned to devices round-
+ * robin, with the .rec's relative topic ("*" for the base topic)
+ * appended.
+ */
+
+static struct msg *replay(char **files, int nfiles, int ndevices, long *count)
+{
+	struct msg *msgs = NULL;
+	long n = 0, max = 0;
+	char buf[LINESIZE], *bp, *reltopic, *json;
+	UT_string *t = NULL;
+	FILE *fp;
+	int f;
+
+	for (f = 0; f < nfiles; f++) {
+		if ((fp = fopen(files[f], "r")) == NULL) {
+			perror(files[f]);
+			continue;
+		}
+		while (fgets(buf, sizeof(buf), fp) != NULL) {
+			if ((bp = strchr(buf, '\n')) != NULL)
+				*bp = 0;
+			/* isotime \t reltopic \t payload */
+			if ((reltopic = strchr(buf, '\t')) == NULL)
+				continue;
+			reltopic++;
+			if ((json = strchr(reltopic, '\t')) == NULL)
+				continue;
+			*json++ = 0;
+			while ((bp = strrchr(reltopic, ' ')) != NULL && bp[1] == 0)
+				*bp = 0;
+			if (*json != '{')
+				continue;
+
+			if (n == max) {
+				max = max ? max * 2 : 1024;
+				if ((msgs = realloc(msgs, max * sizeof(struct msg))) == NULL)
+					return (NULL);
+			}
+			utstring_renew(t);
+			utstring_printf(t, "owntracks/bench/d%ld", n % ndevices);
+			if (strcmp(reltopic, "*") != 0)
+				utstring_printf(t, "/%s", reltopic);
+			msgs[n].topic = strdup(UB(t));
+			msgs[n].payload = strdup(json);
+			n++;
+		}
+		fclose(fp);
+	}
+	if (t)
+		utstring_free(t);
+	*count = n;
+	return (msgs);
+}
+
+static off_t du_bytes;
+
+static int du_file(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	if (flag == FTW_F)
+		du_bytes += sb->st_size;
+	return (0);
+}
+
+static off_t du(char *dir)
+{
+	du_bytes = 0;
+	nftw(dir, du_file, 16, FTW_PHYS);
+	return (du_bytes);
+}
+
+static int rm_file(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return (remove(path));
+}
+
+/*
+ * --export: read every location of the bench devices, enriched and
+ * rendered as /api/0/locations does, until told to stop.
+ */
+
+static volatile int exporting = FALSE;
+static long exports = 0L, exported = 0L;
+static pthread_mutex_t export_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *exporter(void *arg)
+{
+	int dev, ndevices = *(int *)arg;
+	JsonNode *files, *arr, *f, *obj, *locs, *e;
+	char device[32], *js;
+	long n;
+
+	while (exporting) {
+		n = 0;
+		for (dev = 0; dev < ndevices && exporting; dev++) {
+			snprintf(device, sizeof(device), "d%d", dev);
+			if ((files = lister("bench", device, 0, time(NULL) + 86400L * 365 * 10, FALSE)) == NULL)
+				continue;
+			obj = json_mkobject();
+			locs = json_mkarray();
+			if ((arr = json_find_member(files, "results")) != NULL) {
+				json_foreach(f, arr) {
+					locations(f->string_, obj, locs, 0, time(NULL) + 86400L * 365 * 10,
+						JSON, 0, NULL, NULL, NULL, 0.0, NULL);
+				}
+			}
+			json_delete(files);
+			json_foreach(e, locs) {
+				n++;
+			}
+			json_append_member(obj, "data", locs);
+			if ((js = json_stringify(obj, NULL)) != NULL)
+				free(js);
+			json_delete(obj);
+		}
+		pthread_mutex_lock(&export_mutex);
+		exports++;
+		exported += n;
+		pthread_mutex_unlock(&export_mutex);
+	}
+	return (NULL);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(double *)a, y = *(double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static struct gcache *open_db(char *dbname, int rdonly)
+{
+	char path[BUFSIZ];
+
+	snprintf(path, sizeof(path), "%s/ghash", STORAGEDIR);
+	return (gcache_open(path, dbname, rdonly));
+}
+
+int main(int argc, char **argv)
+{
+	static struct udata udata, *ud = &udata;
+	char *progname = *argv, tmpdir[] = "/tmp/ot-bench.XXXXXX", path[BUFSIZ], *pp;
+	int ndevices = 10, http = FALSE, keep = FALSE, own_store = TRUE, ch;
+	int journal = FALSE, batch = 64, killms = 0, nexport = 0;
+	int mix[M_MAX] = { 100, 0, 0, 0 };
+	long count = 100000L, i, j, seed = 1L, replayed = 0L;
+	double rate = 0, t0, t1, start, flushed, elapsed, *lat;
+	off_t bytes_before, written;
+	struct msg *msgs;
+	pthread_t *exporters = NULL;
+	char *payload;
+	JsonNode *jnode;
+#ifdef WITH_LUA
+	char *luascript = NULL;
+#endif
+
+	while (1) {
+		static struct option long_options[] = {
+			{ "help",	no_argument,		0, 'h'},
+			{ "storage",	required_argument,	0, 'S'},
+			{ "devices",	required_argument,	0, 'D'},
+			{ "count",	required_argument,	0, 'n'},
+			{ "rate",	required_argument,	0, 'r'},
+			{ "mix",	required_argument,	0, 'm'},
+			{ "http",	no_argument,		0, 'H'},
+			{ "seed",	required_argument,	0, 1},
+			{ "keep",	no_argument,		0, 2},
+			{ "journal",	no_argument,		0, 4},
+			{ "batch",	required_argument,	0, 5},
+			{ "kill-after",	required_argument,	0, 6},
+			{ "export",	required_argument,	0, 7},
+#ifdef WITH_LUA
+			{ "lua-script",	required_argument,	0, 3},
+#endif
+			{0, 0, 0, 0}
+		};
+		int optindex = 0;
+
+		ch = getopt_long(argc, argv, "hS:D:n:r:m:H", long_options, &optindex);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+			case 'S':
+				strcpy(STORAGEDIR, optarg);
+				own_store = FALSE;
+				break;
+			case 'D':
+				ndevices = atoi(optarg);
+				break;
+			case 'n':
+				count = atol(optarg);
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 'm':
+				if (!parse_mix(optarg, mix)) {
+					fprintf(stderr, "%s: bad mix `%s'\n", progname, optarg);
+					exit(2);
+				}
+				break;
+			case 'H':
+				http = TRUE;
+				break;
+			case 1:
+				seed = atol(optarg);
+				break;
+			case 2:
+				keep = TRUE;
+				break;
+			case 4:
+				journal = TRUE;
+				break;
+			case 5:
+				batch = atoi(optarg);
+				break;
+			case 6:
+				killms = atoi(optarg);
+				break;
+			case 7:
+				nexport = atoi(optarg);
+				break;
+#ifdef WITH_LUA
+			case 3:
+				luascript = strdup(optarg);
+				break;
+#endif
+			default:
+				usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (ndevices < 1 || count < (journal ? 0 : 1) || batch < 1 || nexport < 0)
+		usage(progname);
+	if (count == 0 && own_store)
+		usage(progname);
+	if (http)
+		batch = 1;
+
+	if (own_store) {
+		if (mkdtemp(tmpdir) == NULL) {
+			perror("mkdtemp");
+			exit(2);
+		}
+		strcpy(STORAGEDIR, tmpdir);
+	}
+
+	snprintf(path, sizeof(path), "%s/ghash", STORAGEDIR);
+	pp = strdup(path);
+	mkpath(pp);
+	free(pp);
+
+	memset(ud, 0, sizeof(struct udata));
+#ifdef WITH_HTTP
+	pthread_mutex_init(&ud->lock, NULL);
+#endif
+	ud->ignoreretained	= TRUE;
+	ud->skipdemo		= TRUE;
+	ud->revgeo		= FALSE;
+	ud->verbose		= FALSE;
+	ud->norec		= FALSE;
+	ud->label		= "ot-bench";
+
+	storage_init(FALSE);
+	ud->t2t		= open_db("topic2tid", FALSE);
+	ud->httpfriends	= open_db("friends", FALSE);
+	ud->wpdb	= open_db("wp", FALSE);
+	ud->sumdb	= open_db(SUMMARY_DBNAME, FALSE);
+
+#ifdef WITH_ENCRYPT
+	if (sodium_init() == -1) {
+		fprintf(stderr, "%s: cannot initialize libsodium\n", progname);
+		exit(2);
+	}
+	ud->keydb = open_db("keys", FALSE);
+	for (i = 0; i < ndevices; i++) {
+		char key[64];
+
+		snprintf(key, sizeof(key), "bench-d%ld", i);
+		gcache_put(ud->keydb, key, BENCH_KEY);
+	}
+#else
+	if (mix[M_ENCRYPTED] > 0)
+		fprintf(stderr, "%s: built without encryption; sending cleartext instead\n", progname);
+#endif
+
+#ifdef WITH_LUA
+	if (luascript) {
+		ud->luascript = luascript;
+		ud->luadb = open_db("luadb", FALSE);
+		if ((ud->luadata = hooks_init(ud, luascript)) == NULL) {
+			fprintf(stderr, "%s: cannot load Lua from %s\n", progname, luascript);
+			exit(2);
+		}
+	}
+#endif
+
+	load_fences(ud);
+	dedup_init(16);			/* the recorder's default */
+
+	if (journal) {
+		ud->journal = TRUE;
+		if ((replayed = ingest_init(ud)) < 0) {
+			fprintf(stderr, "%s: cannot open journal\n", progname);
+			exit(2);
+		}
+		printf("replayed   %ld (journal at %llu)\n", replayed,
+			(unsigned long long)journal_handled());
+		if (count == 0) {
+			summary_flush();
+			journal_close();
+			return (0);
+		}
+	}
+
+	srand48(seed);
+	if (argc > 0)
+		msgs = replay(argv, argc, ndevices, &count);
+	else
+		msgs = synthesize(count, ndevices, mix);
+
+	if (msgs == NULL || count == 0) {
+		fprintf(stderr, "%s: no messages\n", progname);
+		exit(2);
+	}
+	if ((lat = calloc(count, sizeof(double))) == NULL) {
+		perror("calloc");
+		exit(2);
+	}
+
+	bytes_before = du(STORAGEDIR);
+
+	if (killms > 0) {
+		struct itimerval it;
+
+		memset(&it, 0, sizeof(it));
+		it.it_value.tv_sec = killms / 1000;
+		it.it_value.tv_usec = (killms % 1000) * 1000;
+		setitimer(ITIMER_REAL, &it, NULL);
+	}
+
+	if (nexport > 0) {
+		if ((exporters = calloc(nexport, sizeof(pthread_t))) == NULL) {
+			perror("calloc");
+			exit(2);
+		}
+		exporting = TRUE;
+		for (i = 0; i < nexport; i++) {
+			if (pthread_create(&exporters[i], NULL, exporter, &ndevices) != 0) {
+				fprintf(stderr, "%s: cannot start exporter\n", progname);
+				exit(2);
+			}
+		}
+	}
+
+	start = flushed = now_us();
+	for (i = 0; i < count; i++) {
+		if (rate > 0) {
+			double due = start + i * (1e6 / rate), wait = due - now_us();
+
+			if (wait > 0) {
+				struct timespec ts;
+
+				ts.tv_sec = wait / 1e6;
+				ts.tv_nsec = fmod(wait, 1e6) * 1e3;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		/* handle_message() may modify the payload */
+		payload = strdup(msgs[i].payload);
+		jnode = NULL;
+
+		t0 = now_us();
+		if (journal && !http) {
+			/* As from MQTT: `batch' publishes share a sync */
+			lat[i] = t0;
+			ingest_defer(ud, msgs[i].topic, payload, strlen(payload), 0);
+			if ((i + 1) % batch == 0 || i == count - 1) {
+				ingest_flush(ud);
+				t1 = now_us();
+				for (j = i - (i % batch); j <= i; j++)
+					lat[j] = t1 - lat[j];
+			}
+		} else {
+			if (journal) {
+				ingest(ud, msgs[i].topic, payload, strlen(payload), 0,
+					http, http ? &jnode : NULL);
+			} else {
+				handle_message(ud, msgs[i].topic, payload, strlen(payload), 0,
+					http, FALSE, http ? &jnode : NULL);
+			}
+			t1 = now_us();
+			lat[i] = t1 - t0;
+		}
+		free(payload);
+		if (jnode)
+			json_delete(jnode);
+
+		/* as the recorder's main loop does */
+		if (now_us() - flushed >= 1e6) {
+			summary_flush();
+			if (journal)
+				journal_checkpoint(journal_handled());
+			flushed = now_us();
+		}
+	}
+	summary_flush();
+	elapsed = (now_us() - start) / 1e6;
+
+	if (nexport > 0) {
+		exporting = FALSE;
+		for (i = 0; i < nexport; i++)
+			pthread_join(exporters[i], NULL);
+		free(exporters);
+	}
+
+	qsort(lat, count, sizeof(double), cmp_double);
+
+	printf("messages   %ld (%d devices, %s", count, ndevices, http ? "http" : "mqtt");
+	if (argc > 0) {
+		printf(", replayed)\n");
+	} else {
+		for (i = 0; i < M_MAX; i++) {
+			if (mix[i])
+				printf(", %s=%d", mixnames[i], mix[i]);
+		}
+		printf(")\n");
+	}
+	printf("elapsed    %.3f s\n", elapsed);
+	printf("rate       %.0f msg/s\n", count / elapsed);
+	printf("latency    p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+		lat[count / 2], lat[(long)(count * 0.90)], lat[(long)(count * 0.99)], lat[count - 1]);
+	if (nexport > 0) {
+		printf("exports    %ld in %d threads (%ld locations, %.0f per second)\n",
+			exports, nexport, exported, exported / elapsed);
+	}
+	written = du(STORAGEDIR) - bytes_before;
+	printf("written    %lld bytes (%.0f per message)\n",
+		(long long)written, (double)written / count);
+	if (journal) {
+		printf("journal    %lu syncs (%.1f messages per sync)\n",
+			journal_commits(), (double)count / (journal_commits() ? journal_commits() : 1));
+		journal_close();
+	}
+
+#ifdef WITH_LUA
+	hooks_exit(ud->luadata, "ot-bench stops");
+#endif
+	spidx_close();
+	gcache_close(ud->t2t);
+	gcache_close(ud->httpfriends);
+	gcache_close(ud->wpdb);
+	gcache_close(ud->sumdb);
+#ifdef WITH_ENCRYPT
+	gcache_close(ud->keydb);
+#endif
+
+	if (own_store) {
+		if (keep) {
+			fprintf(stderr, "%s: store kept in %s\n", progname, STORAGEDIR);
+		} else {
+			nftw(STORAGEDIR, rm_file, 16, FTW_DEPTH | FTW_PHYS);
+		}
+	}
+
+	return (0);
+}
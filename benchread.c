@@ -0,0 +1,567 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * ot-bench-read: build a deterministic synthetic store and time the
+ * query side -- listing, reading .rec files forwards and backwards,
+ * turning lines into locations, and each output formatter -- first in
+ * isolation and then end to end as ocat does it. One JSON object per
+ * benchmark is printed on stdout so runs can be compared.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "storage.h"
+#include "misc.h"
+#include "util.h"
+#include "json.h"
+#include "utstring.h"
+
+#define MAXITER		(25)
+
+struct store {
+	int users, devices, months, interval;
+	JsonNode *files;		/* all .rec files */
+	JsonNode *locs;			/* all locations of user0/device0 */
+};
+
+static int iterations = 3;
+static struct store st;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(double *)a, y = *(double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Run `fn' `iterations' times and print the best and median times. fn
+ * returns the number of items (lines, locations, ...) it processed.
+ */
+
+static void bench(char *name, char *unit, long (*fn)(void *), void *arg)
+{
+	double secs[MAXITER], t0;
+	JsonNode *o;
+	long items = 0;
+	char *js;
+	int n;
+
+	for (n = 0; n < iterations; n++) {
+		t0 = now_s();
+		items = fn(arg);
+		secs[n] = now_s() - t0;
+	}
+	qsort(secs, iterations, sizeof(double), cmp_double);
+
+	o = json_mkobject();
+	json_append_member(o, "bench",		json_mkstring(name));
+	json_append_member(o, "items",		json_mknumber(items));
+	json_append_member(o, "unit",		json_mkstring(unit));
+	json_append_member(o, "iterations",	json_mknumber(iterations));
+	json_append_member(o, "best_s",		json_mknumber(secs[0]));
+	json_append_member(o, "median_s",	json_mknumber(secs[iterations / 2]));
+	json_append_member(o, "per_s",		json_mknumber(secs[0] > 0 ? (long)(items / secs[0]) : 0));
+	if ((js = json_stringify(o, NULL)) != NULL) {
+		printf("%s\n", js);
+		fflush(stdout);
+		free(js);
+	}
+	json_delete(o);
+}
+
+/*
+ * Users walk around their own spot with one fix every `interval'
+ * seconds; every 50th record is a non-location (lwt, card, transition)
+ * so readers have to skip some lines.
+ */
+
+static void generate(struct store *s)
+{
+	char path[BUFSIZ], *pp, isot[32];
+	int u, d, m, i;
+	struct tm tm;
+	time_t t, t_end;
+	double lat, lon;
+	FILE *fp;
+
+	srand48(42);
+	for (u = 0; u < s->users; u++) {
+		for (d = 0; d < s->devices; d++) {
+			snprintf(path, sizeof(path), "%s/rec/user%d/device%d", STORAGEDIR, u, d);
+			pp = strdup(path);
+			mkpath(pp);
+			free(pp);
+
+			lat = 48.0 + u * 0.5 + d * 0.01;
+			lon = 8.0 + u * 0.5 + d * 0.01;
+			for (m = 0; m < s->months; m++) {
+				memset(&tm, 0, sizeof(tm));
+				tm.tm_year	= 2024 - 1900 + m / 12;
+				tm.tm_mon	= m % 12;
+				tm.tm_mday	= 1;
+				t = timegm(&tm);
+				tm.tm_mon++;
+				t_end = timegm(&tm);
+
+				snprintf(path, sizeof(path), "%s/rec/user%d/device%d/%s.rec",
+					STORAGEDIR, u, d, yyyymm(t));
+				if ((fp = fopen(path, "w")) == NULL) {
+					perror(path);
+					exit(2);
+				}
+				for (i = 0; t < t_end; t += s->interval, i++) {
+					strftime(isot, sizeof(isot), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+					lat += (drand48() - 0.5) * 0.001;
+					lon += (drand48() - 0.5) * 0.0015;
+					if (i % 50 == 49) {
+						fprintf(fp, "%s\t%-18s\t{\"_type\":\"transition\",\"tid\":\"d%d\",\"tst\":%ld,\"lat\":%.6f,\"lon\":%.6f,\"acc\":20,\"event\":\"enter\",\"desc\":\"Home\",\"t\":\"c\",\"wtst\":1700000000}\n",
+							isot, "event", d, (long)t, lat, lon);
+					} else {
+						fprintf(fp, "%s\t%-18s\t{\"_type\":\"location\",\"tid\":\"d%d\",\"tst\":%ld,\"lat\":%.6f,\"lon\":%.6f,\"acc\":%d,\"alt\":%d,\"vel\":%d,\"batt\":%d,\"conn\":\"w\",\"t\":\"u\"}\n",
+							isot, "*", d, (long)t, lat, lon,
+							5 + (int)(drand48() * 30), 100 + (int)(drand48() * 20),
+							(int)(drand48() * 50), 100 - i % 100);
+					}
+				}
+				fclose(fp);
+			}
+		}
+	}
+}
+
+static long b_lister(void *arg)
+{
+	JsonNode *json, *arr, *f;
+	char user[32], device[32];
+	long n = 0;
+	int u, d;
+
+	for (u = 0; u < st.users; u++) {
+		for (d = 0; d < st.devices; d++) {
+			snprintf(user, sizeof(user), "user%d", u);
+			snprintf(device, sizeof(device), "device%d", d);
+			if ((json = lister(user, device, 0, time(0), FALSE)) == NULL)
+				continue;
+			if ((arr = json_find_member(json, "results")) != NULL) {
+				json_foreach(f, arr) {
+					n++;
+				}
+			}
+			json_delete(json);
+		}
+	}
+	return (n);
+}
+
+static int count_line(char *line, void *param)
+{
+	(*(long *)param)++;
+	return (1);
+}
+
+static long b_cat(void *arg)
+{
+	JsonNode *f;
+	long n = 0;
+
+	json_foreach(f, st.files) {
+		cat(f->string_, count_line, &n);
+	}
+	return (n);
+}
+
+static long b_tac(void *arg)
+{
+	JsonNode *f;
+	long n = 0;
+
+	json_foreach(f, st.files) {
+		tac(f->string_, *(long *)arg, count_line, &n);
+	}
+	return (n);
+}
+
+/*
+ * locations() for all months of user0/device0: forward through cat()
+ * or, with a limit, backward through tac(), parsing each candidate line
+ * into a location.
+ */
+
+struct locarg {
+	int limit;
+	output_type otype;
+	JsonNode *obj, *locs;		/* left for the caller when keep is set */
+	int keep;
+};
+
+static long b_locations(void *arg)
+{
+	struct locarg *la = (struct locarg *)arg;
+	JsonNode *json, *arr, *f, *e;
+	long n = 0;
+
+	la->obj = json_mkobject();
+	la->locs = json_mkarray();
+
+	if ((json = lister("user0", "device0", 0, time(0), la->limit > 0)) != NULL) {
+		if ((arr = json_find_member(json, "results")) != NULL) {
+			json_foreach(f, arr) {
+				locations(f->string_, la->obj, la->locs, 0, time(0), la->otype,
+					la->limit, NULL, NULL, NULL, 0.0, NULL);
+				if (la->limit)
+					break;
+			}
+		}
+		json_delete(json);
+	}
+
+	json_foreach(e, la->locs) {
+		n++;
+	}
+
+	if (!la->keep) {
+		json_delete(la->locs);
+		json_delete(la->obj);
+		la->locs = la->obj = NULL;
+	}
+	return (n);
+}
+
+/*
+ * Page through all of user0/device0, oldest first, `size' locations at
+ * a time: with the cursor each page returns, or by starting each page
+ * after the time of the previous page's last location, which reads the
+ * month from its start again.
+ */
+
+struct pagearg {
+	int size;
+	int rescan;
+	long pages;
+};
+
+static long b_pages(void *arg)
+{
+	struct pagearg *pa = (struct pagearg *)arg;
+	JsonNode *udpairs = json_mkarray(), *obj, *locs, *j;
+	UT_string *cursor, *next;
+	struct tm tm;
+	time_t s_lo = 0, s_hi = time(0);
+	long n = 0, got;
+
+	json_append_element(udpairs, json_mkstring("user0/device0"));
+	utstring_new(cursor);
+	utstring_new(next);
+
+	pa->pages = 0;
+	do {
+		obj = json_mkobject();
+		locs = json_mkarray();
+		got = merged_locations(udpairs, obj, locs, s_lo, s_hi, JSON, pa->size, FALSE, NULL, NULL,
+			utstring_len(cursor) ? UB(cursor) : NULL, next);
+		if (got > 0) {
+			n += got;
+			pa->pages++;
+		}
+		if (pa->rescan) {
+			memset(&tm, 0, sizeof(tm));
+			if (locs->children.tail &&
+			    (j = json_find_member(locs->children.tail, "isorcv")) != NULL &&
+			    strptime(j->string_, "%Y-%m-%dT%H:%M:%SZ", &tm) != NULL)
+				s_lo = timegm(&tm);
+		} else {
+			utstring_clear(cursor);
+			utstring_concat(cursor, next);
+		}
+		json_delete(locs);
+		json_delete(obj);
+	} while (got > 0 && utstring_len(next) > 0);
+
+	utstring_free(cursor);
+	utstring_free(next);
+	json_delete(udpairs);
+	return (n);
+}
+
+static void no_line(char *s, void *param)
+{
+	*(long *)param += strlen(s) + 1;
+}
+
+static long b_stringify(void *arg)
+{
+	char *js = json_stringify(st.locs, NULL);
+	long n = strlen(js);
+
+	free(js);
+	return (n);
+}
+
+static long b_geojson(void *arg)
+{
+	JsonNode *g = geo_json(st.locs, false);
+	char *js = json_stringify(g, NULL);
+	long n = strlen(js);
+
+	free(js);
+	json_delete(g);
+	return (n);
+}
+
+static long b_linestring(void *arg)
+{
+	JsonNode *g = geo_linestring(st.locs);
+	char *js = json_stringify(g, NULL);
+	long n = strlen(js);
+
+	free(js);
+	json_delete(g);
+	return (n);
+}
+
+static long b_gpx(void *arg)
+{
+	char *xml = gpx_string(st.locs);	/* static buffer */
+
+	return (xml ? strlen(xml) : 0);
+}
+
+static long b_csv(void *arg)
+{
+	long n = 0;
+
+	csv_output(st.locs, CSV, NULL, no_line, &n);
+	return (n);
+}
+
+static long b_xml(void *arg)
+{
+	long n = 0;
+
+	xml_output(st.locs, XML, NULL, no_line, &n);
+	return (n);
+}
+
+/*
+ * End to end, as ocat would produce each format for user0/device0,
+ * minus writing to stdout.
+ */
+
+static long b_e2e(void *arg)
+{
+	output_type otype = *(output_type *)arg;
+	struct locarg la;
+	long n;
+
+	memset(&la, 0, sizeof(la));
+	la.otype = otype;
+	la.keep = TRUE;
+	b_locations(&la);
+
+	st.locs = la.locs;
+	switch (otype) {
+		case GEOJSON:	n = b_geojson(NULL); break;
+		case LINESTRING: n = b_linestring(NULL); break;
+		case GPX:	n = b_gpx(NULL); break;
+		case CSV:	n = b_csv(NULL); break;
+		case XML:	n = b_xml(NULL); break;
+		default:
+			json_append_member(la.obj, "locations", la.locs);
+			la.locs = NULL;
+			st.locs = la.obj;
+			n = b_stringify(NULL);
+			break;
+	}
+	st.locs = NULL;
+
+	json_delete(la.locs);
+	json_delete(la.obj);
+	return (n);
+}
+
+static int rm_file(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return (remove(path));
+}
+
+static void usage(char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  --storage <dir>      -S  store to generate into (dflt: temporary, removed after)\n");
+	printf("  --users <n>          -u  number of users (dflt: 2)\n");
+	printf("  --devices <n>        -d  devices per user (dflt: 2)\n");
+	printf("  --months <n>         -m  months of data per device (dflt: 1)\n");
+	printf("  --interval <s>       -i  seconds between fixes (dflt: 300)\n");
+	printf("  --iterations <n>     -n  runs per benchmark, max %d (dflt: %d)\n", MAXITER, iterations);
+	printf("  --keep                   keep temporary store\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *progname = *argv, tmpdir[] = "/tmp/ot-bench-read.XXXXXX";
+	int own_store = TRUE, keep = FALSE, ch, u, d;
+	struct locarg la;
+	struct pagearg pa;
+	output_type otype;
+	JsonNode *json, *arr, *f;
+	char user[32], device[32];
+	long lines;
+
+	memset(&st, 0, sizeof(st));
+	st.users	= 2;
+	st.devices	= 2;
+	st.months	= 1;
+	st.interval	= 300;
+
+	while (1) {
+		static struct option long_options[] = {
+			{ "help",	no_argument,		0, 'h'},
+			{ "storage",	required_argument,	0, 'S'},
+			{ "users",	required_argument,	0, 'u'},
+			{ "devices",	required_argument,	0, 'd'},
+			{ "months",	required_argument,	0, 'm'},
+			{ "interval",	required_argument,	0, 'i'},
+			{ "iterations",	required_argument,	0, 'n'},
+			{ "keep",	no_argument,		0, 1},
+			{0, 0, 0, 0}
+		};
+		int optindex = 0;
+
+		ch = getopt_long(argc, argv, "hS:u:d:m:i:n:", long_options, &optindex);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+			case 'S':
+				strcpy(STORAGEDIR, optarg);
+				own_store = FALSE;
+				break;
+			case 'u': st.users = atoi(optarg); break;
+			case 'd': st.devices = atoi(optarg); break;
+			case 'm': st.months = atoi(optarg); break;
+			case 'i': st.interval = atoi(optarg); break;
+			case 'n': iterations = atoi(optarg); break;
+			case 1: keep = TRUE; break;
+			default:
+				usage(progname);
+		}
+	}
+
+	if (st.users < 1 || st.devices < 1 || st.months < 1 || st.interval < 1 ||
+	    iterations < 1 || iterations > MAXITER)
+		usage(progname);
+
+	if (own_store) {
+		if (mkdtemp(tmpdir) == NULL) {
+			perror("mkdtemp");
+			exit(2);
+		}
+		strcpy(STORAGEDIR, tmpdir);
+	}
+
+	storage_init(FALSE);
+	generate(&st);
+
+	st.files = json_mkarray();
+	for (u = 0; u < st.users; u++) {
+		for (d = 0; d < st.devices; d++) {
+			snprintf(user, sizeof(user), "user%d", u);
+			snprintf(device, sizeof(device), "device%d", d);
+			if ((json = lister(user, device, 0, time(0), FALSE)) == NULL)
+				continue;
+			if ((arr = json_find_member(json, "results")) != NULL) {
+				json_foreach(f, arr) {
+					json_append_element(st.files, json_mkstring(f->string_));
+				}
+			}
+			json_delete(json);
+		}
+	}
+
+	/* Readers */
+	bench("lister", "files", b_lister, NULL);
+	bench("cat", "lines", b_cat, NULL);
+	lines = 100;
+	bench("tac-100", "lines", b_tac, &lines);
+
+	memset(&la, 0, sizeof(la));
+	la.otype = JSON;
+	bench("locations", "locations", b_locations, &la);
+	la.limit = 100;
+	bench("locations-limit-100", "locations", b_locations, &la);
+
+	/* Paging, e.g. through a year with --months 12 */
+	memset(&pa, 0, sizeof(pa));
+	pa.size = 1000;
+	bench("pages-1000-cursor", "locations", b_pages, &pa);
+	pa.rescan = TRUE;
+	bench("pages-1000-rescan", "locations", b_pages, &pa);
+
+	/* Formatters, on the locations of user0/device0 */
+	memset(&la, 0, sizeof(la));
+	la.otype = JSON;
+	la.keep = TRUE;
+	b_locations(&la);
+	st.locs = la.locs;
+
+	bench("json", "bytes", b_stringify, NULL);
+	bench("geojson", "bytes", b_geojson, NULL);
+	bench("linestring", "bytes", b_linestring, NULL);
+	bench("gpx", "bytes", b_gpx, NULL);
+	bench("csv", "bytes", b_csv, NULL);
+	bench("xml", "bytes", b_xml, NULL);
+
+	json_delete(la.locs);
+	json_delete(la.obj);
+	st.locs = NULL;
+
+	/* End to end */
+	otype = JSON;		bench("e2e-json", "bytes", b_e2e, &otype);
+	otype = GEOJSON;	bench("e2e-geojson", "bytes", b_e2e, &otype);
+	otype = GPX;		bench("e2e-gpx", "bytes", b_e2e, &otype);
+	otype = CSV;		bench("e2e-csv", "bytes", b_e2e, &otype);
+
+	json_delete(st.files);
+
+	if (own_store) {
+		if (keep) {
+			fprintf(stderr, "%s: store kept in %s\n", progname, STORAGEDIR);
+		} else {
+			nftw(STORAGEDIR, rm_file, 16, FTW_DEPTH | FTW_PHYS);
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+
+# crash-test.sh
+# Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+# 
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+# 
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+# Usage: crash-test.sh [ot-bench [ms ...]]
+#
+# Kill ot-bench while it ingests with --journal after each of the given
+# numbers of milliseconds, let it replay the journal, and check that
+# every publish which made it into the journal is in the .rec files, and
+# none of them twice. Exits 1 if one is missing or doubled.
+
+bench=${1:-./ot-bench}
+[ $# -gt 0 ] && shift
+times=${*:-"700 1900 3100"}
+status=0
+
+for ms in $times; do
+	store=$(mktemp -d /tmp/ot-crash.XXXXXX) || exit 2
+
+	$bench -S $store --journal --count 10000000 --kill-after $ms > /dev/null 2>&1
+	if [ $? -lt 128 ]; then
+		echo "$ms ms: ot-bench wasn't killed; raise --count" >&2
+		rm -rf $store
+		exit 2
+	fi
+
+	journaled=$($bench -S $store --journal --count 0 |
+		sed -n 's/^replayed .*(journal at \([0-9]*\))$/\1/p')
+	stored=$(cat $store/rec/*/*/*.rec | wc -l)
+	doubled=$(cat $store/rec/*/*/*.rec | sort | uniq -d | wc -l)
+
+	echo "$ms ms: $journaled journaled, $stored stored, $doubled doubled"
+	if [ -z "$journaled" ] || [ $stored -ne $journaled ] || [ $doubled -ne 0 ]; then
+		status=1
+	fi
+	rm -rf $store
+done
+
+exit $status
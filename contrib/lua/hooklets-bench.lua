@@ -0,0 +1,32 @@
+-- used by `make bench-lua': otr_hook() and a hooklet for each member of
+-- an ot-bench location, each of which reads the whole argument table
+-- and changes it, as hooks which fix up payloads do.
+
+local seen = 0
+
+local function touch(topic, _type, data)
+    for k, v in pairs(data) do
+        seen = seen + 1
+    end
+    data['_bench'] = true
+end
+
+function otr_init()
+end
+
+function otr_exit()
+    otr.log("hooklets-bench.lua saw " .. seen .. " members")
+end
+
+otr_hook = touch
+
+hooklet_lat  = touch
+hooklet_lon  = touch
+hooklet_tst  = touch
+hooklet_tid  = touch
+hooklet_acc  = touch
+hooklet_alt  = touch
+hooklet_vel  = touch
+hooklet_batt = touch
+hooklet_conn = touch
+hooklet_t    = touch
@@ -0,0 +1,276 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dedup.h"
+#include "util.h"
+
+#define DEDUP_BUCKETS	1024		/* power of two */
+#define DEDUP_LINE	2048		/* .rec bytes read per slot when seeding */
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+/*
+ * Members which, together with the device, subtopic and _type, identify
+ * a location or transition; apps which resend these may reorder or
+ * reformat their members. Any other publish is identified by its exact
+ * payload. tst is required; a payload without one is never considered
+ * a duplicate.
+ */
+
+static const char *keys[] = { "tst", "lat", "lon", "event", "wtst", "desc", NULL };
+
+struct devwin {
+	struct devwin *next;
+	uint64_t id;			/* hash of user/device */
+	char *name;			/* "user/device" */
+	int n;				/* slots in use */
+	int pos;			/* next slot to overwrite */
+	uint64_t fp[];			/* `window' fingerprints */
+};
+
+static struct devwin *buckets[DEDUP_BUCKETS];
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int window = 0;
+static unsigned long suppressed = 0L;
+
+static uint64_t fnv(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *bp = data;
+
+	while (len--) {
+		h ^= *bp++;
+		h *= FNV_PRIME;
+	}
+	return (h);
+}
+
+/*
+ * Numbers are hashed by value so that "52.1" and "52.10" agree; strings
+ * by content. Each member is prefixed by its name and a tag so that
+ * e.g. a missing lat can't collide with a present one.
+ */
+
+static uint64_t fingerprint(const char *reltopic, JsonNode *json, const char *payload)
+{
+	uint64_t h = FNV_OFFSET;
+	const char **k;
+	JsonNode *j;
+
+	h = fnv(h, reltopic, strlen(reltopic) + 1);
+	if ((j = json_find_member(json, "_type")) == NULL || j->tag != JSON_STRING ||
+		(strcmp(j->string_, "location") != 0 && strcmp(j->string_, "transition") != 0)) {
+		return (fnv(h, payload, strlen(payload)));
+	}
+	h = fnv(h, j->string_, strlen(j->string_) + 1);
+
+	for (k = keys; *k; k++) {
+		if ((j = json_find_member(json, *k)) == NULL)
+			continue;
+
+		h = fnv(h, *k, strlen(*k) + 1);
+		h = fnv(h, &j->tag, sizeof(j->tag));
+		if (j->tag == JSON_NUMBER) {
+			h = fnv(h, &j->number_, sizeof(j->number_));
+		} else if (j->tag == JSON_STRING) {
+			h = fnv(h, j->string_, strlen(j->string_) + 1);
+		} else if (j->tag == JSON_BOOL) {
+			h = fnv(h, &j->bool_, sizeof(j->bool_));
+		}
+	}
+	return (h);
+}
+
+void dedup_init(int n)
+{
+	window = n > 0 ? n : 0;
+}
+
+static void remember(struct devwin *dw, uint64_t fp)
+{
+	dw->fp[dw->pos] = fp;
+	dw->pos = (dw->pos + 1) % window;
+	if (dw->n < window)
+		dw->n++;
+}
+
+/*
+ * A new window starts out with the device's last stored publishes, from
+ * the end of its .rec file for the month of `epoch'. Repeats arriving
+ * just after a restart are caught that way, as are publishes replayed
+ * from the journal which had been stored before the recorder went down.
+ */
+
+static void seed(struct devwin *dw, const char *user, const char *device, time_t epoch)
+{
+	static UT_string *u = NULL, *d = NULL;
+	char *path, *buf, *line, *nl, *reltopic, *payload, *bp;
+	struct stat sb;
+	off_t len;
+	JsonNode *json, *j;
+	int fd;
+
+	utstring_renew(u);
+	utstring_renew(d);
+	utstring_printf(u, "%s", user);
+	utstring_printf(d, "%s", device);
+	if ((path = findpath("rec", u, d, "rec", epoch)) == NULL ||
+		(fd = open(path, O_RDONLY)) == -1)
+		return;
+
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		close(fd);
+		return;
+	}
+	len = sb.st_size < (off_t)window * DEDUP_LINE ? sb.st_size : (off_t)window * DEDUP_LINE;
+	if ((buf = malloc(len + 1)) == NULL ||
+		pread(fd, buf, len, sb.st_size - len) != len) {
+		free(buf);
+		close(fd);
+		return;
+	}
+	close(fd);
+	buf[len] = 0;
+
+	/* Complete lines only: "isotime\treltopic\tpayload\n" */
+	line = buf;
+	if (len < sb.st_size && (line = strchr(buf, '\n')) != NULL)
+		line++;
+	for (; line && (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+		*nl = 0;
+		if ((reltopic = strchr(line, '\t')) == NULL ||
+			(payload = strchr(++reltopic, '\t')) == NULL)
+			continue;
+		for (bp = payload; bp > reltopic && bp[-1] == ' '; bp--)
+			;
+		*bp = 0;
+		payload++;
+
+		if ((json = json_decode(payload)) == NULL)
+			continue;
+		if ((j = json_find_member(json, "tst")) != NULL && j->tag == JSON_NUMBER)
+			remember(dw, fingerprint(reltopic, json, payload));
+		json_delete(json);
+	}
+	free(buf);
+}
+
+/*
+ * Return TRUE if the publish `payload', decoded into `json', from
+ * user/device on `reltopic' matches one of the device's last `window'
+ * publishes, in which case the caller should drop it. Otherwise
+ * remember it and return FALSE.
+ */
+
+int dedup_check(const char *user, const char *device, const char *reltopic, JsonNode *json, const char *payload)
+{
+	struct devwin *dw;
+	uint64_t id, fp;
+	unsigned b;
+	char name[BUFSIZ];
+	int i, dup = FALSE;
+	JsonNode *j;
+
+	if (window == 0)
+		return (FALSE);
+
+	if ((j = json_find_member(json, "tst")) == NULL || j->tag != JSON_NUMBER)
+		return (FALSE);
+
+	snprintf(name, sizeof(name), "%s/%s", user, device);
+	id = fnv(FNV_OFFSET, name, strlen(name));
+	fp = fingerprint(reltopic, json, payload);
+	b = id & (DEDUP_BUCKETS - 1);
+
+	pthread_mutex_lock(&dedup_lock);
+
+	for (dw = buckets[b]; dw; dw = dw->next) {
+		if (dw->id == id && strcmp(dw->name, name) == 0)
+			break;
+	}
+
+	if (dw == NULL) {
+		if ((dw = calloc(1, sizeof(struct devwin) + window * sizeof(uint64_t))) == NULL ||
+			(dw->name = strdup(name)) == NULL) {
+			free(dw);
+			pthread_mutex_unlock(&dedup_lock);
+			return (FALSE);
+		}
+		dw->id = id;
+		dw->next = buckets[b];
+		buckets[b] = dw;
+		seed(dw, user, device, (time_t)j->number_);
+	}
+
+	for (i = 0; i < dw->n; i++) {
+		if (dw->fp[i] == fp) {
+			dup = TRUE;
+			break;
+		}
+	}
+
+	if (dup) {
+		suppressed++;
+	} else {
+		remember(dw, fp);
+	}
+
+	pthread_mutex_unlock(&dedup_lock);
+	return (dup);
+}
+
+/*
+ * Number of publishes dropped as duplicates since startup.
+ */
+
+unsigned long dedup_suppressed(void)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&dedup_lock);
+	n = suppressed;
+	pthread_mutex_unlock(&dedup_lock);
+	return (n);
+}
+
+void dedup_free(void)
+{
+	struct devwin *dw, *next;
+	int b;
+
+	pthread_mutex_lock(&dedup_lock);
+	for (b = 0; b < DEDUP_BUCKETS; b++) {
+		for (dw = buckets[b]; dw; dw = next) {
+			next = dw->next;
+			free(dw->name);
+			free(dw);
+		}
+		buckets[b] = NULL;
+	}
+	window = 0;
+	pthread_mutex_unlock(&dedup_lock);
+}
@@ -0,0 +1,17 @@
+#ifndef _DEDUP_H_INCLUDED_
+# define _DEDUP_H_INCLUDED_
+
+#include "json.h"
+
+/*
+ * Per-device window of fingerprints of the most recent publishes, used
+ * to drop exact repeats (QoS redeliveries, apps resending their queue
+ * after a reconnect) before they're stored or trigger anything.
+ */
+
+void dedup_init(int window);
+int dedup_check(const char *user, const char *device, const char *reltopic, JsonNode *json, const char *payload);
+unsigned long dedup_suppressed(void);
+void dedup_free(void);
+
+#endif
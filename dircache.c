@@ -0,0 +1,618 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+#include "dircache.h"
+#include "misc.h"
+#include "util.h"
+
+/*
+ * Each tree hangs off STORAGEDIR/<top>. Nodes above `levels' deep
+ * have their entries cached and (on Linux) an inotify watch; all
+ * entries are directories except for the .rec files of rec/.
+ */
+
+#define DC_REC		0
+#define DC_LAST		1
+#define DC_NTOPS	2
+
+#define WATCH_POLLMS	500
+
+static const char *topnames[DC_NTOPS] = { "rec", "last" };
+static const int levels[DC_NTOPS] = { 3, 2 };
+
+struct dnode {
+	char *name;
+	int top, depth;
+	int wd;				/* inotify watch or -1 */
+	struct dnode *parent;
+	struct dnode **kids;		/* sorted by name */
+	size_t nkids, maxkids;
+};
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static int active = FALSE;
+static struct dnode *tops[DC_NTOPS];
+
+#ifdef __linux__
+static int fd = -1;
+static struct dnode **watches = NULL;	/* sorted by wd */
+static size_t nwatches = 0, maxwatches = 0;
+static volatile int running = FALSE;
+static pthread_t watcher_tid;
+#endif
+
+static int is_month(const char *name)
+{
+	return (fnmatch("2[0-9][0-9][0-9]-[0-3][0-9].rec", name, 0) == 0);
+}
+
+static int has_kids(struct dnode *n)
+{
+	return (n->depth < levels[n->top]);
+}
+
+static int kids_are_dirs(struct dnode *n)
+{
+	return (n->top != DC_REC || n->depth < levels[DC_REC] - 1);
+}
+
+static void node_path(struct dnode *n, char *buf, size_t buflen)
+{
+	size_t len;
+
+	if (n->parent == NULL) {
+		snprintf(buf, buflen, "%s/%s", STORAGEDIR, n->name);
+		return;
+	}
+	node_path(n->parent, buf, buflen);
+	len = strlen(buf);
+	snprintf(buf + len, buflen - len, "/%s", n->name);
+}
+
+static struct dnode *node_new(const char *name, struct dnode *parent, int top)
+{
+	struct dnode *n;
+
+	if ((n = calloc(1, sizeof(struct dnode))) == NULL)
+		return (NULL);
+	if ((n->name = strdup(name)) == NULL) {
+		free(n);
+		return (NULL);
+	}
+	n->top		= top;
+	n->depth	= parent ? parent->depth + 1 : 0;
+	n->parent	= parent;
+	n->wd		= -1;
+	return (n);
+}
+
+static struct dnode *kid_find(struct dnode *n, const char *name, size_t *pos)
+{
+	size_t lo = 0, hi = n->nkids, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((c = strcmp(n->kids[mid]->name, name)) == 0) {
+			lo = mid;
+			break;
+		}
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos)
+		*pos = lo;
+	return ((lo < n->nkids && strcmp(n->kids[lo]->name, name) == 0) ? n->kids[lo] : NULL);
+}
+
+static struct dnode *kid_add(struct dnode *n, const char *name)
+{
+	struct dnode *k, **kids;
+	size_t pos, max;
+
+	if ((k = kid_find(n, name, &pos)) != NULL)
+		return (k);
+
+	if (n->nkids == n->maxkids) {
+		max = n->maxkids ? n->maxkids * 2 : 8;
+		if ((kids = realloc(n->kids, max * sizeof(struct dnode *))) == NULL)
+			return (NULL);
+		n->kids = kids;
+		n->maxkids = max;
+	}
+	if ((k = node_new(name, n, n->top)) == NULL)
+		return (NULL);
+	memmove(n->kids + pos + 1, n->kids + pos, (n->nkids - pos) * sizeof(struct dnode *));
+	n->kids[pos] = k;
+	n->nkids++;
+	return (k);
+}
+
+#ifdef __linux__
+static size_t wd_pos(int wd)
+{
+	size_t lo = 0, hi = nwatches, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (watches[mid]->wd < wd)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static struct dnode *wd_find(int wd)
+{
+	size_t pos = wd_pos(wd);
+
+	return ((pos < nwatches && watches[pos]->wd == wd) ? watches[pos] : NULL);
+}
+
+static int wd_add(struct dnode *n)
+{
+	struct dnode **w;
+	size_t pos = wd_pos(n->wd), max;
+
+	/* the kernel hands out the same wd for an inode watched twice */
+	if (pos < nwatches && watches[pos]->wd == n->wd) {
+		watches[pos]->wd = -1;
+		watches[pos] = n;
+		return (0);
+	}
+	if (nwatches == maxwatches) {
+		max = maxwatches ? maxwatches * 2 : 64;
+		if ((w = realloc(watches, max * sizeof(struct dnode *))) == NULL)
+			return (-1);
+		watches = w;
+		maxwatches = max;
+	}
+	memmove(watches + pos + 1, watches + pos, (nwatches - pos) * sizeof(struct dnode *));
+	watches[pos] = n;
+	nwatches++;
+	return (0);
+}
+
+static void wd_del(int wd)
+{
+	size_t pos = wd_pos(wd);
+
+	if (pos < nwatches && watches[pos]->wd == wd) {
+		memmove(watches + pos, watches + pos + 1, (nwatches - pos - 1) * sizeof(struct dnode *));
+		nwatches--;
+	}
+}
+#endif
+
+/*
+ * Free `n' and what's below it. If `unwatch' is set, the inotify
+ * watches are removed as well; that isn't needed (and fails) for
+ * directories which are gone.
+ */
+
+static void node_free(struct dnode *n, int unwatch)
+{
+	size_t i;
+
+	if (n == NULL)
+		return;
+	for (i = 0; i < n->nkids; i++)
+		node_free(n->kids[i], unwatch);
+#ifdef __linux__
+	if (n->wd != -1) {
+		wd_del(n->wd);
+		if (unwatch)
+			inotify_rm_watch(fd, n->wd);
+	}
+#endif
+	free(n->kids);
+	free(n->name);
+	free(n);
+}
+
+static void kid_del(struct dnode *n, const char *name, int unwatch)
+{
+	struct dnode *k;
+	size_t pos;
+
+	if ((k = kid_find(n, name, &pos)) == NULL)
+		return;
+	node_free(k, unwatch);
+	memmove(n->kids + pos, n->kids + pos + 1, (n->nkids - pos - 1) * sizeof(struct dnode *));
+	n->nkids--;
+}
+
+/*
+ * Watch the directory of `n' and add its entries, recursively. The
+ * watch is added before reading the directory so that nothing created
+ * in between is missed; entries seen twice are harmless. Returns -1
+ * if the cache can't be kept in sync.
+ */
+
+static int scan(struct dnode *n)
+{
+	char path[PATH_MAX], kpath[PATH_MAX];
+	DIR *dirp;
+	struct dirent *dp;
+	struct dnode *k;
+	struct stat sb;
+	int isdir;
+
+	if (!has_kids(n))
+		return (0);
+
+	node_path(n, path, sizeof(path));
+
+#ifdef __linux__
+	if (n->wd == -1) {
+		n->wd = inotify_add_watch(fd, path,
+			IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+			IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+		if (n->wd == -1) {
+			if (errno == ENOENT || errno == ENOTDIR)
+				return (0);	/* gone again; its parent will tell */
+			olog(LOG_ERR, "dircache: cannot watch %s: %m%s", path,
+				errno == ENOSPC ? " (raise fs.inotify.max_user_watches)" : "");
+			return (-1);
+		}
+		if (wd_add(n) == -1)
+			return (-1);
+	}
+#endif
+
+	if ((dirp = opendir(path)) == NULL)
+		return (0);
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (*dp->d_name == '.')
+			continue;
+
+		if (kids_are_dirs(n)) {
+			/* XFS doesn't always fill in d_type */
+			if (dp->d_type == DT_UNKNOWN) {
+				snprintf(kpath, sizeof(kpath), "%s/%s", path, dp->d_name);
+				isdir = stat(kpath, &sb) == 0 && S_ISDIR(sb.st_mode);
+			} else {
+				isdir = dp->d_type == DT_DIR;
+			}
+			if (!isdir)
+				continue;
+		} else if (!is_month(dp->d_name)) {
+			continue;
+		}
+
+		if ((k = kid_add(n, dp->d_name)) == NULL || scan(k) == -1) {
+			closedir(dirp);
+			return (-1);
+		}
+	}
+	closedir(dirp);
+	return (0);
+}
+
+static void teardown(void)
+{
+	int t;
+
+	for (t = 0; t < DC_NTOPS; t++) {
+		node_free(tops[t], FALSE);
+		tops[t] = NULL;
+	}
+#ifdef __linux__
+	free(watches);
+	watches = NULL;
+	nwatches = maxwatches = 0;
+	if (fd != -1)
+		close(fd);
+	fd = -1;
+#endif
+	active = FALSE;
+}
+
+#ifdef __linux__
+static int build(void)
+{
+	char path[PATH_MAX];
+	int t;
+
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		olog(LOG_ERR, "dircache: inotify_init: %m");
+		return (-1);
+	}
+
+	for (t = 0; t < DC_NTOPS; t++) {
+		if ((tops[t] = node_new(topnames[t], NULL, t)) == NULL)
+			return (-1);
+
+		/* the recorder creates these anyway; they must exist to be watched */
+		node_path(tops[t], path, sizeof(path));
+		mkpath(path);
+
+		if (scan(tops[t]) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Apply one inotify event. Returns FALSE if the rest of the events
+ * read with it are to be ignored because the trees were rebuilt.
+ */
+
+static int handle_event(struct inotify_event *ev)
+{
+	struct dnode *n, *k;
+	int wanted;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		olog(LOG_NOTICE, "dircache: inotify queue overflowed; rescanning");
+		teardown();
+		if (build() == -1) {
+			teardown();
+			olog(LOG_ERR, "dircache: disabled; listings will read directories");
+			return (FALSE);
+		}
+		active = TRUE;
+		return (FALSE);
+	}
+
+	if ((n = wd_find(ev->wd)) == NULL)
+		return (TRUE);
+
+	if (ev->mask & IN_IGNORED) {
+		wd_del(ev->wd);
+		n->wd = -1;
+		return (TRUE);
+	}
+	if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		if (n->parent == NULL) {
+			olog(LOG_ERR, "dircache: %s/%s went away; listings will read directories",
+				STORAGEDIR, n->name);
+			teardown();
+			return (FALSE);
+		}
+		return (TRUE);
+	}
+	if (ev->len == 0 || *ev->name == '.')
+		return (TRUE);
+
+	if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+		if (kids_are_dirs(n))
+			wanted = (ev->mask & IN_ISDIR) != 0;
+		else
+			wanted = !(ev->mask & IN_ISDIR) && is_month(ev->name);
+
+		if (wanted && ((k = kid_add(n, ev->name)) == NULL || scan(k) == -1)) {
+			olog(LOG_ERR, "dircache: disabled; listings will read directories");
+			teardown();
+			return (FALSE);
+		}
+	} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		kid_del(n, ev->name, (ev->mask & IN_MOVED_FROM) != 0);
+	}
+	return (TRUE);
+}
+
+static void *watcher(void *arg)
+{
+	char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	ssize_t len;
+	char *p;
+	int more;
+
+	while (running) {
+		pfd.fd		= fd;
+		pfd.events	= POLLIN;
+		if (poll(&pfd, 1, WATCH_POLLMS) <= 0)
+			continue;
+		if ((len = read(fd, buf, sizeof(buf))) <= 0)
+			continue;
+
+		pthread_rwlock_wrlock(&lock);
+		for (p = buf, more = TRUE; more && p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+			more = handle_event(ev);
+		}
+		more = active;
+		pthread_rwlock_unlock(&lock);
+
+		if (!more)
+			break;
+	}
+	return (NULL);
+}
+#endif /* __linux__ */
+
+/*
+ * Read the trees and start watching them. Returns TRUE if listings
+ * will be served from the cache.
+ */
+
+int dircache_init(void)
+{
+#ifdef __linux__
+	struct timespec t0, t1;
+	sigset_t all, old;
+	size_t nw;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	pthread_rwlock_wrlock(&lock);
+	if (build() == -1) {
+		teardown();
+		pthread_rwlock_unlock(&lock);
+		olog(LOG_ERR, "dircache: not caching directory listings");
+		return (FALSE);
+	}
+	active = TRUE;
+	nw = nwatches;
+	pthread_rwlock_unlock(&lock);
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	running = TRUE;
+	if (pthread_create(&watcher_tid, NULL, watcher, NULL) != 0) {
+		running = FALSE;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		pthread_rwlock_wrlock(&lock);
+		teardown();
+		pthread_rwlock_unlock(&lock);
+		olog(LOG_ERR, "dircache: cannot start watcher: %m");
+		return (FALSE);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	olog(LOG_INFO, "Caching directory listings: %zu directories read in %.0f ms",
+		nw, (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	return (TRUE);
+#else
+	olog(LOG_INFO, "Not caching directory listings: no inotify on this platform");
+	return (FALSE);
+#endif
+}
+
+/*
+ * The recorder has just created the file or directory at `path'. Add
+ * it now rather than when inotify gets round to it, so that it's
+ * listed as soon as the write which created it is done.
+ */
+
+void dircache_note(const char *path)
+{
+	size_t slen = strlen(STORAGEDIR);
+	char *copy, *comp[4], *p, *save = NULL;
+	struct dnode *n;
+	int t, ncomp = 0, i, found;
+
+	if (strncmp(path, STORAGEDIR, slen) != 0 || path[slen] != '/')
+		return;
+	if ((copy = strdup(path + slen + 1)) == NULL)
+		return;
+
+	for (p = strtok_r(copy, "/", &save); p && ncomp < 4; p = strtok_r(NULL, "/", &save))
+		comp[ncomp++] = p;
+
+	for (t = 0; t < DC_NTOPS; t++) {
+		if (ncomp > 0 && strcmp(comp[0], topnames[t]) == 0)
+			break;
+	}
+	if (t == DC_NTOPS) {
+		free(copy);
+		return;
+	}
+	if (ncomp > levels[t] + 1)
+		ncomp = levels[t] + 1;
+	if (t == DC_REC && ncomp == levels[t] + 1 && !is_month(comp[ncomp - 1]))
+		ncomp--;
+
+	/* usually it's there already */
+	pthread_rwlock_rdlock(&lock);
+	found = TRUE;
+	if (active) {
+		for (n = tops[t], i = 1; n && i < ncomp; i++)
+			n = kid_find(n, comp[i], NULL);
+		found = (n != NULL);
+	}
+	pthread_rwlock_unlock(&lock);
+
+	if (!found) {
+		pthread_rwlock_wrlock(&lock);
+		if (active) {
+			for (n = tops[t], i = 1; n && i < ncomp; i++)
+				n = kid_add(n, comp[i]);
+		}
+		pthread_rwlock_unlock(&lock);
+	}
+	free(copy);
+}
+
+/*
+ * Append the names in STORAGEDIR/<top>[/<user>[/<device>]] to the
+ * JSON array `arr', in order. Returns DC_OFF if the cache isn't
+ * active, 0 if there's no such directory, else 1.
+ */
+
+int dircache_ls(const char *top, const char *user, const char *device, JsonNode *arr)
+{
+	struct dnode *n;
+	size_t i;
+	int t;
+
+	for (t = 0; t < DC_NTOPS; t++) {
+		if (strcmp(top, topnames[t]) == 0)
+			break;
+	}
+	if (t == DC_NTOPS)
+		return (DC_OFF);
+
+	pthread_rwlock_rdlock(&lock);
+	if (!active) {
+		pthread_rwlock_unlock(&lock);
+		return (DC_OFF);
+	}
+
+	n = tops[t];
+	if (n && user)
+		n = kid_find(n, user, NULL);
+	if (n && device)
+		n = kid_find(n, device, NULL);
+	if (n) {
+		for (i = 0; i < n->nkids; i++)
+			json_append_element(arr, json_mkstring(n->kids[i]->name));
+	}
+	pthread_rwlock_unlock(&lock);
+
+	return (n ? 1 : 0);
+}
+
+void dircache_free(void)
+{
+#ifdef __linux__
+	if (running) {
+		running = FALSE;
+		pthread_join(watcher_tid, NULL);
+	}
+#endif
+	pthread_rwlock_wrlock(&lock);
+	teardown();
+	pthread_rwlock_unlock(&lock);
+}
@@ -0,0 +1,22 @@
+#ifndef _DIRCACHE_H_INCLUDED_
+# define _DIRCACHE_H_INCLUDED_
+
+#include "json.h"
+
+/*
+ * In-memory copy of the directory trees below STORAGEDIR which the
+ * listing functions read: rec/<user>/<device>/YYYY-MM.rec and
+ * last/<user>/<device>. It's updated by the recorder's own writes
+ * (dircache_note()) and, on Linux, kept in sync with changes made by
+ * others with inotify. Where the cache isn't active, listing falls
+ * back to reading the directories.
+ */
+
+#define DC_OFF		(-1)	/* cache not active; read the directory */
+
+int dircache_init(void);
+void dircache_note(const char *path);
+int dircache_ls(const char *top, const char *user, const char *device, JsonNode *arr);
+void dircache_free(void);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fcache.h"
+
+#define FCACHE_BUCKETS	256
+
+#if defined(__APPLE__)
+# define MTIME_NS(sb)	((sb).st_mtimespec.tv_nsec)
+#else
+# define MTIME_NS(sb)	((sb).st_mtim.tv_nsec)
+#endif
+
+struct fentry {
+	struct fentry *next;
+	char *key;			/* "user-device" */
+	char *friends;			/* value in the friends database */
+	struct fdeps deps;
+	char *reply;			/* JSON array */
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fentry *buckets[FCACHE_BUCKETS];
+static int nentries = 0, maxentries = 0;
+
+static unsigned hash(const char *s)
+{
+	unsigned h = 5381;
+
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return (h % FCACHE_BUCKETS);
+}
+
+static void sign(struct fdep *dp)
+{
+	struct stat sb;
+
+	if (stat(dp->path, &sb) == 0) {
+		dp->exists	= 1;
+		dp->ino		= sb.st_ino;
+		dp->size	= sb.st_size;
+		dp->mtime	= sb.st_mtime;
+		dp->mtime_ns	= MTIME_NS(sb);
+	} else {
+		dp->exists	= 0;
+		dp->ino		= 0;
+		dp->size	= 0;
+		dp->mtime	= 0;
+		dp->mtime_ns	= 0;
+	}
+}
+
+/*
+ * Note `path' as one the reply is built from, in its current state;
+ * this must be done before the file is read.
+ */
+
+void fdeps_add(struct fdeps *deps, const char *path)
+{
+	struct fdep *dp;
+	char *p;
+
+	if (deps->n == deps->max) {
+		int n = deps->max ? deps->max * 2 : 16;
+
+		if ((dp = realloc(deps->d, n * sizeof(struct fdep))) == NULL)
+			return;
+		deps->d = dp;
+		deps->max = n;
+	}
+	if ((p = strdup(path)) == NULL)
+		return;
+
+	dp = &deps->d[deps->n++];
+	dp->path = p;
+	sign(dp);
+}
+
+void fdeps_free(struct fdeps *deps)
+{
+	int i;
+
+	for (i = 0; i < deps->n; i++)
+		free(deps->d[i].path);
+	free(deps->d);
+	deps->d = NULL;
+	deps->n = deps->max = 0;
+}
+
+/*
+ * True if none of the files in `deps' has changed since it was added.
+ */
+
+int fdeps_unchanged(struct fdeps *deps)
+{
+	struct fdep now;
+	int i;
+
+	for (i = 0; i < deps->n; i++) {
+		now.path = deps->d[i].path;
+		sign(&now);
+		if (now.exists != deps->d[i].exists ||
+			now.ino != deps->d[i].ino ||
+			now.size != deps->d[i].size ||
+			now.mtime != deps->d[i].mtime ||
+			now.mtime_ns != deps->d[i].mtime_ns)
+			return (0);
+	}
+	return (1);
+}
+
+static void fentry_free(struct fentry *e)
+{
+	free(e->key);
+	free(e->friends);
+	fdeps_free(&e->deps);
+	free(e->reply);
+	free(e);
+}
+
+/* Called with the mutex held, as is everything else using nentries */
+
+static void drop(struct fentry *e)
+{
+	fentry_free(e);
+	nentries--;
+}
+
+static struct fentry *unlink_key(const char *key)
+{
+	struct fentry **ep, *e;
+
+	for (ep = &buckets[hash(key)]; (e = *ep) != NULL; ep = &e->next) {
+		if (strcmp(e->key, key) == 0) {
+			*ep = e->next;
+			return (e);
+		}
+	}
+	return (NULL);
+}
+
+static void clear(void)
+{
+	struct fentry *e;
+	int i;
+
+	for (i = 0; i < FCACHE_BUCKETS; i++) {
+		while ((e = buckets[i]) != NULL) {
+			buckets[i] = e->next;
+			drop(e);
+		}
+	}
+}
+
+/*
+ * There's one entry per device publishing over HTTP; should there be
+ * more than `max', the cache is emptied and starts afresh.
+ */
+
+void fcache_init(int max)
+{
+	maxentries = max;
+}
+
+/*
+ * Return a copy of the reply for `key' if it was built from `friends'
+ * and files which haven't changed since, else NULL.
+ */
+
+char *fcache_get(const char *key, const char *friends)
+{
+	struct fentry *e;
+	char *reply = NULL;
+
+	pthread_mutex_lock(&mutex);
+	for (e = buckets[hash(key)]; e != NULL; e = e->next) {
+		if (strcmp(e->key, key) == 0)
+			break;
+	}
+	if (e != NULL) {
+		if (strcmp(e->friends, friends) == 0 && fdeps_unchanged(&e->deps)) {
+			reply = strdup(e->reply);
+		} else {
+			unlink_key(key);
+			drop(e);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return (reply);
+}
+
+/*
+ * Store `reply' for `key'; `deps' is taken over. The entry is built
+ * before the mutex is taken.
+ */
+
+void fcache_put(const char *key, const char *friends, struct fdeps *deps, const char *reply)
+{
+	struct fentry *e, *old;
+	unsigned h = hash(key);
+
+	if (maxentries <= 0 || (e = calloc(1, sizeof(struct fentry))) == NULL) {
+		fdeps_free(deps);
+		return;
+	}
+	e->key		= strdup(key);
+	e->friends	= strdup(friends);
+	e->reply	= strdup(reply);
+	e->deps		= *deps;
+	memset(deps, 0, sizeof(*deps));
+	if (!e->key || !e->friends || !e->reply) {
+		fentry_free(e);
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	if ((old = unlink_key(key)) != NULL)
+		drop(old);
+	if (++nentries > maxentries) {
+		clear();			/* all but `e', which isn't linked yet */
+	}
+	e->next = buckets[h];
+	buckets[h] = e;
+	pthread_mutex_unlock(&mutex);
+}
+
+void fcache_free(void)
+{
+	pthread_mutex_lock(&mutex);
+	clear();
+	pthread_mutex_unlock(&mutex);
+}
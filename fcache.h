@@ -0,0 +1,39 @@
+#ifndef _FCACHE_H_INCLUDED_
+# define _FCACHE_H_INCLUDED_
+
+#include <sys/types.h>
+
+/*
+ * Cache of the friends part of the reply to an HTTP publish, per
+ * user/device. An entry remembers the value in the friends database it
+ * was built from and the state (inode, size, modification time) of
+ * each file it was built from, and is only used while all of them are
+ * unchanged. Safe for use by concurrent HTTP workers.
+ */
+
+#define FCACHE_ENTRIES	4096		/* user/devices */
+
+struct fdep {
+	char *path;
+	int exists;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_ns;
+};
+
+struct fdeps {
+	struct fdep *d;
+	int n, max;
+};
+
+void fdeps_add(struct fdeps *deps, const char *path);
+void fdeps_free(struct fdeps *deps);
+int fdeps_unchanged(struct fdeps *deps);
+
+void fcache_init(int maxentries);
+char *fcache_get(const char *key, const char *friends);
+void fcache_put(const char *key, const char *friends, struct fdeps *deps, const char *reply);
+void fcache_free(void);
+
+#endif
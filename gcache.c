@@ -21,6 +21,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "udata.h"
 #include "fences.h"
 #include "gcache.h"
@@ -211,6 +214,67 @@ int gcache_json_put(struct gcache *gc, char *keystr, JsonNode *json)
 	return (rc);
 }
 
+/*
+ * Several gets and puts in one write transaction, committed (and synced)
+ * once with gcache_txn_commit().
+ */
+
+MDB_txn *gcache_txn_begin(struct gcache *gc)
+{
+	MDB_txn *txn;
+	int rc;
+
+	if (gc == NULL)
+		return (NULL);
+
+	if ((rc = mdb_txn_begin(gc->env, NULL, 0, &txn)) != 0) {
+		olog(LOG_ERR, "gcache_txn_begin: mdb_txn_begin: %s", mdb_strerror(rc));
+		return (NULL);
+	}
+	return (txn);
+}
+
+long gcache_txn_get(struct gcache *gc, MDB_txn *txn, char *k, char *buf, long buflen)
+{
+	MDB_val key, data;
+	long len;
+
+	key.mv_data = k;
+	key.mv_size = strlen(k);
+
+	if (mdb_get(txn, gc->dbi, &key, &data) != 0)
+		return (-1);
+	len = (data.mv_size < buflen) ? data.mv_size : buflen;
+	memcpy(buf, data.mv_data, len);
+	return (len);
+}
+
+int gcache_txn_put(struct gcache *gc, MDB_txn *txn, char *keystr, char *payload)
+{
+	MDB_val key, data;
+	int rc;
+
+	key.mv_data	= keystr;
+	key.mv_size	= strlen(keystr);
+	data.mv_data	= payload;
+	data.mv_size	= strlen(payload) + 1;
+
+	if ((rc = mdb_put(txn, gc->dbi, &key, &data, 0)) != 0) {
+		olog(LOG_ERR, "gcache_txn_put: mdb_put: %s", mdb_strerror(rc));
+	}
+	return (rc);
+}
+
+int gcache_txn_commit(MDB_txn *txn)
+{
+	int rc;
+
+	if ((rc = mdb_txn_commit(txn)) != 0) {
+		olog(LOG_ERR, "gcache_txn_commit: mdb_txn_commit: (%d) %s", rc, mdb_strerror(rc));
+	}
+	return (rc);
+}
+
 long gcache_get(struct gcache *gc, char *k, char *buf, long buflen)
 {
 	MDB_val key, data;
@@ -290,28 +354,329 @@ JsonNode *gcache_json_get(struct gcache *gc, char *k)
 	return (json);
 }
 
-void gcache_dump(char *path, char *lmdbname)
+#define GCACHE_BATCH	10000		/* puts per write transaction when loading */
+#define GCACHE_BLOCK	(1024 * 1024)	/* bytes of records per block of a binary dump */
+#define GCACHE_QUEUE	4		/* blocks in flight between the two threads */
+
+/*
+ * A binary dump is a header followed by blocks of records, in host
+ * byte order. A record is the key and value lengths (each a varint:
+ * seven bits per byte, least significant first, high bit set on all
+ * but the last) followed by the key and the value as stored, i.e.
+ * including the value's nul-byte. Each block header carries the CRC-32 of the block's
+ * records; the last block holds only the total number of records.
+ */
+
+#define DUMP_MAGIC	0x4347544f	/* "OTGC" */
+#define DUMP_VERSION	1
+#define BLOCK_MAGIC	0x4247544f	/* "OTGB" */
+#define END_MAGIC	0x4547544f	/* "OTGE" */
+
+struct dumphdr {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct blockhdr {
+	uint32_t magic;
+	uint32_t count;			/* records */
+	uint32_t len;			/* bytes following */
+	uint32_t crc;
+};
+
+#define VARINT_MAX	5		/* bytes for a uint32_t */
+
+static size_t varint_put(char *bp, uint32_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		bp[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	bp[n++] = (char)v;
+	return (n);
+}
+
+/*
+ * Decode a varint from [*bpp, end), advancing *bpp; -1 if it's
+ * truncated or too long.
+ */
+
+static int varint_get(char **bpp, char *end, uint32_t *v)
 {
+	unsigned char *bp = (unsigned char *)*bpp;
+	uint32_t val = 0;
+	int shift;
+
+	for (shift = 0; shift < 7 * VARINT_MAX; shift += 7) {
+		if ((char *)bp >= end)
+			return (-1);
+		val |= (uint32_t)(*bp & 0x7f) << shift;
+		if ((*bp++ & 0x80) == 0) {
+			*bpp = (char *)bp;
+			*v = val;
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+/*
+ * Blocks are handed from one thread to the other (LMDB reader to
+ * writer of the dump, reader of the dump to LMDB writer) through a
+ * short queue, so that reading and writing overlap.
+ */
+
+struct block {
+	struct block *next;
+	uint32_t count;
+	uint32_t len;
+	size_t size;			/* allocated for data */
+	char data[];
+};
+
+struct blockq {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct block *head, *tail;
+	int n;
+	int eof;			/* producer has finished */
+	int abort;			/* consumer has given up */
+	char *err;			/* why the producer stopped early */
 	struct gcache *gc;
+	FILE *fp;
+};
+
+static void bq_init(struct blockq *q, struct gcache *gc, FILE *fp)
+{
+	memset(q, 0, sizeof(struct blockq));
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->gc = gc;
+	q->fp = fp;
+}
+
+static void bq_destroy(struct blockq *q)
+{
+	struct block *b;
+
+	while ((b = q->head) != NULL) {
+		q->head = b->next;
+		free(b);
+	}
+	pthread_mutex_destroy(&q->mutex);
+	pthread_cond_destroy(&q->cond);
+}
+
+static struct block *block_new(size_t size)
+{
+	struct block *b;
+
+	if (size < GCACHE_BLOCK)
+		size = GCACHE_BLOCK;
+	if ((b = malloc(sizeof(struct block) + size)) != NULL) {
+		b->next		= NULL;
+		b->count	= 0;
+		b->len		= 0;
+		b->size		= size;
+	}
+	return (b);
+}
+
+/*
+ * Queue block `b', or with NULL, signal the end (`err' says why if it
+ * came early). Returns -1 if the consumer has given up, in which case
+ * the block has been freed.
+ */
+
+static int bq_put(struct blockq *q, struct block *b, char *err)
+{
+	pthread_mutex_lock(&q->mutex);
+	while (b && q->n >= GCACHE_QUEUE && !q->abort)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	if (q->abort) {
+		pthread_mutex_unlock(&q->mutex);
+		free(b);
+		return (-1);
+	}
+	if (b == NULL) {
+		q->eof = TRUE;
+		q->err = err;
+	} else {
+		if (q->tail)
+			q->tail->next = b;
+		else
+			q->head = b;
+		q->tail = b;
+		q->n++;
+	}
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	return (0);
+}
+
+/*
+ * Next block, or NULL when the producer has finished.
+ */
+
+static struct block *bq_get(struct blockq *q)
+{
+	struct block *b;
+
+	pthread_mutex_lock(&q->mutex);
+	while (q->head == NULL && !q->eof)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	if ((b = q->head) != NULL) {
+		if ((q->head = b->next) == NULL)
+			q->tail = NULL;
+		q->n--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return (b);
+}
+
+static void bq_abort(struct blockq *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	q->abort = TRUE;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/*
+ * Walk the database and queue its records in blocks.
+ */
+
+static void *dump_reader(void *arg)
+{
+	struct blockq *q = (struct blockq *)arg;
+	struct block *b = NULL, *nb;
 	MDB_val key, data;
 	MDB_txn *txn;
 	MDB_cursor *cursor;
+	size_t need;
+	char *err = NULL;
 	int rc;
 
-	if ((gc = gcache_open(path, lmdbname, TRUE)) == NULL) {
-		fprintf(stderr, "Cannot open lmdb/%s at %s\n",
-			lmdbname ? lmdbname : "NULL", path);
-		return;
+	if ((rc = mdb_txn_begin(q->gc->env, NULL, MDB_RDONLY, &txn)) != 0) {
+		bq_put(q, NULL, mdb_strerror(rc));
+		return (NULL);
+	}
+	if ((rc = mdb_cursor_open(txn, q->gc->dbi, &cursor)) != 0) {
+		mdb_txn_abort(txn);
+		bq_put(q, NULL, mdb_strerror(rc));
+		return (NULL);
 	}
 
-	key.mv_size = 0;
-	key.mv_data = NULL;
+	while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+		need = 2 * VARINT_MAX + key.mv_size + data.mv_size;
+		if (b == NULL || b->len + need > b->size) {
+			if ((nb = block_new(need)) == NULL) {
+				err = "out of memory";
+				break;
+			}
+			if (b && bq_put(q, b, NULL) == -1) {
+				free(nb);
+				b = NULL;
+				break;
+			}
+			b = nb;
+		}
+
+		b->len += varint_put(b->data + b->len, key.mv_size);
+		b->len += varint_put(b->data + b->len, data.mv_size);
+		memcpy(b->data + b->len, key.mv_data, key.mv_size);
+		b->len += key.mv_size;
+		memcpy(b->data + b->len, data.mv_data, data.mv_size);
+		b->len += data.mv_size;
+		b->count++;
+	}
+	if (rc != 0 && rc != MDB_NOTFOUND)
+		err = mdb_strerror(rc);
+
+	mdb_cursor_close(cursor);
+	mdb_txn_abort(txn);
+
+	if (b && err)
+		free(b);
+	else if (b)
+		bq_put(q, b, NULL);
+	bq_put(q, NULL, err);
+	return (NULL);
+}
+
+static int dump_binary(struct gcache *gc, FILE *fp)
+{
+	struct dumphdr dh;
+	struct blockhdr bh;
+	struct blockq q;
+	struct block *b;
+	pthread_t tid;
+	uint64_t total = 0;
+	int rc = 0;
+
+	dh.magic	= DUMP_MAGIC;
+	dh.version	= DUMP_VERSION;
+	if (fwrite(&dh, sizeof(dh), 1, fp) != 1)
+		return (-1);
+
+	bq_init(&q, gc, fp);
+	if (pthread_create(&tid, NULL, dump_reader, &q) != 0) {
+		bq_destroy(&q);
+		return (-1);
+	}
+
+	while ((b = bq_get(&q)) != NULL) {
+		bh.magic	= BLOCK_MAGIC;
+		bh.count	= b->count;
+		bh.len		= b->len;
+		bh.crc		= crc32_update(0, b->data, b->len);
+		if (fwrite(&bh, sizeof(bh), 1, fp) != 1 ||
+			fwrite(b->data, 1, b->len, fp) != b->len) {
+			free(b);
+			bq_abort(&q);
+			rc = -1;
+			break;
+		}
+		total += b->count;
+		free(b);
+	}
+	pthread_join(tid, NULL);
+
+	if (q.err) {
+		fprintf(stderr, "Cannot read database: %s\n", q.err);
+		rc = -1;
+	}
+
+	if (rc == 0) {
+		bh.magic	= END_MAGIC;
+		bh.count	= 0;
+		bh.len		= sizeof(total);
+		bh.crc		= crc32_update(0, &total, sizeof(total));
+		if (fwrite(&bh, sizeof(bh), 1, fp) != 1 ||
+			fwrite(&total, sizeof(total), 1, fp) != 1)
+			rc = -1;
+	}
+	if (fflush(fp) != 0)
+		rc = -1;
+
+	bq_destroy(&q);
+	return (rc);
+}
+
+static int dump_text(struct gcache *gc, FILE *fp)
+{
+	MDB_val key, data;
+	MDB_txn *txn;
+	MDB_cursor *cursor;
+	int rc;
 
 	rc = mdb_txn_begin(gc->env, NULL, MDB_RDONLY, &txn);
 	if (rc) {
 		olog(LOG_ERR, "gcache_dump: mdb_txn_begin: (%d) %s", rc, mdb_strerror(rc));
-		gcache_close(gc);
-		return;
+		return (-1);
 	}
 
 	rc = mdb_cursor_open(txn, gc->dbi, &cursor);
@@ -321,48 +686,414 @@ void gcache_dump(char *path, char *lmdbname)
 
 		/* Don't dump mdb keys if we seem to not have JSON data */
 		if (strchr((char *)data.mv_data, '{') != NULL) {
-			printf("%*.*s %*.*s\n",
-				(int)key.mv_size, (int)key.mv_size, (char *)key.mv_data,
-				(int)data.mv_size - 1, (int)data.mv_size - 1, (char *)data.mv_data);
+			fwrite(key.mv_data, 1, key.mv_size, fp);
+			putc(' ', fp);
+			fwrite(data.mv_data, 1, data.mv_size - 1, fp);
+			putc('\n', fp);
 		}
 	}
 	mdb_cursor_close(cursor);
 	mdb_txn_commit(txn);
-	gcache_close(gc);
+
+	return (fflush(fp) == 0 ? 0 : -1);
 }
 
-void gcache_load(char *path, char *lmdbname)
+/*
+ * Write the content of the database to stdout, either as text (key,
+ * space, value per line; JSON values only) or as a binary dump which
+ * gcache_load() can restore exactly.
+ */
+
+int gcache_dump(char *path, char *lmdbname, int binary)
 {
 	struct gcache *gc;
-	char buf[8192], *bp;
+	static char obuf[GCACHE_BLOCK];
 	int rc;
 
-	if ((gc = gcache_open(path, lmdbname, FALSE)) == NULL) {
-		olog(LOG_ERR, "gcache_load: gcache_open");
-		return;
+	if ((gc = gcache_open(path, lmdbname, TRUE)) == NULL) {
+		fprintf(stderr, "Cannot open lmdb/%s at %s\n",
+			lmdbname ? lmdbname : "NULL", path);
+		return (-1);
+	}
+
+	setvbuf(stdout, obuf, _IOFBF, sizeof(obuf));
+	rc = binary ? dump_binary(gc, stdout) : dump_text(gc, stdout);
+	if (rc != 0) {
+		fprintf(stderr, "Cannot dump lmdb/%s: %s\n",
+			lmdbname ? lmdbname : "NULL", strerror(errno));
 	}
 
-	while (fgets(buf, sizeof(buf), stdin) != NULL) {
+	gcache_close(gc);
+	return (rc);
+}
+
+/*
+ * Loading puts keys in batches of GCACHE_BATCH per transaction. As long
+ * as the keys arrive in order (as dumped) and are beyond those in the
+ * database, they're appended with MDB_APPEND, which skips the search
+ * and fills pages completely.
+ */
+
+struct loader {
+	struct gcache *gc;
+	MDB_txn *txn;
+	long pending;			/* puts in this transaction */
+	long count;			/* puts committed */
+	int append;			/* keys so far were ascending */
+	char *prev;			/* previous key */
+	size_t prevlen, prevsize;
+};
+
+/* LMDB's default key order */
+static int keycmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+
+	return (c ? c : (alen < blen ? -1 : alen > blen));
+}
+
+static int loader_commit(struct loader *ld)
+{
+	int rc;
 
-		if ((bp = strchr(buf, '\r')) != NULL)
+	if (ld->txn == NULL)
+		return (0);
+
+	rc = mdb_txn_commit(ld->txn);
+	ld->txn = NULL;
+	if (rc) {
+		olog(LOG_ERR, "gcache_load: mdb_txn_commit: (%d) %s", rc, mdb_strerror(rc));
+		return (rc);
+	}
+	ld->count += ld->pending;
+	ld->pending = 0;
+	return (0);
+}
+
+static void loader_abort(struct loader *ld)
+{
+	if (ld->txn) {
+		mdb_txn_abort(ld->txn);
+		ld->txn = NULL;
+	}
+	ld->pending = 0;
+}
+
+/*
+ * Put `val' (`vlen' bytes, including its nul-byte) at `k', or delete
+ * `k' if `val' is NULL.
+ */
+
+static int loader_put(struct loader *ld, char *k, size_t klen, char *val, size_t vlen)
+{
+	MDB_val key, data;
+	char *p;
+	int rc;
+
+	if (ld->txn == NULL && (rc = mdb_txn_begin(ld->gc->env, NULL, 0, &ld->txn)) != 0) {
+		olog(LOG_ERR, "gcache_load: mdb_txn_begin: %s", mdb_strerror(rc));
+		return (rc);
+	}
+
+	key.mv_data	= k;
+	key.mv_size	= klen;
+
+	if (val == NULL) {
+		if ((rc = mdb_del(ld->txn, ld->gc->dbi, &key, NULL)) == MDB_NOTFOUND)
+			rc = 0;
+	} else {
+		data.mv_data	= val;
+		data.mv_size	= vlen;
+
+		if (ld->append && ld->prev && keycmp(k, klen, ld->prev, ld->prevlen) <= 0)
+			ld->append = FALSE;
+
+		rc = MDB_KEYEXIST;
+		if (ld->append) {
+			/* fails if the database already has keys beyond this one */
+			if ((rc = mdb_put(ld->txn, ld->gc->dbi, &key, &data, MDB_APPEND)) == MDB_KEYEXIST)
+				ld->append = FALSE;
+		}
+		if (rc == MDB_KEYEXIST)
+			rc = mdb_put(ld->txn, ld->gc->dbi, &key, &data, 0);
+
+		if (ld->append) {
+			if (klen > ld->prevsize) {
+				if ((p = realloc(ld->prev, klen)) == NULL) {
+					ld->append = FALSE;
+				} else {
+					ld->prev = p;
+					ld->prevsize = klen;
+				}
+			}
+			if (ld->append) {
+				memcpy(ld->prev, k, klen);
+				ld->prevlen = klen;
+			}
+		}
+	}
+
+	if (rc != 0) {
+		olog(LOG_ERR, "gcache_load: %s: %s", val ? "mdb_put" : "mdb_del", mdb_strerror(rc));
+		return (rc);
+	}
+
+	if (++ld->pending >= GCACHE_BATCH)
+		return (loader_commit(ld));
+	return (0);
+}
+
+static int load_text(struct loader *ld, FILE *fp)
+{
+	char *line = NULL, *bp;
+	size_t linesize = 0;
+	int rc = 0;
+
+	while (getline(&line, &linesize, fp) != -1) {
+
+		if ((bp = strchr(line, '\r')) != NULL)
 			*bp = 0;
-		if ((bp = strchr(buf, '\n')) != NULL)
+		if ((bp = strchr(line, '\n')) != NULL)
 			*bp = 0;
 
-		if ((bp = strchr(buf, ' ')) != NULL) {
-			*bp = 0;
+		if ((bp = strchr(line, ' ')) != NULL) {
+			*bp++ = 0;
 
-			if ((rc = gcache_put(gc, buf, bp+1)) != 0) {
-				fprintf(stderr, "Cannot load key; aborting load (%d) %s\n",
-					rc, mdb_strerror(rc));
-				olog(LOG_ERR, "gcache_put: (%d) %s", rc, mdb_strerror(rc));
-				goto end;
+			if (strcmp(bp, "DELETE") == 0) {
+				rc = loader_put(ld, line, strlen(line), NULL, 0);
+			} else {
+				rc = loader_put(ld, line, strlen(line), bp, strlen(bp) + 1);
 			}
+			if (rc != 0)
+				break;
 		}
 	}
+	free(line);
+	return (rc);
+}
 
-    end:
-	gcache_close(gc);
+static int readfull(FILE *fp, void *buf, size_t len)
+{
+	return (fread(buf, 1, len, fp) == len ? 0 : -1);
+}
+
+/*
+ * Read the blocks of a binary dump, verify them, and queue them.
+ */
+
+static void *load_reader(void *arg)
+{
+	struct blockq *q = (struct blockq *)arg;
+	struct blockhdr bh;
+	struct block *b;
+	uint64_t total = 0, expected;
+
+	while (1) {
+		if (readfull(q->fp, &bh, sizeof(bh)) == -1) {
+			bq_put(q, NULL, "dump is truncated");
+			return (NULL);
+		}
+
+		if (bh.magic == END_MAGIC) {
+			if (bh.len != sizeof(expected) ||
+				readfull(q->fp, &expected, sizeof(expected)) == -1 ||
+				crc32_update(0, &expected, sizeof(expected)) != bh.crc) {
+				bq_put(q, NULL, "dump has a damaged trailer");
+			} else if (expected != total) {
+				bq_put(q, NULL, "dump is missing records");
+			} else {
+				bq_put(q, NULL, NULL);
+			}
+			return (NULL);
+		}
+
+		if (bh.magic != BLOCK_MAGIC || bh.len > 64 * GCACHE_BLOCK) {
+			bq_put(q, NULL, "dump is damaged");
+			return (NULL);
+		}
+		if ((b = block_new(bh.len)) == NULL) {
+			bq_put(q, NULL, "out of memory");
+			return (NULL);
+		}
+		if (readfull(q->fp, b->data, bh.len) == -1) {
+			free(b);
+			bq_put(q, NULL, "dump is truncated");
+			return (NULL);
+		}
+		if (crc32_update(0, b->data, bh.len) != bh.crc) {
+			free(b);
+			bq_put(q, NULL, "dump has a block with a bad checksum");
+			return (NULL);
+		}
+		b->count	= bh.count;
+		b->len		= bh.len;
+		total		+= bh.count;
+
+		if (bq_put(q, b, NULL) == -1)
+			return (NULL);
+	}
+}
+
+static int load_binary(struct loader *ld, FILE *fp)
+{
+	struct dumphdr dh;
+	struct blockq q;
+	struct block *b;
+	pthread_t tid;
+	uint32_t klen, vlen, n;
+	char *bp, *end;
+	int rc = 0;
+
+	if (readfull(fp, &dh, sizeof(dh)) == -1 || dh.magic != DUMP_MAGIC) {
+		fprintf(stderr, "Input is not a binary dump\n");
+		return (-1);
+	}
+	if (dh.version != DUMP_VERSION) {
+		fprintf(stderr, "Unsupported dump version %u\n", dh.version);
+		return (-1);
+	}
+
+	bq_init(&q, ld->gc, fp);
+	if (pthread_create(&tid, NULL, load_reader, &q) != 0) {
+		bq_destroy(&q);
+		return (-1);
+	}
+
+	while (rc == 0 && (b = bq_get(&q)) != NULL) {
+		bp = b->data;
+		end = b->data + b->len;
+		for (n = 0; rc == 0 && n < b->count; n++) {
+			if (varint_get(&bp, end, &klen) == -1 ||
+				varint_get(&bp, end, &vlen) == -1 ||
+				(size_t)(end - bp) < (size_t)klen + vlen) {
+				rc = -1;
+				break;
+			}
+			rc = loader_put(ld, bp, klen, bp + klen, vlen);
+			bp += klen + vlen;
+		}
+		free(b);
+	}
+	if (rc != 0)
+		bq_abort(&q);
+	pthread_join(tid, NULL);
+
+	if (q.err) {
+		fprintf(stderr, "%s\n", q.err);
+		rc = -1;
+	} else if (rc == -1) {
+		fprintf(stderr, "dump has a malformed block\n");
+	}
+
+	bq_destroy(&q);
+	return (rc);
+}
+
+/*
+ * Load key/value pairs from stdin into the database: lines with key,
+ * space, and value (DELETE removes the key) or a binary dump. A batch
+ * is only committed if all its puts succeed; on error, the batches
+ * before it remain.
+ */
+
+int gcache_load(char *path, char *lmdbname, int binary)
+{
+	struct loader ld;
+	int rc;
+
+	memset(&ld, 0, sizeof(ld));
+	ld.append = TRUE;
+
+	if ((ld.gc = gcache_open(path, lmdbname, FALSE)) == NULL) {
+		olog(LOG_ERR, "gcache_load: gcache_open");
+		return (-1);
+	}
+
+	rc = binary ? load_binary(&ld, stdin) : load_text(&ld, stdin);
+	if (rc == 0) {
+		rc = loader_commit(&ld);
+	} else {
+		loader_abort(&ld);
+	}
+
+	if (rc != 0) {
+		fprintf(stderr, "Load aborted; %ld keys were committed\n", ld.count);
+	}
+
+	free(ld.prev);
+	gcache_close(ld.gc);
+	return (rc);
+}
+
+/*
+ * Hand at most `max' entries of `gc' to func(), starting at the first
+ * key not less than `pos', in a single write transaction; func()
+ * returns GC_KEEP, GC_DELETE to remove the entry, or GC_STOP to end
+ * the slice before it. On return, `pos' holds the key at which to
+ * continue, or is empty if the end of the database was reached.
+ * Returns the number of entries kept or deleted, or -1 on error.
+ */
+
+int gcache_sweep(struct gcache *gc, char *pos, size_t possize, int max, int (*func)(void *arg, char *key, char *value), void *arg)
+{
+	MDB_val key, data;
+	MDB_txn *txn;
+	MDB_cursor *cursor;
+	char ks[512];
+	int rc, n = 0, res = GC_KEEP;
+
+	if (gc == NULL)
+		return (-1);
+
+	if ((rc = mdb_txn_begin(gc->env, NULL, 0, &txn)) != 0) {
+		olog(LOG_ERR, "gcache_sweep: mdb_txn_begin: %s", mdb_strerror(rc));
+		return (-1);
+	}
+	if ((rc = mdb_cursor_open(txn, gc->dbi, &cursor)) != 0) {
+		olog(LOG_ERR, "gcache_sweep: mdb_cursor_open: %s", mdb_strerror(rc));
+		mdb_txn_abort(txn);
+		return (-1);
+	}
+
+	key.mv_data = pos;
+	key.mv_size = strlen(pos);
+	rc = mdb_cursor_get(cursor, &key, &data, *pos ? MDB_SET_RANGE : MDB_FIRST);
+
+	while (rc == 0 && n < max) {
+		if (key.mv_size >= sizeof(ks) || data.mv_size == 0 ||
+			((char *)data.mv_data)[data.mv_size - 1] != 0) {
+			res = GC_KEEP;		/* not one of ours */
+		} else {
+			memcpy(ks, key.mv_data, key.mv_size);
+			ks[key.mv_size] = 0;
+			if ((res = func(arg, ks, data.mv_data)) == GC_STOP)
+				break;
+		}
+
+		if (res == GC_DELETE && (rc = mdb_cursor_del(cursor, 0)) != 0)
+			break;
+		n++;
+		rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+	}
+	if (rc != 0 && rc != MDB_NOTFOUND) {
+		olog(LOG_ERR, "gcache_sweep: %s", mdb_strerror(rc));
+		mdb_cursor_close(cursor);
+		mdb_txn_abort(txn);
+		return (-1);
+	}
+
+	*pos = 0;
+	if (rc == 0 && key.mv_size < possize) {
+		memcpy(pos, key.mv_data, key.mv_size);
+		pos[key.mv_size] = 0;
+	}
+	mdb_cursor_close(cursor);
+
+	if ((rc = mdb_txn_commit(txn)) != 0) {
+		olog(LOG_ERR, "gcache_sweep: mdb_txn_commit: %s", mdb_strerror(rc));
+		return (-1);
+	}
+	return (n);
 }
 
 /*
@@ -17,9 +17,19 @@ int gcache_put(struct gcache *, char *ghash, char *payload);
 int gcache_json_put(struct gcache *, char *ghash, JsonNode *geo);
 long gcache_get(struct gcache *, char *key, char *buf, long buflen);
 JsonNode *gcache_json_get(struct gcache *, char *key);
-void gcache_dump(char *path, char *lmdbname);
-void gcache_load(char *path, char *lmdbname);
+int gcache_dump(char *path, char *lmdbname, int binary);
+int gcache_load(char *path, char *lmdbname, int binary);
 int gcache_del(struct gcache *gc, char *keystr);
+MDB_txn *gcache_txn_begin(struct gcache *gc);
+long gcache_txn_get(struct gcache *gc, MDB_txn *txn, char *key, char *buf, long buflen);
+int gcache_txn_put(struct gcache *gc, MDB_txn *txn, char *keystr, char *payload);
+int gcache_txn_commit(MDB_txn *txn);
+
+#define GC_KEEP		0	/* gcache_sweep() callback results */
+#define GC_DELETE	1
+#define GC_STOP		2
+
+int gcache_sweep(struct gcache *gc, char *pos, size_t possize, int max, int (*func)(void *arg, char *key, char *value), void *arg);
 bool gcache_enum(char *user, char *device, struct gcache *gc, char *key_part, int (*func)(char *key, wpoint *wp, double lat, double lon), double lat, double lon, struct udata *ud, char *topic, JsonNode *json);
 
 #endif
@@ -50,6 +50,8 @@ static struct mosquitto *MQTTconn = NULL;
 
 static struct gcache *LuaDB = NULL;
 
+#define HOOKLET_PREFIX	"hooklet_"
+
 
 /*
  * Invoke the function `name' in the Lua script, which _may_ return
@@ -73,6 +75,181 @@ static int l_function(lua_State *L, char *name)
 	return (rc);
 }
 
+/*
+ * Return a registry reference to the global function `name', or
+ * LUA_NOREF if there is no such function.
+ */
+
+static int l_ref(lua_State *L, char *name)
+{
+	lua_getglobal(L, name);
+	if (lua_type(L, -1) != LUA_TFUNCTION) {
+		lua_pop(L, 1);
+		return (LUA_NOREF);
+	}
+	return (luaL_ref(L, LUA_REGISTRYINDEX));
+}
+
+/*
+ * Resolve the script's hook functions once so that messages don't
+ * look them up by name. Hooklets (functions named hooklet_<key>) are
+ * collected into a table keyed by <key>, which saves formatting and
+ * looking up a global name for every member of every payload.
+ */
+
+static void hooks_resolve(struct luadata *ld)
+{
+	lua_State *L = ld->L;
+	size_t plen = strlen(HOOKLET_PREFIX);
+	const char *key;
+
+	lua_settop(L, 0);
+	ld->r_hook		= l_ref(L, "otr_hook");
+	ld->r_putrec		= l_ref(L, "otr_putrec");
+	ld->r_httpobject	= l_ref(L, "otr_httpobject");
+	ld->r_transition	= l_ref(L, "otr_transition");
+	ld->r_revgeo		= l_ref(L, "otr_revgeo");
+
+	ld->nhooklets = 0;
+	lua_newtable(L);				/* 1: hooklets */
+	lua_getglobal(L, "_G");				/* 2: globals */
+	lua_pushnil(L);
+	while (lua_next(L, 2) != 0) {
+		/* check the type first: lua_tostring() on a number key would upset lua_next() */
+		if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TFUNCTION) {
+			key = lua_tostring(L, -2);
+			if (strncmp(key, HOOKLET_PREFIX, plen) == 0 && key[plen]) {
+				lua_pushstring(L, key + plen);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, 1);
+				ld->nhooklets++;
+			}
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	ld->r_hooklets = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_settop(L, 0);
+}
+
+/*
+ * Push a function we resolved in hooks_resolve() and return TRUE, or
+ * push nothing and return FALSE if the script doesn't have it.
+ */
+
+static int l_push(lua_State *L, int ref)
+{
+	if (ref == LUA_NOREF)
+		return (FALSE);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+	return (TRUE);
+}
+
+/*
+ * The argument marshaller: push a Lua table with the scalar members of
+ * the JSON object `o'; arrays and objects are skipped.
+ */
+
+static void push_table(lua_State *L, JsonNode *o)
+{
+	JsonNode *j;
+	int n = 0;
+
+	json_foreach(j, o) {
+		n++;
+	}
+
+	lua_createtable(L, 0, n);
+	json_foreach(j, o) {
+		if (j->tag >= JSON_ARRAY)
+			continue;
+		lua_pushstring(L, j->key);		/* table key */
+		if (j->tag == JSON_STRING) {
+			lua_pushstring(L, j->string_);
+		} else if (j->tag == JSON_NUMBER) {
+			lua_pushnumber(L, j->number_);
+		} else if (j->tag == JSON_NULL) {
+			lua_pushnil(L);
+		} else if (j->tag == JSON_BOOL) {
+			lua_pushboolean(L, j->bool_);
+		}
+		lua_rawset(L, -3);
+	}
+}
+
+/*
+ * Hooklets get a view of the argument table instead of a copy: an
+ * empty table whose metatable's __index is the table itself, so that
+ * a view costs the same however wide the payload is. What a hooklet
+ * assigns lands in its own view, unseen by the others; pairs() (from
+ * Lua 5.2) walks the argument table's members.
+ */
+
+static int view_next(lua_State *L)
+{
+	lua_settop(L, 2);
+	if (lua_next(L, 1))
+		return (2);
+	lua_pushnil(L);
+	return (1);
+}
+
+static int view_pairs(lua_State *L)
+{
+	lua_pushcfunction(L, view_next);
+	if (!lua_getmetatable(L, 1))
+		return (luaL_error(L, "not a hooklet argument table"));
+	lua_getfield(L, -1, "__index");
+	lua_remove(L, -2);
+	lua_pushnil(L);
+	return (3);
+}
+
+/* Push the metatable for views of the table at (absolute) index `idx' */
+
+static void view_meta(lua_State *L, int idx)
+{
+	lua_createtable(L, 0, 2);
+	lua_pushvalue(L, idx);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, view_pairs);
+	lua_setfield(L, -2, "__pairs");
+}
+
+/* Push a view with the metatable at (absolute) index `meta' */
+
+static void push_view(lua_State *L, int meta)
+{
+	lua_createtable(L, 0, 0);
+	lua_pushvalue(L, meta);
+	lua_setmetatable(L, -2);
+}
+
+/*
+ * Push a shallow copy of the table at (absolute) index `idx', presized
+ * for `n' members; cheaper than marshalling the JSON object again.
+ */
+
+static void copy_table(lua_State *L, int idx, int n)
+{
+	lua_createtable(L, 0, n);
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		lua_pushvalue(L, -2);			/* key key value */
+		lua_insert(L, -2);
+		lua_rawset(L, -4);
+	}
+}
+
+static char *json_type(JsonNode *o)
+{
+	JsonNode *j;
+
+	if ((j = json_find_member(o, "_type")) != NULL && j->tag == JSON_STRING)
+		return (j->string_);
+	return ("unknown");
+}
+
 struct luadata *hooks_init(struct udata *ud, char *script)
 {
 	struct luadata *ld;
@@ -140,9 +317,12 @@ struct luadata *hooks_init(struct udata *ud, char *script)
 		 */
 
 		hooks_exit(ld, "otr_init() returned non-zero");
-		ld = NULL;
+		return (NULL);
 	}
 
+	hooks_resolve(ld);
+	olog(LOG_DEBUG, "Lua hooks resolved: %d hooklet(s)", ld->nhooklets);
+
 	return (ld);
 }
 
@@ -158,75 +338,23 @@ void hooks_exit(struct luadata *ld, char *reason)
 	}
 }
 
-static void do_hook(char *hookname, struct udata *ud, char *topic, JsonNode *fullo)
-{
-	struct luadata *ld = ud->luadata;
-	char *_type = "unknown";
-	JsonNode *j;
-
-	if (!ld || !ld->script)
-		return;
-
-	lua_settop(ld->L, 0);
-	lua_getglobal(ld->L, hookname);
-	if (lua_type(ld->L, -1) != LUA_TFUNCTION) {
-		olog(LOG_NOTICE, "cannot invoke %s in Lua script", hookname);
-		return;
-	}
-
-	lua_pushstring(ld->L, topic);			/* arg1: topic */
-
-	if ((j = json_find_member(fullo, "_type")) != NULL) {
-		if (j->tag == JSON_STRING)
-			_type = j->string_;
-	}
-
-	lua_pushstring(ld->L, _type);			/* arg2: record type */
-
-	lua_newtable(ld->L);				/* arg3: table */
-	json_foreach(j, fullo) {
-		if (j->tag >= JSON_ARRAY)
-			continue;
-		lua_pushstring(ld->L, j->key);		/* table key */
-		if (j->tag == JSON_STRING) {
-			lua_pushstring(ld->L, j->string_);
-		} else if (j->tag == JSON_NUMBER) {
-			lua_pushnumber(ld->L, j->number_);
-		} else if (j->tag == JSON_NULL) {
-			lua_pushnil(ld->L);
-		} else if (j->tag == JSON_BOOL) {
-			lua_pushboolean(ld->L, j->bool_);
-		}
-		lua_rawset(ld->L, -3);
+/*
+ * Invoke the function on top of the stack with topic, record type, and
+ * the argument table at stack index `targ'.
+ */
 
-	}
+static void do_hook(lua_State *L, char *hookname, char *topic, char *_type, int targ)
+{
+	lua_pushstring(L, topic);			/* arg1: topic */
+	lua_pushstring(L, _type);			/* arg2: record type */
+	lua_pushvalue(L, targ);				/* arg3: table */
 
 	/* Invoke `hook' function in Lua with our args */
-	if (lua_pcall(ld->L, 3, 1, 0)) {
-		olog(LOG_ERR, "Failed to run script: %s", lua_tostring(ld->L, -1));
+	if (lua_pcall(L, 3, 1, 0)) {
+		olog(LOG_ERR, "Failed to run %s in Lua: %s", hookname, lua_tostring(L, -1));
 		exit(1);
 	}
-
-	// rc = (int)lua_tonumber(ld->L, -1);
-	// printf("C: FILTER returns %d\n", rc);
-}
-
-static void hooks_hooklet(struct udata *ud, char *topic, JsonNode *fullo)
-{
-	JsonNode *j;
-	struct luadata *ld = ud->luadata;
-	char hookname[BUFSIZ];
-
-	if (!ud->luascript)
-		return;
-
-	json_foreach(j, fullo) {
-		snprintf(hookname, sizeof(hookname), "hooklet_%s", j->key);
-		lua_getglobal(ld->L, hookname);
-		if (lua_type(ld->L, -1) == LUA_TFUNCTION) {
-			do_hook(hookname, ud, topic, fullo);
-		}
-	}
+	lua_pop(L, 1);
 }
 
 /*
@@ -243,8 +371,7 @@ int hooks_norec(struct udata *ud, char *user, char *device, char *payload)
 		return (0);
 
 	lua_settop(ld->L, 0);
-	lua_getglobal(ld->L, "otr_putrec");
-	if (lua_type(ld->L, -1) != LUA_TFUNCTION) {
+	if (!l_push(ld->L, ld->r_putrec)) {
 		return (0);
 	}
 
@@ -270,50 +397,28 @@ int hooks_norec(struct udata *ud, char *user, char *device, char *payload)
 JsonNode *hooks_http(struct udata *ud, char *user, char *device, char *payload)
 {
 	struct luadata *ld = ud->luadata;
-	char *_type = "unknown";
-	JsonNode *obj = NULL, *j, *fullo;
+	JsonNode *obj = NULL, *fullo;
 
 	debug(ud, "in hooks_http()");
 	if (ld == NULL || !ld->script)
 		return (0);
 
-	fullo = json_decode(payload);
-
 	lua_settop(ld->L, 0);
-	lua_getglobal(ld->L, "otr_httpobject");
-	if (lua_type(ld->L, -1) != LUA_TFUNCTION) {
+	if (!l_push(ld->L, ld->r_httpobject)) {
 		debug(ud, "no otr_httpobject function in Lua file: returning");
 		return (0);
 	}
 
-	lua_pushstring(ld->L, user);			/* arg1 */
-	lua_pushstring(ld->L, device);			/* arg2 */
-
-
-	if ((j = json_find_member(fullo, "_type")) != NULL) {
-		if (j->tag == JSON_STRING)
-			_type = j->string_;
+	if ((fullo = json_decode(payload)) == NULL) {
+		lua_settop(ld->L, 0);
+		return (0);
 	}
 
-	lua_pushstring(ld->L, _type);			/* arg3: record type */
-
-	lua_newtable(ld->L);				/* arg4: table */
-	json_foreach(j, fullo) {
-		if (j->tag >= JSON_ARRAY)
-			continue;
-		lua_pushstring(ld->L, j->key);		/* table key */
-		if (j->tag == JSON_STRING) {
-			lua_pushstring(ld->L, j->string_);
-		} else if (j->tag == JSON_NUMBER) {
-			lua_pushnumber(ld->L, j->number_);
-		} else if (j->tag == JSON_NULL) {
-			lua_pushnil(ld->L);
-		} else if (j->tag == JSON_BOOL) {
-			lua_pushboolean(ld->L, j->bool_);
-		}
-		lua_rawset(ld->L, -3);
-
-	}
+	lua_pushstring(ld->L, user);			/* arg1 */
+	lua_pushstring(ld->L, device);			/* arg2 */
+	lua_pushstring(ld->L, json_type(fullo));	/* arg3: record type */
+	push_table(ld->L, fullo);			/* arg4: table */
+	json_delete(fullo);
 
 
 	// lua_pushstring(ld->L, payload);
@@ -375,10 +480,57 @@ JsonNode *hooks_http(struct udata *ud, char *user, char *device, char *payload)
 	return (obj);
 }
 
+/*
+ * Invoke otr_hook() and the hooklets for the members of `fullo'. The
+ * argument table is built once. otr_hook() gets it to itself if there
+ * are no hooklets, else a copy; each hooklet gets a view of it, so
+ * that changes one of them makes aren't seen by the others.
+ */
+
 void hooks_hook(struct udata *ud, char *topic, JsonNode *fullo)
 {
-	do_hook("otr_hook", ud, topic, fullo);
-	hooks_hooklet(ud, topic, fullo);
+	struct luadata *ld = ud->luadata;
+	char *_type = json_type(fullo);
+	JsonNode *j;
+	int n = 0;
+
+	if (!ld || !ld->script)
+		return;
+
+	json_foreach(j, fullo) {
+		n++;
+	}
+
+	lua_settop(ld->L, 0);
+	push_table(ld->L, fullo);			/* 1: argument table */
+
+	if (l_push(ld->L, ld->r_hook)) {
+		if (ld->nhooklets > 0)
+			copy_table(ld->L, 1, n);	/* 2: its copy, below the function */
+		else
+			lua_pushvalue(ld->L, 1);	/* 2: the table itself */
+		lua_insert(ld->L, -2);
+		do_hook(ld->L, "otr_hook", topic, _type, 2);
+	} else {
+		olog(LOG_NOTICE, "cannot invoke %s in Lua script", "otr_hook");
+	}
+	lua_settop(ld->L, 1);
+
+	if (ld->nhooklets > 0) {
+		lua_rawgeti(ld->L, LUA_REGISTRYINDEX, ld->r_hooklets);	/* 2 */
+		view_meta(ld->L, 1);				/* 3 */
+		json_foreach(j, fullo) {
+			lua_pushstring(ld->L, j->key);
+			lua_rawget(ld->L, 2);
+			if (lua_type(ld->L, -1) == LUA_TFUNCTION) {
+				push_view(ld->L, 3);		/* 4: a view */
+				lua_insert(ld->L, -2);
+				do_hook(ld->L, j->key, topic, _type, 4);
+			}
+			lua_settop(ld->L, 3);
+		}
+	}
+	lua_settop(ld->L, 0);
 }
 
 /*
@@ -389,6 +541,7 @@ void hooks_hook(struct udata *ud, char *topic, JsonNode *fullo)
 
 void hooks_transition(struct udata *ud, char *user, char *device, int event, char *desc, double wplat, double wplon, double lat, double lon, char *topic, JsonNode *json, long meters)
 {
+	struct luadata *ld = ud->luadata;
 	JsonNode *j;
 
 	if ((j = json_find_member(json, "_type")) != NULL) {
@@ -406,7 +559,17 @@ void hooks_transition(struct udata *ud, char *user, char *device, int event, cha
 		event == ENTER ? "ENTER" : "LEAVE", desc);
 
 
-	do_hook("otr_transition", ud, topic, json);
+	if (!ld || !ld->script)
+		return;
+
+	lua_settop(ld->L, 0);
+	push_table(ld->L, json);			/* 1: argument table */
+	if (l_push(ld->L, ld->r_transition)) {
+		do_hook(ld->L, "otr_transition", topic, "transition", 1);
+	} else {
+		olog(LOG_NOTICE, "cannot invoke %s in Lua script", "otr_transition");
+	}
+	lua_settop(ld->L, 0);
 }
 
 /*
@@ -425,10 +588,19 @@ JsonNode *hook_revgeo(struct udata *ud, char *luafunc, char *topic, char *user,
 		return (0);
 
 	lua_settop(ld->L, 0);
-	lua_getglobal(ld->L, luafunc);
-	if (lua_type(ld->L, -1) != LUA_TFUNCTION) {
-		debug(ud, "no %s function in Lua file: returning", luafunc);
-		return (0);
+	if (strcmp(luafunc, "otr_revgeo") == 0) {
+		if (!l_push(ld->L, ld->r_revgeo)) {
+			debug(ud, "no %s function in Lua file: returning", luafunc);
+			return (0);
+		}
+	} else {
+		/* named by the payload's _lua, so we can't resolve it up front */
+		lua_getglobal(ld->L, luafunc);
+		if (lua_type(ld->L, -1) != LUA_TFUNCTION) {
+			debug(ud, "no %s function in Lua file: returning", luafunc);
+			lua_settop(ld->L, 0);
+			return (0);
+		}
 	}
 
 	lua_pushstring(ld->L, topic);			/* arg1 */
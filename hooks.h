@@ -8,6 +8,13 @@
 struct luadata {
 	char *script;			/* Path to Lua script in --lua-script  */
 	lua_State *L;			/* The Lua machine */
+	int r_hook;			/* registry references to the script's */
+	int r_putrec;			/*   functions, or LUA_NOREF */
+	int r_httpobject;
+	int r_transition;
+	int r_revgeo;
+	int r_hooklets;			/* table of JSON key -> hooklet_<key>() */
+	int nhooklets;			/* number of entries therein */
 };
 
 struct luadata *hooks_init(struct udata *ud, char *luascript);
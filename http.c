@@ -23,6 +23,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#ifdef WITH_ZLIB
+# include <zlib.h>
+#endif
 #include "recorder.h"
 #include "json.h"
 #include "util.h"
@@ -33,6 +40,9 @@
 #include "geohash.h"
 #include "udata.h"
 #include "version.h"
+#include "rcache.h"
+#include "fcache.h"
+#include "vcache.h"
 #include <float.h>
 #ifdef WITH_HTTP
 # include "http.h"
@@ -40,6 +50,7 @@
 #if WITH_ENCRYPT
 # include <sodium.h>
 # include "base64.h"
+# include "keycache.h"
 #endif
 #if WITH_LUA
 # include "hooks.h"
@@ -114,7 +125,7 @@ static long *field_n(struct mg_connection *conn, char *fieldname)
 {
 	char buf[BUFSIZ];
 	int ret;
-	static long l;
+	static __thread long l;
 
 	if ((ret = mg_get_var(conn, fieldname, buf, sizeof(buf))) < 0) {
 		return (NULL);
@@ -123,6 +134,32 @@ static long *field_n(struct mg_connection *conn, char *fieldname)
 	return (&l);
 }
 
+/*
+ * Parse the view JSON in the file at `path' into `view'; the file is
+ * read from the view cache.
+ */
+
+static int view_from_file(JsonNode *view, char *path)
+{
+	char *js_string;
+	JsonNode *node;
+
+	if ((js_string = vcache_file(path, TRUE)) == NULL) {
+		return (FALSE);
+	}
+
+	if ((node = json_decode(js_string)) == NULL) {
+		fprintf(stderr, "view_from_file can't decode JSON from %s\n", path);
+		free(js_string);
+		return (FALSE);
+	}
+	json_copy_to_object(view, node, FALSE);
+	json_delete(node);
+	free(js_string);
+
+	return (TRUE);
+}
+
 /*
  * Open a view.json file, parse the JSON and return the object
  * or NULL.
@@ -130,7 +167,7 @@ static long *field_n(struct mg_connection *conn, char *fieldname)
 
 static JsonNode *loadview(struct udata *ud, const char *viewname)
 {
-	static UT_string *fpath = NULL;
+	static __thread UT_string *fpath = NULL;
 	JsonNode *view;
 
 	utstring_renew(fpath);
@@ -138,13 +175,13 @@ static JsonNode *loadview(struct udata *ud, const char *viewname)
 	debug(ud, "loadview fpath=%s", UB(fpath));
 
 	view = json_mkobject();
-	if (json_copy_from_file(view, UB(fpath)) != TRUE) {
+	if (view_from_file(view, UB(fpath)) != TRUE) {
 #ifdef WITH_TOURS
 		/* Now try second possibility */
 		utstring_renew(fpath);
 		utstring_printf(fpath, "%s/%s.json", toursdir(), viewname);
 		debug(ud, "loadview2 fpath=%s", UB(fpath));
-		if (json_copy_from_file(view, UB(fpath)) != TRUE) {
+		if (view_from_file(view, UB(fpath)) != TRUE) {
 #endif
 		json_delete(view);
 		return (NULL);
@@ -269,6 +306,174 @@ void http_ws_push_json(struct mg_server *server, JsonNode *obj)
 	}
 }
 
+/*
+ * HTTP requests are served by a pool of worker threads so that a long
+ * export doesn't hold up ingest. Each worker polls a server of its own;
+ * all of them share the listening socket of ud->mgserver. Websocket
+ * pushes are queued in a ring which every worker drains onto its own
+ * websocket connections after each poll, so that ingest never waits on
+ * a worker which is busy building a response. A worker which falls
+ * more than WSQ_SIZE messages behind loses the oldest of them.
+ */
+
+#define WSQ_SIZE	(256)
+#define WORKER_POLLMS	(100)
+
+static struct {
+	pthread_mutex_t mutex;
+	unsigned long seq;		/* number of messages ever queued */
+	JsonNode *ring[WSQ_SIZE];
+} wsq = { PTHREAD_MUTEX_INITIALIZER, 0, { NULL } };
+
+struct http_worker {
+	pthread_t tid;
+	struct mg_server *server;
+	unsigned long seq;		/* next message to push */
+};
+
+static struct http_worker *workers = NULL;
+static int nworkers = 0;
+static volatile int workers_run = 0;
+
+void http_ws_publish(JsonNode *obj)
+{
+	JsonNode *copy;
+	int slot;
+
+	if (!obj || obj->tag != JSON_OBJECT || nworkers == 0)
+		return;
+
+	copy = json_mkobject();
+	json_copy_to_object(copy, obj, TRUE);
+
+	pthread_mutex_lock(&wsq.mutex);
+	slot = wsq.seq++ % WSQ_SIZE;
+	if (wsq.ring[slot])
+		json_delete(wsq.ring[slot]);
+	wsq.ring[slot] = copy;
+	pthread_mutex_unlock(&wsq.mutex);
+}
+
+static int has_websockets(struct mg_server *server)
+{
+	struct mg_connection *c;
+
+	for (c = mg_next(server, NULL); c != NULL; c = mg_next(server, c)) {
+		if (c->is_websocket)
+			return (TRUE);
+	}
+	return (FALSE);
+}
+
+static void ws_drain(struct http_worker *w)
+{
+	JsonNode *pending[WSQ_SIZE];
+	int n = 0, i, push = has_websockets(w->server);
+
+	pthread_mutex_lock(&wsq.mutex);
+	if (wsq.seq - w->seq > WSQ_SIZE)
+		w->seq = wsq.seq - WSQ_SIZE;
+	for (; w->seq < wsq.seq; w->seq++) {
+		if (push) {
+			pending[n] = json_mkobject();
+			json_copy_to_object(pending[n++], wsq.ring[w->seq % WSQ_SIZE], TRUE);
+		}
+	}
+	pthread_mutex_unlock(&wsq.mutex);
+
+	for (i = 0; i < n; i++) {
+		http_ws_push_json(w->server, pending[i]);
+		json_delete(pending[i]);
+	}
+}
+
+static void *http_worker(void *arg)
+{
+	struct http_worker *w = (struct http_worker *)arg;
+
+	while (workers_run) {
+		mg_poll_server(w->server, WORKER_POLLMS);
+		ws_drain(w);
+	}
+	return (NULL);
+}
+
+/*
+ * Start `n' workers on ud->mgserver, which must be configured and
+ * listening. Additional servers get the same options and share its
+ * listeners. Signals are left to the main thread.
+ */
+
+int http_workers_start(struct udata *ud, int n)
+{
+	const char **names, *value;
+	sigset_t all, old;
+	struct http_worker *w;
+	int i, rc;
+
+	if (n < 1)
+		n = 1;
+	if ((workers = calloc(n, sizeof(struct http_worker))) == NULL)
+		return (-1);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	workers_run = 1;
+	for (i = 0; i < n; i++) {
+		w = &workers[i];
+		if (i == 0) {
+			w->server = ud->mgserver;
+		} else {
+			w->server = mg_create_server(ud, ev_handler);
+			for (names = mg_get_valid_option_names(); *names; names += 2) {
+				if (strcmp(*names, "listening_port") == 0)
+					continue;
+				if ((value = mg_get_option(ud->mgserver, *names)) != NULL && *value)
+					mg_set_option(w->server, *names, value);
+			}
+			mg_copy_listeners(ud->mgserver, w->server);
+		}
+
+		w->seq = wsq.seq;
+		if ((rc = pthread_create(&w->tid, NULL, http_worker, w)) != 0) {
+			olog(LOG_ERR, "Cannot start HTTP worker %d: %s", i, strerror(rc));
+			if (i > 0)
+				mg_destroy_server(&w->server);
+			break;
+		}
+		nworkers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return (nworkers);
+}
+
+void http_workers_stop(struct udata *ud)
+{
+	int i;
+
+	workers_run = 0;
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].tid, NULL);
+	}
+	for (i = 1; i < nworkers; i++) {
+		mg_destroy_server(&workers[i].server);
+	}
+	mg_destroy_server(&ud->mgserver);
+
+	nworkers = 0;
+	free(workers);
+	workers = NULL;
+
+	for (i = 0; i < WSQ_SIZE; i++) {
+		if (wsq.ring[i]) {
+			json_delete(wsq.ring[i]);
+			wsq.ring[i] = NULL;
+		}
+	}
+}
+
 static int send_reply(struct mg_connection *conn)
 {
 	if (conn->is_websocket) {
@@ -293,7 +498,6 @@ static int send_reply(struct mg_connection *conn)
 
 static void send_last(struct mg_connection *conn)
 {
-	struct udata *ud = (struct udata *)conn->server_param;
 	JsonNode *user_array, *o, *one;
 	char *u = NULL, *d = NULL, *ghash;
 	double lat, lon;
@@ -349,7 +553,7 @@ static void send_last(struct mg_connection *conn)
 				free(ghash);
 			}
 
-			http_ws_push_json(ud->mgserver, o);
+			http_ws_publish(o);
 			json_delete(o);
 		}
 		json_delete(user_array);
@@ -366,63 +570,437 @@ static int monitor(struct mg_connection *conn)
 	return (MG_TRUE);
 }
 
-static int json_response(struct mg_connection *conn, JsonNode *json)
+/*
+ * A response body is produced into a struct out: out_write() takes it a
+ * piece at a time as the writers produce it (a CSV or XML line, a GPX
+ * track point, JSON between array elements), and if the client accepts
+ * it and OTR_HTTPCOMPRESS (a zlib level) isn't 0, deflate()s it there
+ * and then, so that of a compressed response only the compressed body
+ * is held. out_send() sends it once it's complete, which lets a
+ * deflate() error fail the response with a 500 instead of sending a
+ * truncated stream. BODY_JSON gets a JSON Content-Type and CORS header;
+ * X-Content-Length is the uncompressed length and therefore only sent
+ * for uncompressed bodies.
+ */
+
+#define BODY_JSON	0
+#define BODY_TEXT	1
+#define BODY_GEOKEYS	2	/* never sent: the ghashes a response used */
+
+#define ENC_IDENTITY	0
+#define ENC_GZIP	1
+#define ENC_DEFLATE	2
+
+static const char *encodings[] = { "identity", "gzip", "deflate" };
+
+#ifdef WITH_ZLIB
+# define ZCHUNK		(16 * 1024)
+#endif
+
+struct out {
+	int enc;
+	int failed;
+	size_t len;		/* uncompressed length */
+	UT_string *body;	/* as it will be sent, i.e. in `enc' */
+#ifdef WITH_ZLIB
+	z_stream zs;
+#endif
+};
+
+#ifdef WITH_ZLIB
+/*
+ * True if the Accept-Encoding header `ae' lists `coding' without q=0.
+ */
+
+static int accepts(const char *ae, const char *coding)
 {
-	char *js;
+	size_t clen = strlen(coding);
+	const char *p = ae, *q;
+
+	while (*p) {
+		while (*p == ' ' || *p == ',')
+			p++;
+		if (strncasecmp(p, coding, clen) == 0 && strchr(" ;,", p[clen] ? p[clen] : ',')) {
+			q = p + clen;
+			while (*q == ' ')
+				q++;
+			if (*q == ';' && (q = strstr(q, "q=")) != NULL && strtod(q + 2, NULL) == 0.0)
+				return (FALSE);
+			return (TRUE);
+		}
+		if ((p = strchr(p, ',')) == NULL)
+			break;
+	}
+	return (FALSE);
+}
+
+/*
+ * Run deflate() with `flush' over what's in z->zs, appending its output
+ * to o->body, until it wants no more room. Z_BUF_ERROR means it could
+ * make no progress, which with room and input given is an error too.
+ */
 
-	mg_send_header(conn, "Content-Type", "application/json; charset=utf-8");
-	mg_send_header(conn, "Access-Control-Allow-Origin", "*");
+static int out_deflate(struct out *o, int flush)
+{
+	size_t room;
+	int rc;
+
+	do {
+		utstring_reserve(o->body, ZCHUNK);
+		room = o->body->n - o->body->i - 1;
+		o->zs.next_out	= (Bytef *)o->body->d + o->body->i;
+		o->zs.avail_out	= room;
+		rc = deflate(&o->zs, flush);
+		o->body->i += room - o->zs.avail_out;
+		o->body->d[o->body->i] = 0;
+		if (rc != Z_OK && rc != Z_STREAM_END) {
+			olog(LOG_ERR, "Cannot compress response: deflate: %d %s", rc, o->zs.msg ? o->zs.msg : "");
+			return (FALSE);
+		}
+	} while (o->zs.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+	return (TRUE);
+}
+#endif /* WITH_ZLIB */
 
+static void out_init(struct out *o, struct mg_connection *conn, int enc)
+{
+#ifdef WITH_ZLIB
+	struct udata *ud = (struct udata *)conn->server_param;
+#endif
+
+	memset(o, 0, sizeof(struct out));
+	utstring_new(o->body);
+#ifdef WITH_ZLIB
+	/* 15 window bits; +16 asks for a gzip wrapper, else it's zlib ("deflate") */
+	if (enc != ENC_IDENTITY) {
+		if (deflateInit2(&o->zs, ud->http_compress, Z_DEFLATED, (enc == ENC_GZIP) ? 15 + 16 : 15,
+			8, Z_DEFAULT_STRATEGY) == Z_OK) {
+			o->enc = enc;
+			return;
+		}
+		olog(LOG_ERR, "Cannot compress response; sending it uncompressed");
+	}
+#endif
+	o->enc = ENC_IDENTITY;
+}
+
+static void out_write(struct out *o, const char *data, size_t len)
+{
+	if (o->failed || len == 0)
+		return;
+	o->len += len;
+#ifdef WITH_ZLIB
+	if (o->enc != ENC_IDENTITY) {
+		o->zs.next_in	= (Bytef *)data;
+		o->zs.avail_in	= len;
+		if (!out_deflate(o, Z_NO_FLUSH))
+			o->failed = TRUE;
+		return;
+	}
+#endif
+	utstring_bincpy(o->body, data, len);
+}
+
+static void out_free(struct out *o)
+{
+#ifdef WITH_ZLIB
+	if (o->enc != ENC_IDENTITY)
+		deflateEnd(&o->zs);
+#endif
+	utstring_free(o->body);
+}
+
+/* writers' callbacks */
+
+static void out_json(const char *s, size_t len, void *param)
+{
+	out_write((struct out *)param, s, len);
+}
+
+static void out_line(char *line, void *param)
+{
+	out_write((struct out *)param, line, strlen(line));
+}
+
+static void out_xml_line(char *line, void *param)
+{
+	out_write((struct out *)param, line, strlen(line));
+	out_write((struct out *)param, "\n", 1);
+}
+
+/*
+ * Choose the Content-Encoding for the response to `conn'.
+ */
+
+static int response_encoding(struct mg_connection *conn)
+{
+#ifdef WITH_ZLIB
+	struct udata *ud = (struct udata *)conn->server_param;
+	const char *ae;
+
+	if (ud->http_compress <= 0 || (ae = mg_get_header(conn, "Accept-Encoding")) == NULL)
+		return (ENC_IDENTITY);
+	if (accepts(ae, "gzip"))
+		return (ENC_GZIP);
+	if (accepts(ae, "deflate"))
+		return (ENC_DEFLATE);
+#endif
+	return (ENC_IDENTITY);
+}
+
+static void http_date(char *buf, size_t buflen, time_t t)
+{
+	struct tm tm;
+
+	strftime(buf, buflen, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+static void send_headers(struct mg_connection *conn, int kind, int enc, size_t len, const char *etag, time_t lastmod)
+{
+	char buf[64];
+
+	if (kind == BODY_JSON) {
+		mg_send_header(conn, "Content-Type", "application/json; charset=utf-8");
+		mg_send_header(conn, "Access-Control-Allow-Origin", "*");
+		if (enc == ENC_IDENTITY) {
+			snprintf(buf, sizeof(buf), "%zu", len);
+			mg_send_header(conn, "X-Content-Length", buf);
+		}
+	}
+#ifdef WITH_ZLIB
+	mg_send_header(conn, "Vary", "Accept-Encoding");
+#endif
+	if (enc != ENC_IDENTITY) {
+		mg_send_header(conn, "Content-Encoding", encodings[enc]);
+	}
+	if (etag != NULL) {
+		mg_send_header(conn, "ETag", etag);
+		if (lastmod) {
+			http_date(buf, sizeof(buf), lastmod);
+			mg_send_header(conn, "Last-Modified", buf);
+		}
+	}
+}
+
+static int send_status(struct mg_connection *conn, int status, char *text);
+
+/*
+ * Finish `o' and send it as the response to `conn'. Returns the coding
+ * it was sent with, or -1 if it couldn't be produced and a 500 was sent
+ * instead. o->body holds what was sent until out_free().
+ */
+
+static int out_send(struct mg_connection *conn, struct out *o, int kind, const char *etag, time_t lastmod)
+{
+#ifdef WITH_ZLIB
+	if (o->enc != ENC_IDENTITY && !o->failed) {
+		o->zs.next_in	= NULL;
+		o->zs.avail_in	= 0;
+		if (!out_deflate(o, Z_FINISH))
+			o->failed = TRUE;
+	}
+#endif
+	if (o->failed) {
+		send_status(conn, 500, "Cannot compress response");
+		return (-1);
+	}
+	send_headers(conn, kind, o->enc, o->len, etag, lastmod);
+	mg_send_data(conn, UB(o->body), utstring_len(o->body));
+	return (o->enc);
+}
+
+/*
+ * Send `body' with content-coding `enc'.
+ */
+
+static void send_body(struct mg_connection *conn, int kind, const char *body, size_t len, int enc)
+{
+	struct out o;
+
+	out_init(&o, conn, enc);
+	out_write(&o, body, len);
+	out_send(conn, &o, kind, NULL, 0);
+	out_free(&o);
+}
+
+static int json_response(struct mg_connection *conn, JsonNode *json)
+{
+	struct out o;
+
+	out_init(&o, conn, response_encoding(conn));
 	if (json == NULL) {
-		mg_send_header(conn, "X-Content-Length", "2");
-		mg_printf_data(conn, "{}");
+		out_write(&o, "{}", 2);
 	} else {
-		if ((js = json_stringify(json, JSON_INDENT)) != NULL) {
-			size_t content_length = strlen(js);
-			int length = snprintf(NULL, 0, "%zu", content_length);
-			char buffer[length + 1];
-			snprintf(buffer, length + 1, "%zu", content_length);
-			mg_send_header(conn, "X-Content-Length", buffer);
-			mg_printf_data(conn, js);
-			free(js);
-		}
+		json_stringify_to(json, JSON_INDENT, out_json, &o);
 		json_delete(json);
 	}
+	out_send(conn, &o, BODY_JSON, NULL, 0);
+	out_free(&o);
 	return (MG_TRUE);
 }
 
-static void emit_xml_line(char *line, void *param)
+/*
+ * The kind of body the /locations result comes as in `otype'.
+ */
+
+static int locations_kind(output_type otype)
 {
-	struct mg_connection *conn = (struct mg_connection *)param;
+	return ((otype == CSV || otype == XML || otype == GPX) ? BODY_TEXT : BODY_JSON);
+}
+
+/*
+ * Turn the /locations result `obj' with its array `locs' into what's
+ * rendered as `otype'. Returns NULL if it can't be; consumes obj.
+ */
 
-	mg_printf_data(conn, line);
-	mg_printf_data(conn, "\n");
+static JsonNode *locations_result(JsonNode *obj, JsonNode *locs, output_type otype)
+{
+	JsonNode *json;
+
+	switch (otype) {
+		case CSV:
+		case XML:
+		case GPX:
+			return (obj);
+		case LINESTRING:
+			if ((json = geo_linestring(locs)) == NULL)
+				json = json_mkobject();
+			break;
+		case GEOJSON:
+		case GEOJSONPOI:
+			json = geo_json(locs, otype == GEOJSONPOI);
+			break;
+		default:
+			return (obj);
+	}
+	json_delete(obj);
+	return (json);
 }
 
-static void emit_csv_line(char *line, void *param)
+/*
+ * Render `json' from locations_result() as `otype' into `o'.
+ */
+
+static void render_locations(JsonNode *json, output_type otype, struct out *o)
 {
-	struct mg_connection *conn = (struct mg_connection *)param;
+	switch (otype) {
+		case CSV:
+			csv_output(json_find_member(json, "data"), CSV, NULL, out_line, o);
+			break;
+		case XML:
+			xml_output(json_find_member(json, "data"), XML, NULL, out_xml_line, o);
+			break;
+		case GPX:
+			gpx_output(json_find_member(json, "data"), out_line, o);
+			break;
+		default:
+			json_stringify_to(json, JSON_INDENT, out_json, o);
+			break;
+	}
+}
 
-	mg_printf_data(conn, line);
+static time_t parse_http_date(const char *s)
+{
+	static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	struct tm tm;
+	char mon[4], *p;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(s, "%*3s, %d %3s %d %d:%d:%d", &tm.tm_mday, mon, &tm.tm_year,
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return (0);
+	if ((p = strstr(months, mon)) == NULL || (p - months) % 3 != 0)
+		return (0);
+	tm.tm_mon = (p - months) / 3;
+	tm.tm_year -= 1900;
+	return (timegm(&tm));
 }
 
-static int xml_response(struct mg_connection *conn, JsonNode *obj)
+/*
+ * Validators for a /locations response. validators() returns in `base'
+ * an FNV-1a hash of the request (query string and form data), its time
+ * range, and the name, size, and mtime of each of the .rec files in
+ * `files' (from lister()), and in `lastmod' the newest of those mtimes.
+ * The ETag is made of that and a digest of the reverse-geo entries the
+ * locations were enriched from (geo_collected(), geo_digest()), so that
+ * a change to any of them, by whichever process, gives a new ETag.
+ */
+
+static uint64_t fnv1a(uint64_t h, const char *s, size_t len)
 {
-	JsonNode *array = json_find_member(obj, "data");
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+	return (h);
+}
 
-	xml_output(array, XML, NULL, emit_xml_line, conn);
+static uint64_t validators(struct mg_connection *conn, JsonNode *files, time_t s_lo, time_t s_hi, time_t *lastmod)
+{
+	uint64_t h = 14695981039346656037ULL;
+	JsonNode *arr, *f;
+	struct stat sb;
+	char buf[BUFSIZ];
 
-	json_delete(obj);
-	return (MG_TRUE);
+	snprintf(buf, sizeof(buf), "%s %s?%s %ld %ld ", VERSION, conn->uri,
+		conn->query_string ? conn->query_string : "", (long)s_lo, (long)s_hi);
+	h = fnv1a(h, buf, strlen(buf));
+	if (conn->content != NULL)
+		h = fnv1a(h, conn->content, conn->content_len);
+
+	if (files && (arr = json_find_member(files, "results")) != NULL) {
+		json_foreach(f, arr) {
+			if (stat(f->string_, &sb) != 0)
+				continue;
+			snprintf(buf, sizeof(buf), "%s %lld %ld", f->string_,
+				(long long)sb.st_size, (long)sb.st_mtime);
+			h = fnv1a(h, buf, strlen(buf));
+			if (sb.st_mtime > *lastmod)
+				*lastmod = sb.st_mtime;
+		}
+	}
+	return (h);
 }
 
-static int csv_response(struct mg_connection *conn, JsonNode *obj)
+static void mketag(char *etag, size_t etaglen, uint64_t base, uint64_t digest, int enc)
 {
-	JsonNode *array = json_find_member(obj, "data");
+	uint64_t h = fnv1a(base, (char *)&digest, sizeof(digest));
 
-	csv_output(array, CSV, NULL, emit_csv_line, conn);
+	/* each content-coding is a different representation */
+	if (enc == ENC_IDENTITY)
+		snprintf(etag, etaglen, "\"%016llx\"", (unsigned long long)h);
+	else
+		snprintf(etag, etaglen, "\"%016llx-%s\"", (unsigned long long)h, encodings[enc]);
+}
 
-	json_delete(obj);
+static int not_modified(struct mg_connection *conn, const char *etag, time_t lastmod)
+{
+	const char *inm = mg_get_header(conn, "If-None-Match");
+	const char *ims = mg_get_header(conn, "If-Modified-Since");
+
+	if (inm != NULL)
+		return (strcmp(inm, "*") == 0 || strstr(inm, etag) != NULL);
+	return (ims != NULL && lastmod != 0 && lastmod <= parse_http_date(ims));
+}
+
+/*
+ * Return the first second of the (UTC) month `t' is in.
+ */
+
+static time_t month_start(time_t t)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	tm.tm_mday = 1;
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	return (timegm(&tm));
+}
+
+static int send_not_modified(struct mg_connection *conn, const char *etag)
+{
+	conn->status_code = 304;
+	mg_printf(conn, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n\r\n", etag);
 	return (MG_TRUE);
 }
 
@@ -466,7 +1044,7 @@ JsonNode *populate_friends(struct mg_connection *conn, char *u, char *d)
 	JsonNode *friends, *obj, *jud, *newob, *jtid, *jtopic;
 	int np;
 	char *pairs[3];
-	static UT_string *userdevice = NULL, *topic = NULL;
+	static __thread UT_string *userdevice = NULL, *topic = NULL;
 
 
 	utstring_renew(userdevice);
@@ -560,68 +1138,221 @@ JsonNode *populate_friends(struct mg_connection *conn, char *u, char *d)
 	return (results);
 }
 
+/*
+ * The friends and http.json part of the reply to a publish by `u'/`d'.
+ * This is the same for each of a device's publishes until one of the
+ * files it's built from or the list of friends changes, so it's kept
+ * in the friends cache. The state of the files is noted before they
+ * are read: a change made meanwhile invalidates the entry. (No member
+ * of the reply comes from the reverse-geo cache: populate_friends()
+ * copies position, card, and topic members only.)
+ */
+
+#define FRIENDSBUF	(64 * 1024)
+
+static JsonNode *friends_reply(struct mg_connection *conn, char *u, char *d)
+{
+	struct udata *ud = (struct udata *)conn->server_param;
+	static __thread char *fbuf = NULL;
+	static __thread UT_string *userdevice = NULL, *path = NULL;
+	struct fdeps deps = { NULL, 0, 0 };
+	JsonNode *jarray, *friends, *jud;
+	char *reply, *pairs[3];
+	long len;
+
+	if (fbuf == NULL && (fbuf = malloc(FRIENDSBUF)) == NULL)
+		goto nocache;
+
+	utstring_renew(userdevice);
+	utstring_printf(userdevice, "%s-%s", u, d);
+
+	/* a list of friends too long for the buffer isn't cached */
+	if ((len = gcache_get(ud->httpfriends, UB(userdevice), fbuf, FRIENDSBUF)) >= FRIENDSBUF)
+		goto nocache;
+	fbuf[len < 0 ? 0 : len] = 0;
+
+	if ((reply = fcache_get(UB(userdevice), fbuf)) != NULL) {
+		jarray = json_decode(reply);
+		free(reply);
+		if (jarray != NULL)
+			return (jarray);
+	}
+
+	if ((friends = json_decode(fbuf)) != NULL && friends->tag == JSON_ARRAY) {
+		json_foreach(jud, friends) {
+			if (jud->tag != JSON_STRING || splitter(jud->string_, "/:-", pairs) != 2)
+				continue;
+			utstring_renew(path);
+			utstring_printf(path, "%s/last/%s/%s/%s-%s.json", STORAGEDIR, pairs[0], pairs[1], pairs[0], pairs[1]);
+			fdeps_add(&deps, UB(path));
+			utstring_renew(path);
+			utstring_printf(path, "%s/last/%s/%s/extra.json", STORAGEDIR, pairs[0], pairs[1]);
+			fdeps_add(&deps, UB(path));
+			utstring_renew(path);
+			utstring_printf(path, "%s/cards/%s/%s/%s-%s.json", STORAGEDIR, pairs[0], pairs[1], pairs[0], pairs[1]);
+			fdeps_add(&deps, UB(path));
+			utstring_renew(path);
+			utstring_printf(path, "%s/cards/%s/%s.json", STORAGEDIR, pairs[0], pairs[0]);
+			fdeps_add(&deps, UB(path));
+			splitterfree(pairs);
+		}
+	}
+	if (friends)
+		json_delete(friends);
+	utstring_renew(path);
+	utstring_printf(path, "%s/last/%s/%s/http.json", STORAGEDIR, u, d);
+	fdeps_add(&deps, UB(path));
+
+	jarray = populate_friends(conn, u, d);
+	extra_http_json(jarray, u, d);
+
+	if ((reply = json_stringify(jarray, NULL)) != NULL) {
+		fcache_put(UB(userdevice), fbuf, &deps, reply);
+		free(reply);
+	}
+	fdeps_free(&deps);
+	return (jarray);
+
+    nocache:
+	jarray = populate_friends(conn, u, d);
+	extra_http_json(jarray, u, d);
+	return (jarray);
+}
+
 #ifdef WITH_ENCRYPT
+/*
+ * The nonce and the ciphertext are written straight into a per-thread
+ * buffer which is reused by the next call; only the base64 result is
+ * allocated.
+ */
+
 char *j_encrypt(struct udata *ud, JsonNode *json, char *userdevice)
 {
-	unsigned char nonce[crypto_secretbox_NONCEBYTES];
+	static __thread unsigned char *encrypted = NULL;
+	static __thread size_t encrypted_size = 0;
 	unsigned char key[crypto_secretbox_KEYBYTES];
-	unsigned char *ciphertext;
+	unsigned char *nb;
 	unsigned long ciphertext_len, mlen;
-	char *js_string, *b64, *encrypted;
-	int klen;
-
-	if ((js_string = json_stringify(json, NULL)) == NULL) {
-		olog(LOG_ERR, "Cannot decode JSON array for encryption");
-		return (NULL);
-	}
+	char *js_string, *b64;
+	long klen;
 
-	memset(key, 0, sizeof(key));
-	klen = gcache_get(ud->keydb, userdevice, (char *)key, sizeof(key));
+	/* most users have no key; find out before stringifying */
+	klen = keycache_get(ud->keydb, userdevice, key, sizeof(key), FALSE);
 	if (klen < 1) {
 		debug(ud, "no encryption key for %s; not encrypting response", userdevice);
-		free(js_string);
 		return (NULL);
 	}
 	debug(ud, "encryption key for %s is {%s}", userdevice, key);
 
-	mlen = strlen(js_string) + 0;
-	ciphertext_len = mlen + crypto_box_MACBYTES;
-	if ((ciphertext = malloc(ciphertext_len)) == NULL) {
-		olog(LOG_ERR, "out of memory in encrypt()");
-		free(js_string);
+	if ((js_string = json_stringify(json, NULL)) == NULL) {
+		olog(LOG_ERR, "Cannot decode JSON array for encryption");
 		return (NULL);
 	}
 
-	if ((encrypted = malloc(ciphertext_len + 40)) == NULL) {
-		olog(LOG_ERR, "out of memory in encrypt() two");
-		free(ciphertext);
-		free(js_string);
-		return (NULL);
+	mlen = strlen(js_string) + 0;
+	ciphertext_len = mlen + crypto_secretbox_MACBYTES;
+	if (crypto_secretbox_NONCEBYTES + ciphertext_len > encrypted_size) {
+		if ((nb = realloc(encrypted, crypto_secretbox_NONCEBYTES + ciphertext_len)) == NULL) {
+			olog(LOG_ERR, "out of memory in encrypt()");
+			free(js_string);
+			return (NULL);
+		}
+		encrypted = nb;
+		encrypted_size = crypto_secretbox_NONCEBYTES + ciphertext_len;
 	}
 
 	/* Create random nonce */
-	randombytes_buf(nonce, sizeof nonce);
+	randombytes_buf(encrypted, crypto_secretbox_NONCEBYTES);
 
-	if (crypto_secretbox_easy((unsigned char *)ciphertext, (unsigned char *)js_string, mlen, nonce, key) != 0) {
+	if (crypto_secretbox_easy(encrypted + crypto_secretbox_NONCEBYTES, (unsigned char *)js_string, mlen, encrypted, key) != 0) {
 		olog(LOG_ERR, "payload cannot be encrypted");
 		free(js_string);
-		free(ciphertext);
-		free(encrypted);
 		return (NULL);
 	}
 
-	memcpy(encrypted, nonce, crypto_secretbox_NONCEBYTES);
-	memcpy(encrypted + crypto_secretbox_NONCEBYTES, ciphertext, ciphertext_len);
 	b64 = base64_encode(encrypted, ciphertext_len + crypto_secretbox_NONCEBYTES);
 	free(js_string);
-	free(ciphertext);
-	free(encrypted);
 
 	return (b64);
 
 }
 #endif /* WITH_ENCRYPT */
 
+/*
+ * A POST to /pub may carry several publishes, e.g. from a device
+ * uploading its backlog: a JSON array of them, or one per line
+ * (newline-delimited JSON). Split `body' into separately allocated
+ * payloads; returns their number, or -1 if `body' is a single publish.
+ */
+
+static int split_batch(char *body, size_t len, char ***payloadsp, size_t **lensp)
+{
+	char **payloads, *bp = body, *end = body + len, *nl;
+	size_t *lens;
+	JsonNode *json, *el;
+	int n = 0, max;
+
+	while (bp < end && isspace((unsigned char)*bp))
+		bp++;
+
+	if (bp < end && *bp == '[') {
+		if ((json = json_decode(body)) == NULL)
+			return (-1);
+		max = 0;
+		json_foreach(el, json)
+			max++;
+		payloads = calloc(max ? max : 1, sizeof(char *));
+		lens = calloc(max ? max : 1, sizeof(size_t));
+		if (payloads == NULL || lens == NULL) {
+			free(payloads);
+			free(lens);
+			json_delete(json);
+			return (-1);
+		}
+		json_foreach(el, json) {
+			if ((payloads[n] = json_stringify(el, NULL)) != NULL) {
+				lens[n] = strlen(payloads[n]);
+				n++;
+			}
+		}
+		json_delete(json);
+	} else {
+		/* A single object may well be spread over several lines */
+		if (memchr(bp, '\n', end - bp) == NULL)
+			return (-1);
+		if ((json = json_decode(body)) != NULL) {
+			json_delete(json);
+			return (-1);
+		}
+
+		max = 1;
+		for (nl = bp; (nl = memchr(nl, '\n', end - nl)) != NULL; nl++)
+			max++;
+		payloads = calloc(max, sizeof(char *));
+		lens = calloc(max, sizeof(size_t));
+		if (payloads == NULL || lens == NULL) {
+			free(payloads);
+			free(lens);
+			return (-1);
+		}
+		while (bp < end) {
+			if ((nl = memchr(bp, '\n', end - bp)) == NULL)
+				nl = end;
+			while (bp < nl && isspace((unsigned char)*bp))
+				bp++;
+			if (bp < nl && (payloads[n] = strndup(bp, nl - bp)) != NULL) {
+				lens[n] = nl - bp;
+				n++;
+			}
+			bp = nl + 1;
+		}
+	}
+
+	*payloadsp = payloads;
+	*lensp = lens;
+	return (n);
+}
+
 /*
  * Invoked from an HTTP POST to /pub?u=username&d=devicename
  * We need u and d in order to contruct a topic name. Obtain
@@ -636,8 +1367,11 @@ static int dopublish(struct mg_connection *conn, const char *uri)
 #ifdef WITH_ENCRYPT
 	char *enc;
 #endif
-	static UT_string *topic = NULL, *userdevice = NULL;
-	JsonNode *jarray, *jnode = NULL;
+	static __thread UT_string *topic = NULL, *userdevice = NULL;
+	JsonNode *jarray, *jnode = NULL, *responses = NULL, *j;
+	char **payloads = NULL;
+	size_t *lens = NULL;
+	int n, i;
 #if WITH_LUA
 	JsonNode *htobj;
 #endif
@@ -660,13 +1394,17 @@ static int dopublish(struct mg_connection *conn, const char *uri)
 	payload = calloc(sizeof(char), conn->content_len + 1);
 	memcpy(payload, conn->content, conn->content_len);
 
-	debug(ud, "HTTPPUB clen=%zu, topic=%s", conn->content_len, UB(topic));
-
-	handle_message(ud, UB(topic), payload, conn->content_len, 0, TRUE, FALSE, &jnode);
+	if ((n = split_batch(payload, conn->content_len, &payloads, &lens)) == -1) {
+		debug(ud, "HTTPPUB clen=%zu, topic=%s", conn->content_len, UB(topic));
+		ingest(ud, UB(topic), payload, conn->content_len, 0, TRUE, &jnode);
+	} else {
+		debug(ud, "HTTPPUB clen=%zu, topic=%s, batch of %d", conn->content_len, UB(topic), n);
+		responses = json_mkarray();
+		ingest_batch(ud, UB(topic), payloads, lens, n, responses);
+	}
 
 
-	jarray = populate_friends(conn, u, d);
-	extra_http_json(jarray, u, d);
+	jarray = friends_reply(conn, u, d);
 
 	if (jnode != NULL) {
 		/*
@@ -676,11 +1414,28 @@ static int dopublish(struct mg_connection *conn, const char *uri)
 		 */
 		json_append_element(jarray, jnode);
 	}
+	if (responses != NULL) {
+		while ((j = json_first_child(responses)) != NULL) {
+			json_remove_from_parent(j);
+			json_append_element(jarray, j);
+		}
+		json_delete(responses);
+	}
 #if WITH_LUA
-	if ((htobj = hooks_http(ud, u, d, payload)) != NULL) {
-		json_append_element(jarray, htobj);
+	pthread_mutex_lock(&ud->lock);
+	for (i = 0; i < (n == -1 ? 1 : n); i++) {
+		htobj = hooks_http(ud, u, d, n == -1 ? payload : payloads[i]);
+		if (htobj != NULL) {
+			json_append_element(jarray, htobj);
+		}
 	}
+	pthread_mutex_unlock(&ud->lock);
 #endif
+	for (i = 0; i < n; i++) {
+		free(payloads[i]);
+	}
+	free(payloads);
+	free(lens);
 	free(payload);
 	free(u);
 	free(d);
@@ -782,7 +1537,7 @@ static JsonNode *viewdata(struct mg_connection *conn, JsonNode *view, int limit)
 		if ((arr = json_find_member(json, "results")) != NULL) {
 			JsonNode *f;
 			json_foreach(f, arr) {
-				locations(f->string_, obj, locs, s_lo, s_hi, JSON, limit, NULL, NULL, NULL);
+				locations(f->string_, obj, locs, s_lo, s_hi, JSON, limit, NULL, NULL, NULL, 0.0, NULL);
 				if (limit) {
 					i_have += limit;
 					if (i_have >= limit) {
@@ -815,6 +1570,34 @@ static JsonNode *viewdata(struct mg_connection *conn, JsonNode *view, int limit)
 	return (locs);
 }
 
+/*
+ * Return the GeoJSON track of `view' from the view cache, or NULL if
+ * the caller must build it with viewdata().
+ */
+
+static char *viewtrack(const char *viewname, JsonNode *view)
+{
+	JsonNode *j, *ju, *jd;
+	char *from = NULL, *to = NULL;
+	time_t s_lo, s_hi;
+	int hours = 0;
+
+	ju = json_find_member(view, "user");
+	jd = json_find_member(view, "device");
+	if ((j = json_find_member(view, "from")) != NULL)
+		from = j->string_;
+	if ((j = json_find_member(view, "to")) != NULL)
+		to = j->string_;
+	if ((j = json_find_member(view, "hours")) != NULL) {
+		hours = j->number_;
+	}
+
+	if (!ju || !jd || make_times(from, &s_lo, to, &s_hi, hours) != 1)
+		return (NULL);
+
+	return (vcache_track(viewname, ju->string_, jd->string_, from, to, hours, s_lo, s_hi));
+}
+
 /*
  * Build and return JavaScript file containing an API key variable in it.
  */
@@ -822,7 +1605,7 @@ static JsonNode *viewdata(struct mg_connection *conn, JsonNode *view, int limit)
 static int apikey(struct mg_connection *conn)
 {
 	struct udata *ud = (struct udata *)conn->server_param;
-	static UT_string *sbuf = NULL;
+	static __thread UT_string *sbuf = NULL;
 
 	utstring_renew(sbuf);
 	utstring_printf(sbuf, "var apiKey = '%s';",
@@ -843,8 +1626,8 @@ static int view(struct mg_connection *conn, const char *viewname)
 {
 	struct udata *ud = (struct udata *)conn->server_param;
 	int limit;
-	char *p, buf[BUFSIZ];
-	static UT_string *fpath = NULL, *sbuf = NULL;
+	char *p, *page, *body, buf[BUFSIZ];
+	static __thread UT_string *fpath = NULL, *sbuf = NULL;
 	FILE *fp;
 	JsonNode *view, *j, *locarray, *obj, *loc, *geoline;
 	viewtype vtype = PAGE;
@@ -887,12 +1670,12 @@ static int view(struct mg_connection *conn, const char *viewname)
 		utstring_printf(fpath, "%s/%s", ud->viewsdir, j->string_);
 		debug(ud, "page file=%s", UB(fpath));
 
-		if ((fp = fopen(UB(fpath), "r")) == NULL) {
+		if ((page = vcache_file(UB(fpath), FALSE)) == NULL) {
 #ifdef WITH_TOURS
 			utstring_renew(fpath);
 			utstring_printf(fpath, "%s/%s", toursdir(), j->string_);
 			debug(ud, "page2 file=%s", UB(fpath));
-			if ((fp = fopen(UB(fpath), "r")) == NULL) {
+			if ((page = vcache_file(UB(fpath), FALSE)) == NULL) {
 #endif
 			json_delete(view);
 			return send_status(conn, 404, "Cannot open view page");
@@ -900,6 +1683,11 @@ static int view(struct mg_connection *conn, const char *viewname)
 			}
 #endif
 		}
+		if ((fp = fmemopen(page, strlen(page), "r")) == NULL) {
+			free(page);
+			json_delete(view);
+			return send_status(conn, 500, "Cannot read view page");
+		}
 
 		mg_send_header(conn, "Content-type", "text/html");
 		utstring_renew(sbuf);
@@ -940,6 +1728,7 @@ static int view(struct mg_connection *conn, const char *viewname)
 			}
 		}
 		fclose(fp);
+		free(page);
 		json_delete(view);
 		return (MG_TRUE);
 		/* NOTREACHED */
@@ -949,8 +1738,16 @@ static int view(struct mg_connection *conn, const char *viewname)
 
 			/*
 			 * We're being asked for the GeoJSON track data for this view.
+			 * It's usually in the view cache, which has it up to date.
 			 */
 
+			if ((body = viewtrack(viewname, view)) != NULL) {
+				json_delete(view);
+				send_body(conn, BODY_JSON, body, strlen(body), response_encoding(conn));
+				free(body);
+				return (MG_TRUE);
+			}
+
 			if ((locarray = viewdata(conn, view, limit=0)) == NULL) {
 				return (MG_TRUE);
 			}
@@ -1025,7 +1822,9 @@ static int view(struct mg_connection *conn, const char *viewname)
 static int dispatch(struct mg_connection *conn, const char *uri)
 {
 	output_type otype = JSON;
-	int nparts, ret, limit = 0;
+	int nparts, ret, limit = 0, maxpoints = 0;
+	double simplify = 0.0;
+	struct bbox bbox, *bb = NULL;
 	char *uparts[MAXPARTS], buf[BUFSIZ], *u = NULL, *d = NULL;
 	char *time_from = NULL, *time_to = NULL;
 	time_t s_lo, s_hi;
@@ -1104,6 +1903,22 @@ static int dispatch(struct mg_connection *conn, const char *uri)
 		limit = atoi(buf);
 	}
 
+	if ((ret = mg_get_var(conn, "simplify", buf, sizeof(buf))) > 0) {
+		simplify = atof(buf);
+	}
+
+	if ((ret = mg_get_var(conn, "maxpoints", buf, sizeof(buf))) > 0) {
+		maxpoints = atoi(buf);
+	}
+
+	if ((ret = mg_get_var(conn, "bbox", buf, sizeof(buf))) > 0) {
+		if (!bbox_parse(buf, &bbox)) {
+			CLEANUP;
+			return send_status(conn, 400, "bbox must be west,south,east,north");
+		}
+		bb = &bbox;
+	}
+
 	if ((ret = mg_get_var(conn, "format", buf, sizeof(buf))) > 0) {
 		if (!strcmp(buf, "geojson"))
 			otype = GEOJSON;
@@ -1144,25 +1959,154 @@ static int dispatch(struct mg_connection *conn, const char *uri)
 		}
 	}
 
-	/* /locations			[<username>[<device>]][[fields=a,b,c] */
+	/* /summary			<username><device> */
 
-	if (nparts == 1 && !strcmp(uparts[0], "locations")) {
+	if (nparts == 1 && !strcmp(uparts[0], "summary")) {
 		if (!u || !d) {
 			CLEANUP;
 			mg_send_status(conn, 416);
 			mg_printf_data(conn, "user and device are required\n");
 			return (MG_TRUE);
 		}
+		json = summaries(u, d, s_lo, s_hi);
+		CLEANUP;
+		return (json_response(conn, json));
+	}
+
+	/* /locations			[<username>[<device>]][[fields=a,b,c] */
+
+	if (nparts == 1 && !strcmp(uparts[0], "locations")) {
+		UT_string *body, *next = NULL;
+		JsonNode *udpairs = NULL;
+		struct out out;
+		char etag[64], geokey[24], *tag = NULL, *cursor = field(conn, "cursor");
+		UT_string *geonotes = NULL;
+		uint64_t base = 0, digest;
+		time_t lastmod = 0;
+		int kind, cacheable = FALSE, enc = response_encoding(conn), reverse = -1;
+
+		if (!u) {
+			CLEANUP;
+			free(cursor);
+			mg_send_status(conn, 416);
+			mg_printf_data(conn, "user is required\n");
+			return (MG_TRUE);
+		}
+		if ((ret = mg_get_var(conn, "order", buf, sizeof(buf))) > 0) {
+			if (strcmp(buf, "asc") && strcmp(buf, "desc")) {
+				CLEANUP;
+				free(cursor);
+				return send_status(conn, 400, "order must be asc or desc");
+			}
+			reverse = !strcmp(buf, "desc");
+		}
+
+		/* simplify follows a single device's track, not a merged stream */
+		if (simplify > 0.0 && (!d || reverse != -1 || cursor)) {
+			CLEANUP;
+			free(cursor);
+			return send_status(conn, 400, "simplify requires a device, and neither order nor cursor");
+		}
+
 		/*
 		 * Obtain a list of .rec files from lister(), possibly limited
 		 * by s_lo/s_hi times, process each and build the JSON `obj'
-		 * with an array of locations.
+		 * with an array of locations. Without a device, or with an
+		 * order or a cursor, the .rec files of the user's devices (or
+		 * of the one) are merged into a single stream ordered by time
+		 * instead; a page cut short by `limit' then comes with a
+		 * cursor for the next one.
+		 */
+
+		if (!d || reverse != -1 || cursor) {
+			if (d) {
+				snprintf(buf, sizeof(buf), "%s/%s", u, d);
+				udpairs = json_mkarray();
+				json_append_element(udpairs, json_mkstring(buf));
+			} else {
+				udpairs = user_devices(u);
+			}
+			if (reverse == -1)
+				reverse = (limit > 0);
+			json = NULL;
+		} else {
+			json = lister(u, d, s_lo, s_hi, (limit > 0) ? TRUE : FALSE);
+		}
+
+		/*
+		 * Given an explicit range, the response changes only when
+		 * its .rec files or the reverse-geo entries it used do, so
+		 * it gets validators, and if the range ends before the
+		 * current month it is worth caching. Which entries a request
+		 * uses is known once it has been answered, and is kept in the
+		 * response cache (BODY_GEOKEYS) for the next one.
 		 */
 
+		if (json && time_from && *time_from && time_to && *time_to) {
+			base = validators(conn, json, s_lo, s_hi, &lastmod);
+			cacheable = s_hi < month_start(time(NULL));
+			snprintf(geokey, sizeof(geokey), "geo-%016llx", (unsigned long long)base);
+
+			/* cached bodies are stored as sent, i.e. in `enc' */
+			utstring_new(body);
+			if (rcache_get(geokey, body, &kind) && kind == BODY_GEOKEYS) {
+				mketag(etag, sizeof(etag), base, geo_digest(UB(body), &lastmod), enc);
+				tag = etag;
+
+				if (not_modified(conn, etag, lastmod)) {
+					utstring_free(body);
+					json_delete(json);
+					CLEANUP;
+					return (send_not_modified(conn, etag));
+				}
+
+				utstring_clear(body);
+				if (cacheable && rcache_get(etag, body, &kind)) {
+					json_delete(json);
+					CLEANUP;
+					send_headers(conn, kind, enc, utstring_len(body), etag, lastmod);
+					mg_send_data(conn, UB(body), utstring_len(body));
+					utstring_free(body);
+					return (MG_TRUE);
+				}
+			}
+			utstring_free(body);
+
+			utstring_new(geonotes);
+			geo_collect(geonotes);
+		}
+
 		obj = json_mkobject();
 		locs = json_mkarray();
 
-		if ((json = lister(u, d, s_lo, s_hi, (limit > 0) ? TRUE : FALSE)) != NULL) {
+		if (udpairs != NULL) {
+			JsonNode *fields = NULL;
+			char *flds = field(conn, "fields");
+
+			if (flds != NULL) {
+				fields = json_splitter(flds, ",");
+				free(flds);
+			}
+
+			CLEANUP;
+
+			utstring_new(next);
+			ret = merged_locations(udpairs, obj, locs, s_lo, s_hi, otype, limit, reverse, fields, bb, cursor, next);
+			json_delete(fields);
+			json_delete(udpairs);
+			free(cursor);
+			if (ret == -1) {
+				utstring_free(next);
+				json_delete(locs);
+				json_delete(obj);
+				return send_status(conn, 400, "invalid cursor");
+			}
+			if (utstring_len(next) > 0) {
+				json_append_member(obj, "cursor", json_mkstring(UB(next)));
+				mg_send_header(conn, "X-Cursor", UB(next));
+			}
+			utstring_free(next);
+		} else if (json != NULL) {
 			JsonNode *arr, *fields = NULL;
 			char *flds = field(conn, "fields");
 			int i_have = 0;
@@ -1177,7 +2121,7 @@ static int dispatch(struct mg_connection *conn, const char *uri)
 			if ((arr = json_find_member(json, "results")) != NULL) {
 				JsonNode *f;
                                 json_foreach(f, arr) {
-                                        locations(f->string_, obj, locs, s_lo, s_hi, otype, limit, fields, NULL, NULL);
+                                        locations(f->string_, obj, locs, s_lo, s_hi, otype, limit, fields, NULL, NULL, simplify, bb);
 					if (limit) {
 						i_have += limit;
 						if (i_have >= limit)
@@ -1189,50 +2133,45 @@ static int dispatch(struct mg_connection *conn, const char *uri)
 			json_delete(fields);
                         json_delete(json);
                 }
+		locations_decimate(obj, locs, maxpoints);
 		json_append_member(obj, "data", locs);
 		json_append_member(obj, "status", json_mknumber(200));
 		json_append_member(obj, "version", json_mkstring(VERSION));
 
-		if (otype == JSON) {
-			return (json_response(conn, obj));
-		} else if (otype == CSV) {
-			return (csv_response(conn, obj));
-		} else if (otype == XML) {
-			return (xml_response(conn, obj));
-		} else if (otype == GPX) {
-			char *xml = gpx_string(locs);
-
-			if (xml) {
-				mg_send_data(conn, xml, strlen(xml));
-			}
-			json_delete(obj);
-			return (MG_TRUE);
-		} else if (otype == LINESTRING) {
-			JsonNode *geoline = geo_linestring(locs);
-
-			json_delete(obj);
-			return (json_response(conn, geoline));
-
-		} else if (otype == GEOJSON) {
-			JsonNode *geojson = geo_json(locs, false);
+		/*
+		 * An entry changed under us leaves the response without
+		 * validators: it may hold both the old and the new one.
+		 */
 
-			json_delete(obj);
-			if (geojson != NULL) {
-				return (json_response(conn, geojson));
+		if (geonotes != NULL) {
+			geo_collect(NULL);
+			if (geo_collected(geonotes, &digest, &lastmod)) {
+				mketag(etag, sizeof(etag), base, digest, enc);
+				tag = etag;
+				rcache_put(geokey, BODY_GEOKEYS, UB(geonotes), utstring_len(geonotes));
+			} else {
+				tag = NULL;
+				cacheable = FALSE;
 			}
-			json_delete(obj);
-			return send_status(conn, 422, "geojson failed");
-
-		} else if (otype == GEOJSONPOI) {	// POI only
-			JsonNode *geojson = geo_json(locs, true);
+			utstring_free(geonotes);
 
-			json_delete(obj);
-			if (geojson != NULL) {
-				return (json_response(conn, geojson));
+			if (tag != NULL && not_modified(conn, etag, lastmod)) {
+				json_delete(obj);
+				return (send_not_modified(conn, etag));
 			}
-			json_delete(obj);
-			return send_status(conn, 422, "geojson failed");
 		}
+
+		if ((obj = locations_result(obj, locs, otype)) == NULL)
+			return send_status(conn, 422, "geojson failed");
+
+		kind = locations_kind(otype);
+		out_init(&out, conn, enc);
+		render_locations(obj, otype, &out);
+		json_delete(obj);
+		if (out_send(conn, &out, kind, tag, lastmod) == enc && cacheable)
+			rcache_put(etag, kind, UB(out.body), utstring_len(out.body));
+		out_free(&out);
+		return (MG_TRUE);
 	}
 
 	if (nparts == 1 && !strcmp(uparts[0], "q")) {
@@ -1480,7 +2419,7 @@ int ev_handler(struct mg_connection *conn, enum mg_event ev)
 
 			if (!strcmp(conn->request_method, "GET") && !strcmp(conn->uri, "/")) {
 				JsonNode *obj = json_mkobject();
-				static UT_string *topic = NULL;
+				static __thread UT_string *topic = NULL;
 				char *js, *parts[10], buf[512];
 				double d;
 				long *l;
@@ -1537,7 +2476,7 @@ int ev_handler(struct mg_connection *conn, enum mg_event ev)
 
 				if ((js = json_stringify(obj, NULL)) != NULL) {
 					fprintf(stderr, "Traccar: %s\n", js);
-					handle_message(ud, UB(topic), js, strlen(js), 0, TRUE, FALSE, NULL);
+					ingest(ud, UB(topic), js, strlen(js), 0, TRUE, NULL);
 					free(js);
 				}
 
@@ -6,6 +6,8 @@
 #include "storage.h"
 #include "json.h"
 
+struct udata;
+
 #define API_PREFIX	"/api/0/"
 #define MONITOR_URI	"/api/0/monitor"
 
@@ -17,5 +19,8 @@ typedef enum {
 
 int ev_handler(struct mg_connection *conn, enum mg_event ev);
 void http_ws_push_json(struct mg_server *server, JsonNode *obj);
+void http_ws_publish(JsonNode *obj);
+int http_workers_start(struct udata *ud, int n);
+void http_workers_stop(struct udata *ud);
 
 #endif
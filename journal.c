@@ -0,0 +1,468 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "journal.h"
+#include "misc.h"
+#include "util.h"
+
+/*
+ * STORAGEDIR/journal/ingest.log holds the entries, each a header
+ * followed by the topic and the payload. ingest.ckpt holds a struct
+ * ckpt with two sequence numbers:
+ *
+ * `durable': all entries up to here have been applied and what they
+ * wrote is on disk. journal_checkpoint() advances it every JOURNAL_CKPT
+ * seconds by syncing the store first and the checkpoint after that.
+ *
+ * `applied': all entries up to here have been applied. It is rewritten
+ * after each one but not synced, so it survives the recorder being
+ * killed, not the machine going down; it is only believed if the
+ * system hasn't been rebooted since it was written (`boot').
+ *
+ * After a crash of the system, the entries after `durable' are replayed
+ * again, and dedup drops those whose publishes had made it to disk.
+ * Once everything in the log has been applied and it has grown beyond
+ * JOURNAL_ROTATE, the log is emptied at a checkpoint.
+ */
+
+#define JOURNAL_MAGIC	0x4f544a31		/* "OTJ1" */
+#define JOURNAL_ROTATE	(16 * 1024 * 1024)
+#define JOURNAL_CKPT	10			/* seconds between syncs of the store */
+#define JOURNAL_WINDOW	4096			/* entries applied out of order */
+#define JOURNAL_MAXLEN	(64 * 1024 * 1024)	/* sanity limit on replay */
+
+struct jhdr {
+	uint32_t magic;
+	uint32_t crc;			/* CRC-32 of topic and payload */
+	uint64_t seq;
+	uint32_t flags;			/* JF_ */
+	uint32_t topiclen;
+	uint32_t len;			/* of payload */
+	uint32_t pad;
+};
+
+struct ckpt {
+	uint64_t durable;
+	uint64_t applied;
+	char boot[40];			/* boot_id when `applied' was written */
+};
+
+static int fd = -1, ckfd = -1;
+static off_t size;
+static uint64_t lastseq;		/* last appended */
+static uint64_t synced;			/* journal durable up to */
+static uint64_t applied;		/* applied up to, without gaps */
+static uint64_t durable;		/* applied and synced up to */
+static time_t ckpt_time;		/* of the last durable checkpoint */
+static unsigned char done[JOURNAL_WINDOW / 8];	/* applied beyond `applied' */
+static int syncing;
+static unsigned long ncommits;
+static pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jcond = PTHREAD_COND_INITIALIZER;
+
+#define BIT(seq)	(done[((seq) % JOURNAL_WINDOW) / 8])
+#define MASK(seq)	(1 << ((seq) % 8))
+
+static void ckpt_write(void)
+{
+	if (pwrite(ckfd, &applied, sizeof(applied), offsetof(struct ckpt, applied)) != sizeof(applied)) {
+		olog(LOG_ERR, "Cannot write journal checkpoint: %s", strerror(errno));
+	}
+}
+
+/*
+ * The system's boot_id, which changes with each boot; empty if it can't
+ * be had, in which case `applied' is never believed.
+ */
+
+static void bootid(char *buf, size_t len)
+{
+	memset(buf, 0, len);
+#ifdef __linux__
+	{
+		FILE *fp;
+
+		if ((fp = fopen("/proc/sys/kernel/random/boot_id", "r")) != NULL) {
+			if (fgets(buf, len, fp) == NULL)
+				*buf = 0;
+			fclose(fp);
+		}
+	}
+#endif
+}
+
+/*
+ * Get what the entries up to `seq' wrote onto disk, then record that
+ * in the checkpoint.
+ */
+
+static void ckpt_sync(uint64_t seq)
+{
+#ifdef __linux__
+	syncfs(fd);
+#else
+	sync();
+#endif
+	if (pwrite(ckfd, &seq, sizeof(seq), offsetof(struct ckpt, durable)) != sizeof(seq) ||
+		fdatasync(ckfd) == -1) {
+		olog(LOG_ERR, "Cannot write journal checkpoint: %s", strerror(errno));
+		return;
+	}
+	durable = seq;
+	ckpt_time = time(0);
+}
+
+/*
+ * Called with everything in the log applied: make that durable, then
+ * start the log afresh.
+ */
+
+static void rotate(void)
+{
+	ckpt_sync(applied);
+	if (durable != applied)
+		return;
+	if (ftruncate(fd, 0) == -1) {
+		olog(LOG_ERR, "Cannot truncate journal: %s", strerror(errno));
+		return;
+	}
+	fdatasync(fd);
+	size = 0;
+}
+
+int journal_open(void)
+{
+	char path[BUFSIZ], boot[sizeof(((struct ckpt *)0)->boot)];
+	mode_t mode = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP;
+	struct ckpt ck;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "%s/journal", STORAGEDIR);
+	if (mkpath(path) < 0) {
+		olog(LOG_ERR, "Cannot create %s: %s", path, strerror(errno));
+		return (-1);
+	}
+
+	snprintf(path, sizeof(path), "%s/journal/ingest.log", STORAGEDIR);
+	if ((fd = open(path, O_RDWR|O_CREAT|O_APPEND, mode)) == -1) {
+		olog(LOG_ERR, "Cannot open %s: %s", path, strerror(errno));
+		return (-1);
+	}
+
+	snprintf(path, sizeof(path), "%s/journal/ingest.ckpt", STORAGEDIR);
+	if ((ckfd = open(path, O_RDWR|O_CREAT, mode)) == -1) {
+		olog(LOG_ERR, "Cannot open %s: %s", path, strerror(errno));
+		close(fd);
+		fd = -1;
+		return (-1);
+	}
+	if ((n = pread(ckfd, &ck, sizeof(ck), 0)) == sizeof(ck)) {
+		durable = applied = ck.durable;
+		bootid(boot, sizeof(boot));
+		if (*boot && memcmp(boot, ck.boot, sizeof(boot)) == 0 && ck.applied > durable)
+			applied = ck.applied;
+	} else if (n == sizeof(uint64_t)) {
+		durable = applied = ck.durable;		/* older single number */
+	} else {
+		durable = applied = 0;
+	}
+
+	memset(&ck, 0, sizeof(ck));
+	ck.durable = durable;
+	ck.applied = applied;
+	bootid(ck.boot, sizeof(ck.boot));
+	if (pwrite(ckfd, &ck, sizeof(ck), 0) != sizeof(ck)) {
+		olog(LOG_ERR, "Cannot write journal checkpoint: %s", strerror(errno));
+	}
+	ckpt_time = time(0);
+
+	size = lseek(fd, 0, SEEK_END);
+	lastseq = synced = applied;
+	memset(done, 0, sizeof(done));
+	return (0);
+}
+
+static int readn(int fd, void *buf, size_t len)
+{
+	char *bp = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, bp, len)) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return (-1);
+		}
+		bp += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Hand each entry which hasn't been applied to `fn', in order. `applied'
+ * is advanced before an entry is handed over, so one which brings the
+ * recorder down isn't replayed again on the next start. A torn or
+ * damaged tail (e.g. from a crash during an append) ends the replay and
+ * is cut off. What the entries wrote is made durable at the next
+ * checkpoint. Returns the number of entries replayed.
+ */
+
+long journal_replay(journal_replay_fn fn, void *arg)
+{
+	struct jhdr h;
+	char *body;
+	off_t off = 0;
+	uint64_t prev = 0;
+	long n = 0;
+
+	if (fd == -1)
+		return (0);
+
+	lseek(fd, 0, SEEK_SET);
+	while (readn(fd, &h, sizeof(h)) == 0) {
+		if (h.magic != JOURNAL_MAGIC || h.topiclen == 0 ||
+			h.topiclen > JOURNAL_MAXLEN || h.len > JOURNAL_MAXLEN ||
+			(prev && h.seq != prev + 1))
+			break;
+
+		if ((body = malloc(h.topiclen + h.len + 2)) == NULL)
+			break;
+		if (readn(fd, body, h.topiclen + h.len) == -1 ||
+			crc32_update(0, body, h.topiclen + h.len) != h.crc) {
+			free(body);
+			break;
+		}
+		memmove(body + h.topiclen + 1, body + h.topiclen, h.len);
+		body[h.topiclen] = 0;
+		body[h.topiclen + 1 + h.len] = 0;
+
+		if (h.seq > applied) {
+			applied = h.seq;
+			ckpt_write();
+			fn(arg, body, body + h.topiclen + 1, h.len, h.flags);
+			n++;
+		}
+		free(body);
+
+		prev = h.seq;
+		off += sizeof(h) + h.topiclen + h.len;
+	}
+
+	if (off < size) {
+		olog(LOG_ERR, "Journal: discarding %lld bytes of incomplete or damaged entries",
+			(long long)(size - off));
+		if (ftruncate(fd, off) == -1) {
+			olog(LOG_ERR, "Cannot truncate journal: %s", strerror(errno));
+		}
+	}
+
+	if (prev > applied)
+		applied = prev;
+	lastseq = synced = applied;
+	ckpt_write();
+	size = off;
+
+	return (n);
+}
+
+/*
+ * Append a publish and return its sequence number, or 0 if it couldn't
+ * be written; it isn't durable until journal_commit() for it returns.
+ */
+
+uint64_t journal_append(const char *topic, const char *payload, size_t len, int flags)
+{
+	struct jhdr h;
+	struct iovec iov[3];
+	size_t total;
+	uint64_t seq = 0;
+
+	if (fd == -1)
+		return (0);
+
+	memset(&h, 0, sizeof(h));
+	h.magic		= JOURNAL_MAGIC;
+	h.flags		= flags;
+	h.topiclen	= strlen(topic);
+	h.len		= len;
+	h.crc		= crc32_update(crc32_update(0, topic, h.topiclen), payload, len);
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len	= sizeof(h);
+	iov[1].iov_base = (void *)topic;
+	iov[1].iov_len	= h.topiclen;
+	iov[2].iov_base = (void *)payload;
+	iov[2].iov_len	= len;
+	total = sizeof(h) + h.topiclen + len;
+
+	pthread_mutex_lock(&jlock);
+	h.seq = lastseq + 1;
+	if (writev(fd, iov, 3) != (ssize_t)total) {
+		olog(LOG_ERR, "Cannot append to journal: %s", strerror(errno));
+		if (ftruncate(fd, size) == -1) {
+			olog(LOG_ERR, "Cannot truncate journal: %s", strerror(errno));
+		}
+	} else {
+		size += total;
+		seq = ++lastseq;
+	}
+	pthread_mutex_unlock(&jlock);
+	return (seq);
+}
+
+/*
+ * Make the journal durable up to `seq'. Whoever gets here first syncs
+ * everything appended so far; callers arriving meanwhile wait for that
+ * and only sync again if their entry came later (group commit).
+ */
+
+int journal_commit(uint64_t seq)
+{
+	uint64_t target;
+	int rc = 0;
+
+	pthread_mutex_lock(&jlock);
+	while (synced < seq) {
+		if (syncing) {
+			pthread_cond_wait(&jcond, &jlock);
+			continue;
+		}
+		syncing = TRUE;
+		target = lastseq;
+		pthread_mutex_unlock(&jlock);
+
+		rc = fdatasync(fd);
+
+		pthread_mutex_lock(&jlock);
+		syncing = FALSE;
+		pthread_cond_broadcast(&jcond);
+		if (rc == -1) {
+			olog(LOG_ERR, "Cannot sync journal: %s", strerror(errno));
+			break;
+		}
+		synced = target;
+		ncommits++;
+	}
+	pthread_mutex_unlock(&jlock);
+	return (rc);
+}
+
+/*
+ * Entry `seq' has been handled. Entries may complete out of order
+ * (HTTP workers); the checkpoint only moves over a contiguous run.
+ */
+
+void journal_applied(uint64_t seq)
+{
+	pthread_mutex_lock(&jlock);
+	if (seq > applied) {
+		if (seq - applied > JOURNAL_WINDOW) {
+			olog(LOG_ERR, "Journal: entries %llu to %llu never applied",
+				(unsigned long long)applied + 1,
+				(unsigned long long)(seq - JOURNAL_WINDOW));
+			while (seq - applied > JOURNAL_WINDOW) {
+				BIT(applied + 1) &= ~MASK(applied + 1);
+				applied++;
+			}
+		}
+		BIT(seq) |= MASK(seq);
+		while (BIT(applied + 1) & MASK(applied + 1)) {
+			BIT(applied + 1) &= ~MASK(applied + 1);
+			applied++;
+		}
+		ckpt_write();
+	}
+	pthread_mutex_unlock(&jlock);
+}
+
+/*
+ * Entries up to here have been applied.
+ */
+
+uint64_t journal_handled(void)
+{
+	uint64_t seq;
+
+	pthread_mutex_lock(&jlock);
+	seq = applied;
+	pthread_mutex_unlock(&jlock);
+	return (seq);
+}
+
+/*
+ * Entries up to `seq' have been applied and nothing they did is held in
+ * memory any longer. Every JOURNAL_CKPT seconds, make that durable; if
+ * that covers the whole log and it's grown large, empty it as well.
+ */
+
+void journal_checkpoint(uint64_t seq)
+{
+	if (fd == -1 || seq <= durable || time(0) - ckpt_time < JOURNAL_CKPT)
+		return;
+
+	pthread_mutex_lock(&jlock);
+	if (seq == applied && applied == lastseq && size >= JOURNAL_ROTATE) {
+		rotate();
+		pthread_mutex_unlock(&jlock);
+		return;
+	}
+	pthread_mutex_unlock(&jlock);
+
+	ckpt_sync(seq);
+}
+
+unsigned long journal_commits(void)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&jlock);
+	n = ncommits;
+	pthread_mutex_unlock(&jlock);
+	return (n);
+}
+
+void journal_close(void)
+{
+	if (fd == -1)
+		return;
+
+	pthread_mutex_lock(&jlock);
+	if (applied == lastseq && size > 0)
+		rotate();
+	else if (applied > durable)
+		ckpt_sync(applied);
+	close(ckfd);
+	close(fd);
+	fd = ckfd = -1;
+	pthread_mutex_unlock(&jlock);
+}
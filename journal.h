@@ -0,0 +1,31 @@
+#ifndef _JOURNAL_H_INCLUDED_
+# define _JOURNAL_H_INCLUDED_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Append-only journal of incoming publishes (STORAGEDIR/journal). A
+ * publish is appended and made durable before it is handled, and its
+ * sequence number is marked applied once it has been; a group of
+ * publishes shares one fdatasync(). The store is synced at periodic
+ * checkpoints. On startup, publishes which were journaled but never
+ * applied, or whose effects may not have reached the disk, are replayed.
+ */
+
+#define JF_RETAIN	0x01		/* publish was retained */
+#define JF_HTTP		0x02		/* publish arrived in HTTP mode */
+
+typedef void (*journal_replay_fn)(void *arg, char *topic, char *payload, size_t len, int flags);
+
+int journal_open(void);
+long journal_replay(journal_replay_fn fn, void *arg);
+uint64_t journal_append(const char *topic, const char *payload, size_t len, int flags);
+int journal_commit(uint64_t seq);
+void journal_applied(uint64_t seq);
+uint64_t journal_handled(void);
+void journal_checkpoint(uint64_t seq);
+unsigned long journal_commits(void);
+void journal_close(void);
+
+#endif
@@ -51,8 +51,12 @@ typedef struct
 	char *cur;
 	char *end;
 	char *start;
+	void (*drain)(const char *s, size_t len, void *param);
+	void *param;
 } SB;
 
+#define SB_DRAIN	(16 * 1024)
+
 static void sb_init(SB *sb)
 {
 	sb->start = (char*) malloc(17);
@@ -60,6 +64,16 @@ static void sb_init(SB *sb)
 		out_of_memory();
 	sb->cur = sb->start;
 	sb->end = sb->start + 16;
+	sb->drain = NULL;
+}
+
+/* Hand a stream's buffer to its drain function once it's big enough. */
+static void sb_drain(SB *sb)
+{
+	if (sb->drain != NULL && sb->cur - sb->start >= SB_DRAIN) {
+		sb->drain(sb->start, sb->cur - sb->start, sb->param);
+		sb->cur = sb->start;
+	}
 }
 
 /* sb and need may be evaluated multiple times. */
@@ -404,6 +418,28 @@ char *json_stringify(const JsonNode *node, const char *space)
 	return sb_finish(&sb);
 }
 
+/*
+ * As json_stringify(), but the text is handed to `func' a piece at a
+ * time (between array elements) as it is produced instead of being
+ * returned in full.
+ */
+void json_stringify_to(const JsonNode *node, const char *space, void (*func)(const char *s, size_t len, void *param), void *param)
+{
+	SB sb;
+	sb_init(&sb);
+	sb.drain = func;
+	sb.param = param;
+	
+	if (space != NULL)
+		emit_value_indented(&sb, node, space, 0);
+	else
+		emit_value(&sb, node);
+	
+	if (sb.cur > sb.start)
+		func(sb.start, sb.cur - sb.start, param);
+	sb_free(&sb);
+}
+
 void json_delete(JsonNode *node)
 {
 	if (node != NULL) {
@@ -1034,6 +1070,7 @@ static void emit_array(SB *out, const JsonNode *array)
 		emit_value(out, element);
 		if (element->next != NULL)
 			sb_putc(out, ',');
+		sb_drain(out);
 	}
 	sb_putc(out, ']');
 }
@@ -1056,6 +1093,7 @@ static void emit_array_indented(SB *out, const JsonNode *array, const char *spac
 		
 		element = element->next;
 		sb_puts(out, element != NULL ? ",\n" : "\n");
+		sb_drain(out);
 	}
 	for (i = 0; i < indent_level; i++)
 		sb_puts(out, space);
@@ -72,6 +72,8 @@ JsonNode   *json_decode         (const char *json);
 char       *json_encode         (const JsonNode *node);
 char       *json_encode_string  (const char *str);
 char       *json_stringify      (const JsonNode *node, const char *space);
+void        json_stringify_to   (const JsonNode *node, const char *space,
+                                 void (*func)(const char *s, size_t len, void *param), void *param);
 void        json_delete         (JsonNode *node);
 
 bool        json_validate       (const char *json);
@@ -0,0 +1,116 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sodium.h>
+#include "udata.h"
+#include "fences.h"
+#include "gcache.h"
+#include "keycache.h"
+
+/*
+ * The table is direct-mapped: a user-device hashes to one slot, and
+ * takes it over from whoever had it. That bounds memory without any
+ * bookkeeping; a collision merely costs a database read.
+ */
+
+struct kslot {
+	char *userdev;			/* NULL if unused */
+	long klen;			/* < 1 if there's no key */
+	time_t fetched;
+	unsigned char key[crypto_secretbox_KEYBYTES];
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct kslot slots[KEYCACHE_SLOTS];
+
+static struct kslot *slot_for(const char *userdev)
+{
+	uint32_t h = 2166136261U;
+	const char *p;
+
+	for (p = userdev; *p; p++) {
+		h ^= (unsigned char)*p;
+		h *= 16777619U;
+	}
+	return (&slots[h % KEYCACHE_SLOTS]);
+}
+
+/*
+ * Copy the key for `userdev' into `key' (zero-padded to `keylen', as
+ * gcache_get() would) and return its length, which is < 1 if there
+ * is none.
+ */
+
+long keycache_get(struct gcache *keydb, const char *userdev, unsigned char *key, size_t keylen, int refresh)
+{
+	struct kslot *s;
+	time_t now = time(NULL);
+	long klen;
+
+	if (keylen > crypto_secretbox_KEYBYTES)
+		keylen = crypto_secretbox_KEYBYTES;
+
+	pthread_mutex_lock(&mutex);
+	s = slot_for(userdev);
+	if (!refresh && s->userdev && strcmp(s->userdev, userdev) == 0 &&
+	    now - s->fetched < KEYCACHE_TTL) {
+		memcpy(key, s->key, keylen);
+		klen = s->klen;
+		pthread_mutex_unlock(&mutex);
+		return (klen);
+	}
+
+	if (s->userdev == NULL || strcmp(s->userdev, userdev) != 0) {
+		free(s->userdev);
+		s->klen = 0;
+		if ((s->userdev = strdup(userdev)) == NULL) {
+			pthread_mutex_unlock(&mutex);
+			memset(key, 0, keylen);
+			return (gcache_get(keydb, (char *)userdev, (char *)key, keylen));
+		}
+	}
+
+	sodium_memzero(s->key, sizeof(s->key));
+	s->klen		= gcache_get(keydb, (char *)userdev, (char *)s->key, sizeof(s->key));
+	s->fetched	= now;
+
+	memcpy(key, s->key, keylen);
+	klen = s->klen;
+	pthread_mutex_unlock(&mutex);
+	return (klen);
+}
+
+void keycache_free(void)
+{
+	int n;
+
+	pthread_mutex_lock(&mutex);
+	for (n = 0; n < KEYCACHE_SLOTS; n++) {
+		free(slots[n].userdev);
+		slots[n].userdev = NULL;
+		sodium_memzero(slots[n].key, sizeof(slots[n].key));
+	}
+	pthread_mutex_unlock(&mutex);
+}
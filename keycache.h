@@ -0,0 +1,22 @@
+#ifndef _KEYCACHE_H_INCLUDED_
+# define _KEYCACHE_H_INCLUDED_
+
+#include <stddef.h>
+
+struct gcache;
+
+/*
+ * Cache of the secret keys in the `keys' database (and of their
+ * absence), so that encrypted payloads don't cost an LMDB transaction
+ * each. Keys are loaded with `ocat --load=keys' from another process,
+ * so entries are re-read after KEYCACHE_TTL seconds; callers pass
+ * `refresh' to re-read one at once, e.g. when decryption fails.
+ */
+
+#define KEYCACHE_SLOTS	4096
+#define KEYCACHE_TTL	60
+
+long keycache_get(struct gcache *keydb, const char *userdev, unsigned char *key, size_t keylen, int refresh);
+void keycache_free(void);
+
+#endif
@@ -0,0 +1,465 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+#include "mcache.h"
+#include "misc.h"
+#include "util.h"
+
+#ifdef __linux__
+
+/*
+ * An entry is added (PENDING) and its directory watched before the
+ * file is read, so a change made meanwhile marks it STALE and it's
+ * dropped instead of being kept. Entries hang off the watch of the
+ * directory whose events affect them; a directory renamed further up
+ * isn't noticed.
+ */
+
+#define MC_BUCKETS	16384
+#define WATCH_BUCKETS	1024
+#define WATCH_POLLMS	500
+#define WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			 IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define ME_PENDING	0	/* being read */
+#define ME_VALID	1
+#define ME_STALE	2	/* changed while being read */
+
+struct mwatch;
+
+struct mentry {
+	struct mentry *next;		/* in its bucket */
+	struct mentry *wnext, *wprev;	/* on its watch */
+	struct mwatch *w;
+	char *path;
+	int state;
+	JsonNode *json;			/* NULL if there's no such file */
+};
+
+struct mwatch {
+	struct mwatch *next;		/* in its bucket */
+	int wd;
+	char *dir;
+	struct mentry *entries;
+};
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static int active = FALSE;
+static struct mentry *buckets[MC_BUCKETS];
+static struct mwatch *wbuckets[WATCH_BUCKETS];
+static int fd = -1, nospc = FALSE;
+static volatile int running = FALSE;
+static pthread_t watcher_tid;
+
+static int copy(JsonNode *obj, JsonNode *node)
+{
+	if (node == NULL)
+		return (FALSE);
+	json_copy_to_object(obj, node, FALSE);
+	return (TRUE);
+}
+
+static unsigned hash(const char *s)
+{
+	unsigned h = 2166136261U;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return (h % MC_BUCKETS);
+}
+
+static struct mentry *entry_find(const char *path)
+{
+	struct mentry *e;
+
+	for (e = buckets[hash(path)]; e != NULL; e = e->next) {
+		if (strcmp(e->path, path) == 0)
+			break;
+	}
+	return (e);
+}
+
+static void entry_unwatch(struct mentry *e)
+{
+	if (e->w == NULL)
+		return;
+	if (e->wprev)
+		e->wprev->wnext = e->wnext;
+	else
+		e->w->entries = e->wnext;
+	if (e->wnext)
+		e->wnext->wprev = e->wprev;
+	e->w = NULL;
+	e->wnext = e->wprev = NULL;
+}
+
+static void entry_drop(struct mentry *e)
+{
+	struct mentry **ep;
+
+	for (ep = &buckets[hash(e->path)]; *ep != NULL; ep = &(*ep)->next) {
+		if (*ep == e) {
+			*ep = e->next;
+			break;
+		}
+	}
+	entry_unwatch(e);
+	if (e->json)
+		json_delete(e->json);
+	free(e->path);
+	free(e);
+}
+
+/* one being read is dropped by its reader */
+static void invalidate(struct mentry *e)
+{
+	if (e->state == ME_VALID)
+		entry_drop(e);
+	else
+		e->state = ME_STALE;
+}
+
+static struct mwatch *watch_find(int wd)
+{
+	struct mwatch *w;
+
+	for (w = wbuckets[wd % WATCH_BUCKETS]; w != NULL; w = w->next) {
+		if (w->wd == wd)
+			break;
+	}
+	return (w);
+}
+
+static void watch_drop(struct mwatch *w)
+{
+	struct mwatch **wp;
+	struct mentry *e;
+
+	while ((e = w->entries) != NULL) {
+		entry_unwatch(e);
+		invalidate(e);
+	}
+	for (wp = &wbuckets[w->wd % WATCH_BUCKETS]; *wp != NULL; wp = &(*wp)->next) {
+		if (*wp == w) {
+			*wp = w->next;
+			break;
+		}
+	}
+	free(w->dir);
+	free(w);
+}
+
+/*
+ * Watch the directory of `path' or, if that doesn't exist, the nearest
+ * one above it (not beyond STORAGEDIR) which does.
+ */
+
+static struct mwatch *watch_for(const char *path)
+{
+	char dir[PATH_MAX], *p;
+	size_t slen = strlen(STORAGEDIR);
+	struct mwatch *w;
+	int wd;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (;;) {
+		if ((p = strrchr(dir, '/')) == NULL || (size_t)(p - dir) < slen)
+			return (NULL);
+		*p = 0;
+
+		if ((wd = inotify_add_watch(fd, dir, WATCH_MASK)) != -1)
+			break;
+		if (errno != ENOENT && errno != ENOTDIR) {
+			if (!nospc) {
+				olog(LOG_ERR, "mcache: cannot watch %s: %m%s; reading files instead", dir,
+					errno == ENOSPC ? " (raise fs.inotify.max_user_watches)" : "");
+				nospc = TRUE;
+			}
+			return (NULL);
+		}
+	}
+
+	if ((w = watch_find(wd)) != NULL)
+		return (w);
+
+	if ((w = calloc(1, sizeof(struct mwatch))) == NULL || (w->dir = strdup(dir)) == NULL) {
+		free(w);
+		inotify_rm_watch(fd, wd);
+		return (NULL);
+	}
+	w->wd = wd;
+	w->next = wbuckets[wd % WATCH_BUCKETS];
+	wbuckets[wd % WATCH_BUCKETS] = w;
+	return (w);
+}
+
+static struct mentry *entry_new(const char *path)
+{
+	struct mentry *e;
+	struct mwatch *w;
+	unsigned h = hash(path);
+
+	if ((w = watch_for(path)) == NULL)
+		return (NULL);
+	if ((e = calloc(1, sizeof(struct mentry))) == NULL)
+		return (NULL);
+	if ((e->path = strdup(path)) == NULL) {
+		free(e);
+		return (NULL);
+	}
+	e->state = ME_PENDING;
+	e->next = buckets[h];
+	buckets[h] = e;
+
+	e->w = w;
+	e->wnext = w->entries;
+	if (w->entries)
+		w->entries->wprev = e;
+	w->entries = e;
+	return (e);
+}
+
+static void flush(void)
+{
+	struct mwatch *w;
+	int i;
+
+	for (i = 0; i < WATCH_BUCKETS; i++) {
+		while ((w = wbuckets[i]) != NULL) {
+			inotify_rm_watch(fd, w->wd);
+			watch_drop(w);
+		}
+	}
+}
+
+static void handle_event(struct inotify_event *ev)
+{
+	char path[PATH_MAX];
+	struct mwatch *w;
+	struct mentry *e, *next;
+	size_t len;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		olog(LOG_NOTICE, "mcache: inotify queue overflowed; emptying");
+		flush();
+		return;
+	}
+
+	if ((w = watch_find(ev->wd)) == NULL)
+		return;
+
+	if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		if (!(ev->mask & IN_IGNORED))
+			inotify_rm_watch(fd, w->wd);
+		watch_drop(w);
+		return;
+	}
+	if (ev->len == 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", w->dir, ev->name);
+	len = strlen(path);
+	for (e = w->entries; e != NULL; e = next) {
+		next = e->wnext;
+		if (strncmp(e->path, path, len) == 0 && (e->path[len] == 0 || e->path[len] == '/'))
+			invalidate(e);
+	}
+}
+
+static void *watcher(void *arg)
+{
+	char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	ssize_t len;
+	char *p;
+
+	while (running) {
+		pfd.fd		= fd;
+		pfd.events	= POLLIN;
+		if (poll(&pfd, 1, WATCH_POLLMS) <= 0)
+			continue;
+		if ((len = read(fd, buf, sizeof(buf))) <= 0)
+			continue;
+
+		pthread_rwlock_wrlock(&lock);
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+			handle_event(ev);
+		}
+		pthread_rwlock_unlock(&lock);
+	}
+	return (NULL);
+}
+
+#endif /* __linux__ */
+
+/*
+ * Start watching. Returns TRUE if files will be served from the cache.
+ */
+
+int mcache_init(void)
+{
+#ifdef __linux__
+	sigset_t all, old;
+
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		olog(LOG_ERR, "mcache: inotify_init: %m");
+		return (FALSE);
+	}
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	running = TRUE;
+	if (pthread_create(&watcher_tid, NULL, watcher, NULL) != 0) {
+		running = FALSE;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		close(fd);
+		fd = -1;
+		olog(LOG_ERR, "mcache: cannot start watcher: %m");
+		return (FALSE);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	pthread_rwlock_wrlock(&lock);
+	active = TRUE;
+	pthread_rwlock_unlock(&lock);
+
+	olog(LOG_INFO, "Caching last positions, cards and extra.json in memory");
+	return (TRUE);
+#else
+	return (FALSE);
+#endif
+}
+
+/*
+ * Like json_copy_from_file(): merge the JSON object in the file at
+ * `path' into `obj' without clobbering what's there. TRUE if there's
+ * such a file and it has JSON in it.
+ */
+
+int mcache_copy(JsonNode *obj, char *path)
+{
+#ifdef __linux__
+	struct mentry *e = NULL;
+	JsonNode *node = NULL;
+	char *js;
+	int on, rc;
+
+	pthread_rwlock_rdlock(&lock);
+	if ((on = active) && (e = entry_find(path)) != NULL && e->state == ME_VALID) {
+		rc = copy(obj, e->json);
+		pthread_rwlock_unlock(&lock);
+		return (rc);
+	}
+	pthread_rwlock_unlock(&lock);
+
+	if (!on)
+		return (json_copy_from_file(obj, path));
+
+	/* not there (or someone else is reading it) */
+	pthread_rwlock_wrlock(&lock);
+	if (active) {
+		if ((e = entry_find(path)) == NULL) {
+			e = entry_new(path);
+		} else if (e->state == ME_VALID) {
+			rc = copy(obj, e->json);
+			pthread_rwlock_unlock(&lock);
+			return (rc);
+		} else {
+			e = NULL;
+		}
+	}
+	pthread_rwlock_unlock(&lock);
+
+	if ((js = slurp_file(path, TRUE)) != NULL) {
+		if ((node = json_decode(js)) == NULL)
+			fprintf(stderr, "mcache_copy can't decode JSON from %s\n", path);
+		free(js);
+	}
+	rc = copy(obj, node);
+
+	if (e != NULL) {
+		pthread_rwlock_wrlock(&lock);
+		if (e->state == ME_PENDING) {
+			e->json = node;
+			e->state = ME_VALID;
+			node = NULL;
+		} else {
+			entry_drop(e);
+		}
+		pthread_rwlock_unlock(&lock);
+	}
+	if (node)
+		json_delete(node);
+
+	return (rc);
+#else
+	return (json_copy_from_file(obj, path));
+#endif
+}
+
+/*
+ * The recorder has just written the file at `path'; don't wait for
+ * inotify to tell.
+ */
+
+void mcache_note(const char *path)
+{
+#ifdef __linux__
+	struct mentry *e;
+
+	pthread_rwlock_wrlock(&lock);
+	if (active && (e = entry_find(path)) != NULL)
+		invalidate(e);
+	pthread_rwlock_unlock(&lock);
+#endif
+}
+
+void mcache_free(void)
+{
+#ifdef __linux__
+	if (running) {
+		running = FALSE;
+		pthread_join(watcher_tid, NULL);
+	}
+	pthread_rwlock_wrlock(&lock);
+	if (active) {
+		flush();
+		close(fd);
+		fd = -1;
+		active = FALSE;
+	}
+	pthread_rwlock_unlock(&lock);
+#endif
+}
@@ -0,0 +1,21 @@
+#ifndef _MCACHE_H_INCLUDED_
+# define _MCACHE_H_INCLUDED_
+
+#include "json.h"
+
+/*
+ * In-memory copy of the small JSON files read for each device when
+ * its last position is listed: last/<user>/<device>/<user>-<device>.json,
+ * extra.json and the cards. Entries are dropped when inotify reports a
+ * change in the file's directory (or, if that doesn't exist yet, in
+ * the nearest one above it which does), and at once for the recorder's
+ * own writes (mcache_note()). Linux only; elsewhere, and until
+ * mcache_init(), files are read each time.
+ */
+
+int mcache_init(void);
+int mcache_copy(JsonNode *obj, char *path);
+void mcache_note(const char *path);
+void mcache_free(void);
+
+#endif
@@ -33,7 +33,7 @@
 
 char *bindump(char *buf, long buflen)
 {
-	static UT_string *out = NULL;
+	static __thread UT_string *out = NULL;
 	int i, ch;
 
 	utstring_renew(out);
@@ -78,7 +78,7 @@ void monitorhook(struct udata *userdata, time_t now, char *topic)
 char *monitor_get()
 {
 	char mpath[BUFSIZ];
-	static char monitorline[BUFSIZ], *ret = NULL;
+	static __thread char monitorline[BUFSIZ], *ret = NULL;
 	FILE *fp;
 
 	snprintf(mpath, sizeof(mpath), "%s/monitor", STORAGEDIR);
@@ -232,6 +232,9 @@ void get_defaults(char *filename, struct udata *ud)
 	ud->viewsdir		= c_str(cf, "OTR_VIEWSDIR", ud->viewsdir);
 
 	ud->http_port		= c_int(cf, "OTR_HTTPPORT", ud->http_port);
+	ud->http_workers	= c_int(cf, "OTR_HTTPWORKERS", ud->http_workers);
+	ud->http_cachesize	= c_int(cf, "OTR_HTTPCACHESIZE", ud->http_cachesize);
+	ud->http_compress	= c_int(cf, "OTR_HTTPCOMPRESS", ud->http_compress);
 
 #ifdef WITH_TOURS
 	ud->http_prefix		= c_str(cf, "OTR_HTTPPREFIX", NULL);
@@ -243,6 +246,10 @@ void get_defaults(char *filename, struct udata *ud)
 #endif
 	ud->label		= c_str(cf, "OTR_SERVERLABEL", ud->label);
 	ud->clean_age		= c_int(cf, "OTR_CLEAN_AGE", ud->clean_age);
+	ud->clean_refresh	= c_int(cf, "OTR_CLEAN_REFRESH", ud->clean_refresh);
+	ud->dircache		= c_int(cf, "OTR_DIRCACHE", ud->dircache);
+	ud->dedup_window	= c_int(cf, "OTR_DEDUPWINDOW", ud->dedup_window);
+	ud->journal		= c_int(cf, "OTR_JOURNAL", ud->journal);
 
 	if (cf) {
 		config_destroy(cf);
@@ -301,6 +308,9 @@ void display_json_variables(struct udata *ud, bool plain)
 #ifdef WITH_HTTP
 	j_str(json, "OTR_HTTPHOST",		ud->http_host);
 	j_int(json, "OTR_HTTPPORT",		ud->http_port);
+	j_int(json, "OTR_HTTPWORKERS",		ud->http_workers);
+	j_int(json, "OTR_HTTPCACHESIZE",	ud->http_cachesize);
+	j_int(json, "OTR_HTTPCOMPRESS",		ud->http_compress);
 	j_str(json, "OTR_HTTPLOGDIR",		ud->http_logdir);
 	j_str(json, "OTR_BROWSERAPIKEY",	ud->browser_apikey);
 	j_str(json, "OTR_VIEWSDIR",		ud->viewsdir);
@@ -313,6 +323,10 @@ void display_json_variables(struct udata *ud, bool plain)
 #endif
 	j_str(json, "OTR_SERVERLABEL",	ud->label);
 	j_int(json, "OTR_CLEAN_AGE",		ud->clean_age);
+	j_int(json, "OTR_CLEAN_REFRESH",	ud->clean_refresh);
+	j_int(json, "OTR_DIRCACHE",		ud->dircache);
+	j_int(json, "OTR_DEDUPWINDOW",		ud->dedup_window);
+	j_int(json, "OTR_JOURNAL",		ud->journal);
 #ifdef WITH_TZ
 	j_str(json, "TZDATADB",		TZDATADB);
 #endif
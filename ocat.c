@@ -34,6 +34,9 @@
 #include "util.h"
 #include "misc.h"
 #include "version.h"
+#ifdef WITH_TZ
+# include "tzgrid.h"
+#endif
 #if WITH_ENCRYPT
 # include <sodium.h>
 #endif
@@ -60,6 +63,7 @@ void usage(char *prog)
 	printf("                               	YYYY-MM-DD\n");
 	printf("                               	YYYY-MM\n");
 	printf("  --limit <number>	-N     	last <number> points\n");
+	printf("  --order asc|desc             	oldest/newest first, merging devices\n");
 	printf("  --format json    	-f     	output format (default: JSON)\n");
 	printf("           csv                 	(overrides $OCAT_FORMAT\n");
 	printf("           geojson		Geo-JSON points\n");
@@ -70,6 +74,12 @@ void usage(char *prog)
 	printf("           raw\n");
 	printf("           payload		Like RAW but JSON payload only\n");
 	printf("  --fields tst,lat,lon,...     	Choose fields for CSV. (dflt: ALL)\n");
+	printf("  --simplify <meters>          	drop points deviating less from track\n");
+	printf("  --maxpoints <number>         	thin out to at most <number> points\n");
+	printf("  --bbox west,south,east,north 	only locations within bounding box\n");
+	printf("  --reindex                    	rebuild spatial index of -u/-d or files\n");
+	printf("  --summary                    	daily summaries for -u/-d between -F/-T\n");
+	printf("  --summary-rebuild            	recompute daily summaries from .rec files\n");
 	printf("  --last		-L     	JSON object with last users\n");
 #if WITH_KILL
 	printf("  --killdata                   	requires -u and -d\n");
@@ -79,6 +89,11 @@ void usage(char *prog)
 	printf("  --precision		        ghash precision (dflt: %d)\n", GHASHPREC);
 	printf("  --version		-v	print version information\n");
 	printf("  --dump / --load [<db>]        dump/load content of db (default ghash)\n");
+	printf("  --binary                      with --dump/--load: binary dump, restored exactly\n");
+#ifdef WITH_TZ
+	printf("  --tzgrid-build [<degrees>]    precompute timezone grid (dflt: %.2f)\n", TZGRID_CELLSIZE);
+	printf("  --tzgrid-bench [<count>]      benchmark timezone lookups (dflt: 100000)\n");
+#endif
 	printf("\n");
 	printf("Options override these environment variables:\n");
 	printf("   $OCAT_USERNAME\n");
@@ -143,9 +158,16 @@ int main(int argc, char **argv)
 {
 	char *progname = *argv, *p;
 	int c;
-	int list = 0, last = 0, limit = 0;
+	int list = 0, last = 0, limit = 0, maxpoints = 0, reverse = -1;
+	double simplify = 0.0;
+	struct bbox bbox, *bb = NULL;
+	int reindex = FALSE, summary = FALSE, summary_rebuild = FALSE;
 	char *lmdbname = NULL;
-	int dumpghash = FALSE, loadghash = FALSE;
+	int dumpghash = FALSE, loadghash = FALSE, binary = FALSE;
+#ifdef WITH_TZ
+	double tzgrid_cellsize = 0.0;
+	long tzgrid_bench = 0L;
+#endif
 #if WITH_KILL
 	int killdata = FALSE;
 #endif
@@ -200,6 +222,18 @@ int main(int argc, char **argv)
 			{ "precision",	required_argument, 0, 	2},
 			{ "dump",	optional_argument, 0, 	3},
 			{ "load",	optional_argument, 0, 	4},
+			{ "simplify",	required_argument, 0, 	7},
+			{ "maxpoints",	required_argument, 0, 	8},
+			{ "bbox",	required_argument, 0, 	9},
+			{ "reindex",	no_argument, 0, 	10},
+			{ "summary",	no_argument, 0, 	11},
+			{ "summary-rebuild", no_argument, 0, 	12},
+			{ "binary",	no_argument, 0, 	13},
+			{ "order",	required_argument, 0, 	14},
+#ifdef WITH_TZ
+			{ "tzgrid-build", optional_argument, 0, 5},
+			{ "tzgrid-bench", optional_argument, 0, 6},
+#endif
 #if WITH_KILL
 			{ "killdata",	no_argument, 0, 	'K'},
 #endif
@@ -230,6 +264,46 @@ int main(int argc, char **argv)
 				if (optarg)
 					lmdbname = strdup(optarg);
 				break;
+			case 7:
+				simplify = atof(optarg);
+				break;
+			case 8:
+				maxpoints = atoi(optarg);
+				break;
+			case 9:
+				if (!bbox_parse(optarg, &bbox)) {
+					fprintf(stderr, "%s: bbox must be west,south,east,north\n", progname);
+					exit(2);
+				}
+				bb = &bbox;
+				break;
+			case 10:
+				reindex = TRUE;
+				break;
+			case 11:
+				summary = TRUE;
+				break;
+			case 12:
+				summary_rebuild = TRUE;
+				break;
+			case 13:
+				binary = TRUE;
+				break;
+			case 14:
+				if (strcmp(optarg, "asc") && strcmp(optarg, "desc")) {
+					fprintf(stderr, "%s: order must be asc or desc\n", progname);
+					exit(2);
+				}
+				reverse = !strcmp(optarg, "desc");
+				break;
+#ifdef WITH_TZ
+			case 5:
+				tzgrid_cellsize = (optarg) ? atof(optarg) : TZGRID_CELLSIZE;
+				break;
+			case 6:
+				tzgrid_bench = (optarg) ? atol(optarg) : 100000L;
+				break;
+#endif
 			case 'v':
 				print_versioninfo();
 				break;
@@ -306,17 +380,24 @@ int main(int argc, char **argv)
 	// printf("lmdbname = %s\n", (lmdbname) ? lmdbname : "NULL");
 
 	if (loadghash) {
-		storage_gcache_load(lmdbname);
-		exit(0);
+		exit(storage_gcache_load(lmdbname, binary) == 0 ? 0 : 1);
 	}
 
 	if (dumpghash) {
-		storage_gcache_dump(lmdbname);
-		exit(0);
+		exit(storage_gcache_dump(lmdbname, binary) == 0 ? 0 : 1);
 	}
 
 	storage_init(revgeo);
 
+#ifdef WITH_TZ
+	if (tzgrid_cellsize > 0.0 || tzgrid_bench > 0) {
+		if (tzgrid_cellsize > 0.0 && !storage_tzgrid_build(tzgrid_cellsize))
+			exit(2);
+		if (tzgrid_bench > 0)
+			storage_tzgrid_bench(tzgrid_bench);
+		exit(0);
+	}
+#endif
 
 #if WITH_KILL
 	if (killdata) {
@@ -376,6 +457,43 @@ int main(int argc, char **argv)
 		return (-2);
 	}
 
+	if (reindex) {
+		JsonNode *arr, *f;
+		int n;
+
+		if (argc) {
+			for (n = 0; n < argc; n++) {
+				if (spidx_rebuild(argv[n]) != 0)
+					fprintf(stderr, "%s: cannot index %s\n", progname, argv[n]);
+			}
+		} else if (username && device) {
+			if ((json = lister(username, device, 0, now, FALSE)) != NULL) {
+				if ((arr = json_find_member(json, "results")) != NULL) {
+					json_foreach(f, arr) {
+						if (spidx_rebuild(f->string_) != 0)
+							fprintf(stderr, "%s: cannot index %s\n", progname, f->string_);
+					}
+				}
+				json_delete(json);
+			}
+		} else {
+			fprintf(stderr, "%s: reindex requires username and device or files\n", progname);
+			return (-2);
+		}
+		return (0);
+	}
+
+	if (summary_rebuild) {
+		long ndays;
+
+		if ((ndays = summaries_rebuild(username, device)) == -1) {
+			fprintf(stderr, "%s: cannot rebuild summaries\n", progname);
+			return (2);
+		}
+		fprintf(stderr, "%s: %ld daily summaries stored\n", progname, ndays);
+		return (0);
+	}
+
 	/* If no from time specified but limit, set from to this month */
 	if (limit) {
 		if (time_from == NULL) {
@@ -388,6 +506,22 @@ int main(int argc, char **argv)
 		return (-2);
 	}
 
+	if (summary) {
+		char *js;
+
+		if (!username || !device) {
+			fprintf(stderr, "%s: summary requires username and device\n", progname);
+			return (-2);
+		}
+		json = summaries(username, device, s_lo, s_hi);
+		if ((js = json_stringify(json, JSON_INDENT)) != NULL) {
+			printf("%s\n", js);
+			free(js);
+		}
+		json_delete(json);
+		return (0);
+	}
+
 	if (list) {
 		char *js;
 
@@ -418,8 +552,8 @@ int main(int argc, char **argv)
 	if (argc == 0 && !username && !device) {
 		fprintf(stderr, "%s: nothing to do. Specify filename or --user and --device\n", progname);
 		return (-1);
-	} else if (argc == 0 && (!username || !device)) {
-		fprintf(stderr, "%s: must specify username and device\n", progname);
+	} else if (argc == 0 && !username) {
+		fprintf(stderr, "%s: must specify username\n", progname);
 		return (-1);
 	} else if ((username || device) && (argc > 0)) {
 		fprintf(stderr, "%s: filename with --user and --device is not supported\n", progname);
@@ -433,6 +567,12 @@ int main(int argc, char **argv)
 	 * "today"
 	 */
 
+	/* simplify follows a single device's track, not a merged stream */
+	if (!argc && simplify > 0.0 && (!device || reverse != -1)) {
+		fprintf(stderr, "%s: --simplify requires --device, and no --order\n", progname);
+		return (-2);
+	}
+
 	obj = json_mkobject();
 	locs = json_mkarray();
 
@@ -441,8 +581,30 @@ int main(int argc, char **argv)
 		int n;
 
 		for (n = 0; n < argc; n++) {
-			locations(argv[n], obj, locs, s_lo, s_hi, otype, 0, fields, NULL, NULL);
+			locations(argv[n], obj, locs, s_lo, s_hi, otype, 0, fields, NULL, NULL, simplify, bb);
 		}
+	} else if (!device || reverse != -1) {
+		JsonNode *udpairs;
+
+		/*
+		 * All of the user's devices, or the one in the order requested:
+		 * merge their .rec files into a single stream ordered by time.
+		 */
+
+		if (device) {
+			char pair[BUFSIZ];
+
+			snprintf(pair, sizeof(pair), "%s/%s", username, device);
+			udpairs = json_mkarray();
+			json_append_element(udpairs, json_mkstring(pair));
+		} else {
+			udpairs = user_devices(username);
+		}
+		if (reverse == -1)
+			reverse = (limit > 0);
+
+		merged_locations(udpairs, obj, locs, s_lo, s_hi, otype, limit, reverse, fields, bb, NULL, NULL);
+		json_delete(udpairs);
 	} else {
 		JsonNode *arr, *f;
 
@@ -457,7 +619,7 @@ int main(int argc, char **argv)
 			if ((arr = json_find_member(json, "results")) != NULL) { // get array
 				json_foreach(f, arr) {
 					// locations(f->string_, obj, locs, s_lo, s_hi, otype, limit, fields, username, device);
-					locations(f->string_, obj, locs, s_lo, s_hi, otype, limit, fields, NULL, NULL);
+					locations(f->string_, obj, locs, s_lo, s_hi, otype, limit, fields, NULL, NULL, simplify, bb);
 					if (limit) {
 						i_have += limit;
 						if (i_have >= limit)
@@ -470,6 +632,7 @@ int main(int argc, char **argv)
 		}
 	}
 
+	locations_decimate(obj, locs, maxpoints);
 	json_append_member(obj, "locations", locs);
 
 
@@ -0,0 +1,154 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "rcache.h"
+
+struct rentry {
+	char *etag;
+	int kind;
+	char *body;
+	size_t len;
+	struct rentry *prev, *next;	/* most recently used first */
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct rentry *head = NULL, *tail = NULL;
+static size_t maxsize = 0, cursize = 0;
+
+static void unlink_entry(struct rentry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void push_front(struct rentry *e)
+{
+	e->prev = NULL;
+	e->next = head;
+	if (head)
+		head->prev = e;
+	head = e;
+	if (tail == NULL)
+		tail = e;
+}
+
+static void drop(struct rentry *e)
+{
+	unlink_entry(e);
+	cursize -= e->len;
+	free(e->etag);
+	free(e->body);
+	free(e);
+}
+
+static struct rentry *find(const char *etag)
+{
+	struct rentry *e;
+
+	for (e = head; e != NULL; e = e->next) {
+		if (strcmp(e->etag, etag) == 0)
+			return (e);
+	}
+	return (NULL);
+}
+
+/*
+ * A size of 0 disables the cache.
+ */
+
+void rcache_init(size_t maxbytes)
+{
+	pthread_mutex_lock(&mutex);
+	maxsize = maxbytes;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Copy the body cached for `etag' into `body' and return TRUE, or
+ * FALSE if there is none.
+ */
+
+int rcache_get(const char *etag, UT_string *body, int *kind)
+{
+	struct rentry *e;
+	int found = 0;
+
+	pthread_mutex_lock(&mutex);
+	if ((e = find(etag)) != NULL) {
+		unlink_entry(e);
+		push_front(e);
+		utstring_bincpy(body, e->body, e->len);
+		*kind = e->kind;
+		found = 1;
+	}
+	pthread_mutex_unlock(&mutex);
+	return (found);
+}
+
+/*
+ * Responses larger than a quarter of the cache aren't kept, so that a
+ * single export can't flush everything else.
+ */
+
+void rcache_put(const char *etag, int kind, const char *body, size_t len)
+{
+	struct rentry *e;
+
+	pthread_mutex_lock(&mutex);
+	if (maxsize == 0 || len > maxsize / 4 || find(etag) != NULL)
+		goto out;
+
+	if ((e = calloc(1, sizeof(struct rentry))) == NULL)
+		goto out;
+	if ((e->etag = strdup(etag)) == NULL || (e->body = malloc(len)) == NULL) {
+		free(e->etag);
+		free(e);
+		goto out;
+	}
+	memcpy(e->body, body, len);
+	e->len	= len;
+	e->kind	= kind;
+
+	while (tail && cursize + len > maxsize)
+		drop(tail);
+	push_front(e);
+	cursize += len;
+
+    out:
+	pthread_mutex_unlock(&mutex);
+}
+
+void rcache_free(void)
+{
+	pthread_mutex_lock(&mutex);
+	while (head)
+		drop(head);
+	pthread_mutex_unlock(&mutex);
+}
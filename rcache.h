@@ -0,0 +1,18 @@
+#ifndef _RCACHE_H_INCLUDED_
+# define _RCACHE_H_INCLUDED_
+
+#include <stddef.h>
+#include "utstring.h"
+
+/*
+ * In-memory cache of rendered API responses, keyed by their ETag and
+ * bounded in total size; least recently used entries are evicted
+ * first. Safe for use by concurrent HTTP workers.
+ */
+
+void rcache_init(size_t maxbytes);
+int rcache_get(const char *etag, UT_string *body, int *kind);
+void rcache_put(const char *etag, int kind, const char *body, size_t len);
+void rcache_free(void);
+
+#endif
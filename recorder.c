@@ -26,6 +26,7 @@
 #include <signal.h>
 #if WITH_MQTT
 # include <mosquitto.h>
+# include <poll.h>
 #endif
 #include <getopt.h>
 #include <time.h>
@@ -44,21 +45,28 @@
 #include "storage.h"
 #include "fences.h"
 #include "gcache.h"
+#include "spidx.h"
+#include "summary.h"
+#include "dircache.h"
+#include "mcache.h"
+#include "dedup.h"
+#include "journal.h"
+#include "sweep.h"
 #ifdef WITH_HTTP
 # include "http.h"
+# include "rcache.h"
+# include "fcache.h"
+# include "vcache.h"
 #endif
 #ifdef WITH_LUA
 # include "hooks.h"
 #endif
 #if WITH_ENCRYPT
 # include <sodium.h>
+# include "keycache.h"
 #endif
 #include "version.h"
 #include <dirent.h>
-#ifdef WITH_TZ
-# include "zonedetect.h"
-extern ZoneDetect *zdb;
-#endif
 
 #define SSL_VERIFY_PEER (1)
 #define SSL_VERIFY_NONE (0)
@@ -85,7 +93,7 @@ int do_info(void *userdata, UT_string *username, UT_string *device, JsonNode *js
 {
 	struct udata *ud = (struct udata *)userdata;
 	JsonNode *j;
-	static UT_string *name = NULL, *face = NULL;
+	static UT_string *name = NULL, *face = NULL, *cardpath = NULL;
 	FILE *fp;
 	char *img;
 	int rc = FALSE;
@@ -103,6 +111,10 @@ int do_info(void *userdata, UT_string *username, UT_string *device, JsonNode *js
 			free(js);
 		}
 		fclose(fp);
+		utstring_renew(cardpath);
+		utstring_printf(cardpath, "%s/cards/%s/%s/%s-%s.json",
+			STORAGEDIR, UB(username), UB(device), UB(username), UB(device));
+		mcache_note(UB(cardpath));
 	}
 	rc = TRUE;
 
@@ -270,23 +282,175 @@ JsonNode *csv_to_json(char *payload)
 
 #define RECFORMAT "%s\t%-18s\t%s\n"
 
+/*
+ * While a batch of publishes is handled (ingest_batch()), the .rec file
+ * being appended to stays open, and its spatial index entries are only
+ * added once the records have been written out. The last/ file and the
+ * day summary are likewise written once per device rather than for
+ * each location. Batches are handled with ud->lock held.
+ */
+
+struct pendidx {
+	time_t tst;
+	long offset, end;
+	double lat, lon;
+};
+
+static struct batch {
+	int active;
+	FILE *recfp;			/* open .rec file ... */
+	char reckey[BUFSIZ];		/* ... of user/device/YYYY-MM */
+	UT_string *user, *device;	/* for the index of recfp */
+	struct pendidx *idx;
+	int nidx, maxidx;
+	int idxlost;			/* an entry couldn't be kept */
+	char lastkey[BUFSIZ];		/* user/device of ... */
+	char *lastpath;			/* ... the last/ file to write ... */
+	char *lastjson;			/* ... with this */
+	double lasttst;
+} batch;
+
+static void batch_recclose(void)
+{
+	int i, ok;
+
+	if (batch.recfp == NULL)
+		return;
+
+	ok = (fclose(batch.recfp) == 0);
+	batch.recfp = NULL;
+	if (!ok && batch.nidx)
+		spidx_drop(batch.user, batch.device, batch.idx[0].tst);
+	for (i = 0; ok && !batch.idxlost && i < batch.nidx; i++) {
+		if (spidx_append(batch.user, batch.device, batch.idx[i].tst, batch.idx[i].offset,
+			batch.idx[i].end, batch.idx[i].lat, batch.idx[i].lon) != 0)
+			break;
+	}
+	batch.nidx = 0;
+	batch.idxlost = FALSE;
+}
+
+static FILE *batch_recfile(UT_string *username, UT_string *device, time_t epoch)
+{
+	char key[BUFSIZ];
+
+	snprintf(key, sizeof(key), "%s/%s/%s", UB(username), UB(device), yyyymm(epoch));
+	if (batch.recfp && strcmp(key, batch.reckey) == 0)
+		return (batch.recfp);
+
+	batch_recclose();
+	if ((batch.recfp = pathn("a", "rec", username, device, "rec", epoch)) == NULL)
+		return (NULL);
+	fseek(batch.recfp, 0, SEEK_END);
+
+	snprintf(batch.reckey, sizeof(batch.reckey), "%s", key);
+	utstring_renew(batch.user);
+	utstring_printf(batch.user, "%s", UB(username));
+	utstring_renew(batch.device);
+	utstring_printf(batch.device, "%s", UB(device));
+	return (batch.recfp);
+}
+
+static void batch_index(time_t tst, long offset, long end, double lat, double lon)
+{
+	struct pendidx *p;
+
+	if (batch.idxlost)
+		return;
+	if (batch.nidx == batch.maxidx) {
+		int n = batch.maxidx ? batch.maxidx * 2 : 256;
+
+		if ((p = realloc(batch.idx, n * sizeof(struct pendidx))) == NULL) {
+			olog(LOG_ERR, "out of memory for index entries; index will be rebuilt on demand");
+			spidx_drop(batch.user, batch.device, tst);
+			batch.idxlost = TRUE;
+			return;
+		}
+		batch.idx = p;
+		batch.maxidx = n;
+	}
+
+	p = &batch.idx[batch.nidx++];
+	p->tst		= tst;
+	p->offset	= offset;
+	p->end		= end;
+	p->lat		= lat;
+	p->lon		= lon;
+}
+
+static void batch_lastflush(void)
+{
+	if (batch.lastjson) {
+		safewrite(batch.lastpath, batch.lastjson);
+		free(batch.lastpath);
+		free(batch.lastjson);
+		batch.lastpath = batch.lastjson = NULL;
+	}
+}
+
+/*
+ * Keep `jsonstring' (which we take over) to be written to the last/
+ * file at `path' when the batch ends.
+ */
+
+static void batch_last(UT_string *username, UT_string *device, char *path, char *jsonstring, double tst)
+{
+	char key[BUFSIZ];
+
+	snprintf(key, sizeof(key), "%s/%s", UB(username), UB(device));
+	if (batch.lastjson && strcmp(key, batch.lastkey) != 0)
+		batch_lastflush();
+
+	free(batch.lastpath);
+	free(batch.lastjson);
+	if ((batch.lastpath = strdup(path)) == NULL) {
+		safewrite(path, jsonstring);
+		free(jsonstring);
+		batch.lastjson = NULL;
+		return;
+	}
+	batch.lastjson = jsonstring;
+	batch.lasttst = tst;
+	snprintf(batch.lastkey, sizeof(batch.lastkey), "%s", key);
+}
+
+static void batch_begin(void)
+{
+	batch.active = TRUE;
+}
+
+static void batch_end(void)
+{
+	batch_recclose();
+	batch_lastflush();
+	summary_flush();
+	batch.active = FALSE;
+}
+
 /*
  * Store payload in REC file. Use the epoch
  * time to construct path name and "key"
  */
 
-static void putrec(struct udata *ud, time_t epoch, UT_string *reltopic, UT_string *username, UT_string *device, char *string)
+static void putrec(struct udata *ud, time_t epoch, UT_string *reltopic, UT_string *username, UT_string *device, char *string, double lat, double lon)
 {
 	FILE *fp;
+	long offset, end;
 
 	if (ud->norec)
 		return;
 
-	if ((fp = pathn("a", "rec", username, device, "rec", epoch)) == NULL) {
+	if (batch.active) {
+		fp = batch_recfile(username, device, epoch);
+	} else if ((fp = pathn("a", "rec", username, device, "rec", epoch)) != NULL) {
+		fseek(fp, 0, SEEK_END);
+	}
+	if (fp == NULL) {
 		olog(LOG_ERR, "Cannot write REC for %s/%s: %m",
 			UB(username), UB(device));
 		return;
 	}
+	offset = ftell(fp);
 
 	/*
 	 * `string' might contain JSON, and it might be such that is
@@ -309,8 +473,18 @@ static void putrec(struct udata *ud, time_t epoch, UT_string *reltopic, UT_strin
 		fprintf(fp, RECFORMAT, isotime(epoch),
 		UB(reltopic), string);
 	}
-	fclose(fp);
 
+	/* Locations are added to the spatial index (see spidx.c) */
+	end = ftell(fp);
+	if (batch.active) {
+		if (!isnan(lat) && !isnan(lon))
+			batch_index(epoch, offset, end, lat, lon);
+	} else if (fclose(fp) != 0) {
+		if (!isnan(lat) && !isnan(lon))
+			spidx_drop(username, device, epoch);
+	} else if (!isnan(lat) && !isnan(lon)) {
+		spidx_append(username, device, epoch, offset, end, lat, lon);
+	}
 }
 
 /*
@@ -641,66 +815,85 @@ void do_request(struct udata *ud, UT_string *username, UT_string *device, char *
 
 #if WITH_ENCRYPT
 /*
- * Decrypt the payload and return a pointer to allocated space containing
- * the clear text.
+ * Decrypt the payload and return a pointer to the clear text, which
+ * is in a per-thread buffer that's reused by the next call.
  * p64 contains the base64-encoded, encrypted payload from the device. `username'
  * and `device' are needed to obtain the decryption key for this object.
  */
 
-unsigned char *decrypt(struct udata *ud, char *topic, char *p64, char *username, char *device)
+static int open_box(unsigned char *cleartext, unsigned char *ciphertext, size_t ciphertext_len, unsigned char *key)
 {
-	unsigned char key[crypto_secretbox_KEYBYTES];
-	unsigned char *ciphertext, *cleartext;
-	size_t ciphertext_len;
-	int n, klen;
-	static UT_string *userdev = NULL;
-
-	utstring_renew(userdev);
-	utstring_printf(userdev, "%s-%s", username, device);
+	return (crypto_secretbox_open_easy(cleartext,			// message
+			ciphertext + crypto_secretbox_NONCEBYTES,	// skip over nonce
+			ciphertext_len - crypto_secretbox_NONCEBYTES,	// len (- nonce)
+			ciphertext,					// nonce
+			key));
+}
 
-	lowercase(UB(userdev));
-	for (n = 0; n < strlen(UB(userdev)); n++) {
-		if (UB(userdev)[n] == ' ')
-			UB(userdev)[n] = '-';
+unsigned char *decrypt(struct udata *ud, char *topic, char *p64, char *username, char *device)
+{
+	static __thread unsigned char *buf = NULL;
+	static __thread size_t buflen = 0;
+	unsigned char key[crypto_secretbox_KEYBYTES], newkey[crypto_secretbox_KEYBYTES];
+	unsigned char *ciphertext, *cleartext, *nb;
+	size_t ciphertext_len, half;
+	char userdev[BUFSIZ], *bp;
+	long klen;
+
+	snprintf(userdev, sizeof(userdev), "%s-%s", username, device);
+	lowercase(userdev);
+	for (bp = userdev; *bp; bp++) {
+		if (*bp == ' ')
+			*bp = '-';
+	}
+
+	klen = keycache_get(ud->keydb, userdev, key, sizeof(key), FALSE);
+	if (klen < 1) {
+		/* perhaps it's been added since we last looked */
+		klen = keycache_get(ud->keydb, userdev, key, sizeof(key), TRUE);
 	}
-
-	memset(key, 0, sizeof(key));
-	klen = gcache_get(ud->keydb, (char *)UB(userdev), (char *)key, sizeof(key));
 	if (klen < 1) {
-		olog(LOG_ERR, "no decryption key for %s in %s", UB(userdev), topic);
+		olog(LOG_ERR, "no decryption key for %s in %s", userdev, topic);
 		return (NULL);
 	}
 
-	debug(ud, "Key for %s is [%s]", UB(userdev), key);
+	debug(ud, "Key for %s is [%s]", userdev, key);
 
-	n = strlen(p64);		/* This is more than enough */
+	/* ciphertext in the first half of buf, cleartext in the second */
+	half = BASE64_DECODED_MAX(strlen(p64)) + 1;
+	if (2 * half > buflen) {
+		if ((nb = realloc(buf, 2 * half)) == NULL)
+			return (NULL);
+		buf = nb;
+		buflen = 2 * half;
+	}
+	ciphertext = buf;
+	cleartext = buf + half;
 
-	if ((ciphertext = base64_decode(p64, &ciphertext_len)) == NULL) {
+	if (base64_decode_buf(p64, ciphertext, &ciphertext_len) != 0) {
 		olog(LOG_ERR, "payload of %s cannot be base64-decoded", topic);
 		return (NULL);
 	}
 
 	debug(ud, "START DECRYPT. clen==%lu", ciphertext_len);
 
-	if ((cleartext = calloc(n, sizeof(unsigned char))) == NULL) {
-		free(ciphertext);
+	if (ciphertext_len < crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES) {
+		olog(LOG_ERR, "payload of %s is too short to be decrypted", topic);
 		return (NULL);
 	}
 
-	if (crypto_secretbox_open_easy(cleartext,			// message
-			ciphertext + crypto_secretbox_NONCEBYTES,	// skip over nonce
-			ciphertext_len - crypto_secretbox_NONCEBYTES,	// len (- nonce)
-			ciphertext,					// nonce
-			key) != 0)
-	{
-		olog(LOG_ERR, "payload of %s cannot be decrypted; forged?", topic);
-		free(ciphertext);
-		free(cleartext);
-		return (NULL);
+	if (open_box(cleartext, ciphertext, ciphertext_len, key) != 0) {
+		/* the cached key may since have been replaced */
+		if (keycache_get(ud->keydb, userdev, newkey, sizeof(newkey), TRUE) < 1 ||
+		    memcmp(key, newkey, sizeof(key)) == 0 ||
+		    open_box(cleartext, ciphertext, ciphertext_len, newkey) != 0) {
+			olog(LOG_ERR, "payload of %s cannot be decrypted; forged?", topic);
+			return (NULL);
+		}
 	}
+	cleartext[ciphertext_len - crypto_secretbox_NONCEBYTES - crypto_secretbox_MACBYTES] = 0;
 
 	debug(ud, "DECRYPTED: %s", (char *)cleartext);
-	free(ciphertext);
 
 	return (cleartext);
 }
@@ -732,6 +925,21 @@ static bool is_newer_than_last(JsonNode *json)
 	return is_newer;
 }
 
+/*
+ * Within a batch, the device's last/ file may not have been written
+ * yet; compare with what will be.
+ */
+
+static bool batch_newer(JsonNode *json, UT_string *username, UT_string *device)
+{
+	char key[BUFSIZ];
+
+	snprintf(key, sizeof(key), "%s/%s", UB(username), UB(device));
+	if (batch.lastjson && strcmp(key, batch.lastkey) == 0)
+		return (batch.lasttst < number(json, "tst"));
+	return (is_newer_than_last(json));
+}
+
 /*
  * if `jnode' will be set to a JsonNode object with results added to the
  * outgoing HTTP payload; the caller (in http.c) will delete the object
@@ -865,7 +1073,7 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 			r_ok = hooks_norec(ud, UB(username), UB(device), dumpedpayload) == 0;
 #endif
 			if (r_ok) {
-				putrec(ud, now, reltopic, username, device, dumpedpayload);
+				putrec(ud, now, reltopic, username, device, dumpedpayload, NAN, NAN);
 			}
 			return;
 		}
@@ -900,6 +1108,17 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 		}
 	}
 
+	/*
+	 * Drop exact repeats of one of the device's recent publishes, e.g.
+	 * QoS redeliveries or a queue resent after a reconnect, before
+	 * anything is stored or triggered.
+	 */
+
+	if (!pingping && dedup_check(UB(username), UB(device), UB(reltopic), json, payload)) {
+		debug(ud, "Suppressing duplicate %s on %s", _typestr ? _typestr : "publish", topic);
+		goto cleanup;
+	}
+
 	switch (_type) {
 		case T_CARD:
 			do_info(ud, username, device, json);
@@ -917,11 +1136,11 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 				json_append_member(json, "topic", json_mkstring(topic));
 				json_append_member(json, "username", json_mkstring(UB(username)));
 				json_append_member(json, "device", json_mkstring(UB(device)));
-				http_ws_push_json(ud->mgserver, json);
+				http_ws_publish(json);
 			}
 #endif
 
-			putrec(ud, now, reltopic, username, device, dumpedpayload);
+			putrec(ud, now, reltopic, username, device, dumpedpayload, NAN, NAN);
 			goto cleanup;
 		case T_LWT:
 			/*
@@ -943,7 +1162,7 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 			r_ok = hooks_norec(ud, UB(username), UB(device), payload) == 0;
 #endif
 			if (r_ok) {
-				putrec(ud, now, reltopic, username, device, payload);
+				putrec(ud, now, reltopic, username, device, payload, NAN, NAN);
 			}
 			goto cleanup;
 		case T_WAYPOINTS:
@@ -965,6 +1184,13 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 			 * heavy lifting.
 			 */
 
+			if (was_encrypted) {
+				/* decrypt()'s buffer holds the payload */
+				olog(LOG_ERR, "encrypted payload in encrypted payload of %s", topic);
+				if (_typestr) free(_typestr);
+				json_delete(json);
+				return;
+			}
 			if ((j = json_find_member(json, "data")) != NULL) {
 				if (j->tag == JSON_STRING) {
 					char *cleartext;
@@ -972,7 +1198,6 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 					cleartext = (char *)decrypt(ud, topic, j->string_, UB(username), UB(device));
 					if (cleartext != NULL) {
 						handle_message(ud, topic, cleartext, strlen(cleartext), retain, httpmode, TRUE, NULL);
-						free(cleartext);
 					}
 					if (_typestr) free(_typestr);
 					json_delete(json);
@@ -997,7 +1222,7 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 			r_ok = hooks_norec(ud, UB(username), UB(device), dumpedpayload) == 0;
 #endif
 			if (r_ok) {
-				putrec(ud, now, reltopic, username, device, dumpedpayload);
+				putrec(ud, now, reltopic, username, device, dumpedpayload, NAN, NAN);
 			}
 			goto cleanup;
 	}
@@ -1061,10 +1286,10 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 
 #ifdef WITH_TZ
 	if ((j = json_find_member(json, "tzname")) == NULL) {
-		char* tz_str = ZDHelperSimpleLookupString(zdb, lat, lon);
+		char* tz_str = tz_lookup(lat, lon);
 		if (tz_str) {
 			json_append_member(json, "tzname", json_mkstring(tz_str));
-			ZDHelperSimpleLookupStringFree(tz_str);
+			free(tz_str);
 		}
 	}
 #endif
@@ -1234,7 +1459,13 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 			r_ok = hooks_norec(ud, UB(username), UB(device), jsonstring) == 0;
 #endif
 			if (r_ok) {
-				putrec(ud, epoch, reltopic, username, device, jsonstring);
+				putrec(ud, epoch, reltopic, username, device, jsonstring,
+					(_type == T_LOCATION) ? lat : NAN,
+					(_type == T_LOCATION) ? lon : NAN);
+				if (_type == T_LOCATION && !ud->norec) {
+					summary_update(ud->sumdb, UB(username), UB(device), epoch,
+						lat, lon, number(json, "vel"));
+				}
 			}
 			free(jsonstring);
 		}
@@ -1272,7 +1503,7 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 		utstring_renew(filename);
 
 		if (_type == T_LOCATION) {
-			if (is_newer_than_last(json)) {
+			if (batch.active ? batch_newer(json, username, device) : is_newer_than_last(json)) {
 				component = "last";
 				utstring_printf(filename, "%s-%s.json",
 					UB(username), UB(device));
@@ -1293,11 +1524,17 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 					UB(device));
 				if (mkpath(UB(ts)) < 0) {
 					olog(LOG_ERR, "Cannot mkdir %s: %m", UB(ts));
+				} else {
+					dircache_note(UB(ts));
 				}
 
 				utstring_printf(ts, "/%s", UB(filename));
-				safewrite(UB(ts), jsonstring);
-				free(jsonstring);
+				if (batch.active && _type == T_LOCATION) {
+					batch_last(username, device, UB(ts), jsonstring, number(json, "tst"));
+				} else {
+					safewrite(UB(ts), jsonstring);
+					free(jsonstring);
+				}
 			}
 
 			append_card_to_object(json, UB(username), UB(device));
@@ -1315,7 +1552,7 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 
 #ifdef WITH_HTTP
 	if (ud->mgserver && !pingping) {
-		http_ws_push_json(ud->mgserver, json);
+		http_ws_publish(json);
 	}
 #endif
 
@@ -1377,13 +1614,198 @@ void handle_message(void *userdata, char *topic, char *payload, size_t payloadle
 	if (_typestr)	free(_typestr);
 }
 
+/*
+ * Handle a publish; if it's journal entry `seq', mark it applied while
+ * still holding the lock, so that no more than the one publish being
+ * handled can be stored twice if the recorder is killed.
+ */
+
+static void apply(struct udata *ud, char *topic, char *payload, size_t len, int retain, int httpmode, JsonNode **jnode, uint64_t seq)
+{
+#ifdef WITH_HTTP
+	pthread_mutex_lock(&ud->lock);
+#endif
+	handle_message(ud, topic, payload, len, retain, httpmode, FALSE, jnode);
+	if (seq)
+		journal_applied(seq);
+#ifdef WITH_HTTP
+	pthread_mutex_unlock(&ud->lock);
+#endif
+}
+
+/*
+ * Handle a publish which has just arrived. With the journal enabled
+ * it's journaled and synced first (concurrent HTTP publishes share a
+ * sync), and marked applied afterwards.
+ */
+
+void ingest(void *userdata, char *topic, char *payload, size_t len, int retain, int httpmode, JsonNode **jnode)
+{
+	struct udata *ud = (struct udata *)userdata;
+	uint64_t seq = 0;
+
+	if (ud->journal) {
+		seq = journal_append(topic, payload, len,
+			(retain ? JF_RETAIN : 0) | (httpmode ? JF_HTTP : 0));
+		if (seq)
+			journal_commit(seq);
+	}
+
+	apply(ud, topic, payload, len, retain, httpmode, jnode, seq);
+}
+
+/*
+ * Handle `n' publishes to `topic' which arrived in one HTTP request as
+ * a batch: they share one journal sync and one turn of the lock, and
+ * their storage is written as described at struct batch. Objects for
+ * the client (tours) are appended to `responses'. The journal entries
+ * are only marked applied once the whole batch has been written, so a
+ * batch interrupted by a crash is replayed in full.
+ */
+
+void ingest_batch(void *userdata, char *topic, char **payloads, size_t *lens, int n, JsonNode *responses)
+{
+	struct udata *ud = (struct udata *)userdata;
+	uint64_t *seqs = NULL, last = 0;
+	JsonNode *jnode;
+	int i;
+
+	if (ud->journal) {
+		if ((seqs = calloc(n ? n : 1, sizeof(uint64_t))) == NULL) {
+			for (i = 0; i < n; i++) {
+				jnode = NULL;
+				ingest(ud, topic, payloads[i], lens[i], 0, TRUE, &jnode);
+				if (jnode)
+					json_append_element(responses, jnode);
+			}
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			if ((seqs[i] = journal_append(topic, payloads[i], lens[i], JF_HTTP)) > last)
+				last = seqs[i];
+		}
+		if (last)
+			journal_commit(last);
+	}
+
+#ifdef WITH_HTTP
+	pthread_mutex_lock(&ud->lock);
+#endif
+	batch_begin();
+	for (i = 0; i < n; i++) {
+		jnode = NULL;
+		handle_message(ud, topic, payloads[i], lens[i], 0, TRUE, FALSE, &jnode);
+		if (jnode)
+			json_append_element(responses, jnode);
+	}
+	batch_end();
+	for (i = 0; seqs && i < n; i++) {
+		if (seqs[i])
+			journal_applied(seqs[i]);
+	}
+#ifdef WITH_HTTP
+	pthread_mutex_unlock(&ud->lock);
+#endif
+	free(seqs);
+}
+
+/*
+ * Publishes received over MQTT are journaled as they come in but only
+ * handled by ingest_flush(), after everything available has been read,
+ * so that they share one sync.
+ */
+
+static struct deferred {
+	char *topic;
+	char *payload;
+	size_t len;
+	int retain;
+	uint64_t seq;
+} *deferred = NULL;
+static int ndeferred = 0, maxdeferred = 0;
+
+void ingest_defer(void *userdata, char *topic, char *payload, size_t len, int retain)
+{
+	struct deferred *d;
+
+	if (ndeferred == maxdeferred) {
+		int n = maxdeferred ? maxdeferred * 2 : 64;
+
+		if ((d = realloc(deferred, n * sizeof(struct deferred))) == NULL) {
+			ingest(userdata, topic, payload, len, retain, FALSE, NULL);
+			return;
+		}
+		deferred = d;
+		maxdeferred = n;
+	}
+
+	d = &deferred[ndeferred];
+	d->topic	= strdup(topic);
+	d->payload	= malloc(len + 1);
+	if (d->topic == NULL || d->payload == NULL) {
+		free(d->topic);
+		free(d->payload);
+		ingest(userdata, topic, payload, len, retain, FALSE, NULL);
+		return;
+	}
+	memcpy(d->payload, payload, len);
+	d->payload[len]	= 0;
+	d->len		= len;
+	d->retain	= retain;
+	d->seq		= journal_append(topic, payload, len, retain ? JF_RETAIN : 0);
+	ndeferred++;
+}
+
+void ingest_flush(void *userdata)
+{
+	struct udata *ud = (struct udata *)userdata;
+	uint64_t last = 0;
+	int i;
+
+	for (i = 0; i < ndeferred; i++) {
+		if (deferred[i].seq > last)
+			last = deferred[i].seq;
+	}
+	if (last)
+		journal_commit(last);
+
+	for (i = 0; i < ndeferred; i++) {
+		apply(ud, deferred[i].topic, deferred[i].payload, deferred[i].len, deferred[i].retain, FALSE, NULL, deferred[i].seq);
+		free(deferred[i].topic);
+		free(deferred[i].payload);
+	}
+	ndeferred = 0;
+}
+
+static void replay(void *userdata, char *topic, char *payload, size_t len, int flags)
+{
+	handle_message(userdata, topic, payload, len, flags & JF_RETAIN, flags & JF_HTTP, FALSE, NULL);
+}
+
+/*
+ * Open the journal and handle what it holds that wasn't handled before
+ * the recorder last stopped. Returns the number of publishes replayed,
+ * or -1 if the journal can't be used.
+ */
+
+long ingest_init(void *userdata)
+{
+	if (journal_open() == -1)
+		return (-1);
+	return (journal_replay(replay, userdata));
+}
+
 #ifdef WITH_MQTT
 
 void on_message(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *m)
 {
 	struct udata *ud = (struct udata *)userdata;
 
-	handle_message(ud, m->topic, m->payload, m->payloadlen, m->retain, FALSE, FALSE, NULL);
+	if (ud->journal) {
+		ingest_defer(ud, m->topic, m->payload, m->payloadlen, m->retain);
+	} else {
+		apply(ud, m->topic, m->payload, m->payloadlen, m->retain, FALSE, NULL, 0);
+	}
 }
 
 
@@ -1429,8 +1851,140 @@ void on_disconnect(struct mosquitto *mosq, void *userdata, int reason)
 	}
 }
 
+#define MQTT_DRAIN	64		/* reads per wakeup before keepalive etc. */
+
+/*
+ * Service the MQTT connection: wait up to `timeout' ms for its socket
+ * to become readable (or writable if output is queued), then keep
+ * reading for as long as more has arrived instead of going back to
+ * sleep after every packet. Publishes deferred for the journal are
+ * handled next, and acknowledgements queued meanwhile go out right
+ * after. Returns a MOSQ_ERR_ code, as does
+ * mosquitto_loop().
+ */
+
+static int mqtt_loop(struct mosquitto *mosq, struct udata *ud, int timeout)
+{
+	struct pollfd pfd;
+	int rc = MOSQ_ERR_SUCCESS, n;
+
+	if ((pfd.fd = mosquitto_socket(mosq)) < 0)
+		return (MOSQ_ERR_NO_CONN);
+
+	pfd.events = POLLIN | (mosquitto_want_write(mosq) ? POLLOUT : 0);
+	pfd.revents = 0;
+	if (poll(&pfd, 1, timeout) == -1)
+		return (errno == EINTR ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ERRNO);
+
+	if (pfd.revents & POLLOUT) {
+		if ((rc = mosquitto_loop_write(mosq, 1)) != MOSQ_ERR_SUCCESS)
+			return (rc);
+	}
+
+	pfd.events = POLLIN;
+	for (n = 0; n < MQTT_DRAIN && (pfd.revents & (POLLIN|POLLHUP|POLLERR)); n++) {
+		if ((rc = mosquitto_loop_read(mosq, 1)) != MOSQ_ERR_SUCCESS)
+			break;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) < 1)
+			break;
+	}
+	if (ud->journal)
+		ingest_flush(ud);
+	if (rc != MOSQ_ERR_SUCCESS)
+		return (rc);
+
+	if (mosquitto_want_write(mosq)) {
+		if ((rc = mosquitto_loop_write(mosq, 1)) != MOSQ_ERR_SUCCESS)
+			return (rc);
+	}
+
+	return (mosquitto_loop_misc(mosq));
+}
+
 #endif /* WITH_MQTT */
 
+/*
+ * Log the number of publishes dropped as duplicates since the last
+ * report; at most once an hour, and only if there were any.
+ */
+
+static void dedup_report(int final)
+{
+	static unsigned long reported = 0L;
+	static time_t next = 0;
+	unsigned long n = dedup_suppressed();
+	time_t now = time(0);
+
+	if (!final && now < next)
+		return;
+	next = now + 3600;
+
+	if (n > reported) {
+		olog(LOG_INFO, "Suppressed %lu duplicate publish%s (%lu since startup)",
+			n - reported, (n - reported) == 1 ? "" : "es", n);
+		reported = n;
+	}
+}
+
+/*
+ * Log what the geo cache sweeper has done since the last report; at
+ * most once an hour, and only if it has done anything.
+ */
+
+static void sweep_report(int final)
+{
+	static struct sweep_stats reported;
+	static time_t next = 0;
+	struct sweep_stats s;
+	time_t now = time(0);
+
+	if (!final && now < next)
+		return;
+	next = now + 3600;
+
+	sweep_stats(&s);
+	if (s.visited > reported.visited) {
+		olog(LOG_INFO, "Geo cache sweep: %lu entries checked, %lu evicted, %lu refreshed, %lu refreshes failed (%lu passes since startup)",
+			s.visited - reported.visited,
+			s.evicted - reported.evicted,
+			s.refreshed - reported.refreshed,
+			s.failed - reported.failed,
+			s.passes);
+		reported = s;
+	}
+}
+
+/*
+ * Day summaries are updated in memory and written out from the main
+ * loop once a second (batches flush their own at the end). Nothing the
+ * journal entries handled so far did is in memory after that, so the
+ * journal may checkpoint up to there.
+ */
+
+static void summaries_flush(struct udata *ud, int final)
+{
+	static time_t last = 0;
+	time_t now = time(0);
+	uint64_t seq = 0;
+
+	if (!final && now == last)
+		return;
+	last = now;
+
+#ifdef WITH_HTTP
+	pthread_mutex_lock(&ud->lock);
+#endif
+	summary_flush();
+	if (ud->journal)
+		seq = journal_handled();
+#ifdef WITH_HTTP
+	pthread_mutex_unlock(&ud->lock);
+#endif
+	if (ud->journal && !final)
+		journal_checkpoint(seq);
+}
+
 static void catcher(int sig)
 {
         fprintf(stderr, "Going down on signal %d\n", sig);
@@ -1468,6 +2022,11 @@ void usage(char *prog)
 	printf("  --http-port <port>	-A     HTTP port (8083); 0 to disable HTTP\n");
 	printf("  --doc-root <directory>       document root (%s)\n", DOCROOT);
 	printf("  --http-logdir <directory>    directory in which to store access.log\n");
+	printf("  --http-workers <n>           number of HTTP worker threads (4)\n");
+	printf("  --http-cache <MB>            size of API response cache (64); 0 to disable\n");
+#ifdef WITH_ZLIB
+	printf("  --http-compress <level>      compression level 1-9 for HTTP responses (6); 0 to disable\n");
+#endif
 	printf("  --browser-apikey <key>       Google maps browser API key\n");
 	printf("  --viewsdir <directory>       full path to JSON views. Default: (%s/views)\n", DOCROOT);
 #endif
@@ -1476,6 +2035,9 @@ void usage(char *prog)
 #endif
 	printf("  --precision		       ghash precision (dflt: %d)\n", GHASHPREC);
 	printf("  --norec		       don't maintain REC files\n");
+	printf("  --no-dircache		       read directories and files for listings instead of caching them\n");
+	printf("  --dedup-window <n>           drop repeats of a device's last <n> publishes (16); 0 to disable\n");
+	printf("  --journal		       journal publishes before handling them\n");
 	printf("  --geokey		       optional reverse-geo API key\n");
 	printf("  --debug  		       additional debugging\n");
 	printf("  --json-variables  	-J     print settings in JSON and exit\n");
@@ -1511,7 +2073,6 @@ int main(int argc, char **argv)
 	static struct udata udata, *ud = &udata;
 #ifdef WITH_HTTP
 	char *doc_root		= DOCROOT;
-	int http_pollms		= 50;
 #endif
 	char *progname = *argv;
 
@@ -1539,8 +2100,13 @@ int main(int argc, char **argv)
 	udata.norec		= FALSE;
 	udata.gc		= NULL;
 	udata.t2t		= NULL;		/* Topic to TID */
+	udata.sumdb		= NULL;
 #ifdef WITH_HTTP
 	udata.mgserver		= NULL;
+	udata.http_workers	= 4;
+	udata.http_cachesize	= 64;
+	udata.http_compress	= 6;
+	pthread_mutex_init(&udata.lock, NULL);
 	udata.http_host		= strdup("localhost");
 	udata.http_port		= 8083;
 	udata.http_logdir	= NULL;
@@ -1569,6 +2135,10 @@ int main(int argc, char **argv)
 	udata.geokey		= NULL;		/* default: no API key */
 	udata.debug		= FALSE;
 	udata.clean_age		= 0L;		/* default: don't clean */
+	udata.clean_refresh	= 0L;		/* default: delete expired entries */
+	udata.dircache		= TRUE;
+	udata.dedup_window	= 16;
+	udata.journal		= FALSE;
 
 	flags = LOG_PID;
 	if (isatty(0) || (getenv("DOCKER_RUNNING") != NULL)) {
@@ -1614,6 +2184,9 @@ int main(int argc, char **argv)
 			{ "norec",	no_argument,		0, 	11},
 			{ "geokey",	required_argument,	0, 	12},
 			{ "debug",	no_argument,		0, 	13},
+			{ "no-dircache",	no_argument,		0, 	22},
+			{ "dedup-window",	required_argument,	0, 	23},
+			{ "journal",	no_argument,		0, 	24},
 #ifdef WITH_LUA
 			{ "lua-script",	required_argument,	0, 	7},
 #endif
@@ -1624,6 +2197,11 @@ int main(int argc, char **argv)
 			{ "http-logdir",	required_argument,	0, 	14},
 			{ "browser-apikey",	required_argument,	0, 	15},
 			{ "viewsdir",	required_argument,	0, 	16},
+			{ "http-workers",	required_argument,	0, 	17},
+			{ "http-cache",	required_argument,	0, 	18},
+#ifdef WITH_ZLIB
+			{ "http-compress",	required_argument,	0, 	19},
+#endif
 #endif
 			{ "variables",	no_argument,		0, 	'V'},
 			{ "json-variables",	no_argument,		0, 	'J'},
@@ -1643,6 +2221,15 @@ int main(int argc, char **argv)
 				if (udata.geokey) free(udata.geokey);
 				udata.geokey = strdup(optarg);
 				break;
+			case 22:
+				ud->dircache = FALSE;
+				break;
+			case 23:
+				ud->dedup_window = atoi(optarg);
+				break;
+			case 24:
+				ud->journal = TRUE;
+				break;
 			case 11:
 				udata.norec = TRUE;
 				break;
@@ -1725,6 +2312,15 @@ int main(int argc, char **argv)
 				if (ud->viewsdir) free(ud->viewsdir);
 				ud->viewsdir = strdup(optarg);
 				break;
+			case 17:
+				ud->http_workers = atoi(optarg);
+				break;
+			case 18:
+				ud->http_cachesize = atoi(optarg);
+				break;
+			case 19:
+				ud->http_compress = atoi(optarg);
+				break;
 #endif
 			case 'D':
 				ud->skipdemo = FALSE;
@@ -1813,6 +2409,12 @@ int main(int argc, char **argv)
 			exit(2);
 		}
 		gcache_close(gt);
+
+		if ((gt = gcache_open(path, SUMMARY_DBNAME, FALSE)) == NULL) {
+			fprintf(stderr, "Cannot lmdb-open `%s'\n", SUMMARY_DBNAME);
+			exit(2);
+		}
+		gcache_close(gt);
 		exit(0);
 	}
 
@@ -1885,9 +2487,18 @@ int main(int argc, char **argv)
 # endif
 	ud->httpfriends = gcache_open(err, "friends", TRUE);
 	ud->wpdb = gcache_open(err, "wp", FALSE);
+	ud->sumdb = gcache_open(err, SUMMARY_DBNAME, FALSE);
 
 	load_fences(ud);
 
+	if (ud->dircache) {
+		mcache_init();
+		ud->dircache = dircache_init();
+	}
+
+	dedup_init(ud->dedup_window);
+	sweep_init(ud->clean_age, ud->clean_refresh);
+
 #if WITH_ENCRYPT
 	if (sodium_init() == -1) {
 		olog(LOG_ERR, "cannot initialize libsodium");
@@ -2006,6 +2617,17 @@ int main(int argc, char **argv)
 	}
 #endif
 
+	if (ud->journal) {
+		long n;
+
+		if ((n = ingest_init(ud)) < 0) {
+			olog(LOG_ERR, "Cannot use journal; publishes are handled without it");
+			ud->journal = FALSE;
+		} else if (n > 0) {
+			olog(LOG_INFO, "Replayed %ld publish%s from the journal", n, n == 1 ? "" : "es");
+		}
+	}
+
 #ifdef WITH_HTTP
 	if (ud->http_port) {
 		char address[BUFSIZ], logdir[BUFSIZ];
@@ -2038,6 +2660,16 @@ int main(int argc, char **argv)
 			olog(LOG_ERR, "HTTP port is in use. Exiting.");
 			exit(2);
 		}
+
+		rcache_init((size_t)ud->http_cachesize * 1024 * 1024);
+		fcache_init(FCACHE_ENTRIES);
+		vcache_init(VCACHE_ENTRIES);
+
+		if ((ud->http_workers = http_workers_start(ud, ud->http_workers)) < 1) {
+			olog(LOG_ERR, "Cannot start HTTP workers. Exiting.");
+			exit(2);
+		}
+		olog(LOG_INFO, "HTTP served by %d worker%s", ud->http_workers, ud->http_workers == 1 ? "" : "s");
 #ifdef WITH_TOURS
 		olog(LOG_INFO, "HTTP prefix is %s",
 			ud->http_prefix ? ud->http_prefix : "unset");
@@ -2056,49 +2688,73 @@ int main(int argc, char **argv)
 		access(TZDATADB, F_OK|R_OK) == 0 ? "R_OK" : "ENOENT");
 #endif
 
+	/*
+	 * HTTP is served by its own threads; the main thread only
+	 * handles MQTT, writes day summaries and sweeps the geo cache,
+	 * or waits for a signal.
+	 */
+
 	while (run) {
+		dedup_report(FALSE);
+		summaries_flush(ud, FALSE);
+		sweep_step(ud);
+		sweep_report(FALSE);
 #ifdef WITH_MQTT
 		if (ud->port != 0) {
-#if WITH_HTTP
-			if (ud->http_port != 0)
-#endif /* WITH_HTTP */
-				loop_timeout = 0; /* this belongs to above `if' */
-			rc = mosquitto_loop(mosq, loop_timeout, /* max-packets */ 1);
+			rc = mqtt_loop(mosq, ud, loop_timeout);
 			if (run && rc) {
 				olog(LOG_INFO, "MQTT connection: rc=%d [%s] (errno=%d; %s). Sleeping...", rc, mosquitto_strerror(rc), errno, strerror(errno));
 				sleep(10);
 				mosquitto_reconnect(mosq);
 			}
-		} else {
-#if WITH_HTTP
-			http_pollms = 10000;
-#endif
+			continue;
 		}
 #endif
+		sleep(1);
+	}
+
 #ifdef WITH_HTTP
-		if (udata.mgserver) {
-			mg_poll_server(udata.mgserver, http_pollms);
-		}
+	if (udata.mgserver) {
+		http_workers_stop(ud);
+		rcache_free();
+		fcache_free();
+		vcache_free();
+	}
 #endif
+
+
+	summaries_flush(ud, TRUE);
+	if (ud->journal) {
+		journal_close();
 	}
+	spidx_close();
+
+	dedup_report(TRUE);
+	dedup_free();
+	sweep_report(TRUE);
 
+	if (ud->dircache) {
+		dircache_free();
+	}
+	mcache_free();
 
 	gcache_close(ud->gc);
 	gcache_close(ud->t2t);
 	gcache_close(ud->httpfriends);
 	gcache_close(ud->wpdb);
+	gcache_close(ud->sumdb);
 #ifdef WITH_LUA
 	if (ud->luadb)
 		gcache_close(ud->luadb);
 #endif
 # ifdef WITH_ENCRYPT
+	keycache_free();
 	gcache_close(ud->keydb);
 # endif
 
 	free(ud->label);
 
 #ifdef WITH_HTTP
-	mg_destroy_server(&udata.mgserver);
 	free(ud->http_host);
 	free(ud->browser_apikey);
 	free(ud->viewsdir);
@@ -3,5 +3,10 @@
 # include "json.h"
 
 void handle_message(void *userdata, char *topic, char *payload, size_t payloadlen, int retain, int httpmode, int was_encrypted, JsonNode **jnode);
+void ingest(void *userdata, char *topic, char *payload, size_t len, int retain, int httpmode, JsonNode **jnode);
+void ingest_batch(void *userdata, char *topic, char **payloads, size_t *lens, int n, JsonNode *responses);
+void ingest_defer(void *userdata, char *topic, char *payload, size_t len, int retain);
+void ingest_flush(void *userdata);
+long ingest_init(void *userdata);
 
 #endif /* _RECORDER_H_INCL_ */
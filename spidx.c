@@ -0,0 +1,553 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "spidx.h"
+#include "dircache.h"
+#include "geohash.h"
+#include "json.h"
+#include "util.h"
+
+#ifndef LINESIZE
+# define LINESIZE (32 * 1024)
+#endif
+
+/*
+ * A run: location lines in the .rec file from `offset' up to the next
+ * run's offset (or the end of what the index covers) all lie in geohash
+ * cell `ghash' and all have a `tst' in the same SPIDX_BUCKET as the
+ * run's first point. The .idx file is a header followed by a plain
+ * array of these, appended to as the .rec grows.
+ */
+
+struct spidx_run {
+	char ghash[8];
+	int64_t tst;
+	int64_t offset;
+};
+
+/*
+ * The header records which .rec file (by inode) and how much of it
+ * the runs cover; it is rewritten after each append. Lines beyond
+ * `recsize' are those written since which aren't locations.
+ */
+
+#define SPIDX_MAGIC	"OTRIDX1"
+
+struct spidx_head {
+	char magic[8];
+	int64_t recsize;
+	int64_t recino;
+};
+
+/*
+ * The .idx files being appended to are kept open, with their header
+ * and last run; the least recently used is closed to make room.
+ * spidx_append() and spidx_drop() are called with ud->lock held.
+ */
+
+#define SPIDX_OPEN	16
+
+static struct idxfile {
+	char *path;			/* NULL if unused */
+	int fd;
+	struct spidx_head head;
+	struct spidx_run last;
+	int have;			/* `last' is valid */
+	unsigned long used;
+} idxfiles[SPIDX_OPEN];
+
+static unsigned long idxclock = 0;
+
+int bbox_parse(char *s, struct bbox *bb)
+{
+	if (s == NULL || sscanf(s, "%lf,%lf,%lf,%lf",
+		&bb->west, &bb->south, &bb->east, &bb->north) != 4)
+		return (FALSE);
+
+	if (bb->south < -90.0 || bb->north > 90.0 || bb->south > bb->north ||
+	    bb->west < -180.0 || bb->west > 180.0 || bb->east < -180.0 || bb->east > 180.0)
+		return (FALSE);
+
+	return (TRUE);
+}
+
+static int lon_overlaps(struct bbox *bb, double west, double east)
+{
+	/* west > east means the box crosses the antimeridian */
+	if (bb->west <= bb->east)
+		return (east >= bb->west && west <= bb->east);
+	return (east >= bb->west || west <= bb->east);
+}
+
+int bbox_contains(struct bbox *bb, double lat, double lon)
+{
+	return (lat >= bb->south && lat <= bb->north && lon_overlaps(bb, lon, lon));
+}
+
+static void mkrun(struct spidx_run *run, double lat, double lon, time_t tst, long offset)
+{
+	char *ghash;
+
+	memset(run, 0, sizeof(struct spidx_run));
+	if ((ghash = geohash_encode(lat, lon, SPIDX_PREC)) != NULL) {
+		strncpy(run->ghash, ghash, sizeof(run->ghash) - 1);
+		free(ghash);
+	}
+	run->tst	= tst;
+	run->offset	= offset;
+}
+
+static int same_run(struct spidx_run *a, struct spidx_run *b)
+{
+	return (strcmp(a->ghash, b->ghash) == 0 &&
+		a->tst / SPIDX_BUCKET == b->tst / SPIDX_BUCKET);
+}
+
+/*
+ * If `line' is a location line from a .rec file, extract its position
+ * and time and return TRUE.
+ */
+
+static int location_line(char *line, double *lat, double *lon, time_t *tst)
+{
+	JsonNode *json, *j;
+	double d;
+	char *bp;
+	int rc = FALSE;
+
+	if (strstr(line, "Z\t* ") == NULL || (bp = strchr(line, '{')) == NULL)
+		return (FALSE);
+
+	if ((json = json_decode(bp)) == NULL)
+		return (FALSE);
+
+	if ((j = json_find_member(json, "_type")) != NULL && j->tag == JSON_STRING &&
+		strcmp(j->string_, "location") == 0) {
+		*lat = number(json, "lat");
+		*lon = number(json, "lon");
+		d = number(json, "tst");
+		*tst = isnan(d) ? 0 : d;
+		rc = !isnan(*lat) && !isnan(*lon);
+	}
+	json_delete(json);
+	return (rc);
+}
+
+/*
+ * Index the .rec file `rec' from `from' up to `upto' (or EOF if
+ * negative), appending runs to the .idx open on `fd'. `last' holds the
+ * most recent run written; *have says whether there is one. Returns
+ * the offset in the .rec reached, or -1 if the index can't be written.
+ */
+
+static long index_stream(FILE *rec, int fd, long from, long upto, struct spidx_run *last, int *have)
+{
+	struct spidx_run run;
+	char buf[LINESIZE], *bp;
+	double lat, lon;
+	time_t tst;
+	long offset;
+
+	if (fseek(rec, from, SEEK_SET) != 0 || lseek(fd, 0, SEEK_END) == -1)
+		return (-1);
+	while ((offset = ftell(rec)) >= 0 && (upto < 0 || offset < upto) &&
+		fgets(buf, sizeof(buf), rec) != NULL) {
+
+		if ((bp = strchr(buf, '\n')) != NULL)
+			*bp = 0;
+		if (!location_line(buf, &lat, &lon, &tst))
+			continue;
+
+		mkrun(&run, lat, lon, tst, offset);
+		if (!*have || !same_run(&run, last)) {
+			if (write(fd, &run, sizeof(run)) != sizeof(run))
+				return (-1);
+			*last = run;
+			*have = TRUE;
+		}
+	}
+	return (offset);
+}
+
+static void idx_close(struct idxfile *f)
+{
+	close(f->fd);
+	free(f->path);
+	f->path = NULL;
+}
+
+/*
+ * An index we failed to update is removed rather than left to
+ * misdirect queries; the next append recreates it from the .rec.
+ */
+
+static void idx_drop(struct idxfile *f)
+{
+	olog(LOG_ERR, "Cannot update index %s: %m; removing it", f->path);
+	unlink(f->path);
+	idx_close(f);
+}
+
+/*
+ * Return the open .idx at `path' for the user's/device's .rec file of
+ * `tst', in which a line is about to be indexed at `offset'. An .idx
+ * which doesn't exist yet, is of an older format or doesn't match the
+ * .rec is (re-)built from the .rec; one which lags behind it, e.g.
+ * after a crash, is brought up to date first.
+ */
+
+static struct idxfile *idx_open(char *path, UT_string *user, UT_string *device, time_t tst, long offset)
+{
+	struct idxfile *f, *slot = NULL;
+	struct stat sb;
+	off_t size, nruns;
+	long covered;
+	FILE *rec;
+	int i, ok;
+
+	for (i = 0; i < SPIDX_OPEN; i++) {
+		f = &idxfiles[i];
+		if (f->path && strcmp(f->path, path) == 0) {
+			/* still ours, unless replaced by ocat --reindex or the .rec was rewritten */
+			if (fstat(f->fd, &sb) == 0 && sb.st_nlink > 0 && offset >= f->head.recsize) {
+				f->used = ++idxclock;
+				return (f);
+			}
+			idx_close(f);
+		}
+		if (f->path == NULL) {
+			if (slot == NULL || slot->path)
+				slot = f;
+		} else if (slot == NULL || (slot->path && f->used < slot->used)) {
+			slot = f;
+		}
+	}
+
+	f = slot;
+	if (f->path)
+		idx_close(f);
+	if ((f->path = strdup(path)) == NULL)
+		return (NULL);
+	if ((f->fd = open(f->path, O_RDWR | O_CREAT, 0666)) == -1) {
+		olog(LOG_ERR, "Cannot open index %s: %m", f->path);
+		free(f->path);
+		f->path = NULL;
+		return (NULL);
+	}
+	dircache_note(f->path);
+	f->used = ++idxclock;
+	f->have = FALSE;
+
+	if ((rec = pathn("r", "rec", user, device, "rec", tst)) == NULL || fstat(fileno(rec), &sb) == -1) {
+		if (rec)
+			fclose(rec);
+		idx_drop(f);
+		return (NULL);
+	}
+
+	size = lseek(f->fd, 0, SEEK_END);
+	ok = size >= (off_t)sizeof(f->head) &&
+		pread(f->fd, &f->head, sizeof(f->head), 0) == sizeof(f->head) &&
+		memcmp(f->head.magic, SPIDX_MAGIC, sizeof(f->head.magic)) == 0 &&
+		f->head.recino == (int64_t)sb.st_ino && f->head.recsize <= offset;
+
+	if (ok) {
+		/* drop a partial record, e.g. from a crash mid-write */
+		nruns = (size - sizeof(f->head)) / sizeof(struct spidx_run);
+		if ((size - sizeof(f->head)) % sizeof(struct spidx_run))
+			ok = ftruncate(f->fd, sizeof(f->head) + nruns * sizeof(struct spidx_run)) == 0;
+		if (ok && nruns > 0) {
+			f->have = pread(f->fd, &f->last, sizeof(struct spidx_run),
+				sizeof(f->head) + (nruns - 1) * sizeof(struct spidx_run)) == sizeof(struct spidx_run);
+		}
+	} else {
+		memset(&f->head, 0, sizeof(f->head));
+		memcpy(f->head.magic, SPIDX_MAGIC, sizeof(f->head.magic));
+		f->head.recino = sb.st_ino;
+		ok = ftruncate(f->fd, 0) == 0 &&
+			pwrite(f->fd, &f->head, sizeof(f->head), 0) == sizeof(f->head);
+	}
+
+	if (ok && f->head.recsize < offset) {
+		if ((covered = index_stream(rec, f->fd, f->head.recsize, offset, &f->last, &f->have)) < 0)
+			ok = FALSE;
+		else
+			f->head.recsize = covered;
+	}
+	fclose(rec);
+
+	if (!ok) {
+		idx_drop(f);
+		return (NULL);
+	}
+	return (f);
+}
+
+/*
+ * Invoked from putrec() after a location line for `tst' was written
+ * from `offset' up to `end' into the user's/device's .rec file: start a
+ * new run in the corresponding .idx if the position left the last run's
+ * cell or the time left its bucket, and note that the index covers the
+ * .rec up to `end'.
+ */
+
+int spidx_append(UT_string *user, UT_string *device, time_t tst, long offset, long end, double lat, double lon)
+{
+	struct spidx_run run;
+	struct idxfile *f;
+	char *path;
+	off_t pos;
+
+	if ((path = storepath("rec", user, device, "idx", tst)) == NULL ||
+		(f = idx_open(path, user, device, tst, offset)) == NULL)
+		return (-1);
+
+	mkrun(&run, lat, lon, tst, offset);
+	if (!f->have || !same_run(&run, &f->last)) {
+		if ((pos = lseek(f->fd, 0, SEEK_END)) == -1 ||
+			pwrite(f->fd, &run, sizeof(run), pos) != sizeof(run))
+			goto fail;
+		f->last = run;
+		f->have = TRUE;
+	}
+
+	/* the run is in place before the header claims it */
+	f->head.recsize = end;
+	if (pwrite(f->fd, &f->head, sizeof(f->head), 0) != sizeof(f->head))
+		goto fail;
+	return (0);
+
+    fail:
+	idx_drop(f);
+	return (-1);
+}
+
+/*
+ * Remove the .idx for the user's/device's .rec file of `tst', e.g.
+ * because locations were written to it which couldn't be indexed.
+ */
+
+void spidx_drop(UT_string *user, UT_string *device, time_t tst)
+{
+	char *path;
+	int i;
+
+	if ((path = storepath("rec", user, device, "idx", tst)) == NULL)
+		return;
+	for (i = 0; i < SPIDX_OPEN; i++) {
+		if (idxfiles[i].path && strcmp(idxfiles[i].path, path) == 0)
+			idx_close(&idxfiles[i]);
+	}
+	if (unlink(path) == -1 && errno != ENOENT)
+		olog(LOG_ERR, "Cannot remove index %s: %m", path);
+}
+
+void spidx_close(void)
+{
+	int i;
+
+	for (i = 0; i < SPIDX_OPEN; i++) {
+		if (idxfiles[i].path)
+			idx_close(&idxfiles[i]);
+	}
+}
+
+static char *idxpath(char *recpath)
+{
+	size_t len = strlen(recpath);
+	char *path;
+
+	if (len < 4 || strcmp(recpath + len - 4, ".rec") != 0)
+		return (NULL);
+	if ((path = strdup(recpath)) != NULL)
+		strcpy(path + len - 4, ".idx");
+	return (path);
+}
+
+/*
+ * (Re-)create the .idx for the .rec file at `recpath'.
+ */
+
+int spidx_rebuild(char *recpath)
+{
+	struct spidx_head head;
+	struct spidx_run last;
+	struct stat sb;
+	char *path, tmp[BUFSIZ];
+	int have = FALSE, rc = -1, fd;
+	long covered = -1;
+	FILE *rec;
+
+	if ((path = idxpath(recpath)) == NULL)
+		return (-1);
+
+	if ((rec = fopen(recpath, "r")) == NULL || fstat(fileno(rec), &sb) == -1) {
+		if (rec)
+			fclose(rec);
+		free(path);
+		return (-1);
+	}
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, SPIDX_MAGIC, sizeof(head.magic));
+	head.recino = sb.st_ino;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) != -1) {
+		if (write(fd, &head, sizeof(head)) == sizeof(head) &&
+			(covered = index_stream(rec, fd, 0L, -1L, &last, &have)) >= 0) {
+			head.recsize = covered;
+			if (pwrite(fd, &head, sizeof(head), 0) != sizeof(head))
+				covered = -1;
+		}
+		if (close(fd) == 0 && covered >= 0 && rename(tmp, path) == 0) {
+			rc = 0;
+		} else {
+			olog(LOG_ERR, "Cannot write index %s: %m", path);
+			unlink(tmp);
+		}
+	}
+
+	fclose(rec);
+	free(path);
+	return (rc);
+}
+
+static int run_matches(struct spidx_run *run, struct bbox *bb, time_t s_lo, time_t s_hi)
+{
+	time_t b_lo = (run->tst / SPIDX_BUCKET) * SPIDX_BUCKET;
+	GeoCoord cell;
+
+	if (b_lo + SPIDX_BUCKET < s_lo || b_lo > s_hi)
+		return (FALSE);
+
+	cell = geohash_decode(run->ghash);
+	return (cell.north >= bb->south && cell.south <= bb->north &&
+		lon_overlaps(bb, cell.west, cell.east));
+}
+
+static int read_range(FILE *fp, long start, long end, int (*func)(char *, void *), void *param)
+{
+	char buf[LINESIZE], *bp;
+	int rc = 0;
+
+	if (fseek(fp, start, SEEK_SET) != 0)
+		return (0);
+	while (ftell(fp) < end && fgets(buf, sizeof(buf), fp) != NULL) {
+		if ((bp = strchr(buf, '\n')) != NULL)
+			*bp = 0;
+		if ((rc = func(buf, param)) == -1)
+			break;
+	}
+	return (rc);
+}
+
+/*
+ * Invoke func() on every line of the .rec file at `recpath' which lies
+ * in a run whose cell intersects `bb' and whose time bucket overlaps
+ * s_lo .. s_hi, and on those written after the last location the index
+ * covers; adjacent runs are read in one go. Lines are not filtered any
+ * further: the caller checks them individually.
+ * Returns -1 if there is no index for the file, or it doesn't match the
+ * file, in which case the caller has to read all of it.
+ */
+
+int spidx_scan(char *recpath, struct bbox *bb, time_t s_lo, time_t s_hi, int (*func)(char *, void *), void *param)
+{
+	struct spidx_head head;
+	struct spidx_run *runs;
+	struct stat sb;
+	char *path;
+	long nruns, n, start, end, r_start = -1, r_end = -1;
+	FILE *fp;
+	int rc = 0;
+
+	if ((path = idxpath(recpath)) == NULL)
+		return (-1);
+	fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL)
+		return (-1);
+
+	if (fstat(fileno(fp), &sb) == -1 || sb.st_size < (off_t)sizeof(head) ||
+		fread(&head, sizeof(head), 1, fp) != 1 ||
+		memcmp(head.magic, SPIDX_MAGIC, sizeof(head.magic)) != 0) {
+		fclose(fp);
+		return (-1);
+	}
+	nruns = (sb.st_size - sizeof(head)) / sizeof(struct spidx_run);
+	if ((runs = malloc((nruns ? nruns : 1) * sizeof(struct spidx_run))) == NULL) {
+		fclose(fp);
+		return (-1);
+	}
+	nruns = fread(runs, sizeof(struct spidx_run), nruns, fp);
+	fclose(fp);
+
+	/* a run appended after we read the header isn't covered yet */
+	while (nruns > 0 && runs[nruns - 1].offset >= head.recsize)
+		nruns--;
+
+	if ((fp = fopen(recpath, "r")) == NULL) {
+		free(runs);
+		return (-1);
+	}
+	if (fstat(fileno(fp), &sb) == -1 || (int64_t)sb.st_ino != head.recino ||
+		sb.st_size < head.recsize) {
+		fclose(fp);
+		free(runs);
+		return (-1);
+	}
+
+	for (n = 0; n <= nruns && rc != -1; n++) {
+		if (n < nruns) {
+			start	= runs[n].offset;
+			end	= (n + 1 < nruns) ? runs[n + 1].offset : head.recsize;
+
+			if (!run_matches(&runs[n], bb, s_lo, s_hi))
+				continue;
+		} else {
+			/* lines written since the index was last updated */
+			start	= head.recsize;
+			end	= sb.st_size;
+		}
+
+		if (start == r_end) {
+			r_end = end;
+			continue;
+		}
+		if (r_start >= 0)
+			rc = read_range(fp, r_start, r_end, func, param);
+		r_start	= start;
+		r_end	= end;
+	}
+	if (r_start >= 0 && rc != -1)
+		rc = read_range(fp, r_start, r_end, func, param);
+
+	fclose(fp);
+	free(runs);
+	return (rc == -1 ? 0 : rc);
+}
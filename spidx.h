@@ -0,0 +1,30 @@
+#ifndef _SPIDX_H_INCLUDED_
+# define _SPIDX_H_INCLUDED_
+
+#include <time.h>
+#include "utstring.h"
+
+/*
+ * Spatial index for .rec files. Beside every YYYY-MM.rec lives a
+ * YYYY-MM.idx which records runs of consecutive location lines that
+ * fall into the same geohash cell during the same time bucket, and
+ * the offset in the .rec file at which each run starts, behind a
+ * header which says how much of which .rec the runs cover.
+ */
+
+#define SPIDX_PREC	5	/* geohash characters per cell (~4.9 x 4.9 km) */
+#define SPIDX_BUCKET	3600	/* seconds per time bucket */
+
+struct bbox {
+	double west, south, east, north;
+};
+
+int bbox_parse(char *s, struct bbox *bb);
+int bbox_contains(struct bbox *bb, double lat, double lon);
+int spidx_append(UT_string *user, UT_string *device, time_t tst, long offset, long end, double lat, double lon);
+void spidx_drop(UT_string *user, UT_string *device, time_t tst);
+void spidx_close(void);
+int spidx_rebuild(char *recpath);
+int spidx_scan(char *recpath, struct bbox *bb, time_t s_lo, time_t s_hi, int (*func)(char *, void *), void *param);
+
+#endif
@@ -30,6 +30,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include "utstring.h"
 #include "storage.h"
 #include "geohash.h"
@@ -37,16 +38,27 @@
 #include "gcache.h"
 #include "util.h"
 #include "listsort.h"
+#include "spidx.h"
+#include "summary.h"
+#include "dircache.h"
+#include "mcache.h"
 
 char STORAGEDIR[BUFSIZ] = STORAGEDEFAULT;
 
 #define LARGEBUF        (BUFSIZ * 2)
 
+#ifndef LINESIZE
+# define LINESIZE (32 * 1024)
+#endif
+
 static struct gcache *gc = NULL;
+static struct gcache *sumdb = NULL;
 
 #ifdef WITH_TZ
 # include "zonedetect.h"
+# include "tzgrid.h"
 ZoneDetect *zdb = NULL;
+static struct tzgrid *tzgrid = NULL;
 #endif
 
 void storage_init(int revgeo)
@@ -67,59 +79,330 @@ void storage_init(int revgeo)
 	if (zdb == NULL) {
 		zdb = ZDOpenDatabase(TZDATADB);
 	}
+	if (zdb && tzgrid == NULL) {
+		tzgrid = tzgrid_open(TZDATADB TZGRID_SUFFIX, TZDATADB);
+	}
 #endif
 }
 
-void storage_gcache_dump(char *lmdbname)
+#ifdef WITH_TZ
+/*
+ * Return the timezone name for lat, lon or NULL. The precomputed grid
+ * answers for most of the planet; points close to a border fall back
+ * to a full lookup in the ZoneDetect database. Caller must free.
+ */
+
+char *tz_lookup(double lat, double lon)
+{
+	const char *tzname;
+
+	if (tzgrid_lookup(tzgrid, lat, lon, &tzname)) {
+		return (tzname ? strdup(tzname) : NULL);
+	}
+
+	return (zdb ? ZDHelperSimpleLookupString(zdb, lat, lon) : NULL);
+}
+
+int storage_tzgrid_build(double cellsize)
+{
+	struct tzgrid_stats st;
+	char *path = TZDATADB TZGRID_SUFFIX;
+
+	if (zdb == NULL && (zdb = ZDOpenDatabase(TZDATADB)) == NULL) {
+		fprintf(stderr, "Cannot open %s\n", TZDATADB);
+		return (FALSE);
+	}
+
+	if (tzgrid_build(zdb, TZDATADB, path, cellsize, &st) == 0) {
+		fprintf(stderr, "Cannot build %s\n", path);
+		return (FALSE);
+	}
+
+	printf("%s: %ld cells of %.3f degrees, %ld resolved, %ld near a border (%.1f%%), %d zones\n",
+		path, st.cells, cellsize, st.resolved, st.ambiguous,
+		(st.ambiguous * 100.0) / st.cells, st.zones);
+
+	if (tzgrid) {
+		tzgrid_close(tzgrid);
+	}
+	tzgrid = tzgrid_open(path, TZDATADB);
+	return (TRUE);
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+/*
+ * Compare the full ZoneDetect lookup with tz_lookup() over `count'
+ * pseudo-random (but repeatable) points and print throughput for both,
+ * the grid hit rate, and any disagreement between the two.
+ */
+
+void storage_tzgrid_bench(long count)
+{
+	struct timespec t0;
+	double *lat, *lon, t_full, t_grid;
+	long n, hits = 0, mismatch = 0;
+	char **full;
+	const char *tzname;
+
+	if (zdb == NULL) {
+		fprintf(stderr, "Cannot open %s\n", TZDATADB);
+		return;
+	}
+	if (tzgrid == NULL) {
+		fprintf(stderr, "No usable %s%s; build it with --tzgrid-build\n", TZDATADB, TZGRID_SUFFIX);
+	}
+
+	lat  = malloc(count * sizeof(double));
+	lon  = malloc(count * sizeof(double));
+	full = malloc(count * sizeof(char *));
+	if (!lat || !lon || !full) {
+		free(lat); free(lon); free(full);
+		return;
+	}
+
+	srandom(42);
+	for (n = 0; n < count; n++) {
+		lat[n] = (random() / (double)RAND_MAX) * 180.0 - 90.0;
+		lon[n] = (random() / (double)RAND_MAX) * 360.0 - 180.0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < count; n++) {
+		full[n] = ZDHelperSimpleLookupString(zdb, lat[n], lon[n]);
+	}
+	t_full = elapsed(&t0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < count; n++) {
+		char *tz = tz_lookup(lat[n], lon[n]);
+
+		if ((tz == NULL) != (full[n] == NULL) || (tz && strcmp(tz, full[n]) != 0))
+			mismatch++;
+		free(tz);
+	}
+	t_grid = elapsed(&t0);
+
+	for (n = 0; n < count; n++) {
+		if (tzgrid_lookup(tzgrid, lat[n], lon[n], &tzname))
+			hits++;
+		free(full[n]);
+	}
+
+	printf("lookups %ld\n", count);
+	printf("full    %.3fs %12.0f/s\n", t_full, count / t_full);
+	printf("grid    %.3fs %12.0f/s  (%.1f%% answered by grid, %ld mismatches)\n",
+		t_grid, count / t_grid, (hits * 100.0) / count, mismatch);
+
+	free(lat);
+	free(lon);
+	free(full);
+}
+#endif
+
+int storage_gcache_dump(char *lmdbname, int binary)
 {
 	char path[LARGEBUF];
 	snprintf(path, LARGEBUF, "%s/ghash", STORAGEDIR);
 
-	gcache_dump(path, lmdbname);
+	return (gcache_dump(path, lmdbname, binary));
 }
 
-void storage_gcache_load(char *lmdbname)
+int storage_gcache_load(char *lmdbname, int binary)
 {
 	char path[LARGEBUF];
 
 	snprintf(path, LARGEBUF, "%s/ghash", STORAGEDIR);
-	gcache_load(path, lmdbname);
+	return (gcache_load(path, lmdbname, binary));
+}
+
+static char * my_strptime(const char * restrict buf, const char * restrict format,
+         struct tm * restrict timeptr)
+{
+	return strptime(buf, format, timeptr);
 }
 
 /*
- * Adjust seconds obtained via mktime() to offset from the last
- * timezone we set. This fixes time to what GMT time is without
- * actually knowing what the local $TZ is. We do this to avoid
- * switching $TZ back and forth from UTC to whatever tzname
- * a location has, a very expensive operation.
+ * While a thread collects (geo_collect()), get_geo() notes each ghash
+ * it looks up as "ghash hash tst", the hash and tst being those of the
+ * entry it found (0 if none), so that a response can be validated by
+ * the reverse-geo entries it was built from rather than by the whole
+ * cache. Successive lookups of one cell are noted once.
  */
 
-time_t local2gmt(time_t tlocal) {
-	struct tm *tm;
-	time_t gm_tics;
+#define GEOBUF		4096
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
 
-	tm = localtime(&tlocal);
-	gm_tics = tlocal + tm->tm_gmtoff;
+static __thread UT_string *geonotes = NULL;
+static __thread size_t geolast;		/* offset of the last note */
 
-	return gm_tics;
+static uint64_t fnv(uint64_t h, const char *s, size_t len)
+{
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= FNV_PRIME;
+	}
+	return (h);
 }
 
-static char * my_strptime(const char * restrict buf, const char * restrict format,
-         struct tm * restrict timeptr)
+/* Look up `ghash' into buf; return the hash and tst of what's there */
+
+static long geo_entry(char *ghash, char *buf, uint64_t *hash, time_t *tst)
 {
-	return strptime(buf, format, timeptr);
+	long len;
+	char *bp;
+
+	*hash = 0;
+	*tst = 0;
+	if ((len = gcache_get(gc, ghash, buf, GEOBUF - 1)) < 0)
+		return (-1);
+	buf[len] = 0;
+	*hash = fnv(FNV_OFFSET, buf, len);
+	if ((bp = strstr(buf, "\"tst\":")) != NULL)
+		*tst = strtol(bp + 6, NULL, 10);
+	return (len);
+}
+
+void geo_collect(UT_string *notes)
+{
+	geonotes = notes;
+	geolast = 0;
 }
 
 void get_geo(JsonNode *o, char *ghash)
 {
-	JsonNode *geo;
+	JsonNode *geo = NULL;
+	char buf[GEOBUF];
+	uint64_t hash;
+	time_t tst;
+	size_t len;
+	long n;
+
+	if (geonotes == NULL) {
+		geo = gcache_json_get(gc, ghash);
+	} else {
+		if ((n = geo_entry(ghash, buf, &hash, &tst)) == GEOBUF - 1)
+			geo = gcache_json_get(gc, ghash);
+		else if (n > 0)
+			geo = json_decode(buf);
+
+		len = utstring_len(geonotes);
+		utstring_printf(geonotes, "%s %016llx %ld\n", ghash, (unsigned long long)hash, (long)tst);
+		if (len > 0 && len - geolast == utstring_len(geonotes) - len &&
+			memcmp(UB(geonotes) + geolast, UB(geonotes) + len, len - geolast) == 0) {
+			geonotes->i = len;			/* same as the last note */
+			geonotes->d[len] = 0;
+		} else {
+			geolast = len;
+		}
+	}
 
-	if ((geo = gcache_json_get(gc, ghash)) != NULL) {
+	if (geo != NULL) {
 		json_copy_to_object(o, geo, FALSE);
 		json_delete(geo);
 	}
 }
 
+static int notecmp(const void *a, const void *b)
+{
+	return (strcmp(*(char **)a, *(char **)b));
+}
+
+/*
+ * Reduce the notes made while a response was built to the sorted list
+ * of its ghashes, and return in `digest' a hash over those and their
+ * entries, as geo_digest() would compute it, and the newest entry's
+ * tst in `newest' if that's later. Returns FALSE if an entry changed
+ * while the response was being built.
+ */
+
+int geo_collected(UT_string *notes, uint64_t *digest, time_t *newest)
+{
+	char **lines = NULL, *bp, *sp;
+	size_t n = 0, max = 0, i, klen;
+	uint64_t h = FNV_OFFSET;
+	UT_string *keys = NULL;
+	int ok = TRUE;
+	time_t tst;
+
+	for (bp = UB(notes); bp && *bp; bp = sp + 1) {
+		if ((sp = strchr(bp, '\n')) == NULL)
+			break;
+		*sp = 0;
+		if (n == max) {
+			char **nl;
+
+			max = max ? max * 2 : 256;
+			if ((nl = realloc(lines, max * sizeof(char *))) == NULL) {
+				free(lines);
+				return (FALSE);
+			}
+			lines = nl;
+		}
+		lines[n++] = bp;
+	}
+	qsort(lines, n, sizeof(char *), notecmp);
+
+	utstring_new(keys);
+	for (i = 0; i < n; i++) {
+		if (i > 0 && strcmp(lines[i], lines[i - 1]) == 0)
+			continue;
+		klen = strcspn(lines[i], " ");
+		if (i > 0 && strncmp(lines[i], lines[i - 1], klen + 1) == 0) {
+			ok = FALSE;		/* two different entries */
+			break;
+		}
+		if ((bp = strrchr(lines[i], ' ')) != NULL) {
+			h = fnv(h, lines[i], bp - lines[i]);
+			if ((tst = atol(bp + 1)) > *newest)
+				*newest = tst;
+		}
+		utstring_bincpy(keys, lines[i], klen);
+		utstring_printf(keys, "\n");
+	}
+	free(lines);
+
+	utstring_clear(notes);
+	utstring_concat(notes, keys);
+	utstring_free(keys);
+	*digest = h;
+	return (ok);
+}
+
+/*
+ * A hash over the ghashes in `keys' (one per line, sorted, as left by
+ * geo_collected()) and their current entries; `newest' is raised to
+ * the newest entry's tst.
+ */
+
+uint64_t geo_digest(char *keys, time_t *newest)
+{
+	char buf[GEOBUF], note[BUFSIZ], *bp, *nl;
+	uint64_t h = FNV_OFFSET, hash;
+	time_t tst;
+	int len;
+
+	for (bp = keys; bp && *bp; bp = nl + 1) {
+		if ((nl = strchr(bp, '\n')) == NULL)
+			break;
+		*nl = 0;
+		geo_entry(bp, buf, &hash, &tst);
+		*nl = '\n';
+		len = snprintf(note, sizeof(note), "%.*s %016llx", (int)(nl - bp), bp, (unsigned long long)hash);
+		h = fnv(h, note, len);
+		if (tst > *newest)
+			*newest = tst;
+	}
+	return (h);
+}
+
 
 /*
  * Populate a JSON object (`obj') keyed by directory name; each element points
@@ -168,32 +451,58 @@ static int user_device_list(char *name, int level, JsonNode *obj)
 	return (rc);
 }
 
+/*
+ * Like user_device_list() on STORAGEDIR/last, but from the directory
+ * cache, and only for `in_user' if that isn't NULL. Returns DC_OFF if
+ * the cache isn't active.
+ */
+
+static int user_device_cached(char *in_user, JsonNode *obj)
+{
+	JsonNode *users, *un, *devlist;
+	int rc;
+
+	if (in_user) {
+		devlist = json_mkarray();
+		if ((rc = dircache_ls("last", in_user, NULL, devlist)) == 1)
+			json_append_member(obj, in_user, devlist);
+		else
+			json_delete(devlist);
+		return (rc);
+	}
+
+	users = json_mkarray();
+	if ((rc = dircache_ls("last", NULL, NULL, users)) == 1) {
+		json_foreach(un, users) {
+			devlist = json_mkarray();
+			if (dircache_ls("last", un->string_, NULL, devlist) == 1)
+				json_append_member(obj, un->string_, devlist);
+			else
+				json_delete(devlist);
+		}
+	}
+	json_delete(users);
+	return (rc);
+}
+
 void append_card_to_object(JsonNode *obj, char *user, char *device)
 {
-	char path[LARGEBUF], path1[LARGEBUF], *cardfile = NULL;
+	char path[LARGEBUF];
 	JsonNode *card;
 
 	if (!user || !*user)
 		return;
 
-
+	/* the device's card, else the user's */
+	card = json_mkobject();
 	snprintf(path, LARGEBUF, "%s/cards/%s/%s/%s-%s.json",
 		STORAGEDIR, user, device, user, device);
-	if (access(path, R_OK) == 0) {
-		cardfile = path;
-	} else {
-		snprintf(path1, LARGEBUF, "%s/cards/%s/%s.json",
+	if (mcache_copy(card, path) == FALSE) {
+		snprintf(path, LARGEBUF, "%s/cards/%s/%s.json",
 			STORAGEDIR, user, user);
-
-		if (access(path1, R_OK) == 0) {
-			cardfile = path1;
-		}
-	}
-
-	card = json_mkobject();
-	if (cardfile && json_copy_from_file(card, cardfile) == TRUE) {
-		json_copy_to_object(obj, card, FALSE);
+		mcache_copy(card, path);
 	}
+	json_copy_to_object(obj, card, FALSE);
 	json_delete(card);
 }
 
@@ -201,15 +510,13 @@ void append_card_to_object(JsonNode *obj, char *user, char *device)
 static void tz_info(JsonNode *json, double lat, double lon, time_t tst)
 {
 	// olog(LOG_DEBUG, "tz_info for (%lf, %lf)", lat, lon);
-	if (zdb) {
-		char *tz_str = ZDHelperSimpleLookupString(zdb, lat, lon);
+	char *tz_str = tz_lookup(lat, lon);
 
-		if (tz_str) {
-			json_append_member(json, "tzname", json_mkstring(tz_str));
-			json_append_member(json, "isolocal", json_mkstring(isolocal(tst, tz_str)));
+	if (tz_str) {
+		json_append_member(json, "tzname", json_mkstring(tz_str));
+		json_append_member(json, "isolocal", json_mkstring(isolocal(tst, tz_str)));
 
-			ZDHelperSimpleLookupStringFree(tz_str);
-		}
+		free(tz_str);
 	}
 }
 #endif
@@ -223,7 +530,7 @@ void append_device_details(JsonNode *userlist, char *user, char *device)
 		STORAGEDIR, user, device, user, device);
 
 	last = json_mkobject();
-	if (json_copy_from_file(last, path) == TRUE) {
+	if (mcache_copy(last, path) == TRUE) {
 		JsonNode *jtst;
 
 		if ((jtst = json_find_member(last, "tst")) != NULL) {
@@ -252,7 +559,7 @@ void append_device_details(JsonNode *userlist, char *user, char *device)
 	/* Extra data */
 	snprintf(path, LARGEBUF, "%s/last/%s/%s/extra.json",
 		STORAGEDIR, user, device);
-	json_copy_from_file(last, path);
+	mcache_copy(last, path);
 	json_append_element(userlist, last);
 }
 
@@ -274,7 +581,7 @@ JsonNode *last_users(char *in_user, char *in_device, JsonNode *fields)
 	// fprintf(stderr, "last_users(%s, %s)\n", (in_user) ? in_user : "<nil>",
 	// 	(in_device) ? in_device : "<nil>");
 
-	if (user_device_list(path, 0, obj) == 1) {
+	if (user_device_cached(in_user, obj) == DC_OFF && user_device_list(path, 0, obj) == 1) {
 		json_delete(userlist);
 		return (obj);
 	}
@@ -373,12 +680,9 @@ static int str_time_to_secs(char *s, time_t *secs)
 		return (0);
 
 	tm.tm_mday = (tm.tm_mday < 1) ? 1 : tm.tm_mday;
-	tm.tm_isdst = -1; 		/* A negative value for tm_isdst causes
-					 * the mktime() function to attempt to
-					 * divine whether summer time is in
-					 * effect for the specified time. */
 
-	*secs = local2gmt(mktime(&tm));
+	/* Times are UTC; timegm() doesn't depend on $TZ */
+	*secs = timegm(&tm);
 	// fprintf(stderr, "str_time_to_secs: %s becomes %04d-%02d-%02d %02d:%02d:%02d\n",
 	// 	s,
 	// 	tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
@@ -447,7 +751,7 @@ static void ls(char *path, JsonNode *obj)
 			is_dir = true;
 		} else {
 			struct stat st;
-			static UT_string *fullp = NULL;
+			static __thread UT_string *fullp = NULL;
 
 			utstring_renew(fullp);
 			utstring_printf(fullp, "%s/%s", path, dp->d_name);
@@ -471,59 +775,69 @@ static void ls(char *path, JsonNode *obj)
  * s_lo and s_hi.
  */
 
-static time_t t_lo, t_hi;	/* must be global so that filter() can access them */
+static __thread time_t t_lo, t_hi;	/* must be global (per thread) so that filter() can access them */
 
-static int filter_filename(const struct dirent *d)
+static int filter_name(const char *name)
 {
-	struct tm tmfile, *tm;
+	struct tm tmfile, tm;
 	int lo_months, hi_months, file_months;
 
 	/* if the filename doesn't look like YYYY-MM.rec we can safely ignore it.
 	 * Needs modifying after the year 2999 ;-) */
-	if (fnmatch("2[0-9][0-9][0-9]-[0-3][0-9].rec", d->d_name, 0) != 0)
+	if (fnmatch("2[0-9][0-9][0-9]-[0-3][0-9].rec", name, 0) != 0)
 		return (0);
 
 	/* Convert filename (YYYY-MM) to a tm; see if months falls between
 	 * from months and to months. */
 
 	memset(&tmfile, 0, sizeof(struct tm));
-	if (my_strptime(d->d_name, "%Y-%m", &tmfile) == NULL) {
+	if (my_strptime(name, "%Y-%m", &tmfile) == NULL) {
 		fprintf(stderr, "filter: convert err");
 		return (0);
 	}
 	file_months = (tmfile.tm_year + 1900) * 12 + tmfile.tm_mon;
 
-	tm = gmtime(&t_lo);
-	lo_months = (tm->tm_year + 1900) * 12 + tm->tm_mon;
+	gmtime_r(&t_lo, &tm);
+	lo_months = (tm.tm_year + 1900) * 12 + tm.tm_mon;
 
-	tm = gmtime(&t_hi);
-	hi_months = (tm->tm_year + 1900) * 12 + tm->tm_mon;
+	gmtime_r(&t_hi, &tm);
+	hi_months = (tm.tm_year + 1900) * 12 + tm.tm_mon;
 
 	/*
 	printf("filter: file %s has %04d-%02d-%02d %02d:%02d:%02d\n",
-		d->d_name,
+		name,
 		tmfile.tm_year + 1900, tmfile.tm_mon + 1, tmfile.tm_mday,
 		tmfile.tm_hour, tmfile.tm_min, tmfile.tm_sec);
 	*/
 
 	if (file_months >= lo_months && file_months <= hi_months) {
-		// fprintf(stderr, "filter: returns: %s\n", d->d_name);
+		// fprintf(stderr, "filter: returns: %s\n", name);
 		return (1);
 	}
 	return (0);
 }
 
+static int filter_filename(const struct dirent *d)
+{
+	return (filter_name(d->d_name));
+}
+
 static int cmp( const struct dirent **a, const struct dirent **b)
 {
 	return strcmp((*a)->d_name, (*b)->d_name);
 }
 
-static void lsscan(char *pathpat, time_t s_lo, time_t s_hi, JsonNode *obj, int reverse)
+/*
+ * The month files of user/device are taken from the directory cache
+ * (see dircache.c) if that's active, else read from `pathpat'.
+ */
+
+static void lsscan(char *pathpat, char *user, char *device, time_t s_lo, time_t s_hi, JsonNode *obj, int reverse)
 {
 	struct dirent **namelist;
-	int i, n;
-	JsonNode *jarr = NULL;
-	static UT_string *path = NULL;
+	int i, n, rc;
+	JsonNode *jarr = NULL, *names, *f;
+	static __thread UT_string *path = NULL;
 
 	if (obj == NULL || obj->tag != JSON_OBJECT)
 		return;
@@ -535,8 +849,22 @@ static void lsscan(char *pathpat, time_t s_lo, time_t s_hi, JsonNode *obj, int r
 	t_lo = s_lo;
 	t_hi = s_hi;
 
-	if ((n = scandir(pathpat, &namelist, filter_filename, cmp)) < 0) {
+	names = json_mkarray();
+	if ((rc = dircache_ls("rec", user, device, names)) == DC_OFF) {
+		if ((n = scandir(pathpat, &namelist, filter_filename, cmp)) < 0) {
+			rc = 0;
+		} else {
+			for (i = 0; i < n; i++) {
+				json_append_element(names, json_mkstring(namelist[i]->d_name));
+				free(namelist[i]);
+			}
+			free(namelist);
+			rc = 1;
+		}
+	}
+	if (rc == 0) {
 		json_append_member(obj, "error", json_mkstring("Cannot lsscan requested directory"));
+		json_delete(names);
 		return;
 	}
 
@@ -546,29 +874,46 @@ static void lsscan(char *pathpat, time_t s_lo, time_t s_hi, JsonNode *obj, int r
 	if ((jarr = json_find_member(obj, "results")) == NULL) {
 		jarr = json_mkarray();
 	} else {
-		json_delete(jarr);
+		json_remove_from_parent(jarr);
 	}
 
-	if (reverse) {
-		for (i = n - 1; i >= 0; i--) {
+	for (f = reverse ? names->children.tail : json_first_child(names); f != NULL; f = reverse ? f->prev : f->next) {
+		if (filter_name(f->string_)) {
 			utstring_clear(path);
-			utstring_printf(path, "%s/%s", pathpat, namelist[i]->d_name);
+			utstring_printf(path, "%s/%s", pathpat, f->string_);
 			json_append_element(jarr, json_mkstring(UB(path)));
-			free(namelist[i]);
-		}
-	} else {
-		for (i = 0; i < n; i++) {
-			utstring_clear(path);
-			utstring_printf(path, "%s/%s", pathpat, namelist[i]->d_name);
-			json_append_element(jarr, json_mkstring(UB(path)));
-			free(namelist[i]);
 		}
 	}
-	free(namelist);
+	json_delete(names);
 
 	json_append_member(obj, "results", jarr);
 }
 
+/*
+ * Like ls() on STORAGEDIR/rec[/user], from the directory cache.
+ * Returns FALSE if the cache isn't active.
+ */
+
+static int ls_cached(char *user, JsonNode *obj)
+{
+	JsonNode *jarr = json_mkarray();
+	int rc;
+
+	if (obj == NULL || obj->tag != JSON_OBJECT ||
+	    (rc = dircache_ls("rec", user, NULL, jarr)) == DC_OFF) {
+		json_delete(jarr);
+		return (FALSE);
+	}
+
+	if (rc == 0) {
+		json_append_member(obj, "error", json_mkstring("Cannot open requested directory"));
+		json_delete(jarr);
+	} else {
+		json_append_member(obj, "results", jarr);
+	}
+	return (TRUE);
+}
+
 /*
  * If `user' and `device' are both NULL, return list of users.
  * If `user` is specified, and device is NULL, return user's devices
@@ -580,7 +925,7 @@ static void lsscan(char *pathpat, time_t s_lo, time_t s_hi, JsonNode *obj, int r
 JsonNode *lister(char *user, char *device, time_t s_lo, time_t s_hi, int reverse)
 {
 	JsonNode *json = json_mkobject();
-	static UT_string *path = NULL;
+	static __thread UT_string *path = NULL;
 	char *bp;
 
 	utstring_renew(path);
@@ -595,15 +940,19 @@ JsonNode *lister(char *user, char *device, time_t s_lo, time_t s_hi, int reverse
 	}
 
 	if (!user && !device) {
-		utstring_printf(path, "%s/rec", STORAGEDIR);
-		ls(UB(path), json);
+		if (!ls_cached(NULL, json)) {
+			utstring_printf(path, "%s/rec", STORAGEDIR);
+			ls(UB(path), json);
+		}
 	} else if (!device) {
-		utstring_printf(path, "%s/rec/%s", STORAGEDIR, user);
-		ls(UB(path), json);
+		if (!ls_cached(user, json)) {
+			utstring_printf(path, "%s/rec/%s", STORAGEDIR, user);
+			ls(UB(path), json);
+		}
 	} else {
 		utstring_printf(path, "%s/rec/%s/%s",
 			STORAGEDIR, user, device);
-		lsscan(UB(path), s_lo, s_hi, json, reverse);
+		lsscan(UB(path), user, device, s_lo, s_hi, json, reverse);
 	}
 
 	return (json);
@@ -618,7 +967,7 @@ JsonNode *lister(char *user, char *device, time_t s_lo, time_t s_hi, int reverse
 JsonNode *multilister(JsonNode *udpairs, time_t s_lo, time_t s_hi, int reverse)
 {
 	JsonNode *json = json_mkobject(), *ud;
-	static UT_string *path = NULL;
+	static __thread UT_string *path = NULL;
 	char *pairs[3];
 	int np;
 
@@ -635,7 +984,7 @@ JsonNode *multilister(JsonNode *udpairs, time_t s_lo, time_t s_hi, int reverse)
 			STORAGEDIR,
 			pairs[0],		/* user */
 			pairs[1]);		/* device */
-		lsscan(UB(path), s_lo, s_hi, json, reverse);
+		lsscan(UB(path), pairs[0], pairs[1], s_lo, s_hi, json, reverse);
 
 		splitterfree(pairs);
 	}
@@ -643,6 +992,109 @@ JsonNode *multilister(JsonNode *udpairs, time_t s_lo, time_t s_hi, int reverse)
 	return (json);
 }
 
+/*
+ * Return daily summaries for user/device between s_lo and s_hi. The
+ * `summary' database is created by the recorder, so open it on first
+ * use rather than in storage_init().
+ */
+
+JsonNode *summaries(char *user, char *device, time_t s_lo, time_t s_hi)
+{
+	static pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
+	JsonNode *json = json_mkobject();
+	char path[LARGEBUF];
+
+	pthread_mutex_lock(&open_mutex);
+	if (sumdb == NULL) {
+		snprintf(path, LARGEBUF, "%s/ghash", STORAGEDIR);
+		sumdb = gcache_open(path, SUMMARY_DBNAME, TRUE);
+	}
+	pthread_mutex_unlock(&open_mutex);
+
+	json_append_member(json, "user", json_mkstring(user));
+	json_append_member(json, "device", json_mkstring(device));
+	json_append_member(json, "data", summary_get(sumdb, user, device, s_lo, s_hi));
+	return (json);
+}
+
+/*
+ * Recompute the daily summaries of user/device from their .rec files;
+ * without device, of all the user's devices, and without user, of
+ * everybody. Returns the number of days stored or -1.
+ */
+
+long summaries_rebuild(char *user, char *device)
+{
+	struct gcache *wgc;
+	JsonNode *json, *arr, *f;
+	char path[LARGEBUF];
+	long n, ndays = 0;
+	time_t now = time(0), s_hi;
+	struct tm tm;
+
+	if (user == NULL || device == NULL) {
+		if ((json = lister(user, NULL, 0, 0, FALSE)) != NULL) {
+			if ((arr = json_find_member(json, "results")) != NULL) {
+				json_foreach(f, arr) {
+					if (user)
+						n = summaries_rebuild(user, f->string_);
+					else
+						n = summaries_rebuild(f->string_, NULL);
+					if (n == -1) {
+						ndays = -1;
+						break;
+					}
+					ndays += n;
+				}
+			}
+			json_delete(json);
+		}
+		return (ndays);
+	}
+
+	snprintf(path, LARGEBUF, "%s/ghash", STORAGEDIR);
+	if ((wgc = gcache_open(path, SUMMARY_DBNAME, FALSE)) == NULL)
+		return (-1);
+
+	/*
+	 * Replace the summaries of all days up to the end of this month,
+	 * the range the listed .rec files cover, with those of the
+	 * locations in them.
+	 */
+
+	gmtime_r(&now, &tm);
+	tm.tm_mon += 1;
+	tm.tm_mday = 1;
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	s_hi = timegm(&tm) - 1;
+
+	if (summary_days(wgc, user, device, s_hi, TRUE) == -1) {
+		gcache_close(wgc);
+		return (-1);
+	}
+
+	if ((json = lister(user, device, 0, now, FALSE)) != NULL) {
+		if ((arr = json_find_member(json, "results")) != NULL) {
+			json_foreach(f, arr) {
+				if (summary_rebuild(wgc, f->string_, user, device, s_hi) == -1)
+					olog(LOG_ERR, "Cannot rebuild summaries from %s", f->string_);
+			}
+		}
+		json_delete(json);
+	}
+
+	if (summary_flush() != 0)
+		ndays = -1;
+	else
+		ndays = summary_days(wgc, user, device, s_hi, FALSE);
+
+	gcache_close(wgc);
+	return (ndays);
+}
+
+#define SIMPLIFY_WINDOW	(128)	/* max. points held before forcing a vertex */
+#define EARTH_RADIUS_M	(6371000.0)
+
 struct jparam {
 	JsonNode *obj;
 	JsonNode *locs;
@@ -653,6 +1105,15 @@ struct jparam {
 	JsonNode *fields;	/* If non-NULL array of fields names to return */
 	char *username;		/* If non-NULL, add username to location  */
 	char *device;		/* If non-NULL, add device name to location */
+	struct bbox *bbox;	/* If non-NULL, only locations within */
+	double simplify;	/* If > 0, max. deviation in meters (see simplify_line) */
+	int anchored;		/* simplify: a point has been emitted */
+	int nwin;		/* simplify: points held since the anchor */
+	double alat, alon;	/* simplify: last emitted point */
+	double wlat[SIMPLIFY_WINDOW], wlon[SIMPLIFY_WINDOW];
+	char *pending;		/* simplify: .rec line of most recent held point */
+	long dropped;		/* simplify: points discarded */
+	long emitted;		/* simplify: points returned */
 };
 
 /*
@@ -741,6 +1202,201 @@ static JsonNode *line_to_location(char *line)
 	return (o);
 }
 
+/*
+ * Turn the .rec `line' into a location object, trimmed to the requested
+ * fields, and append it to the locations array; update the counter in
+ * our JSON object.
+ */
+
+static void append_location(struct jparam *jarg, char *line)
+{
+	long counter = 0L;
+	JsonNode *j, *o;
+	JsonNode *obj	= jarg->obj;
+	JsonNode *locs	= jarg->locs;
+	JsonNode *fields = jarg->fields;
+	char *username	= jarg->username;
+	char *device	= jarg->device;
+	/* Initialize our counter to what the JSON obj currently has */
+	if ((j = json_find_member(obj, "count")) != NULL) {
+		counter = j->number_;
+		json_delete(j);
+	}
+
+	// fprintf(stderr, "-->[%s]\n", line);
+
+	if ((o = line_to_location(line)) != NULL) {
+
+		/*
+		 * Username/device are added typically for multilister() only.
+		 */
+
+		if (username)
+			json_append_member(o, "username", json_mkstring(username));
+		if (device)
+			json_append_member(o, "device", json_mkstring(device));
+
+		if (fields) {
+			/* Create a new object, copying members we're interested in into it */
+			JsonNode *f, *node;
+			JsonNode *newo = json_mkobject();
+
+			json_foreach(f, fields) {
+				char *key = f->string_;
+
+				if ((node = json_find_member(o, key)) != NULL) {
+					json_copy_element_to_object(newo, key, node);
+				}
+			}
+			json_delete(o);
+			o = newo;
+
+		}
+		json_append_element(locs, o);
+		++counter;
+	}
+
+
+	/* Add the (possibly) incremented counter back into `obj' */
+	json_append_member(obj, "count", json_mknumber(counter));
+}
+
+/*
+ * Perpendicular distance in meters of (lat, lon) from the segment
+ * (lat1, lon1) - (lat2, lon2), on an equirectangular projection
+ * around the segment's start, which is plenty for the few kilometers
+ * a track segment spans.
+ */
+
+static double segment_dist(double lat, double lon, double lat1, double lon1, double lat2, double lon2)
+{
+	double k = cos(lat1 * M_PI / 180.0) * M_PI / 180.0 * EARTH_RADIUS_M;
+	double m = M_PI / 180.0 * EARTH_RADIUS_M;
+	double x = (lon - lon1) * k, y = (lat - lat1) * m;
+	double dx = (lon2 - lon1) * k, dy = (lat2 - lat1) * m;
+	double len2 = dx * dx + dy * dy, t;
+
+	if (len2 == 0.0)
+		return (sqrt(x * x + y * y));
+
+	t = (x * dx + y * dy) / len2;
+	if (t < 0.0) t = 0.0;
+	if (t > 1.0) t = 1.0;
+	x -= t * dx;
+	y -= t * dy;
+	return (sqrt(x * x + y * y));
+}
+
+/*
+ * Extract lat and lon from a .rec location line without the expense of
+ * line_to_location(). Returns FALSE if it isn't a location.
+ */
+
+static int line_latlon(char *line, double *lat, double *lon)
+{
+	JsonNode *o, *j;
+	char *bp;
+	int rc = FALSE;
+
+	if ((bp = strchr(line, '{')) == NULL || (o = json_decode(bp)) == NULL)
+		return (FALSE);
+
+	if ((j = json_find_member(o, "_type")) != NULL && j->tag == JSON_STRING &&
+		strcmp(j->string_, "location") == 0) {
+		*lat = number(o, "lat");
+		*lon = number(o, "lon");
+		rc = TRUE;
+	}
+	json_delete(o);
+	return (rc);
+}
+
+static int outside_bbox(struct jparam *jarg, char *line)
+{
+	double lat, lon;
+
+	if (jarg->bbox == NULL)
+		return (FALSE);
+
+	return (!line_latlon(line, &lat, &lon) || !bbox_contains(jarg->bbox, lat, lon));
+}
+
+/*
+ * Streaming line simplification ("opening window" Douglas-Peucker):
+ * starting at an emitted anchor, points are held back for as long as
+ * each of them lies within jarg->simplify meters of the straight line
+ * from the anchor to the newest point. When the newest point would
+ * violate that, the point before it is emitted and becomes the new
+ * anchor. Only emitted points are turned into location objects, so
+ * discarded points never pay for reverse-geo and timezone enrichment.
+ * The window is bounded; simplify_flush() emits the last held point.
+ * simplify_line() returns 1 only for a line which results in a point
+ * being emitted, so that a `limit' counts points returned.
+ */
+
+static int simplify_flush(struct jparam *jarg)
+{
+	int emitted = FALSE;
+
+	if (jarg->pending) {
+		append_location(jarg, jarg->pending);
+		free(jarg->pending);
+		jarg->pending = NULL;
+		jarg->emitted++;
+		emitted = TRUE;
+	}
+	jarg->nwin = 0;
+	return (emitted);
+}
+
+static int simplify_line(struct jparam *jarg, char *line)
+{
+	double lat, lon;
+	int n, keep = FALSE, emitted = FALSE;
+
+	if (!line_latlon(line, &lat, &lon))
+		return (0);
+
+	if (!jarg->anchored) {
+		/* first point is always emitted and anchors the window */
+		append_location(jarg, line);
+		jarg->alat = lat;
+		jarg->alon = lon;
+		jarg->anchored = TRUE;
+		jarg->emitted++;
+		return (1);
+	}
+
+	if (jarg->nwin >= SIMPLIFY_WINDOW) {
+		keep = TRUE;
+	} else {
+		for (n = 0; n < jarg->nwin; n++) {
+			if (segment_dist(jarg->wlat[n], jarg->wlon[n], jarg->alat, jarg->alon, lat, lon) > jarg->simplify) {
+				keep = TRUE;
+				break;
+			}
+		}
+	}
+
+	if (keep) {
+		/* previous point becomes the new anchor */
+		jarg->alat = jarg->wlat[jarg->nwin - 1];
+		jarg->alon = jarg->wlon[jarg->nwin - 1];
+		emitted = simplify_flush(jarg);
+	} else if (jarg->pending) {
+		free(jarg->pending);
+		jarg->pending = NULL;
+		jarg->dropped++;
+	}
+
+	jarg->wlat[jarg->nwin] = lat;
+	jarg->wlon[jarg->nwin] = lon;
+	jarg->nwin++;
+	jarg->pending = strdup(line);
+	return (emitted ? 1 : 0);
+}
+
+
 /*
  * Invoked via tac() and cat(). Verify that line is indeed a location
  * line from a .rec file. Then objectorize it and add to the locations
@@ -750,8 +1406,6 @@ static JsonNode *line_to_location(char *line)
 
 static int candidate_line(char *line, void *param)
 {
-	long counter = 0L;
-	JsonNode *j, *o;
 	struct jparam *jarg = (struct jparam*)param;
 	char *bp;
 	JsonNode *obj	= jarg->obj;
@@ -759,10 +1413,7 @@ static int candidate_line(char *line, void *param)
 	int limit	= jarg->limit;
 	time_t s_lo	= jarg->s_lo;
 	time_t s_hi	= jarg->s_hi;
-	JsonNode *fields = jarg->fields;
 	output_type otype = jarg->otype;
-	char *username	= jarg->username;
-	char *device	= jarg->device;
 
 	if (obj == NULL || obj->tag != JSON_OBJECT)
 		return (-1);
@@ -780,16 +1431,16 @@ static int candidate_line(char *line, void *param)
 			fprintf(stderr, "invalid strptime format on %s", line);
 			return (0);
 		}
-		tmline.tm_isdst = -1; 		/* A negative value for tm_isdst causes
-						 * the mktime() function to attempt to
-						 * divine whether summer time is in
-						 * effect for the specified time. */
-		secs = local2gmt(mktime(&tmline));
+		secs = timegm(&tmline);		/* .rec times are UTC */
 
 		if (secs <= s_lo || secs >= s_hi) {
 			return (0);
 		}
 
+		if (outside_bbox(jarg, line)) {
+			return (0);
+		}
+
 		if (otype == RAW) {
 			printf("%s\n", line);
 			return (0);
@@ -802,6 +1453,9 @@ static int candidate_line(char *line, void *param)
 		}
 
 	} else if (limit > 0 && otype == RAW) {
+		if (outside_bbox(jarg, line)) {
+			return (0);
+		}
 		printf("%s\n", line);
 		return (1); /* make it 'count' or tac() will not decrement line counter and continue until EOF */
 	} else if (limit > 0) {
@@ -815,12 +1469,15 @@ static int candidate_line(char *line, void *param)
 			fprintf(stderr, "invalid strptime format on %s", line);
 			return (0);
 		}
-		tmline.tm_isdst = -1;
-		secs = local2gmt(mktime(&tmline));
+		secs = timegm(&tmline);
 
 		if (secs <= s_lo || secs >= s_hi) {
 			return (0);
 		}
+
+		if (outside_bbox(jarg, line)) {
+			return (0);
+		}
 	}
 
 	/* Do we have location line? */
@@ -832,83 +1489,452 @@ static int candidate_line(char *line, void *param)
 		return (0);
 	}
 
-	/* Initialize our counter to what the JSON obj currently has */
-	if ((j = json_find_member(obj, "count")) != NULL) {
-		counter = j->number_;
-		json_delete(j);
+	if (jarg->simplify > 0.0) {
+		return (simplify_line(jarg, line));
+	}
+
+	append_location(jarg, line);
+	return (1);
+}
+
+/*
+ * Read the file at `filename' (- is stdin) and store location
+ * objects at the JSON array `arr`. `obj' is a JSON object which
+ * contains `arr'.
+ * If limit is zero, we're going forward, else backwards.
+ * Fields, if not NULL, is a JSON array of desired element names.
+ *
+ * If username & device are not NULL, populate the JSON locations
+ * with them for multilister().
+ *
+ * If simplify is > 0, points deviating less than that many meters
+ * from the simplified track are dropped; their number is accumulated
+ * in `simplified' in obj.
+ *
+ * If bbox is not NULL, only locations within it are returned; when
+ * reading forward, the file's spatial index (if any) restricts reading
+ * to the parts of the file which can contain such locations.
+ */
+
+void locations(char *filename, JsonNode *obj, JsonNode *arr, time_t s_lo, time_t s_hi, output_type otype, int limit, JsonNode *fields, char *username, char *device, double simplify, struct bbox *bbox)
+{
+	struct jparam jarg;
+	JsonNode *j;
+
+	if (obj == NULL || obj->tag != JSON_OBJECT)
+		return;
+
+	memset(&jarg, 0, sizeof(jarg));
+	jarg.obj	= obj;
+	jarg.locs	= arr;
+	jarg.s_lo	= s_lo;
+	jarg.s_hi	= s_hi;
+	jarg.otype	= otype;
+	jarg.limit	= limit;
+	jarg.fields	= fields;
+	jarg.username	= username;
+	jarg.device	= device;
+	jarg.simplify	= (otype == RAW) ? 0.0 : simplify;
+	jarg.bbox	= bbox;
+
+	if (limit == 0) {
+		if (bbox == NULL || spidx_scan(filename, bbox, s_lo, s_hi, candidate_line, &jarg) == -1)
+			cat(filename, candidate_line, &jarg);
+	} else {
+		tac(filename, limit, candidate_line, &jarg);
+	}
+
+	if (jarg.simplify > 0.0) {
+		/* the held point is only returned if there's room for it */
+		if (limit == 0 || jarg.emitted < limit)
+			simplify_flush(&jarg);
+		free(jarg.pending);
+
+		if ((j = json_find_member(obj, "simplified")) != NULL) {
+			jarg.dropped += j->number_;
+			json_delete(j);
+		}
+		json_append_member(obj, "simplified", json_mknumber(jarg.dropped));
+	}
+}
+
+/*
+ * The lines of one user/device's .rec files between s_lo and s_hi, one
+ * at a time, oldest first or, if `reverse', newest first; an input of
+ * merged_locations().
+ */
+
+struct mstream {
+	int n;				/* position in udpairs */
+	char *user, *device;
+	JsonNode *files;		/* from lister() */
+	JsonNode *f;			/* file being read */
+	FILE *fp;
+	int reverse;
+	off_t pos;			/* offset `line' was read from */
+	time_t secs;			/* time of `line' */
+	char line[LINESIZE];
+};
+
+static void mstream_free(struct mstream *ms)
+{
+	if (ms->fp)
+		fclose(ms->fp);
+	json_delete(ms->files);
+	free(ms->user);
+	free(ms->device);
+	free(ms);
+}
+
+/*
+ * Read the next line within s_lo and s_hi into ms->line; lines without
+ * a time are skipped, as candidate_line() does. Returns 0 at the end.
+ */
+
+static int mstream_next(struct mstream *ms, time_t s_lo, time_t s_hi)
+{
+	struct tm tmline;
+	char *bp;
+
+	while (ms->f != NULL) {
+		if (ms->fp == NULL) {
+			if ((ms->fp = fopen(ms->f->string_, "r")) == NULL) {
+				ms->f = ms->f->next;
+				continue;
+			}
+			if (ms->reverse)
+				fseek(ms->fp, 0, SEEK_END);
+		}
+		ms->pos = ftello(ms->fp);
+		if ((ms->reverse ? tac_gets(ms->line, sizeof(ms->line), ms->fp) :
+		    fgets(ms->line, sizeof(ms->line), ms->fp)) == NULL) {
+			fclose(ms->fp);
+			ms->fp = NULL;
+			ms->f = ms->f->next;
+			continue;
+		}
+		if ((bp = strchr(ms->line, '\n')) != NULL)
+			*bp = 0;
+
+		if (my_strptime(ms->line, "%Y-%m-%dT%H:%M:%SZ", &tmline) == NULL)
+			continue;
+		ms->secs = timegm(&tmline);
+		if (ms->secs > s_lo && ms->secs < s_hi)
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Position `ms' at the line the previous page stopped before, as noted
+ * in the cursor: its .rec file (by name), offset and time. Returns 1 if
+ * positioned, 0 if the cursor has nothing for `ms' (it was exhausted),
+ * and -1 if the line isn't there any more.
+ */
+
+static int mstream_resume(struct mstream *ms, JsonNode *at, time_t s_lo, time_t s_hi)
+{
+	char file[64], *bp;
+	long long pos;
+	long secs;
+
+	if (at == NULL)
+		return (0);
+	if (at->tag != JSON_STRING || sscanf(at->string_, "%63[^\t]\t%lld\t%ld", file, &pos, &secs) != 3)
+		return (-1);
+
+	for (; ms->f != NULL; ms->f = ms->f->next) {
+		if ((bp = strrchr(ms->f->string_, '/')) != NULL && strcmp(bp + 1, file) == 0)
+			break;
 	}
+	if (ms->f == NULL || (ms->fp = fopen(ms->f->string_, "r")) == NULL)
+		return (-1);
+	if (fseeko(ms->fp, (off_t)pos, SEEK_SET) != 0)
+		return (-1);
+	if (!mstream_next(ms, s_lo, s_hi) || ms->pos != (off_t)pos || ms->secs != secs)
+		return (-1);
+	return (1);
+}
+
+/*
+ * A cursor is the direction and, for each device not yet exhausted,
+ * where its next line is; hex-encoded, as it travels in URLs.
+ */
+
+static void cursor_encode(struct mstream **heap, int nheap, UT_string *cursor)
+{
+	static __thread UT_string *text = NULL;
+	unsigned char *bp;
+	int i;
 
-	// fprintf(stderr, "-->[%s]\n", line);
+	utstring_renew(text);
+	utstring_printf(text, "%c\n", heap[0]->reverse ? 'd' : 'a');
+	for (i = 0; i < nheap; i++) {
+		char *file = strrchr(heap[i]->f->string_, '/');
 
-	if ((o = line_to_location(line)) != NULL) {
+		utstring_printf(text, "%s/%s\t%s\t%lld\t%ld\n",
+			heap[i]->user, heap[i]->device,
+			file ? file + 1 : heap[i]->f->string_,
+			(long long)heap[i]->pos, (long)heap[i]->secs);
+	}
 
-		/*
-		 * Username/device are added typically for multilister() only.
-		 */
+	utstring_clear(cursor);
+	for (bp = (unsigned char *)UB(text); *bp; bp++)
+		utstring_printf(cursor, "%02x", *bp);
+}
 
-		if (username)
-			json_append_member(o, "username", json_mkstring(username));
-		if (device)
-			json_append_member(o, "device", json_mkstring(device));
+/*
+ * Decode `cursor' into an object keyed by "user/device". Returns NULL if
+ * it isn't one for direction `reverse'.
+ */
 
-		if (fields) {
-			/* Create a new object, copying members we're interested in into it */
-			JsonNode *f, *node;
-			JsonNode *newo = json_mkobject();
+static JsonNode *cursor_decode(char *cursor, int reverse)
+{
+	JsonNode *at;
+	char *text, *line, *tab, *save;
+	size_t len = strlen(cursor), i;
+	unsigned int c;
 
-			json_foreach(f, fields) {
-				char *key = f->string_;
+	if (len < 4 || len % 2 || (text = malloc(len / 2 + 1)) == NULL)
+		return (NULL);
+	for (i = 0; i < len / 2; i++) {
+		if (!isxdigit((unsigned char)cursor[2 * i]) || !isxdigit((unsigned char)cursor[2 * i + 1]) ||
+		    sscanf(cursor + 2 * i, "%2x", &c) != 1 || c == 0) {
+			free(text);
+			return (NULL);
+		}
+		text[i] = c;
+	}
+	text[i] = 0;
 
-				if ((node = json_find_member(o, key)) != NULL) {
-					json_copy_element_to_object(newo, key, node);
-				}
-			}
-			json_delete(o);
-			o = newo;
+	if (text[0] != (reverse ? 'd' : 'a') || text[1] != '\n') {
+		free(text);
+		return (NULL);
+	}
 
+	at = json_mkobject();
+	for (line = strtok_r(text + 2, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if ((tab = strchr(line, '\t')) == NULL) {
+			json_delete(at);
+			at = NULL;
+			break;
 		}
-		json_append_element(locs, o);
-		++counter;
+		*tab = 0;
+		json_append_member(at, line, json_mkstring(tab + 1));
 	}
+	free(text);
+	return (at);
+}
 
+/* Does `a' come before `b'? Streams are merged in order of their lines' times. */
 
-	/* Add the (possibly) incremented counter back into `obj' */
-	json_append_member(obj, "count", json_mknumber(counter));
-	return (1);
+static int mstream_before(struct mstream *a, struct mstream *b)
+{
+	if (a->secs != b->secs)
+		return (a->reverse ? a->secs > b->secs : a->secs < b->secs);
+	return (a->n < b->n);
+}
+
+static void heap_down(struct mstream **heap, int nheap, int i)
+{
+	struct mstream *ms = heap[i];
+	int c;
+
+	while ((c = 2 * i + 1) < nheap) {
+		if (c + 1 < nheap && mstream_before(heap[c + 1], heap[c]))
+			c++;
+		if (!mstream_before(heap[c], ms))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = ms;
 }
 
 /*
- * Read the file at `filename' (- is stdin) and store location
- * objects at the JSON array `arr`. `obj' is a JSON object which
- * contains `arr'.
- * If limit is zero, we're going forward, else backwards.
- * Fields, if not NULL, is a JSON array of desired element names.
+ * Like locations(), for all the user/device pairs in `udpairs' (see
+ * multilister()) at once: their .rec files are read side by side and
+ * the lines merged in the order they were recorded, oldest first or, if
+ * `reverse', newest first, holding one line per device. Locations get
+ * username and device. If `limit' is positive, reading stops as soon as
+ * that many locations (or lines, for RAW) have been returned.
  *
- * If username & device are not NULL, populate the JSON locations
- * with them for multilister().
+ * If `next' isn't NULL and reading stopped short of the end, it gets a
+ * cursor, which, passed back as `cursor' with the same arguments,
+ * continues right where this call stopped: each device's .rec file is
+ * entered at the offset noted, without reading it from the start.
+ * Returns the number of locations returned, or -1 if `cursor' is invalid
+ * (or its lines have since been removed).
  */
 
-void locations(char *filename, JsonNode *obj, JsonNode *arr, time_t s_lo, time_t s_hi, output_type otype, int limit, JsonNode *fields, char *username, char *device)
+long merged_locations(JsonNode *udpairs, JsonNode *obj, JsonNode *arr, time_t s_lo, time_t s_hi, output_type otype, int limit, int reverse, JsonNode *fields, struct bbox *bbox, char *cursor, UT_string *next)
 {
+	struct mstream **heap, *ms;
 	struct jparam jarg;
+	JsonNode *ud, *res, *at = NULL;
+	char *pairs[3], key[BUFSIZ];
+	int nheap = 0, max = 0, i, rc, full = FALSE;
+	long count = 0;
 
+	if (next)
+		utstring_clear(next);
 	if (obj == NULL || obj->tag != JSON_OBJECT)
-		return;
+		return (0);
+	if (udpairs == NULL || udpairs->tag != JSON_ARRAY)
+		return (0);
+	if (cursor && (at = cursor_decode(cursor, reverse)) == NULL)
+		return (-1);
+
+	json_foreach(ud, udpairs)
+		max++;
+	if (max == 0 || (heap = calloc(max, sizeof(struct mstream *))) == NULL) {
+		json_delete(at);
+		return (0);
+	}
+
+	json_foreach(ud, udpairs) {
+		if (splitter(ud->string_, "/", pairs) != 2) {
+			continue;
+		}
+		if ((ms = calloc(1, sizeof(struct mstream))) == NULL) {
+			splitterfree(pairs);
+			break;
+		}
+		ms->n		= nheap;
+		ms->user	= strdup(pairs[0]);
+		ms->device	= strdup(pairs[1]);
+		ms->reverse	= reverse;
+		splitterfree(pairs);
+
+		if (ms->user && ms->device)
+			ms->files = lister(ms->user, ms->device, s_lo, s_hi, reverse);
+		if (ms->files && (res = json_find_member(ms->files, "results")) != NULL)
+			ms->f = json_first_child(res);
+
+		if (at != NULL) {
+			/* lister() has lowercased the names, as in the cursor */
+			snprintf(key, sizeof(key), "%s/%s", ms->user, ms->device);
+			rc = mstream_resume(ms, json_find_member(at, key), s_lo, s_hi);
+		} else {
+			rc = mstream_next(ms, s_lo, s_hi);
+		}
+
+		if (rc == 1) {
+			heap[nheap++] = ms;
+		} else {
+			mstream_free(ms);
+			if (rc == -1) {
+				count = -1;
+				goto out;
+			}
+		}
+	}
+	for (i = nheap / 2 - 1; i >= 0; i--)
+		heap_down(heap, nheap, i);
 
+	memset(&jarg, 0, sizeof(jarg));
 	jarg.obj	= obj;
 	jarg.locs	= arr;
 	jarg.s_lo	= s_lo;
 	jarg.s_hi	= s_hi;
 	jarg.otype	= otype;
-	jarg.limit	= limit;
 	jarg.fields	= fields;
-	jarg.username	= username;
-	jarg.device	= device;
+	jarg.bbox	= bbox;
 
-	if (limit == 0) {
-		cat(filename, candidate_line, &jarg);
-	} else {
-		tac(filename, limit, candidate_line, &jarg);
+	while (nheap > 0 && !full) {
+		ms = heap[0];
+		jarg.username	= ms->user;
+		jarg.device	= ms->device;
+
+		/* RAW lines are printed, not returned, by candidate_line() */
+		rc = candidate_line(ms->line, &jarg);
+		if (rc == -1)
+			break;
+		if (otype == RAW ? !outside_bbox(&jarg, ms->line) : rc == 1) {
+			full = (++count == limit);
+		}
+
+		if (!mstream_next(ms, s_lo, s_hi)) {
+			mstream_free(ms);
+			heap[0] = heap[--nheap];
+		}
+		if (nheap > 0)
+			heap_down(heap, nheap, 0);
+	}
+
+	if (full && nheap > 0 && next != NULL)
+		cursor_encode(heap, nheap, next);
+
+    out:
+	for (i = 0; i < nheap; i++)
+		mstream_free(heap[i]);
+	free(heap);
+	json_delete(at);
+	return (count);
+}
+
+/*
+ * Return a JSON array with a "user/device" string, as merged_locations()
+ * takes, for each of `user''s devices.
+ */
+
+JsonNode *user_devices(char *user)
+{
+	JsonNode *json, *arr, *d, *udpairs = json_mkarray();
+	static __thread UT_string *pair = NULL;
+
+	if ((json = lister(user, NULL, 0, 0, FALSE)) != NULL) {
+		if ((arr = json_find_member(json, "results")) != NULL) {
+			json_foreach(d, arr) {
+				utstring_renew(pair);
+				utstring_printf(pair, "%s/%s", user, d->string_);
+				json_append_element(udpairs, json_mkstring(UB(pair)));
+			}
+		}
+		json_delete(json);
+	}
+	return (udpairs);
+}
+
+/*
+ * Thin the locations array `arr' to at most `maxpoints' elements,
+ * evenly spaced, always keeping the first and the last. The counter
+ * in `obj' (which may be NULL) is adjusted.
+ */
+
+void locations_decimate(JsonNode *obj, JsonNode *arr, int maxpoints)
+{
+	JsonNode *e, *next, *j;
+	long n = 0, total = 0, kept = 0, want = 0;
+
+	if (arr == NULL || arr->tag != JSON_ARRAY || maxpoints <= 0)
+		return;
+
+	json_foreach(e, arr) {
+		total++;
+	}
+	if (total <= maxpoints)
+		return;
+
+	for (e = json_first_child(arr); e != NULL; e = next, n++) {
+		next = e->next;
+
+		/* index of the next element to keep */
+		if (maxpoints == 1)
+			want = 0;
+		else
+			want = (long)((double)kept * (total - 1) / (maxpoints - 1) + 0.5);
+
+		if (n == want && kept < maxpoints) {
+			kept++;
+		} else {
+			json_delete(e);
+		}
+	}
+
+	if (obj && (j = json_find_member(obj, "count")) != NULL) {
+		json_delete(j);
+		json_append_member(obj, "count", json_mknumber(kept));
 	}
 }
 
@@ -1120,23 +2146,139 @@ JsonNode *geo_linestring(JsonNode *location_array)
 }
 
 /*
- * Turn our JSON location array into a GPX XML string.
+ * Append to `track' the location lines written to the .rec file at
+ * `filename' since `*offset', and advance `*offset' past them; a line
+ * still being written is left for the next call. `*ino' identifies the
+ * file read from, 0 before the first call. Returns the number of points
+ * added, or -1 if the file is gone, was replaced or has shrunk, in
+ * which case the caller must start over.
  */
 
-char *gpx_string(JsonNode *location_array)
+int track_read(char *filename, ino_t *ino, off_t *offset, struct track *track)
 {
-	JsonNode *one;
-	static UT_string *xml = NULL;
+	FILE *fp;
+	struct stat sb;
+	char buf[LINESIZE], *bp;
+	struct tm tmline;
+	size_t len;
+	off_t off = *offset;
+	int n = 0, skip = FALSE;
 
-	if (location_array->tag != JSON_ARRAY)
-		return (NULL);
+	if ((fp = fopen(filename, "r")) == NULL)
+		return (-1);
+	if (fstat(fileno(fp), &sb) != 0 || (*ino && sb.st_ino != *ino) || sb.st_size < off) {
+		fclose(fp);
+		return (-1);
+	}
+	*ino = sb.st_ino;
+	if (sb.st_size == off || fseeko(fp, off, SEEK_SET) != 0) {
+		fclose(fp);
+		return (0);
+	}
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		JsonNode *o, *j, *lat, *lon;
+		struct trackpt *tp;
+
+		len = strlen(buf);
+		if (len == 0 || buf[len - 1] != '\n') {
+			if (feof(fp))
+				break;
+			/* Longer than cat() reads in one piece; ignore it */
+			off += len;
+			skip = TRUE;
+			continue;
+		}
+		off += len;
+		if (skip) {
+			skip = FALSE;
+			continue;
+		}
+		buf[len - 1] = 0;
+
+		if (strstr(buf, "Z\t* ") == NULL || (bp = strchr(buf, '{')) == NULL)
+			continue;
+		if (my_strptime(buf, "%Y-%m-%dT%H:%M:%SZ", &tmline) == NULL)
+			continue;
+
+		if ((o = json_decode(bp)) == NULL)
+			continue;
+		if ((j = json_find_member(o, "_type")) == NULL ||
+		    j->tag != JSON_STRING || strcmp(j->string_, "location") != 0 ||
+		    (lat = json_find_member(o, "lat")) == NULL ||
+		    (lon = json_find_member(o, "lon")) == NULL) {
+			json_delete(o);
+			continue;
+		}
+
+		if (track->n == track->max) {
+			size_t max = track->max ? track->max * 2 : 1024;
+
+			if ((tp = realloc(track->pts, max * sizeof(struct trackpt))) == NULL) {
+				json_delete(o);
+				break;
+			}
+			track->pts = tp;
+			track->max = max;
+		}
+		tp = &track->pts[track->n++];
+		tp->rcv		= timegm(&tmline);
+		tp->lat		= lat->number_;
+		tp->lon		= lon->number_;
+		tp->has_tst	= (j = json_find_member(o, "tst")) != NULL;
+		tp->tst		= j ? j->number_ : 0;
+		json_delete(o);
+		n++;
+	}
+	fclose(fp);
+
+	*offset = off;
+	return (n);
+}
+
+/*
+ * The GeoJSON LineString of the points in `track' written between s_lo
+ * and s_hi (exclusive, as for locations()); the same as geo_linestring()
+ * returns for the locations read from the .rec files.
+ */
+
+JsonNode *track_linestring(struct track *track, time_t s_lo, time_t s_hi)
+{
+	JsonNode *arr = json_mkarray(), *o, *top;
+	struct trackpt *tp;
+	size_t i;
+
+	for (i = 0, tp = track->pts; i < track->n; i++, tp++) {
+		if (tp->rcv <= s_lo || tp->rcv >= s_hi)
+			continue;
+		o = json_mkobject();
+		if (tp->has_tst)
+			json_append_member(o, "tst", json_mknumber(tp->tst));
+		json_append_member(o, "lat", json_mknumber(tp->lat));
+		json_append_member(o, "lon", json_mknumber(tp->lon));
+		json_append_element(arr, o);
+	}
+	top = geo_linestring(arr);
+	json_delete(arr);
+	return (top);
+}
+
+/*
+ * Write our JSON location array as GPX, a track point at a time, to
+ * `func'.
+ */
+
+void gpx_output(JsonNode *location_array, void (*func)(char *s, void *param), void *param)
+{
+	JsonNode *one;
+	static __thread UT_string *xml = NULL;
 
 	utstring_renew(xml);
 
-	utstring_printf(xml, "%s", "<?xml version='1.0' encoding='UTF-8' standalone='no' ?>\n\
+	func("<?xml version='1.0' encoding='UTF-8' standalone='no' ?>\n\
 <gpx version='1.1' creator='OwnTracks-Recorder' xmlns:xsi='http://www.w3.org/2001/XMLSchema-instance' xmlns='http://www.topografix.com/GPX/1/1'>\n\
  <trk>\n\
-  <trkseg>\n");
+  <trkseg>\n", param);
 
 	// <trkpt lat="xx.xxx" lon="yy.yyy"> <!-- Attribute des Trackpunkts --> </trkpt>
 
@@ -1147,16 +2289,38 @@ char *gpx_string(JsonNode *location_array)
 			(jlon = json_find_member(one, "lon")) &&
 			(jisotst = json_find_member(one, "isotst"))) {
 
+				utstring_clear(xml);
 				utstring_printf(xml, "    <trkpt lat='%lf' lon='%lf'>\n", jlat->number_, jlon->number_);
 				utstring_printf(xml, "\t<time>%s</time>\n", jisotst->string_);
 				if ((j = json_find_member(one, "alt")) != NULL) {
 					utstring_printf(xml, "\t<ele>%.2f</ele>\n", j->number_);
 				}
 				utstring_printf(xml, "\t</trkpt>\n");
+				func(UB(xml), param);
 		}
 	}
 
-	utstring_printf(xml, "%s", "  </trkseg>\n</trk>\n</gpx>\n");
+	func("  </trkseg>\n</trk>\n</gpx>\n", param);
+}
+
+static void gpx_append(char *s, void *param)
+{
+	utstring_printf((UT_string *)param, "%s", s);
+}
+
+/*
+ * Turn our JSON location array into a GPX XML string.
+ */
+
+char *gpx_string(JsonNode *location_array)
+{
+	static __thread UT_string *xml = NULL;
+
+	if (location_array->tag != JSON_ARRAY)
+		return (NULL);
+
+	utstring_renew(xml);
+	gpx_output(location_array, gpx_append, xml);
 	return (UB(xml));
 }
 
@@ -1174,7 +2338,7 @@ static int kill_datastore_filter(const struct dirent *d)
 
 JsonNode *kill_datastore(char *user, char *device)
 {
-	static UT_string *path = NULL, *fname = NULL;
+	static __thread UT_string *path = NULL, *fname = NULL;
 	JsonNode *obj = json_mkobject(), *killed = json_mkarray();
 	char *bp;
 	struct dirent **namelist;
@@ -1360,7 +2524,7 @@ JsonNode *kill_datastore(char *user, char *device)
 
 static void emit_one(JsonNode *j, JsonNode *inttypes, void (func)(char *line, void *param), void *param)
 {
-	static UT_string *line = NULL;
+	static __thread UT_string *line = NULL;
 
 	if (!strcmp(j->key, "_type"))
 		return;
@@ -1492,7 +2656,7 @@ void csv_output(JsonNode *array, output_type otype, JsonNode *fields, void (*fun
 	JsonNode *node, *inttypes;
 	JsonNode *one, *j;
 	short virgin = 1;
-	static UT_string *line = NULL;
+	static __thread UT_string *line = NULL;
 
 	utstring_renew(line);
 
@@ -1553,7 +2717,7 @@ void csv_output(JsonNode *array, output_type otype, JsonNode *fields, void (*fun
 
 char *storage_userphoto(char *username)
 {
-	static char path[LARGEBUF];
+	static __thread char path[LARGEBUF];
 
 	if (!username || !*username)
 		return (NULL);
@@ -1612,25 +2776,65 @@ void extra_http_json(JsonNode *array, char *user, char *device)
 	free(js_string);
 }
 
+/*
+ * The keys and values to be stored for a set of waypoints.
+ */
+
+struct wpents {
+	int n, max;
+	char **kv;			/* key, value, key, value, ... */
+};
+
+static void wpents_add(struct wpents *we, char *key, char *value)
+{
+	char **kv;
+
+	if (we->n + 2 > we->max) {
+		int max = we->max ? we->max * 2 : 32;
+
+		if ((kv = realloc(we->kv, max * sizeof(char *))) == NULL) {
+			free(key);
+			free(value);
+			return;
+		}
+		we->kv = kv;
+		we->max = max;
+	}
+	we->kv[we->n++] = key;
+	we->kv[we->n++] = value;
+}
+
+static void wpents_free(struct wpents *we)
+{
+	int i;
+
+	for (i = 0; i < we->n; i++)
+		free(we->kv[i]);
+	free(we->kv);
+	memset(we, 0, sizeof(*we));
+}
+
 /*
  * Process an array of waypoints as read from an .otrw file. If
- * rad is positive and lat/lon exist, store in LMDB database for
- * this user.
+ * rad is positive and lat/lon exist, add them to `we' to be stored
+ * in the LMDB database for this user.
  */
 
-static bool load_otrw_waypoints(struct udata *ud, JsonNode *wplist, char *user, char *device)
+static bool otrw_waypoints(JsonNode *wplist, char *user, char *device, struct wpents *we)
 {
 	JsonNode *n;
-	static UT_string *key;
+	UT_string *key = NULL;
+	char *gh, *js;
 
+	utstring_new(key);
 	json_foreach(n, wplist) {
 		JsonNode *rad, *lat, *lon, *desc, *tst, *type;
 
 		if ((type = json_find_member(n, "_type")) == NULL)
-			return (false);
+			break;
 
 		if (strcmp(type->string_, "waypoint") != 0)
-			return (false);
+			break;
 
 		json_delete(type);
 
@@ -1649,27 +2853,36 @@ static bool load_otrw_waypoints(struct udata *ud, JsonNode *wplist, char *user,
 
 		json_delete(tst);
 
-		utstring_renew(key);
-		utstring_printf(key, "%s-%s-%s", user, device,
-			geohash_encode(lat->number_, lon->number_, 10));
+		if ((gh = geohash_encode(lat->number_, lon->number_, 10)) == NULL)
+			continue;
+		utstring_clear(key);
+		utstring_printf(key, "%s-%s-%s", user, device, gh);
+		free(gh);
 
 		olog(LOG_DEBUG, "--> %s: %s\t(%lf, %lf) (%ld)", UB(key), desc->string_, lat->number_, lon->number_, (long)rad->number_);
 
-		/*
-		 * Just before initially storing in LMDB, we need to determine whether
-		 * device is currently within or without a waypoint...
-		 */
+		/* Clobber existing record b/c desc might have changed (#171) */
+		if ((js = json_stringify(n, NULL)) != NULL)
+			wpents_add(we, strdup(UB(key)), js);
+	}
+	utstring_free(key);
 
-		/* Note: we don't need buf -- just checking if key exists */
-		// len = gcache_get(ud->wpdb, UB(key), buf, sizeof(buf));
-		// if (len == -1) {
-		// }
+	return (n == NULL);
+}
 
-		/* Clobber existing record b/c desc might have changed (#171) */
-		gcache_json_put(ud->wpdb, UB(key), n);
+static bool load_otrw_waypoints(struct udata *ud, JsonNode *wplist, char *user, char *device)
+{
+	struct wpents we = { 0, 0, NULL };
+	bool ok;
+	int i;
+
+	ok = otrw_waypoints(wplist, user, device, &we);
+	for (i = 0; i < we.n; i += 2) {
+		gcache_put(ud->wpdb, we.kv[i], we.kv[i + 1]);
 	}
+	wpents_free(&we);
 
-	return (true);
+	return (ok);
 }
 
 void load_otrw_from_string(struct udata *ud, char *username, char *device, char *js_string)
@@ -1688,19 +2901,43 @@ void load_otrw_from_string(struct udata *ud, char *username, char *device, char
 	json_delete(node);
 }
 
-static int load_otrw_file(struct udata *ud, char *filename)
+/*
+ * Waypoint files are loaded at startup. The wp database holds an entry
+ * for each, keyed on a slash and the file's path below waypoints/
+ * (no user-device key begins with one), with the modification time
+ * and size the file had when it was loaded; files unchanged since then
+ * aren't read again. The others are parsed by up to OTRW_WORKERS
+ * threads, and all they contain is put in a single transaction.
+ */
+
+#define OTRW_WORKERS	4
+
+struct otrw {
+	char *path;
+	char sig[64];			/* modification time and size */
+	bool ok;
+	struct wpents we;
+};
+
+struct otrw_pool {
+	struct otrw **files;
+	int n, next;
+	pthread_mutex_t mutex;
+};
+
+static void otrw_parse(struct otrw *o)
 {
-	char *js_string, *bp, *parts[20], *user, *device;
+	char *js_string, *bp, *parts[20];
 	JsonNode *node, *wplist;
 
-	if ((js_string = slurp_file(filename, TRUE)) == NULL) {
-		return (false);
+	if ((js_string = slurp_file(o->path, TRUE)) == NULL) {
+		return;
 	}
 
 	if ((node = json_decode(js_string)) == NULL) {
-		olog(LOG_ERR, "load_otrw_file: can't decode JSON from file s\n", filename);
+		olog(LOG_ERR, "load_otrw_file: can't decode JSON from file %s\n", o->path);
 		free(js_string);
-		return (false);
+		return;
 	}
 
 	/*
@@ -1708,44 +2945,142 @@ static int load_otrw_file(struct udata *ud, char *filename)
 	 * path (i.e. "/user-device.otrw").
 	 */
 
-	if ((bp = strrchr(filename, '/')) == NULL)
-		return (false);
-	if (splitter(bp+1, "-.", parts) != 3)
-		return (false);
-
-	user = parts[0];
-	device = parts[1];
-
-	if ((wplist = json_find_member(node, "waypoints"))) {
-		load_otrw_waypoints(ud, wplist, user, device);
+	if ((bp = strrchr(o->path, '/')) != NULL && splitter(bp+1, "-.", parts) == 3) {
+		if ((wplist = json_find_member(node, "waypoints"))) {
+			otrw_waypoints(wplist, parts[0], parts[1], &o->we);
+		}
+		splitterfree(parts);
+		o->ok = true;
 	}
 
-	splitterfree(parts);
 	free(js_string);
 	json_delete(node);
+}
+
+static void *otrw_worker(void *arg)
+{
+	struct otrw_pool *pool = (struct otrw_pool *)arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mutex);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->mutex);
+		if (i >= pool->n)
+			break;
+		otrw_parse(pool->files[i]);
+	}
+	return (NULL);
+}
 
-	return (true);
+static void otrw_parse_all(struct otrw **files, int n)
+{
+	struct otrw_pool pool;
+	pthread_t tids[OTRW_WORKERS];
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nworkers = OTRW_WORKERS, i, started = 0;
+
+	if (ncpu > 0 && ncpu < nworkers)
+		nworkers = ncpu;
+	if (n < nworkers)
+		nworkers = n;
+
+	pool.files = files;
+	pool.n = n;
+	pool.next = 0;
+	pthread_mutex_init(&pool.mutex, NULL);
+
+	for (i = 1; i < nworkers; i++) {
+		if (pthread_create(&tids[started], NULL, otrw_worker, &pool) == 0)
+			started++;
+	}
+	otrw_worker(&pool);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&pool.mutex);
 }
 
 bool load_fences(struct udata *ud)
 {
 	static UT_string *path = NULL;
-	int n, rc;
+	struct otrw *o, **changed;
+	struct stat sb;
+	char sig[64], *mkey;
+	int n, nchanged = 0, i, rc;
+	size_t plen;
 	glob_t results;
+	MDB_txn *txn;
 
 	/* Get list of waypoint files */
 	utstring_renew(path);
 	utstring_printf(path, "%s/waypoints/*/*/*.otrw", STORAGEDIR);
 	rc = glob(UB(path), 0, 0, &results);
-	if (rc == 0) {
+	if (rc != 0 || ud->wpdb == NULL) {
+		globfree(&results);
+		return (true);
+	}
 
-		for (n = 0; n < results.gl_pathc; n++) {
-			char *f = results.gl_pathv[n];
+	if ((txn = gcache_txn_begin(ud->wpdb)) == NULL) {
+		globfree(&results);
+		return (false);
+	}
+
+	o = calloc(results.gl_pathc, sizeof(struct otrw));
+	changed = calloc(results.gl_pathc, sizeof(struct otrw *));
+	if (o == NULL || changed == NULL) {
+		mdb_txn_abort(txn);
+		free(o);
+		free(changed);
+		globfree(&results);
+		return (false);
+	}
+
+	plen = strlen(STORAGEDIR) + strlen("/waypoints");
+	for (n = 0; n < results.gl_pathc; n++) {
+		o[n].path = results.gl_pathv[n];
+		if (stat(o[n].path, &sb) != 0)
+			continue;
+		snprintf(o[n].sig, sizeof(o[n].sig), "%lld.%09ld %lld",
+			(long long)sb.st_mtime,
+#if defined(__APPLE__)
+			(long)sb.st_mtimespec.tv_nsec,
+#else
+			(long)sb.st_mtim.tv_nsec,
+#endif
+			(long long)sb.st_size);
+
+		mkey = o[n].path + plen;
+		if ((i = gcache_txn_get(ud->wpdb, txn, mkey, sig, sizeof(sig) - 1)) > 0) {
+			sig[i] = 0;
+			if (strcmp(sig, o[n].sig) == 0)
+				continue;
+		}
+		changed[nchanged++] = &o[n];
+	}
+
+	otrw_parse_all(changed, nchanged);
 
-			load_otrw_file(ud, f);
+	/* in the order of the files, so later waypoints win as before */
+	for (n = 0; n < nchanged; n++) {
+		struct otrw *f = changed[n];
+
+		for (i = 0; i < f->we.n; i += 2) {
+			gcache_txn_put(ud->wpdb, txn, f->we.kv[i], f->we.kv[i + 1]);
+		}
+		if (f->ok) {
+			gcache_txn_put(ud->wpdb, txn, f->path + plen, f->sig);
 		}
+		wpents_free(&f->we);
 	}
+	rc = gcache_txn_commit(txn);
+
+	olog(LOG_INFO, "Waypoints: %d of %zu files loaded, the others unchanged",
+		nchanged, (size_t)results.gl_pathc);
+
+	free(changed);
+	free(o);
 	globfree(&results);
 
-	return (true);
+	return (rc == 0);
 }
@@ -2,8 +2,12 @@
 # define _STORAGE_H_INCL_
 
 #include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "json.h"
+#include "utstring.h"
 #include "udata.h"
+#include "spidx.h"
 
 #define DEFAULT_HISTORY_HOURS 6
 
@@ -43,18 +47,41 @@ typedef enum {
 	T_STATUS,
 } payload_type;
 
+/* What geo_linestring() needs of a location line in a .rec file */
+struct trackpt {
+	time_t rcv;			/* time the line was written */
+	double tst, lat, lon;
+	int has_tst;
+};
+
+struct track {
+	struct trackpt *pts;
+	size_t n, max;
+};
+
 JsonNode *lister(char *username, char *device, time_t s_lo, time_t s_hi, int reverse);
 JsonNode *multilister(JsonNode *udpairs, time_t s_lo, time_t s_hi, int reverse);
-void locations(char *filename, JsonNode *obj, JsonNode *arr, time_t s_lo, time_t s_hi, output_type otype, int limit, JsonNode *fields, char *username, char *device);
+void locations(char *filename, JsonNode *obj, JsonNode *arr, time_t s_lo, time_t s_hi, output_type otype, int limit, JsonNode *fields, char *username, char *device, double simplify, struct bbox *bbox);
+long merged_locations(JsonNode *udpairs, JsonNode *obj, JsonNode *arr, time_t s_lo, time_t s_hi, output_type otype, int limit, int reverse, JsonNode *fields, struct bbox *bbox, char *cursor, UT_string *next);
+JsonNode *user_devices(char *user);
+void locations_decimate(JsonNode *obj, JsonNode *arr, int maxpoints);
+JsonNode *summaries(char *user, char *device, time_t s_lo, time_t s_hi);
+long summaries_rebuild(char *user, char *device);
 int make_times(char *time_from, time_t *s_lo, char *time_to, time_t *s_to, int hours);
 JsonNode *geo_json(JsonNode *json, bool poi_only);
 JsonNode *geo_linestring(JsonNode *location_array);
+int track_read(char *filename, ino_t *ino, off_t *offset, struct track *track);
+JsonNode *track_linestring(struct track *track, time_t s_lo, time_t s_hi);
 JsonNode *kill_datastore(char *username, char *device);
 JsonNode *last_users(char *user, char *device, JsonNode *fields);
 char *gpx_string(JsonNode *json);
+void gpx_output(JsonNode *json, void (*func)(char *s, void *param), void *param);
 void storage_init(int revgeo);
-void storage_gcache_dump(char *lmdbname);
-void storage_gcache_load(char *lmdbname);
+void geo_collect(UT_string *notes);
+int geo_collected(UT_string *notes, uint64_t *digest, time_t *newest);
+uint64_t geo_digest(char *keys, time_t *newest);
+int storage_gcache_dump(char *lmdbname, int binary);
+int storage_gcache_load(char *lmdbname, int binary);
 void xml_output(JsonNode *json, output_type otype, JsonNode *fields, void (*func)(char *s, void *param), void *param);
 void csv_output(JsonNode *json, output_type otype, JsonNode *fields, void (*func)(char *s, void *param), void *param);
 char *storage_userphoto(char *username);
@@ -62,5 +89,10 @@ void append_card_to_object(JsonNode *obj, char *user, char *device);
 void extra_http_json(JsonNode *array, char *user, char *device);
 void load_otrw_from_string(struct udata *ud, char *username, char *device, char *js);
 bool load_fences(struct udata *ud);
+#ifdef WITH_TZ
+char *tz_lookup(double lat, double lon);
+int storage_tzgrid_build(double cellsize);
+void storage_tzgrid_bench(long count);
+#endif
 
 #endif
@@ -0,0 +1,350 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "udata.h"
+#include "fences.h"
+#include "gcache.h"
+#include "summary.h"
+#include "util.h"
+
+#define DAYSECS	(60 * 60 * 24)
+
+/*
+ * Account for a location at `tst' in `ds'. Distance is only added for
+ * locations which are newer than the last one seen for the day, so a
+ * location which arrives late (e.g. from a device's queue) is counted
+ * but doesn't zig-zag the track. Rebuilding replays the .rec file in
+ * the order it was written, which yields the same result.
+ */
+
+void daysum_add(struct daysum *ds, time_t tst, double lat, double lon, double vel)
+{
+	if (ds->count++ == 0) {
+		ds->first	= tst;
+		ds->last	= tst;
+		ds->lat		= lat;
+		ds->lon		= lon;
+	} else if (tst >= ds->last) {
+		ds->dist	+= haversine_dist(ds->lat, ds->lon, lat, lon);
+		ds->last	= tst;
+		ds->lat		= lat;
+		ds->lon		= lon;
+	} else if (tst < ds->first) {
+		ds->first	= tst;
+	}
+
+	if (!isnan(vel) && vel > ds->maxvel)
+		ds->maxvel = vel;
+}
+
+static void daykey(char *buf, size_t buflen, char *user, char *device, time_t tst)
+{
+	char day[32];
+	struct tm tm;
+
+	strftime(day, sizeof(day), "%Y-%m-%d", gmtime_r(&tst, &tm));
+	snprintf(buf, buflen, "%s/%s/%s", user, device, day);
+}
+
+/*
+ * Summaries are stored with the exact distance so that adding to them
+ * doesn't accumulate rounding; output gets whole metres.
+ */
+
+static JsonNode *daysum_to_json(struct daysum *ds, time_t tst, int stored)
+{
+	JsonNode *o = json_mkobject();
+	char day[32];
+	struct tm tm;
+
+	strftime(day, sizeof(day), "%Y-%m-%d", gmtime_r(&tst, &tm));
+	json_append_member(o, "day",	json_mkstring(day));
+	json_append_member(o, "count",	json_mknumber(ds->count));
+	json_append_member(o, "first",	json_mknumber(ds->first));
+	json_append_member(o, "last",	json_mknumber(ds->last));
+	json_append_member(o, "dist",	json_mknumber(stored ? ds->dist : round(ds->dist)));
+	json_append_member(o, "maxvel",	json_mknumber(ds->maxvel));
+	json_append_member(o, "lat",	json_mknumber(ds->lat));
+	json_append_member(o, "lon",	json_mknumber(ds->lon));
+	return (o);
+}
+
+static int daysum_get(struct gcache *gc, char *key, struct daysum *ds)
+{
+	JsonNode *o;
+	double d;
+
+	memset(ds, 0, sizeof(struct daysum));
+	if ((o = gcache_json_get(gc, key)) == NULL)
+		return (FALSE);
+
+	ds->count	= (d = number(o, "count")) > 0 ? d : 0;
+	ds->first	= number(o, "first");
+	ds->last	= number(o, "last");
+	ds->dist	= number(o, "dist");
+	ds->maxvel	= number(o, "maxvel");
+	ds->lat		= number(o, "lat");
+	ds->lon		= number(o, "lon");
+	json_delete(o);
+
+	if (ds->count == 0 || isnan(ds->dist) || isnan(ds->lat) || isnan(ds->lon)) {
+		memset(ds, 0, sizeof(struct daysum));
+		return (FALSE);
+	}
+	if (isnan(ds->maxvel))
+		ds->maxvel = 0;
+	return (TRUE);
+}
+
+/*
+ * Updates are added to copies of their days' summaries kept in memory,
+ * which summary_flush() writes out in one transaction; the recorder
+ * flushes at the end of each batch of publishes, and from its main
+ * loop once a second otherwise. A location then costs a write per
+ * second rather than a read and a write (and sync) of its own. Callers
+ * serialize these (the recorder holds its lock).
+ */
+
+#define SUMMARY_HELD	64	/* days (of devices) held between flushes */
+
+static struct heldday {
+	struct gcache *gc;
+	char key[BUFSIZ];
+	struct daysum ds;
+	time_t tst;
+} held[SUMMARY_HELD];
+
+static int nheld = 0;
+
+static int daysum_txn_put(struct gcache *gc, MDB_txn *txn, char *key, struct daysum *ds, time_t tst)
+{
+	JsonNode *o;
+	char *js;
+	int rc = 1;
+
+	o = daysum_to_json(ds, tst, TRUE);
+	if ((js = json_stringify(o, NULL)) != NULL) {
+		rc = gcache_txn_put(gc, txn, key, js);
+		free(js);
+	}
+	json_delete(o);
+	return (rc);
+}
+
+/*
+ * Add the location at `tst' to its day's summary.
+ */
+
+int summary_update(struct gcache *gc, char *user, char *device, time_t tst, double lat, double lon, double vel)
+{
+	struct heldday *h;
+	char key[BUFSIZ];
+	int n, rc = 0;
+
+	if (gc == NULL || isnan(lat) || isnan(lon))
+		return (1);
+
+	daykey(key, sizeof(key), user, device, tst);
+
+	for (n = nheld - 1; n >= 0; n--) {
+		if (held[n].gc == gc && strcmp(held[n].key, key) == 0)
+			break;
+	}
+	if (n < 0) {
+		if (nheld == SUMMARY_HELD)
+			rc = summary_flush();
+		h = &held[nheld++];
+		h->gc = gc;
+		snprintf(h->key, sizeof(h->key), "%s", key);
+		daysum_get(gc, key, &h->ds);
+	} else {
+		h = &held[n];
+	}
+	daysum_add(&h->ds, tst, lat, lon, vel);
+	h->tst = tst;
+	return (rc);
+}
+
+/*
+ * Write the summaries updated since the last flush.
+ */
+
+int summary_flush(void)
+{
+	struct gcache *gc = NULL;
+	MDB_txn *txn = NULL;
+	int n, rc = 0;
+
+	for (n = 0; n < nheld; n++) {
+		if (held[n].gc != gc) {
+			if (txn && gcache_txn_commit(txn) != 0)
+				rc = 1;
+			gc = held[n].gc;
+			if ((txn = gcache_txn_begin(gc)) == NULL)
+				rc = 1;
+		}
+		if (txn == NULL || daysum_txn_put(gc, txn, held[n].key, &held[n].ds, held[n].tst) != 0)
+			rc = 1;
+	}
+	if (txn && gcache_txn_commit(txn) != 0)
+		rc = 1;
+	nheld = 0;
+	return (rc);
+}
+
+/*
+ * Return an array with the summaries of the days between s_lo and
+ * s_hi; days without locations are omitted.
+ */
+
+JsonNode *summary_get(struct gcache *gc, char *user, char *device, time_t s_lo, time_t s_hi)
+{
+	JsonNode *arr = json_mkarray();
+	struct daysum ds;
+	char key[BUFSIZ];
+	time_t t;
+
+	if (gc == NULL)
+		return (arr);
+
+	for (t = s_lo - (s_lo % DAYSECS); t <= s_hi; t += DAYSECS) {
+		daykey(key, sizeof(key), user, device, t);
+		if (daysum_get(gc, key, &ds)) {
+			json_append_element(arr, daysum_to_json(&ds, t, FALSE));
+		}
+	}
+	return (arr);
+}
+
+/*
+ * Rebuilding replays each location line through summary_update(), at
+ * the time the recorder filed the line under (its leading timestamp,
+ * which is the location's tst or the time it arrived without one), so
+ * a location lands on the same UTC day, by the same rule, as it did
+ * when it was stored; .rec files are replayed oldest first.
+ */
+
+struct rebuild {
+	struct gcache *gc;
+	char *user, *device;
+	time_t s_hi;			/* ignore lines after this */
+};
+
+static int rebuild_line(char *line, void *param)
+{
+	struct rebuild *rb = (struct rebuild *)param;
+	JsonNode *json, *j;
+	struct tm tm;
+	time_t tst;
+	char *bp;
+	int len = 0;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(line, "%4d-%2d-%2dT%2d:%2d:%2dZ%n", &tm.tm_year, &tm.tm_mon,
+			&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &len) != 6 || len == 0)
+		return (0);
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	if ((tst = timegm(&tm)) > rb->s_hi)
+		return (0);
+
+	if ((bp = strchr(line + len, '{')) == NULL || (json = json_decode(bp)) == NULL)
+		return (0);
+
+	if ((j = json_find_member(json, "_type")) != NULL && j->tag == JSON_STRING &&
+		strcmp(j->string_, "location") == 0) {
+		summary_update(rb->gc, rb->user, rb->device, tst,
+			number(json, "lat"), number(json, "lon"), number(json, "vel"));
+	}
+
+	json_delete(json);
+	return (0);
+}
+
+/*
+ * Replay the locations in the .rec file at `recpath' up to `s_hi' into
+ * the summaries of user/device; summary_days() them first and
+ * summary_flush() when done.
+ */
+
+int summary_rebuild(struct gcache *gc, char *recpath, char *user, char *device, time_t s_hi)
+{
+	struct rebuild rb;
+
+	if (gc == NULL)
+		return (-1);
+
+	rb.gc		= gc;
+	rb.user		= user;
+	rb.device	= device;
+	rb.s_hi		= s_hi;
+	return (cat(recpath, rebuild_line, &rb) == -1 ? -1 : 0);
+}
+
+struct dropkeys {
+	char prefix[BUFSIZ];		/* "user/device/" */
+	char last[BUFSIZ];		/* key of the last day, inclusive */
+	int drop;
+	int stopped;
+	long n;
+};
+
+static int drop_key(void *arg, char *key, char *value)
+{
+	struct dropkeys *dk = (struct dropkeys *)arg;
+
+	if (strncmp(key, dk->prefix, strlen(dk->prefix)) != 0 || strcmp(key, dk->last) > 0) {
+		dk->stopped = TRUE;
+		return (GC_STOP);
+	}
+	dk->n++;
+	return (dk->drop ? GC_DELETE : GC_KEEP);
+}
+
+/*
+ * Count the stored summaries of user/device for the days up to and
+ * including that of `s_hi', deleting them if `drop' is set. Returns the
+ * number of summaries, or -1 on error.
+ */
+
+long summary_days(struct gcache *gc, char *user, char *device, time_t s_hi, int drop)
+{
+	struct dropkeys dk;
+	char pos[BUFSIZ];
+
+	if (gc == NULL)
+		return (-1);
+
+	memset(&dk, 0, sizeof(dk));
+	snprintf(dk.prefix, sizeof(dk.prefix), "%s/%s/", user, device);
+	daykey(dk.last, sizeof(dk.last), user, device, s_hi);
+	dk.drop = drop;
+
+	snprintf(pos, sizeof(pos), "%s", dk.prefix);
+	do {
+		if (gcache_sweep(gc, pos, sizeof(pos), 1000, drop_key, &dk) == -1)
+			return (-1);
+	} while (*pos && !dk.stopped);
+
+	return (dk.n);
+}
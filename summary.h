@@ -0,0 +1,33 @@
+#ifndef _SUMMARY_H_INCLUDED_
+# define _SUMMARY_H_INCLUDED_
+
+#include <time.h>
+#include "json.h"
+
+/*
+ * Daily summaries per user/device, kept in the LMDB named database
+ * `summary' under the key "user/device/YYYY-MM-DD" (UTC). They are
+ * updated as locations are stored, written out with summary_flush(),
+ * and can be recomputed from the .rec files with `ocat --summary-rebuild'.
+ */
+
+#define SUMMARY_DBNAME	"summary"
+
+struct gcache;
+
+struct daysum {
+	long count;		/* number of locations */
+	time_t first, last;	/* tst of earliest and latest location */
+	double dist;		/* metres travelled */
+	double maxvel;		/* highest reported velocity (km/h) */
+	double lat, lon;	/* position at `last' */
+};
+
+void daysum_add(struct daysum *ds, time_t tst, double lat, double lon, double vel);
+int summary_update(struct gcache *gc, char *user, char *device, time_t tst, double lat, double lon, double vel);
+int summary_flush(void);
+JsonNode *summary_get(struct gcache *gc, char *user, char *device, time_t s_lo, time_t s_hi);
+int summary_rebuild(struct gcache *gc, char *recpath, char *user, char *device, time_t s_hi);
+long summary_days(struct gcache *gc, char *user, char *device, time_t s_hi, int drop);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "utstring.h"
+#include "udata.h"
+#include "fences.h"
+#include "sweep.h"
+#include "gcache.h"
+#include "geo.h"
+#include "geohash.h"
+#include "json.h"
+#include "util.h"
+
+#define SWEEP_SLICE	500		/* entries per step */
+#define SWEEP_PAUSE	3600		/* seconds between the end of a pass and the next */
+#define SWEEP_REFRESH	4		/* lookups per step at most */
+
+static const char base32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+static long clean_age = 0L;
+static double rate = 0.0;		/* refreshes per second */
+static double tokens = 0.0;
+static time_t next = 0, last = 0, started = 0;
+static char pos[BUFSIZ];		/* where the next step starts */
+static struct sweep_stats st, pass;
+static pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct slice {
+	time_t now;
+	struct sweep_stats n;		/* counted in this step */
+	int nrefresh;
+	char refresh[SWEEP_REFRESH][64];
+};
+
+/*
+ * Entries are the JSON objects revgeo() returns, keyed on the geohash
+ * of the cell; one is expired if its `tst' is older than clean_age.
+ */
+
+static int visit(void *arg, char *key, char *value)
+{
+	struct slice *sl = (struct slice *)arg;
+	JsonNode *json, *j;
+	long tst = -1L;
+
+	if ((json = json_decode(value)) == NULL)
+		return (GC_KEEP);
+	if ((j = json_find_member(json, "tst")) != NULL && j->tag == JSON_NUMBER)
+		tst = j->number_;
+	json_delete(json);
+
+	if (tst < 0 || sl->now - tst <= clean_age)
+		return (GC_KEEP);
+
+	if (rate == 0.0) {
+		sl->n.evicted++;
+		return (GC_DELETE);
+	}
+
+	/*
+	 * Refresh it, unless the cell can't be decoded. If we may not look
+	 * up another one now, end the slice here so that this entry is
+	 * the first of the next.
+	 */
+
+	if (strlen(key) >= sizeof(sl->refresh[0]) || key[strspn(key, base32)] != 0)
+		return (GC_KEEP);
+	if (sl->nrefresh == SWEEP_REFRESH || tokens < 1.0)
+		return (GC_STOP);
+	tokens -= 1.0;
+	strcpy(sl->refresh[sl->nrefresh++], key);
+	return (GC_KEEP);
+}
+
+/*
+ * Look up the centre of the cell again and replace the entry. This
+ * uses the same (not thread-safe) lookup as handle_message(), hence
+ * the lock.
+ */
+
+static void refresh(struct udata *ud, struct slice *sl, char *key)
+{
+	static UT_string *addr = NULL, *cc = NULL;
+	GeoCoord g = geohash_decode(key);
+	JsonNode *geo;
+
+#ifdef WITH_HTTP
+	pthread_mutex_lock(&ud->lock);
+#endif
+	utstring_renew(addr);
+	utstring_renew(cc);
+	if ((geo = revgeo(ud, g.latitude, g.longitude, addr, cc)) != NULL &&
+		json_find_member(geo, "tst") != NULL) {
+		gcache_json_put(ud->gc, key, geo);
+		sl->n.refreshed++;
+	} else {
+		sl->n.failed++;
+	}
+#ifdef WITH_HTTP
+	pthread_mutex_unlock(&ud->lock);
+#endif
+
+	if (geo)
+		json_delete(geo);
+}
+
+/*
+ * `refresh_per_hour' entries at most are looked up again; with 0 (or
+ * without a geocoder), expired entries are deleted.
+ */
+
+void sweep_init(long age, long refresh_per_hour)
+{
+	clean_age = age;
+	rate = refresh_per_hour > 0 ? refresh_per_hour / 3600.0 : 0.0;
+	tokens = 0.0;
+	next = last = 0;
+	*pos = 0;
+}
+
+/*
+ * Called from the main loop; does at most one slice per second.
+ */
+
+void sweep_step(struct udata *ud)
+{
+	struct slice sl;
+	time_t now = time(0);
+	int n, i;
+
+	if (clean_age <= 0L || ud->gc == NULL || now < next)
+		return;
+	next = now + 1;
+
+	if (rate > 0.0 && (!ud->geokey || !*ud->geokey))
+		rate = 0.0;
+	if (last) {
+		tokens += (now - last) * rate;
+		if (tokens > 60.0 * rate + 1.0)
+			tokens = 60.0 * rate + 1.0;	/* a minute's worth */
+	}
+	last = now;
+
+	if (*pos == 0 && started == 0) {
+		started = now;
+		memset(&pass, 0, sizeof(pass));
+	}
+
+	memset(&sl, 0, sizeof(sl));
+	sl.now = now;
+	if ((n = gcache_sweep(ud->gc, pos, sizeof(pos), SWEEP_SLICE, visit, &sl)) == -1) {
+		next = now + SWEEP_PAUSE;
+		started = 0;
+		*pos = 0;
+		return;
+	}
+	sl.n.visited = n;
+
+	for (i = 0; i < sl.nrefresh; i++)
+		refresh(ud, &sl, sl.refresh[i]);
+
+	pass.visited	+= sl.n.visited;
+	pass.evicted	+= sl.n.evicted;
+	pass.refreshed	+= sl.n.refreshed;
+	pass.failed	+= sl.n.failed;
+
+	pthread_mutex_lock(&sweep_lock);
+	st.visited	+= sl.n.visited;
+	st.evicted	+= sl.n.evicted;
+	st.refreshed	+= sl.n.refreshed;
+	st.failed	+= sl.n.failed;
+	if (*pos == 0)
+		st.passes++;
+	pthread_mutex_unlock(&sweep_lock);
+
+	if (*pos == 0) {
+		olog(LOG_INFO, "Geo cache sweep: %lu entries in %lds, %lu expired evicted, %lu refreshed, %lu refreshes failed",
+			pass.visited, (long)(now - started), pass.evicted, pass.refreshed, pass.failed);
+		next = now + SWEEP_PAUSE;
+		started = 0;
+	}
+}
+
+void sweep_stats(struct sweep_stats *s)
+{
+	pthread_mutex_lock(&sweep_lock);
+	*s = st;
+	pthread_mutex_unlock(&sweep_lock);
+}
@@ -0,0 +1,25 @@
+#ifndef _SWEEP_H_INCLUDED_
+# define _SWEEP_H_INCLUDED_
+
+#include "udata.h"
+
+/*
+ * Background expiry of the reverse-geo cache. With OTR_CLEAN_AGE set,
+ * the main loop walks the ghash database a slice at a time and either
+ * deletes the entries which have expired or, at a limited rate, looks
+ * them up again, instead of waiting for a location to land in the cell.
+ */
+
+struct sweep_stats {
+	unsigned long passes;		/* completed walks of the database */
+	unsigned long visited;		/* entries looked at */
+	unsigned long evicted;
+	unsigned long refreshed;
+	unsigned long failed;		/* refreshes without an answer */
+};
+
+void sweep_init(long clean_age, long refresh_per_hour);
+void sweep_step(struct udata *ud);
+void sweep_stats(struct sweep_stats *st);
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tzgrid.h"
+#include "util.h"
+
+#define TZGRID_MAGIC	"OTZG"
+#define TZGRID_VERSION	(1)
+
+/*
+ * On-disk layout: header, rows * cols uint16_t zone ids (row 0 is
+ * the southernmost band, column 0 starts at -180), followed by
+ * `nzones' NUL-terminated zone names. Zone id N refers to the Nth
+ * name (1-based); 0 and 0xFFFF are TZGRID_NOZONE and TZGRID_AMBIGUOUS.
+ * The size and mtime of the TZDATADB the grid was built from are
+ * recorded so a stale grid is never used after a database upgrade.
+ */
+
+struct tzgrid_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t rows;
+	uint32_t cols;
+	double cellsize;
+	uint32_t nzones;
+	uint32_t ambiguous;
+	int64_t db_size;
+	int64_t db_mtime;
+};
+
+struct tzgrid {
+	void *map;
+	size_t len;
+	const struct tzgrid_header *h;
+	const uint16_t *cells;
+	const char **zones;		/* zones[1 .. nzones] */
+};
+
+struct tzgrid *tzgrid_open(const char *path, const char *tzdatadb)
+{
+	struct tzgrid *g;
+	struct stat sb, dbsb;
+	const struct tzgrid_header *h;
+	const char *p, *end;
+	size_t ncells;
+	uint32_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		return (NULL);
+	}
+
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(struct tzgrid_header)) {
+		olog(LOG_ERR, "tzgrid: %s is too short", path);
+		close(fd);
+		return (NULL);
+	}
+
+	if ((g = calloc(1, sizeof(struct tzgrid))) == NULL) {
+		close(fd);
+		return (NULL);
+	}
+
+	g->len = sb.st_size;
+	g->map = mmap(NULL, g->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (g->map == MAP_FAILED) {
+		olog(LOG_ERR, "tzgrid: cannot mmap %s: %s", path, strerror(errno));
+		free(g);
+		return (NULL);
+	}
+
+	h = g->h = g->map;
+	ncells = (size_t)h->rows * (size_t)h->cols;
+
+	if (memcmp(h->magic, TZGRID_MAGIC, 4) != 0 || h->version != TZGRID_VERSION ||
+		h->cellsize <= 0.0 ||
+		sizeof(struct tzgrid_header) + ncells * sizeof(uint16_t) > g->len) {
+		olog(LOG_ERR, "tzgrid: %s is not a usable grid file", path);
+		goto fail;
+	}
+
+	if (tzdatadb && stat(tzdatadb, &dbsb) == 0 &&
+		(dbsb.st_size != h->db_size || dbsb.st_mtime != h->db_mtime)) {
+		olog(LOG_ERR, "tzgrid: %s is stale for %s; rebuild with ocat --tzgrid-build", path, tzdatadb);
+		goto fail;
+	}
+
+	g->cells = (const uint16_t *)((const char *)g->map + sizeof(struct tzgrid_header));
+
+	if ((g->zones = calloc(h->nzones + 1, sizeof(char *))) == NULL) {
+		goto fail;
+	}
+
+	p = (const char *)(g->cells + ncells);
+	end = (const char *)g->map + g->len;
+	for (n = 1; n <= h->nzones; n++) {
+		const char *nul = memchr(p, 0, end - p);
+
+		if (p >= end || nul == NULL) {
+			olog(LOG_ERR, "tzgrid: %s: truncated zone table", path);
+			free(g->zones);
+			goto fail;
+		}
+		g->zones[n] = p;
+		p = nul + 1;
+	}
+
+	return (g);
+
+    fail:
+	munmap(g->map, g->len);
+	free(g);
+	return (NULL);
+}
+
+void tzgrid_close(struct tzgrid *g)
+{
+	if (g == NULL)
+		return;
+
+	munmap(g->map, g->len);
+	free(g->zones);
+	free(g);
+}
+
+/*
+ * Resolve (lat, lon) from the grid. Returns 1 if the grid answered, in
+ * which case *tzname is the zone name (owned by the grid) or NULL if
+ * the point is in no zone at all. Returns 0 if the caller must fall
+ * back to a full lookup.
+ */
+
+int tzgrid_lookup(struct tzgrid *g, double lat, double lon, const char **tzname)
+{
+	long row, col;
+	uint16_t id;
+
+	if (g == NULL || !(lat >= -90.0 && lat <= 90.0 && lon >= -180.0 && lon <= 180.0))
+		return (0);
+
+	row = (long)((lat + 90.0) / g->h->cellsize);
+	col = (long)((lon + 180.0) / g->h->cellsize);
+	if (row >= (long)g->h->rows)
+		row = g->h->rows - 1;
+	if (col >= (long)g->h->cols)
+		col = g->h->cols - 1;
+
+	id = g->cells[row * g->h->cols + col];
+	if (id == TZGRID_AMBIGUOUS || (id != TZGRID_NOZONE && id > g->h->nzones))
+		return (0);
+
+	*tzname = (id == TZGRID_NOZONE) ? NULL : g->zones[id];
+	return (1);
+}
+
+static uint16_t zone_id(char ***zones, uint32_t *nzones, char *name)
+{
+	static uint32_t lastid = 0;
+	uint32_t n;
+	char **z;
+
+	if (lastid && lastid <= *nzones && strcmp((*zones)[lastid], name) == 0)
+		return (lastid);
+
+	for (n = 1; n <= *nzones; n++) {
+		if (strcmp((*zones)[n], name) == 0)
+			return (lastid = n);
+	}
+
+	if (*nzones + 1 >= TZGRID_AMBIGUOUS)
+		return (TZGRID_AMBIGUOUS);
+
+	if ((z = realloc(*zones, (*nzones + 2) * sizeof(char *))) == NULL)
+		return (TZGRID_AMBIGUOUS);
+	*zones = z;
+	(*zones)[++(*nzones)] = strdup(name);
+	return (lastid = *nzones);
+}
+
+/*
+ * Classify a rectangle of cells by looking up its center. ZDLookup()
+ * reports the distance (in degrees) from that point to the nearest border
+ * of every polygon whose bounding box contains it; if that distance
+ * safely exceeds the rectangle's extent, and no other polygon's bounding
+ * box reaches into the rectangle, no border can cross it and the
+ * center's zone holds for all of it. Otherwise split into quadrants
+ * until single cells remain, which are then marked ambiguous. Starting
+ * from large blocks keeps the number of lookups close to the number of
+ * cells near a border.
+ */
+
+struct build {
+	ZoneDetect *zdb;
+	struct tzgrid_header *h;
+	uint16_t *cells;
+	char **zones;
+	uint32_t nzones;
+};
+
+static void classify(struct build *b, uint32_t r0, uint32_t r1, uint32_t c0, uint32_t c1)
+{
+	double cs = b->h->cellsize;
+	float latmin = -90.0 + r0 * cs, latmax = fmin(-90.0 + r1 * cs, 90.0);
+	float lonmin = -180.0 + c0 * cs, lonmax = fmin(-180.0 + c1 * cs, 180.0);
+	float clat = (latmin + latmax) / 2.0, clon = (lonmin + lonmax) / 2.0;
+	float safezone = 0.0;
+	uint16_t id = TZGRID_AMBIGUOUS;
+	ZoneDetectResult *res;
+	uint32_t r, c, rm, cm;
+	char *tz;
+
+	if (r0 >= r1 || c0 >= c1)
+		return;
+
+	if (ZDBoxHasForeignPolygon(b->zdb, latmin, lonmin, latmax, lonmax, clat, clon) == 0 &&
+		(res = ZDLookup(b->zdb, clat, clon, &safezone)) != NULL) {
+		ZDFreeResults(res);
+
+		/*
+		 * ZDLookup() projects onto each border segment in unscaled
+		 * fixed-point space and only then weighs longitude double,
+		 * so safezone can overstate the true distance by up to a
+		 * factor of two. Compare against the full diagonal, with 1%
+		 * slack for fixed-point rounding.
+		 */
+		if (safezone >= hypot(latmax - latmin, lonmax - lonmin) * 1.01) {
+			if ((tz = ZDHelperSimpleLookupString(b->zdb, clat, clon)) == NULL) {
+				id = TZGRID_NOZONE;
+			} else {
+				id = zone_id(&b->zones, &b->nzones, tz);
+				ZDHelperSimpleLookupStringFree(tz);
+			}
+		}
+	}
+
+	if (id == TZGRID_AMBIGUOUS && (r1 - r0 > 1 || c1 - c0 > 1)) {
+		rm = r0 + (r1 - r0 + 1) / 2;
+		cm = c0 + (c1 - c0 + 1) / 2;
+		classify(b, r0, rm, c0, cm);
+		classify(b, r0, rm, cm, c1);
+		classify(b, rm, r1, c0, cm);
+		classify(b, rm, r1, cm, c1);
+		return;
+	}
+
+	for (r = r0; r < r1; r++) {
+		for (c = c0; c < c1; c++) {
+			b->cells[r * b->h->cols + c] = id;
+			if (id == TZGRID_AMBIGUOUS)
+				b->h->ambiguous++;
+		}
+	}
+}
+
+#define TZGRID_BLOCK	(32)	/* cells per side of the initial blocks */
+
+int tzgrid_build(ZoneDetect *zdb, const char *tzdatadb, const char *path, double cellsize, struct tzgrid_stats *stats)
+{
+	struct tzgrid_header h;
+	struct build b;
+	struct stat sb;
+	char tmp[BUFSIZ];
+	uint32_t n, row, col;
+	FILE *fp;
+	int rc = 0;
+
+	if (zdb == NULL || cellsize <= 0.0 || cellsize > 90.0)
+		return (0);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TZGRID_MAGIC, 4);
+	h.version	= TZGRID_VERSION;
+	h.cellsize	= cellsize;
+	h.rows		= (uint32_t)ceil(180.0 / cellsize);
+	h.cols		= (uint32_t)ceil(360.0 / cellsize);
+	if (tzdatadb && stat(tzdatadb, &sb) == 0) {
+		h.db_size	= sb.st_size;
+		h.db_mtime	= sb.st_mtime;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.zdb	= zdb;
+	b.h	= &h;
+	if ((b.cells = calloc((size_t)h.rows * h.cols, sizeof(uint16_t))) == NULL)
+		return (0);
+
+	for (row = 0; row < h.rows; row += TZGRID_BLOCK) {
+		for (col = 0; col < h.cols; col += TZGRID_BLOCK) {
+			classify(&b, row, row + TZGRID_BLOCK < h.rows ? row + TZGRID_BLOCK : h.rows,
+				col, col + TZGRID_BLOCK < h.cols ? col + TZGRID_BLOCK : h.cols);
+		}
+	}
+	h.nzones = b.nzones;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		olog(LOG_ERR, "tzgrid: cannot create %s: %s", tmp, strerror(errno));
+		goto out;
+	}
+
+	fwrite(&h, sizeof(h), 1, fp);
+	fwrite(b.cells, sizeof(uint16_t), (size_t)h.rows * h.cols, fp);
+	for (n = 1; n <= b.nzones; n++) {
+		fwrite(b.zones[n], strlen(b.zones[n]) + 1, 1, fp);
+	}
+
+	if (ferror(fp) | fclose(fp)) {
+		olog(LOG_ERR, "tzgrid: cannot write %s", tmp);
+		unlink(tmp);
+		goto out;
+	}
+
+	if (rename(tmp, path) == -1) {
+		olog(LOG_ERR, "tzgrid: cannot rename %s to %s: %s", tmp, path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+
+	if (stats) {
+		stats->cells		= (long)h.rows * h.cols;
+		stats->ambiguous	= h.ambiguous;
+		stats->resolved		= stats->cells - h.ambiguous;
+		stats->zones		= b.nzones;
+	}
+	rc = 1;
+
+    out:
+	for (n = 1; n <= b.nzones; n++)
+		free(b.zones[n]);
+	free(b.zones);
+	free(b.cells);
+	return (rc);
+}
@@ -0,0 +1,35 @@
+#ifndef _TZGRID_H_INCLUDED_
+# define _TZGRID_H_INCLUDED_
+
+#include <stdint.h>
+#include "zonedetect.h"
+
+/*
+ * A tzgrid is a precomputed lat/lon grid over the ZoneDetect database.
+ * Cells which lie entirely within one timezone carry that zone's name
+ * directly; cells crossed by a border are flagged and resolved with a
+ * full ZDLookup(). The grid is built once by `ocat --tzgrid-build' and
+ * stored beside TZDATADB, from where it is mmap(2)ed read-only.
+ */
+
+#define TZGRID_SUFFIX		".grid"
+#define TZGRID_CELLSIZE		(0.25)	/* default cell size in degrees */
+
+#define TZGRID_NOZONE		(0)	/* cell lies outside of any zone */
+#define TZGRID_AMBIGUOUS	(0xFFFF)	/* cell crosses a border */
+
+struct tzgrid;
+
+struct tzgrid_stats {
+	long cells;
+	long resolved;		/* cells with a single zone */
+	long ambiguous;		/* cells needing a full lookup */
+	int zones;		/* distinct zone names */
+};
+
+struct tzgrid *tzgrid_open(const char *path, const char *tzdatadb);
+void tzgrid_close(struct tzgrid *);
+int tzgrid_lookup(struct tzgrid *, double lat, double lon, const char **tzname);
+int tzgrid_build(ZoneDetect *zdb, const char *tzdatadb, const char *path, double cellsize, struct tzgrid_stats *stats);
+
+#endif
@@ -5,6 +5,7 @@
 
 #ifdef WITH_HTTP
 # include <stdarg.h>
+# include <pthread.h>
 # include "mongoose.h"
 #endif
 // #include "gcache.h"
@@ -37,6 +38,10 @@ struct udata {
 	struct gcache *t2t;		/* topic to tid */
 #ifdef WITH_HTTP
 	struct mg_server *mgserver;	/* Mongoose */
+	int http_workers;		/* number of HTTP worker threads */
+	int http_cachesize;		/* MB of API responses to cache; 0 disables */
+	int http_compress;		/* zlib level for compressed responses; 0 disables */
+	pthread_mutex_t lock;		/* serializes handle_message() and Lua between MQTT and HTTP workers */
 	char *http_host;		/* address of http bind */
 	int http_port;			/* port number for above */
 	char *http_logdir;		/* full path to http access log */
@@ -59,7 +64,12 @@ struct udata {
 	int debug;			/* enable for debugging */
 	struct gcache *httpfriends;	/* lmdb named database 'friends' */
 	struct gcache *wpdb;		/* lmdb named database 'wp' (waypoints) */
+	struct gcache *sumdb;		/* lmdb named database 'summary' (daily summaries) */
 	long clean_age;			/* how long in seconds to keep geo gcache entries */
+	long clean_refresh;		/* expired entries looked up again per hour (sweep.c) */
+	int dircache;			/* cache directory listings (dircache.c) */
+	int dedup_window;		/* publishes per device checked for repeats (dedup.c) */
+	int journal;			/* journal publishes before handling them (journal.c) */
 };
 
 #endif
@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <math.h>
+#include <pthread.h>
 #ifdef WITH_TOURS
 #ifdef __OpenBSD__
 # include <uuid.h>
@@ -40,6 +41,8 @@
 #endif
 #endif
 #include "udata.h"
+#include "dircache.h"
+#include "mcache.h"
 
 #ifndef LINESIZE
 # define LINESIZE (32 * 1024)
@@ -55,75 +58,384 @@ int is_directory(char *path)
 }
 
 const char *isotime(time_t t) {
-        static char buf[] = "YYYY-MM-DDTHH:MM:SSZ";
+        static __thread char buf[] = "YYYY-MM-DDTHH:MM:SSZ";
+        struct tm tm;
 
-        strftime(buf, sizeof(buf), "%FT%TZ", gmtime(&t));
+        strftime(buf, sizeof(buf), "%FT%TZ", gmtime_r(&t, &tm));
         return(buf);
 }
 
 const char *disptime(time_t t) {
-        static char buf[] = "YYYY-MM-DD HH:MM:SS";
+        static __thread char buf[] = "YYYY-MM-DD HH:MM:SS";
+        struct tm tm;
 
-        strftime(buf, sizeof(buf), "%F %T", gmtime(&t));
+        strftime(buf, sizeof(buf), "%F %T", gmtime_r(&t, &tm));
         return(buf);
 }
 
 #ifdef WITH_TZ
-const char *isolocal(long tst, char *tzname)
+/*
+ * isolocal() gets the offset of a zone from its TZif file (tzfile(5))
+ * instead of switching $TZ, which is process-wide and read without a
+ * lock by localtime(), mktime(), strftime() and syslog() in every
+ * thread. Zones are loaded on first use and kept: a table of their
+ * transitions, and the POSIX TZ rule from the file's footer for times
+ * after the last one. An unknown zone is UTC, as it is to tzset().
+ */
+
+#ifndef TZDIR
+# define TZDIR	"/usr/share/zoneinfo"
+#endif
+
+struct tzrule {
+	int kind;		/* 'J', 'M', or 'D' for a zero-based day */
+	int mon, week, wday, day;
+	long secs;		/* local time of the change */
+};
+
+struct zone {
+	struct zone *next;
+	char *name;
+	long n;			/* transitions */
+	int64_t *at;		/* ... at these times */
+	long *off;		/* ... to these offsets */
+	long off0;		/* offset before the first transition */
+	int rule;		/* the footer has DST rules */
+	long stdoff, dstoff;
+	struct tzrule start, end;
+};
+
+static pthread_mutex_t tz_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct zone *zones = NULL;
+
+static int64_t be(const unsigned char *p, int len)
 {
-	static char last_timezone[BUFSIZ] = "UTC";
-        static char local[128];
-        struct tm *tm;
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		v = (v << 8) | p[i];
+	if (len == 4)
+		return ((int32_t)v);
+	return ((int64_t)v);
+}
 
-	/*
-	 * Switch $TZ only if we have to, as it's an expensive
-	 * operation. By tuning this we reduced runtime for 2000 positions
-	 * from 3 minutes to < 0.1s
-	 */
-	if (strcmp(last_timezone, tzname) != 0) {
-		// fprintf(stderr, "isolocal: %s -> %s\n", last_timezone, tzname);
-		strcpy(last_timezone, tzname);
-		setenv("TZ", tzname, 1);
+/* [+-]hh[:mm[:ss]] */
+
+static const char *tzhms(const char *s, long *secs)
+{
+	int sign = 1, n = 0;
+	long v[3] = { 0, 0, 0 };
+
+	if (*s == '+' || *s == '-')
+		sign = (*s++ == '-') ? -1 : 1;
+	if (!isdigit((unsigned char)*s))
+		return (NULL);
+	do {
+		while (isdigit((unsigned char)*s))
+			v[n] = v[n] * 10 + (*s++ - '0');
+	} while (++n < 3 && *s == ':' && isdigit((unsigned char)*++s));
+	*secs = sign * (v[0] * 3600 + v[1] * 60 + v[2]);
+	return (s);
+}
+
+static const char *tzabbr(const char *s)
+{
+	if (*s == '<') {
+		while (*s && *s != '>')
+			s++;
+		return (*s ? s + 1 : NULL);
 	}
+	while (isalpha((unsigned char)*s))
+		s++;
+	return (s);
+}
 
-        strcpy(local, "-");
-        if ((tm = localtime((time_t *)&tst)) != NULL) {
-                strftime(local, sizeof(local), "%FT%T%z", tm);
-        }
+static const char *tzwhen(const char *s, struct tzrule *r)
+{
+	char *end;
+
+	r->secs = 7200;
+	if (*s == 'M') {
+		r->kind = 'M';
+		r->mon = strtol(s + 1, &end, 10);
+		if (*end != '.')
+			return (NULL);
+		r->week = strtol(end + 1, &end, 10);
+		if (*end != '.')
+			return (NULL);
+		r->wday = strtol(end + 1, &end, 10);
+		if (r->mon < 1 || r->mon > 12 || r->week < 1 || r->week > 5 || r->wday < 0 || r->wday > 6)
+			return (NULL);
+	} else {
+		r->kind = (*s == 'J') ? 'J' : 'D';
+		if (*s == 'J')
+			s++;
+		if (!isdigit((unsigned char)*s))
+			return (NULL);
+		r->day = strtol(s, &end, 10);
+	}
+	s = end;
+	if (*s == '/' && (s = tzhms(s + 1, &r->secs)) == NULL)
+		return (NULL);
+	return (s);
+}
+
+/*
+ * Parse a POSIX TZ string such as "CET-1CEST,M3.5.0,M10.5.0/3" into
+ * `z'; offsets are stored east of UTC, i.e. with the sign flipped.
+ */
+
+static int tzrule(struct zone *z, const char *s)
+{
+	if ((s = tzabbr(s)) == NULL || (s = tzhms(s, &z->stdoff)) == NULL)
+		return (FALSE);
+	z->stdoff = -z->stdoff;
+	if (*s == 0) {
+		z->rule = FALSE;	/* the last transition's offset holds */
+		return (TRUE);
+	}
+	if ((s = tzabbr(s)) == NULL)
+		return (FALSE);
+	z->dstoff = z->stdoff + 3600;
+	if (*s != ',') {
+		if ((s = tzhms(s, &z->dstoff)) == NULL)
+			return (FALSE);
+		z->dstoff = -z->dstoff;
+	}
+	if (*s != ',' || (s = tzwhen(s + 1, &z->start)) == NULL)
+		return (FALSE);
+	if (*s != ',' || (s = tzwhen(s + 1, &z->end)) == NULL)
+		return (FALSE);
+	z->rule = TRUE;
+	return (TRUE);
+}
+
+/* UTC time at which rule `r' changes in `year', given the offset before */
+
+static time_t tzchange(int year, struct tzrule *r, long off)
+{
+	struct tm tm;
+	time_t t;
+	int day, wday;
+	static const int mdays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	int leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = year - 1900;
+	tm.tm_mday = 1;
+	if (r->kind == 'M') {
+		tm.tm_mon = r->mon - 1;
+		t = timegm(&tm);
+		wday = ((t / 86400) % 7 + 4 + 7) % 7;	/* 1970-01-01 was a Thursday */
+		day = 1 + (r->wday - wday + 7) % 7 + (r->week - 1) * 7;
+		if (day > mdays[tm.tm_mon] + (tm.tm_mon == 1 && leap))
+			day -= 7;
+		tm.tm_mday = day;
+	} else if (r->kind == 'J') {
+		tm.tm_mday = r->day + (leap && r->day >= 60);
+	} else {
+		tm.tm_mday = r->day + 1;
+	}
+	return (timegm(&tm) + r->secs - off);
+}
+
+static struct zone *tzload(char *name)
+{
+	const char *dir = getenv("TZDIR");
+	unsigned char *buf = NULL, *p, *end;
+	long cnt[6], i, len, tlen = 4;
+	struct zone *z;
+	char path[BUFSIZ];
+	struct stat sb;
+	int fd;
+
+	if ((z = calloc(1, sizeof(struct zone))) == NULL)
+		return (NULL);
+	if ((z->name = strdup(name)) == NULL) {
+		free(z);
+		return (NULL);
+	}
+
+	if (*name == '/' || *name == 0 || strstr(name, "..") != NULL)
+		return (z);
+	snprintf(path, sizeof(path), "%s/%s", dir ? dir : TZDIR, name);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (z);
+	if (fstat(fd, &sb) == 0 && sb.st_size >= 44 && sb.st_size < 1048576 &&
+		(buf = malloc(sb.st_size + 1)) != NULL)
+		len = read(fd, buf, sb.st_size);
+	close(fd);
+	if (buf == NULL)
+		return (z);
+	if (len != sb.st_size || memcmp(buf, "TZif", 4) != 0)
+		goto out;
+	buf[len] = 0;
+	end = buf + len;
+
+	/* skip the 32-bit data block if there's a 64-bit one */
+	p = buf;
+	for (;;) {
+		if (p + 44 > end)
+			goto out;
+		for (i = 0; i < 6; i++)
+			cnt[i] = be(p + 20 + i * 4, 4);
+		p += 44;
+		if (tlen == 8 || buf[4] < '2')
+			break;
+		p += cnt[3] * 5 + cnt[4] * 6 + cnt[5] + cnt[2] * 8 + cnt[1] + cnt[0];
+		tlen = 8;
+	}
+
+	/* counts: isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt */
+	if (cnt[4] < 1 || p + cnt[3] * (tlen + 1) + cnt[4] * 6 > end)
+		goto out;
+	if ((z->at = calloc(cnt[3] + 1, sizeof(int64_t))) == NULL ||
+		(z->off = calloc(cnt[3] + 1, sizeof(long))) == NULL)
+		goto out;
+	for (i = 0; i < cnt[3]; i++) {
+		int type = p[cnt[3] * tlen + i];
+
+		if (type >= cnt[4])
+			goto out;
+		z->at[i] = be(p + i * tlen, tlen);
+		z->off[i] = be(p + cnt[3] * (tlen + 1) + type * 6, 4);
+	}
+	z->n = cnt[3];
+	z->off0 = be(p + cnt[3] * (tlen + 1), 4);
+
+	/* the footer: "\n" POSIX-TZ "\n" */
+	p += cnt[3] * (tlen + 1) + cnt[4] * 6 + cnt[5] + cnt[2] * (tlen + 4) + cnt[1] + cnt[0];
+	if (tlen == 8 && p < end && *p == '\n') {
+		unsigned char *nl = (unsigned char *)strchr((char *)p + 1, '\n');
+
+		if (nl != NULL && nl > p + 1) {
+			*nl = 0;
+			if (!tzrule(z, (char *)p + 1))
+				z->rule = FALSE;
+		}
+	}
+
+    out:
+	free(buf);
+	return (z);
+}
+
+static long tzoffset(struct zone *z, time_t t)
+{
+	long lo = 0, hi = z->n, mid;
+	time_t start, end;
+	struct tm tm;
+
+	if (z->n > 0 && t < z->at[0])
+		return (z->off0);
+	if (z->n > 0 && (t < z->at[z->n - 1] || !z->rule)) {
+		while (hi - lo > 1) {
+			mid = (lo + hi) / 2;
+			if (z->at[mid] <= t)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		return (z->off[lo]);
+	}
+	if (!z->rule)
+		return (z->off0);
+
+	t += z->stdoff;
+	gmtime_r(&t, &tm);
+	t -= z->stdoff;
+	start = tzchange(tm.tm_year + 1900, &z->start, z->stdoff);
+	end = tzchange(tm.tm_year + 1900, &z->end, z->dstoff);
+	if (start < end)
+		return ((t >= start && t < end) ? z->dstoff : z->stdoff);
+	return ((t >= end && t < start) ? z->stdoff : z->dstoff);
+}
+
+const char *isolocal(long tst, char *tzname)
+{
+	static __thread struct zone *last = NULL;
+	static __thread char local[128];
+	time_t t = tst;
+	struct zone *z;
+	struct tm tm;
+	long off;
+	size_t len;
+
+	if ((z = last) == NULL || strcmp(z->name, tzname) != 0) {
+		pthread_mutex_lock(&tz_mutex);
+		for (z = zones; z != NULL; z = z->next) {
+			if (strcmp(z->name, tzname) == 0)
+				break;
+		}
+		if (z == NULL && (z = tzload(tzname)) != NULL) {
+			z->next = zones;
+			zones = z;
+		}
+		pthread_mutex_unlock(&tz_mutex);
+		if (z == NULL)
+			return ("-");
+		last = z;
+	}
 
-        return (local);
+	off = tzoffset(z, t);
+	t += off;
+	strcpy(local, "-");
+	if (gmtime_r(&t, &tm) != NULL && (len = strftime(local, sizeof(local), "%FT%T", &tm)) > 0) {
+		snprintf(local + len, sizeof(local) - len, "%c%02ld%02ld",
+			off < 0 ? '-' : '+', labs(off) / 3600, (labs(off) % 3600) / 60);
+	}
+	return (local);
 }
 #endif
 
 char *slurp_file(char *filename, int fold_newlines)
 {
-	FILE *fp;
-	char *buf, *bp;
-	off_t len;
-	int ch;
+	struct stat sb;
+	char *buf, *bp, *end, *nl;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
 
-	if ((fp = fopen(filename, "rb")) == NULL)
+	if ((fd = open(filename, O_RDONLY)) == -1)
 		return (NULL);
 
-	if (fseeko(fp, 0, SEEK_END) != 0) {
-		fclose(fp);
+	if (fstat(fd, &sb) == -1 || (buf = malloc(sb.st_size + 1)) == NULL) {
+		close(fd);
 		return (NULL);
 	}
-	len = ftello(fp);
-	fseeko(fp, 0, SEEK_SET);
 
-	if ((bp = buf = malloc(len + 1)) == NULL) {
-		fclose(fp);
-		return (NULL);
+	/* one read(2) for the whole file, usually */
+	while (len < (size_t)sb.st_size) {
+		if ((n = read(fd, buf + len, sb.st_size - len)) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+		len += n;
 	}
-	while ((ch = fgetc(fp)) != EOF) {
-		if (ch == '\n') {
-			if (!fold_newlines)
-				*bp++ = ch;
-		} else *bp++ = ch;
+	close(fd);
+	buf[len] = 0;
+
+	/*
+	 * Fold newlines in place, moving each run between them down
+	 * in one go; files without any aren't touched.
+	 */
+
+	if (fold_newlines && (nl = memchr(buf, '\n', len)) != NULL) {
+		end = buf + len;
+		bp = nl;
+		while (nl < end) {
+			char *from = nl + 1, *next;
+
+			if ((next = memchr(from, '\n', end - from)) == NULL)
+				next = end;
+			memmove(bp, from, next - from);
+			bp += next - from;
+			nl = next;
+		}
+		*bp = 0;
 	}
-	*bp = 0;
-	fclose(fp);
 
 	return (buf);
 }
@@ -233,14 +545,14 @@ int json_copy_from_file(JsonNode *obj, char *filename)
 
 int splitter(char *s, char *sep, char **parts)
 {
-        char *token, *p, *ds = strdup(s);
+        char *token, *p, *ds = strdup(s), *save;
         int nt = 0;
 
 	if (!ds)
 		return (-1);
 
-	for (token = strtok(ds, sep);
-		token && *token && nt < (MAXPARTS - 1); token = strtok(NULL, sep)) {
+	for (token = strtok_r(ds, sep, &save);
+		token && *token && nt < (MAXPARTS - 1); token = strtok_r(NULL, sep, &save)) {
 		if ((p = strdup(token)) == NULL)
 			return (-1);
 		parts[nt++] = p;
@@ -266,13 +578,13 @@ void splitterfree(char **parts)
 
 JsonNode *json_splitter(char *s, char *sep)
 {
-	char *token, *ds = strdup(s);
+	char *token, *ds = strdup(s), *save;
 	JsonNode *array = json_mkarray();
 
 	if (!ds || !array)
 		return (NULL);
 
-	for (token = strtok(ds, sep); token && *token; token = strtok(NULL, sep)) {
+	for (token = strtok_r(ds, sep, &save); token && *token; token = strtok_r(NULL, sep, &save)) {
 		json_append_element(array, json_mkstring(token));
         }
 
@@ -321,7 +633,7 @@ int syslog_facility_code(char *facility)
 void olog(int level, char *fmt, ...)
 {
 	va_list ap;
-	static UT_string *u = NULL;
+	static __thread UT_string *u = NULL;
 
 	va_start(ap, fmt);
 	utstring_renew(u);
@@ -346,7 +658,7 @@ void olog(int level, char *fmt, ...)
 void debug(struct udata *ud, char *fmt, ...)
 {
 	va_list ap;
-	static UT_string *u = NULL;
+	static __thread UT_string *u = NULL;
 
 	if (ud->debug == FALSE)
 		return;
@@ -362,9 +674,10 @@ void debug(struct udata *ud, char *fmt, ...)
 }
 
 const char *yyyymm(time_t t) {
-        static char buf[] = "YYYY-MM";
+        static __thread char buf[] = "YYYY-MM";
+        struct tm tm;
 
-        strftime(buf, sizeof(buf), "%Y-%m", gmtime(&t));
+        strftime(buf, sizeof(buf), "%Y-%m", gmtime_r(&t, &tm));
         return(buf);
 }
 
@@ -374,7 +687,7 @@ const char *yyyymm(time_t t) {
  * (http://stackoverflow.com/questions/14834267/)
  */
 
-static char *tac_gets(char *buf, int n, FILE * fp)
+char *tac_gets(char *buf, int n, FILE * fp)
 {
 	long fpos;
 	int cpos;
@@ -512,13 +825,14 @@ static void ut_clean(UT_string *us)
         }
 }
 
-/* Return an open append file pointer to storage for user/device,
-   creating directories on the fly. If device is NULL, omit it.
+/* Return the path of the file in storage for user/device, creating
+   directories on the fly if `create'. If device is NULL, omit it. The
+   path is overwritten by the next call in the same thread.
  */
 
-FILE *pathn(char *mode, char *prefix, UT_string *user, UT_string *device, char *suffix, time_t epoch)
+static char *buildpath(char *prefix, UT_string *user, UT_string *device, char *suffix, time_t epoch, int create)
 {
-        static UT_string *path = NULL;
+        static __thread UT_string *path = NULL;
 
         utstring_renew(path);
 
@@ -533,7 +847,7 @@ FILE *pathn(char *mode, char *prefix, UT_string *user, UT_string *device, char *
 
         ut_clean(path);
 
-        if (mkpath(UB(path)) < 0) {
+        if (create && mkpath(UB(path)) < 0) {
                 olog(LOG_ERR, "Cannot create directory at %s: %m", UB(path));
                 return (NULL);
         }
@@ -546,7 +860,37 @@ FILE *pathn(char *mode, char *prefix, UT_string *user, UT_string *device, char *
 
         ut_clean(path);
 
-        return (fopen(UB(path), mode));
+	return (UB(path));
+}
+
+char *storepath(char *prefix, UT_string *user, UT_string *device, char *suffix, time_t epoch)
+{
+	return (buildpath(prefix, user, device, suffix, epoch, TRUE));
+}
+
+/* Like storepath(), for a file which is only to be read. */
+
+char *findpath(char *prefix, UT_string *user, UT_string *device, char *suffix, time_t epoch)
+{
+	return (buildpath(prefix, user, device, suffix, epoch, FALSE));
+}
+
+/* Return an open append file pointer to storage for user/device,
+   creating directories on the fly. If device is NULL, omit it.
+ */
+
+FILE *pathn(char *mode, char *prefix, UT_string *user, UT_string *device, char *suffix, time_t epoch)
+{
+	char *path;
+	FILE *fp;
+
+	if ((path = storepath(prefix, user, device, suffix, epoch)) == NULL)
+		return (NULL);
+
+	if ((fp = fopen(path, mode)) != NULL && *mode != 'r') {
+		dircache_note(path);
+	}
+        return (fp);
 
 }
 
@@ -592,7 +936,9 @@ int safewrite(char *filename, char *buf)
 
         if ((rename(tmpfile, filename)) == -1) {
                 fprintf(stderr, "Failed to rename %s to %s (errno=%d)\n", tmpfile, filename, errno);
-        }
+        } else {
+		mcache_note(filename);
+	}
 
         free(tmpfile);
         return (0);
@@ -676,6 +1022,62 @@ double number(JsonNode *j, char *element)
 	return (NAN);
 }
 
+/*
+ * CRC-32 (as in zlib and gzip) of `len' bytes at `buf', continuing
+ * from `crc'; start with 0. On little-endian hosts, eight bytes are
+ * processed per step ("slicing-by-8").
+ */
+
+static uint32_t crctab[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = (uint32_t)n;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crctab[0][n] = c;
+	}
+	for (n = 0; n < 256; n++) {
+		c = crctab[0][n];
+		for (k = 1; k < 8; k++) {
+			c = crctab[0][c & 0xff] ^ (c >> 8);
+			crctab[k][n] = c;
+		}
+	}
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *bp = buf;
+
+	pthread_once(&crc_once, crc_init);
+
+	crc = ~crc;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (len >= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, bp, 4);
+		memcpy(&hi, bp + 4, 4);
+		lo ^= crc;
+		crc =	crctab[7][lo & 0xff] ^ crctab[6][(lo >> 8) & 0xff] ^
+			crctab[5][(lo >> 16) & 0xff] ^ crctab[4][lo >> 24] ^
+			crctab[3][hi & 0xff] ^ crctab[2][(hi >> 8) & 0xff] ^
+			crctab[1][(hi >> 16) & 0xff] ^ crctab[0][hi >> 24];
+		bp += 8;
+		len -= 8;
+	}
+#endif
+	while (len--)
+		crc = crctab[0][(crc ^ *bp++) & 0xff] ^ (crc >> 8);
+	return (~crc);
+}
+
 #ifdef WITH_TOURS
 char *uuid4()
 {
@@ -706,7 +1108,7 @@ char *uuid4()
 
 char *toursdir()
 {
-        static UT_string *path = NULL;
+        static __thread UT_string *path = NULL;
 
         utstring_renew(path);
 	utstring_printf(path, "%s/tours", STORAGEDIR);
@@ -716,7 +1118,7 @@ char *toursdir()
 
 FILE *tourfile(struct udata *ud, char *filename, char *mode)
 {
-        static UT_string *path = NULL;
+        static __thread UT_string *path = NULL;
 
         utstring_renew(path);
 
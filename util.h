@@ -7,6 +7,7 @@
 #endif
 
 #include <time.h>
+#include <stdint.h>
 #include <syslog.h>
 #include <math.h>
 #include "json.h"
@@ -30,7 +31,10 @@ JsonNode *json_splitter(char *s, char *sep);
 int syslog_facility_code(char *facility);
 const char *yyyymm(time_t t);
 int tac(char *filename, long lines, int (*func)(char *, void *), void *param);
+char *tac_gets(char *buf, int n, FILE *fp);
 int cat(char *filename, int (*func)(char *, void *), void *param);
+char *storepath(char *prefix, UT_string *user, UT_string *device, char *suffix, time_t epoch);
+char *findpath(char *prefix, UT_string *user, UT_string *device, char *suffix, time_t epoch);
 FILE *pathn(char *mode, char *prefix, UT_string *user, UT_string *device, char *suffix, time_t epoch);
 int safewrite(char *filename, char *buf);
 void olog(int level, char *fmt, ...);
@@ -41,6 +45,7 @@ double haversine_dist(double th1, double ph1, double th2, double ph2);
 void debug(struct udata *, char *fmt, ...);
 void chomp(char *s);
 double number(JsonNode *j, char *element);
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
 #ifdef WITH_TOURS
 char *uuid4(void);
 char *toursdir(void);
@@ -0,0 +1,376 @@
+/*
+ * OwnTracks Recorder
+ * Copyright (C) 2015-2025 Jan-Piet Mens <jpmens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "utstring.h"
+#include "util.h"
+#include "storage.h"
+#include "fcache.h"
+#include "vcache.h"
+
+#define VCACHE_BUCKETS	64
+
+/* A view definition or page */
+struct vfile {
+	struct vfile *next;
+	char *path;
+	int fold;
+	struct fdeps deps;
+	char *data;			/* NULL if it couldn't be read */
+};
+
+/* .rec file a track was read from */
+struct vrec {
+	char *path;
+	ino_t ino;
+	off_t offset;
+};
+
+/* Track of a view */
+struct vtrack {
+	struct vtrack *next;
+	char *name;
+	pthread_mutex_t mutex;
+	char *sig;			/* user, device, from, to, hours */
+	time_t s_lo;			/* points written at or before are gone */
+	struct vrec *recs;
+	int nrecs, maxrecs;
+	struct track track;
+	time_t maxrcv;			/* latest point */
+	char *body;			/* rendered GeoJSON */
+	time_t body_hi;			/* s_hi it was rendered for */
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct vfile *files[VCACHE_BUCKETS];
+static struct vtrack *tracks[VCACHE_BUCKETS];
+static int nfiles = 0, ntracks = 0, maxentries = 0;
+
+static unsigned hash(const char *s)
+{
+	unsigned h = 5381;
+
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return (h % VCACHE_BUCKETS);
+}
+
+static void drop_file(struct vfile *f)
+{
+	free(f->path);
+	fdeps_free(&f->deps);
+	free(f->data);
+	free(f);
+}
+
+static void clear_files(void)
+{
+	struct vfile *f;
+	int i;
+
+	for (i = 0; i < VCACHE_BUCKETS; i++) {
+		while ((f = files[i]) != NULL) {
+			files[i] = f->next;
+			drop_file(f);
+		}
+	}
+	nfiles = 0;
+}
+
+/*
+ * There are entries for the view definitions and pages requested and
+ * for the track of each view; should there be more than `max' files
+ * the file entries are dropped, and views beyond `max' aren't cached.
+ */
+
+void vcache_init(int max)
+{
+	maxentries = max;
+}
+
+/*
+ * Return a copy of the contents of the file at `path', as slurp_file()
+ * would, or NULL if it can't be read.
+ */
+
+char *vcache_file(char *path, int fold_newlines)
+{
+	struct vfile **fp, *f;
+	unsigned h = hash(path);
+	char *data;
+
+	pthread_mutex_lock(&mutex);
+	for (fp = &files[h]; (f = *fp) != NULL; fp = &f->next) {
+		if (strcmp(f->path, path) == 0 && f->fold == fold_newlines)
+			break;
+	}
+	if (f != NULL) {
+		if (fdeps_unchanged(&f->deps)) {
+			data = f->data ? strdup(f->data) : NULL;
+			pthread_mutex_unlock(&mutex);
+			return (data);
+		}
+		*fp = f->next;
+		drop_file(f);
+		nfiles--;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if ((f = calloc(1, sizeof(struct vfile))) == NULL)
+		return (slurp_file(path, fold_newlines));
+	f->fold = fold_newlines;
+	fdeps_add(&f->deps, path);
+	if ((f->path = strdup(path)) == NULL || f->deps.n != 1) {
+		drop_file(f);
+		return (slurp_file(path, fold_newlines));
+	}
+	f->data = slurp_file(path, fold_newlines);
+	data = f->data ? strdup(f->data) : NULL;
+
+	pthread_mutex_lock(&mutex);
+	if (maxentries <= 0) {
+		drop_file(f);
+	} else {
+		struct vfile *o;
+
+		for (fp = &files[h]; (o = *fp) != NULL; fp = &o->next) {
+			if (strcmp(o->path, path) == 0 && o->fold == fold_newlines) {
+				*fp = o->next;
+				drop_file(o);
+				nfiles--;
+				break;
+			}
+		}
+		if (nfiles >= maxentries) {
+			clear_files();
+		}
+		f->next = files[h];
+		files[h] = f;
+		nfiles++;
+	}
+	pthread_mutex_unlock(&mutex);
+	return (data);
+}
+
+static void reset(struct vtrack *t, const char *sig, time_t s_lo)
+{
+	int i;
+
+	for (i = 0; i < t->nrecs; i++)
+		free(t->recs[i].path);
+	t->nrecs = 0;
+	t->track.n = 0;
+	t->maxrcv = 0;
+	free(t->body);
+	t->body = NULL;
+	free(t->sig);
+	t->sig = strdup(sig);
+	t->s_lo = s_lo;
+}
+
+static struct vrec *rec(struct vtrack *t, char *path)
+{
+	struct vrec *r;
+	int i;
+
+	for (i = 0; i < t->nrecs; i++) {
+		if (strcmp(t->recs[i].path, path) == 0)
+			return (&t->recs[i]);
+	}
+	if (t->nrecs == t->maxrecs) {
+		int n = t->maxrecs ? t->maxrecs * 2 : 16;
+
+		if ((r = realloc(t->recs, n * sizeof(struct vrec))) == NULL)
+			return (NULL);
+		t->recs = r;
+		t->maxrecs = n;
+	}
+	r = &t->recs[t->nrecs];
+	if ((r->path = strdup(path)) == NULL)
+		return (NULL);
+	r->ino = 0;
+	r->offset = 0;
+	t->nrecs++;
+	return (r);
+}
+
+/*
+ * Bring `t' up to date with the .rec files of user/device between s_lo
+ * and s_hi: new lines are read from the files already known, and points
+ * written at or before s_lo are dropped. Returns 1 if the points have
+ * changed, 0 if they haven't, and -1 on error.
+ */
+
+static int update(struct vtrack *t, char *user, char *device, time_t s_lo, time_t s_hi)
+{
+	JsonNode *json, *arr, *f;
+	struct vrec *r;
+	struct trackpt *tp, *keep;
+	size_t i;
+	int n, changed = 0, rc = 0;
+
+	if ((json = lister(user, device, s_lo, s_hi, FALSE)) == NULL)
+		return (-1);
+
+	if ((arr = json_find_member(json, "results")) != NULL) {
+		json_foreach(f, arr) {
+			if ((r = rec(t, f->string_)) == NULL) {
+				rc = -1;
+				break;
+			}
+			if ((n = track_read(r->path, &r->ino, &r->offset, &t->track)) == -1) {
+				rc = -1;
+				break;
+			}
+			if (n > 0)
+				changed = 1;
+		}
+	}
+	json_delete(json);
+	if (rc == -1)
+		return (-1);
+
+	if (s_lo > t->s_lo) {
+		keep = t->track.pts;
+		for (i = 0, tp = t->track.pts; i < t->track.n; i++, tp++) {
+			if (tp->rcv > s_lo)
+				*keep++ = *tp;
+		}
+		if ((size_t)(keep - t->track.pts) != t->track.n) {
+			t->track.n = keep - t->track.pts;
+			changed = 1;
+		}
+		t->s_lo = s_lo;
+	}
+
+	if (changed) {
+		t->maxrcv = 0;
+		for (i = 0, tp = t->track.pts; i < t->track.n; i++, tp++) {
+			if (tp->rcv > t->maxrcv)
+				t->maxrcv = tp->rcv;
+		}
+	}
+	return (changed);
+}
+
+/*
+ * Return the GeoJSON LineString of `user'/`device' between s_lo and s_hi
+ * for the view `name' (from, to and hours as in the view), as a string
+ * for the caller to free, or NULL if it isn't cached and the caller must
+ * build it.
+ */
+
+char *vcache_track(const char *name, char *user, char *device, char *from, char *to, int hours, time_t s_lo, time_t s_hi)
+{
+	static __thread UT_string *sig = NULL;
+	struct vtrack *t;
+	unsigned h = hash(name);
+	JsonNode *geoline;
+	char *body = NULL;
+	int changed;
+
+	utstring_renew(sig);
+	utstring_printf(sig, "%s\t%s\t%s\t%s\t%d", user, device,
+		from ? from : "", to ? to : "", hours);
+
+	pthread_mutex_lock(&mutex);
+	for (t = tracks[h]; t != NULL; t = t->next) {
+		if (strcmp(t->name, name) == 0)
+			break;
+	}
+	if (t == NULL && ntracks < maxentries && (t = calloc(1, sizeof(struct vtrack))) != NULL) {
+		if ((t->name = strdup(name)) == NULL) {
+			free(t);
+			t = NULL;
+		} else {
+			pthread_mutex_init(&t->mutex, NULL);
+			t->next = tracks[h];
+			tracks[h] = t;
+			ntracks++;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	if (t == NULL)
+		return (NULL);
+
+	/*
+	 * Entries are never removed before vcache_free(), so `t' stays
+	 * valid; its own lock serializes requests for the same view.
+	 */
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->sig == NULL || strcmp(t->sig, UB(sig)) != 0 || s_lo < t->s_lo) {
+		reset(t, UB(sig), s_lo);
+	}
+	if ((changed = update(t, user, device, s_lo, s_hi)) == -1) {
+		reset(t, UB(sig), s_lo);
+		if ((changed = update(t, user, device, s_lo, s_hi)) == -1) {
+			reset(t, UB(sig), s_lo);
+			goto out;
+		}
+	}
+
+	/*
+	 * The rendered track is still good unless points were added or
+	 * dropped, or some of them were outside of the window it was
+	 * rendered for or are now.
+	 */
+
+	if (changed || t->body == NULL || t->maxrcv >= t->body_hi || t->maxrcv >= s_hi) {
+		free(t->body);
+		t->body = NULL;
+		if ((geoline = track_linestring(&t->track, s_lo, s_hi)) != NULL) {
+			t->body = json_stringify(geoline, JSON_INDENT);
+			t->body_hi = s_hi;
+			json_delete(geoline);
+		}
+	}
+	if (t->body)
+		body = strdup(t->body);
+
+    out:
+	pthread_mutex_unlock(&t->mutex);
+	return (body);
+}
+
+void vcache_free(void)
+{
+	struct vtrack *t;
+	int i;
+
+	pthread_mutex_lock(&mutex);
+	clear_files();
+	for (i = 0; i < VCACHE_BUCKETS; i++) {
+		while ((t = tracks[i]) != NULL) {
+			tracks[i] = t->next;
+			reset(t, "", 0);
+			free(t->sig);
+			free(t->recs);
+			free(t->track.pts);
+			free(t->name);
+			pthread_mutex_destroy(&t->mutex);
+			free(t);
+			ntracks--;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,21 @@
+#ifndef _VCACHE_H_INCLUDED_
+# define _VCACHE_H_INCLUDED_
+
+#include <time.h>
+
+/*
+ * In-memory copies of the view definitions and pages served under
+ * /view/, used while the files are unchanged (see fcache.h), and of the
+ * track of each view's GeoJSON data, to which only the lines written to
+ * its .rec files since the last request are added. Safe for use by
+ * concurrent HTTP workers.
+ */
+
+#define VCACHE_ENTRIES	1024		/* files, views */
+
+void vcache_init(int maxentries);
+char *vcache_file(char *path, int fold_newlines);
+char *vcache_track(const char *name, char *user, char *device, char *from, char *to, int hours, time_t s_lo, time_t s_hi);
+void vcache_free(void);
+
+#endif
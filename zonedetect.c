@@ -1087,6 +1087,51 @@ ZoneDetectResult *ZDLookup(const ZoneDetect *library, float lat, float lon, floa
     return results;
 }
 
+/*
+ * Check whether any polygon bounding box overlaps the box given by
+ * (latMin, lonMin) - (latMax, lonMax) without also containing the point
+ * (lat, lon). Such polygons are invisible to the safezone computed by
+ * ZDLookup() for that point. Returns 1 if one exists, 0 otherwise.
+ */
+int ZDBoxHasForeignPolygon(const ZoneDetect *library, float latMin, float lonMin, float latMax, float lonMax, float lat, float lon)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
+    const int32_t boxMinLat = ZDFloatToFixedPoint(latMin, 90, library->precision) - 1;
+    const int32_t boxMinLon = ZDFloatToFixedPoint(lonMin, 180, library->precision) - 1;
+    const int32_t boxMaxLat = ZDFloatToFixedPoint(latMax, 90, library->precision) + 1;
+    const int32_t boxMaxLon = ZDFloatToFixedPoint(lonMax, 180, library->precision) + 1;
+
+    uint32_t bboxIndex = library->bboxOffset;
+
+    while(bboxIndex < library->metadataOffset) {
+        int32_t minLat, minLon, maxLat, maxLon, metadataIndexDelta;
+        uint64_t polygonIndexDelta;
+        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &minLat)) break;
+        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &minLon)) break;
+        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &maxLat)) break;
+        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &maxLon)) break;
+        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &metadataIndexDelta)) break;
+        if(!ZDDecodeVariableLengthUnsigned(library, &bboxIndex, &polygonIndexDelta)) break;
+
+        /* The data is sorted along minLat */
+        if(minLat > boxMaxLat) {
+            break;
+        }
+
+        if(maxLat < boxMinLat || maxLon < boxMinLon || minLon > boxMaxLon) {
+            continue;
+        }
+
+        if(latFixedPoint < minLat || latFixedPoint > maxLat ||
+                lonFixedPoint < minLon || lonFixedPoint > maxLon) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 void ZDFreeResults(ZoneDetectResult *results)
 {
     unsigned int index = 0;
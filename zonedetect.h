@@ -73,6 +73,7 @@ ZD_EXPORT void        ZDCloseDatabase(ZoneDetect *library);
 
 ZD_EXPORT ZoneDetectResult *ZDLookup(const ZoneDetect *library, float lat, float lon, float *safezone);
 ZD_EXPORT void              ZDFreeResults(ZoneDetectResult *results);
+ZD_EXPORT int               ZDBoxHasForeignPolygon(const ZoneDetect *library, float latMin, float lonMin, float latMax, float lonMax, float lat, float lon);
 
 ZD_EXPORT const char *ZDGetNotice(const ZoneDetect *library);
 ZD_EXPORT uint8_t     ZDGetTableType(const ZoneDetect *library);